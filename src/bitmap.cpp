@@ -3,6 +3,134 @@
  */
 
 #include "bitmap.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define GROS_BITMAP_AVX2
+#endif
+
+static bool           gros_bitmap_avx2_ok = false;
+static pthread_once_t gros_bitmap_once    = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Checks for AVX2.
+ */
+static void gros_bitmap_init( void ) {
+#if defined( GROS_BITMAP_AVX2 )
+    gros_bitmap_avx2_ok = __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+
+/**
+ * Returns the `w`-th 64 bits of the bitmap, bit i of the word being
+ *  element w * 64 + i. Bytes past the end of a short bitmap read as `pad`.
+ */
+static uint64_t gros_bitmap_word( Bitmap * bm, int w, unsigned char pad ) {
+    unsigned char bytes[ 8 ];
+    uint64_t      word;
+    int           nbytes = ( bm->size + 7 ) / 8;
+    int           have   = nbytes - w * 8;
+
+    if( have >= 8 ) {
+        std::memcpy( &word, bm->buf + w * 8, 8 );
+    } else {
+        std::memset( bytes, pad, 8 );
+        std::memcpy( bytes, bm->buf + w * 8, ( size_t ) have );
+        std::memcpy( &word, bytes, 8 );
+    }
+#if defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64( word );
+#endif
+    return word;
+}
+
+
+#if defined( GROS_BITMAP_AVX2 )
+/**
+ * Returns the first of the words `w` .. `end` - 1 that is not all
+ *  `full` (all ones when looking for a clear bit, all zeros when looking
+ *  for a set one), skipping four words at a time. Returns `end` if there is
+ *  none.
+ */
+__attribute__(( target( "avx2" ) ))
+static int gros_bitmap_skip_avx2( Bitmap * bm, int w, int end, bool ones ) {
+    __m256i v;
+    __m256i all = _mm256_set1_epi32( -1 );
+
+    for( ; w + 4 <= end; w += 4 ) {
+        v = _mm256_loadu_si256( ( const __m256i * ) ( bm->buf + w * 8 ) );
+        if( ones ? ! _mm256_testc_si256( v, all ) : ! _mm256_testz_si256( v, v ) )
+            break;
+    }
+    return w;
+}
+#endif
+
+
+/**
+ * Returns the first index in `from` .. `to` - 1 whose bit is `value`, or
+ *  -1. `simd` allows skipping ahead with AVX2.
+ */
+static int gros_bitmap_find( Bitmap * bm, int from, int to, int value, bool simd ) {
+    uint64_t word;
+    uint64_t flip  = value ? 0 : ~( uint64_t ) 0;
+    int      w;
+    int      whole = bm->size / 64;   /* words that lie entirely in the bitmap */
+    int      bit;
+
+    if( from < 0 )
+        from = 0;
+    if( to > bm->size )
+        to = bm->size;
+    if( from >= to )
+        return -1;
+
+    w    = from / 64;
+    word = ( gros_bitmap_word( bm, w, 0 ) ^ flip ) & ( ~( uint64_t ) 0 << ( from % 64 ) );
+    for( ;; ) {
+        if( word != 0 ) {
+            bit = w * 64 + __builtin_ctzll( word );
+            return bit < to ? bit : -1;
+        }
+        if( ++w * 64 >= to )
+            return -1;
+#if defined( GROS_BITMAP_AVX2 )
+        if( simd && gros_bitmap_avx2_ok )
+            w = gros_bitmap_skip_avx2( bm, w, std::min( whole, ( to + 63 ) / 64 ), ! value );
+        if( w * 64 >= to )
+            return -1;
+#endif
+        word = gros_bitmap_word( bm, w, 0 ) ^ flip;
+    }
+}
+
+
+/**
+ * Sets `n` bits from `index` on to `value`, a byte at a time in the middle.
+ */
+static void gros_bitmap_fill( Bitmap * bm, int index, int n, int value ) {
+    int end = index + n;
+
+    while( index < end && index % 8 != 0 ) {
+        value ? gros_set_bit( bm, index ) : gros_unset_bit( bm, index );
+        index++;
+    }
+    if( end - index >= 8 ) {
+        std::memset( bm->buf + index / 8, value ? 0xff : 0, ( size_t ) ( ( end - index ) / 8 ) );
+        index += ( end - index ) / 8 * 8;
+    }
+    while( index < end ) {
+        value ? gros_set_bit( bm, index ) : gros_unset_bit( bm, index );
+        index++;
+    }
+}
 
 /**
  * Returns a new instance of a Bitmap with `size` addressable elements.
@@ -27,20 +155,101 @@ Bitmap * gros_init_bitmap( int size, char * buf ) {
  * @param Bitmap *bm   The bitmap to check
  */
 int gros_first_unset_bit( Bitmap * bm ) {
-    int i;
-    int byte;
-    int offset;
-    int isset = 1;
+    return gros_find_unset_bit( bm, 0, bm->size );
+}
 
-    for( i = 0; i < bm->size && isset == 1; i++ ) {
-        byte   = i / 8;
-        offset = i % 8;
-        isset  = ( bm->buf[ byte ] & ( 1 << offset ) ) > 0;
+/**
+ * Returns the index of the first bit in `from` .. `to` - 1 which is set to
+ *  0 (i.e. unused), or -1 if there is none. The range is clipped to the
+ *  bitmap. The bitmap is scanned a 64-bit word at a time, and 256 bits at a
+ *  time with AVX2 when the CPU has it.
+ *
+ * @param Bitmap *bm     The bitmap to search
+ * @param int from       First index to look at
+ * @param int to         Index to stop before
+ */
+int gros_find_unset_bit( Bitmap * bm, int from, int to ) {
+    pthread_once( &gros_bitmap_once, gros_bitmap_init );
+    return gros_bitmap_find( bm, from, to, 0, true );
+}
+
+/**
+ * Returns the index of the first bit in `from` .. `to` - 1 which is set to
+ *  1 (i.e. in use), or -1 if there is none. Together with
+ *  gros_find_unset_bit this measures runs of free elements.
+ *
+ * @param Bitmap *bm     The bitmap to search
+ * @param int from       First index to look at
+ * @param int to         Index to stop before
+ */
+int gros_find_set_bit( Bitmap * bm, int from, int to ) {
+    pthread_once( &gros_bitmap_once, gros_bitmap_init );
+    return gros_bitmap_find( bm, from, to, 1, true );
+}
+
+/**
+ * Returns how many bits in `from` .. `to` - 1 are set to 1. The range is
+ *  clipped to the bitmap.
+ *
+ * @param Bitmap *bm     The bitmap to count in
+ * @param int from       First index to count
+ * @param int to         Index to stop before
+ */
+int gros_count_set_bits( Bitmap * bm, int from, int to ) {
+    uint64_t word;
+    int      count = 0;
+    int      w;
+    int      last;
+
+    if( from < 0 )
+        from = 0;
+    if( to > bm->size )
+        to = bm->size;
+    if( from >= to )
+        return 0;
+
+    last = ( to - 1 ) / 64;
+    for( w = from / 64; w <= last; w++ ) {
+        word = gros_bitmap_word( bm, w, 0 );
+        if( w == from / 64 )
+            word &= ~( uint64_t ) 0 << ( from % 64 );
+        if( w == last && to % 64 != 0 )
+            word &= ~( ~( uint64_t ) 0 << ( to % 64 ) );
+        count += __builtin_popcountll( word );
     }
-    if( i >= bm->size )
+    return count;
+}
+
+/**
+ * Sets the `n` bits from index `index` on to 1. If any of them is out of
+ *  bounds, nothing is changed and this returns -1. Otherwise, this returns
+ *  the index passed in.
+ *
+ * @param Bitmap *bm     The bitmap to change
+ * @param int index      The first index to set
+ * @param int n          Number of bits to set
+ */
+int gros_set_bits( Bitmap * bm, int index, int n ) {
+    if( index < 0 || n < 0 || index > bm->size - n )
         return -1;
-    else
-        return i - 1;
+    gros_bitmap_fill( bm, index, n, 1 );
+    return index;
+}
+
+/**
+ * Sets the `n` bits from index `index` on to 0. If any of them is out of
+ *  bounds, nothing is changed and this returns -1. Otherwise, this returns
+ *  the index passed in.
+ *
+ * @param Bitmap *bm     The bitmap to change
+ * @param int index      The first index to unset
+ * @param int n          Number of bits to unset
+ */
+int gros_unset_bits( Bitmap * bm, int index, int n ) {
+    if( index < 0 || n < 0 || index > bm->size - n )
+        return -1;
+    gros_bitmap_fill( bm, index, n, 0 );
+    return index;
 }
 
 /**
@@ -227,3 +436,89 @@ TEST_CASE( "Bitmap can unset its bits", "[bitmap]" ) {
         REQUIRE( gros_is_bit_set( bm, 8 ) == 0 );
     }
 }
+
+TEST_CASE( "Bitmap searches a word at a time", "[bitmap]" ) {
+    static char buf[ 512 ];
+    Bitmap    * bm = gros_init_bitmap( 4096, buf );
+    int         i;
+    int         from;
+    int         naive;
+
+    SECTION( "Free bits at and around word boundaries are found" ) {
+        int spots[] = { 0, 1, 63, 64, 65, 127, 128, 255, 256, 1000, 4094, 4095 };
+        for( i = 0; i < ( int ) ( sizeof( spots ) / sizeof( spots[ 0 ] ) ); i++ ) {
+            std::memset( buf, 0xff, sizeof( buf ) );
+            gros_unset_bit( bm, spots[ i ] );
+            REQUIRE( gros_first_unset_bit( bm ) == spots[ i ] );
+            REQUIRE( gros_find_unset_bit( bm, spots[ i ] + 1, 4096 ) == -1 );
+            REQUIRE( gros_find_unset_bit( bm, 0, spots[ i ] ) == -1 );
+        }
+    }
+
+    SECTION( "Searches agree with a bit by bit scan" ) {
+        srand( 16 );
+        for( i = 0; i < ( int ) sizeof( buf ); i++ )
+            buf[ i ] = ( char ) ( rand() % 8 == 0 ? rand() : 0xff );
+        for( from = 0; from < 4096; from += 37 ) {
+            for( naive = from; naive < 4096 && gros_is_bit_set( bm, naive ); naive++ );
+            REQUIRE( gros_find_unset_bit( bm, from, 4096 ) == ( naive < 4096 ? naive : -1 ) );
+            REQUIRE( gros_bitmap_find( bm, from, 4096, 0, false ) == gros_find_unset_bit( bm, from, 4096 ) );
+            REQUIRE( gros_bitmap_find( bm, from, 4096, 1, false ) == gros_find_set_bit( bm, from, 4096 ) );
+        }
+    }
+
+    SECTION( "Set bits are found and counted" ) {
+        std::memset( buf, 0, sizeof( buf ) );
+        REQUIRE( gros_find_set_bit( bm, 0, 4096 ) == -1 );
+        REQUIRE( gros_count_set_bits( bm, 0, 4096 ) == 0 );
+        gros_set_bit( bm, 3000 );
+        gros_set_bit( bm, 70 );
+        REQUIRE( gros_find_set_bit( bm, 0, 4096 ) == 70 );
+        REQUIRE( gros_find_set_bit( bm, 71, 4096 ) == 3000 );
+        REQUIRE( gros_find_set_bit( bm, 71, 3000 ) == -1 );
+        REQUIRE( gros_count_set_bits( bm, 0, 4096 ) == 2 );
+        REQUIRE( gros_count_set_bits( bm, 70, 3000 ) == 1 );
+        REQUIRE( gros_count_set_bits( bm, 71, 3001 ) == 1 );
+    }
+
+    SECTION( "Short bitmaps are not read past their end" ) {
+        char small[] = { ( char ) 0xff, 0x7f };
+        Bitmap * sm = gros_init_bitmap( 15, small );
+        REQUIRE( gros_first_unset_bit( sm ) == -1 );
+        REQUIRE( gros_find_set_bit( sm, 14, 100 ) == 14 );
+        REQUIRE( gros_count_set_bits( sm, 0, 100 ) == 15 );
+        delete sm;
+    }
+
+    delete bm;
+}
+
+TEST_CASE( "Bitmap sets and unsets ranges of bits", "[bitmap]" ) {
+    char     buf[ 64 ];
+    Bitmap * bm = gros_init_bitmap( 512, buf );
+    int      i;
+
+    std::memset( buf, 0, sizeof( buf ) );
+
+    SECTION( "Ranges spanning partial bytes are set exactly" ) {
+        REQUIRE( gros_set_bits( bm, 5, 300 ) == 5 );
+        for( i = 0; i < 512; i++ )
+            REQUIRE( gros_is_bit_set( bm, i ) == ( i >= 5 && i < 305 ) );
+        REQUIRE( gros_count_set_bits( bm, 0, 512 ) == 300 );
+        REQUIRE( gros_unset_bits( bm, 6, 298 ) == 6 );
+        REQUIRE( gros_count_set_bits( bm, 0, 512 ) == 2 );
+        REQUIRE( gros_is_bit_set( bm, 5 ) == 1 );
+        REQUIRE( gros_is_bit_set( bm, 304 ) == 1 );
+    }
+
+    SECTION( "Out of bounds ranges change nothing" ) {
+        REQUIRE( gros_set_bits( bm, -1, 4 ) == -1 );
+        REQUIRE( gros_set_bits( bm, 500, 13 ) == -1 );
+        REQUIRE( gros_unset_bits( bm, 0, -1 ) == -1 );
+        REQUIRE( gros_count_set_bits( bm, 0, 512 ) == 0 );
+        REQUIRE( gros_set_bits( bm, 500, 12 ) == 500 );
+        REQUIRE( gros_count_set_bits( bm, 0, 512 ) == 12 );
+    }
+
+    delete bm;
+}
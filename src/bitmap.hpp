@@ -32,6 +32,61 @@ Bitmap * gros_init_bitmap( int size, char * buf );
  */
 int gros_first_unset_bit( Bitmap * bm );
 
+/**
+ * Returns the index of the first bit in `from` .. `to` - 1 which is set to
+ *  0 (i.e. unused), or -1 if there is none. The range is clipped to the
+ *  bitmap. The bitmap is scanned a 64-bit word at a time, and 256 bits at a
+ *  time with AVX2 when the CPU has it.
+ *
+ * @param Bitmap * bm     The bitmap to search
+ * @param int      from   First index to look at
+ * @param int      to     Index to stop before
+ */
+int gros_find_unset_bit( Bitmap * bm, int from, int to );
+
+/**
+ * Returns the index of the first bit in `from` .. `to` - 1 which is set to
+ *  1 (i.e. in use), or -1 if there is none. Together with
+ *  gros_find_unset_bit this measures runs of free elements.
+ *
+ * @param Bitmap * bm     The bitmap to search
+ * @param int      from   First index to look at
+ * @param int      to     Index to stop before
+ */
+int gros_find_set_bit( Bitmap * bm, int from, int to );
+
+/**
+ * Returns how many bits in `from` .. `to` - 1 are set to 1. The range is
+ *  clipped to the bitmap.
+ *
+ * @param Bitmap * bm     The bitmap to count in
+ * @param int      from   First index to count
+ * @param int      to     Index to stop before
+ */
+int gros_count_set_bits( Bitmap * bm, int from, int to );
+
+/**
+ * Sets the `n` bits from index `index` on to 1. If any of them is out of
+ *  bounds, nothing is changed and this returns -1. Otherwise, this returns
+ *  the index passed in.
+ *
+ * @param Bitmap * bm       The bitmap to change
+ * @param int      index    The first index to set
+ * @param int      n        Number of bits to set
+ */
+int gros_set_bits( Bitmap * bm, int index, int n );
+
+/**
+ * Sets the `n` bits from index `index` on to 0. If any of them is out of
+ *  bounds, nothing is changed and this returns -1. Otherwise, this returns
+ *  the index passed in.
+ *
+ * @param Bitmap * bm       The bitmap to change
+ * @param int      index    The first index to unset
+ * @param int      n        Number of bits to unset
+ */
+int gros_unset_bits( Bitmap * bm, int index, int n );
+
 /**
  * Returns whether the bit at index `index` is set (1) or not (0). 
  *  If `index` is out of bounds (0 < index < bm->size), then this returns 1.
@@ -0,0 +1,1585 @@
+/**
+ * cache.cpp
+ */
+
+#include "cache.hpp"
+#include "journal.hpp"
+#include "csum.hpp"
+#include "readahead.hpp"
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/**
+ * Returns the hash bucket of block `block_num` (Fibonacci hashing, so the
+ *  evenly spaced block group bitmaps do not all land in the same bucket).
+ */
+static unsigned gros_cache_bucket( Cache * cache, int block_num ) {
+    return ( ( uint32_t ) block_num * 2654435769u ) >> cache->shift;
+}
+
+
+static bool gros_cache_valid( Disk * disk, int block_num ) {
+    return block_num >= 0
+           && ( int64_t ) block_num * BLOCK_SIZE + BLOCK_SIZE <= disk->size;
+}
+
+
+/**
+ * Returns the cached copy of block `block_num`, or NULL if it is not cached.
+ */
+static CacheBlock * gros_cache_find( Cache * cache, int block_num ) {
+    CacheBlock * cb = cache->table[ gros_cache_bucket( cache, block_num ) ];
+
+    while( cb != NULL && cb->block_num != block_num )
+        cb = cb->hnext;
+    return cb;
+}
+
+
+/**
+ * Takes a block out of the LRU list.
+ */
+static void gros_cache_unlink_lru( Cache * cache, CacheBlock * cb ) {
+    if( cb->newer != NULL ) cb->newer->older = cb->older;
+    else                    cache->newest   = cb->older;
+    if( cb->older != NULL ) cb->older->newer = cb->newer;
+    else                    cache->oldest   = cb->newer;
+    cb->newer = cb->older = NULL;
+}
+
+
+/**
+ * Puts a block that is not in the LRU list at its newest end.
+ */
+static void gros_cache_link_newest( Cache * cache, CacheBlock * cb ) {
+    cb->newer = NULL;
+    cb->older = cache->newest;
+    if( cache->newest != NULL )
+        cache->newest->newer = cb;
+    else
+        cache->oldest = cb;
+    cache->newest = cb;
+}
+
+
+/**
+ * Marks a cached block as the most recently used one.
+ */
+static void gros_cache_touch( Cache * cache, CacheBlock * cb ) {
+    if( cache->newest == cb )
+        return;
+    gros_cache_unlink_lru( cache, cb );
+    gros_cache_link_newest( cache, cb );
+}
+
+
+/**
+ * Removes a block from the cache and frees it, dirty or not.
+ */
+static void gros_cache_drop( Cache * cache, CacheBlock * cb ) {
+    CacheBlock ** link = &cache->table[ gros_cache_bucket( cache, cb->block_num ) ];
+
+    while( * link != cb )
+        link = &( * link )->hnext;
+    * link = cb->hnext;
+    gros_cache_unlink_lru( cache, cb );
+    if( cb->dirty )
+        cache->ndirty--;
+    cache->nblocks--;
+    delete [] cb->data;
+    delete cb;
+}
+
+
+/**
+ * Writes the given dirty blocks to the disk in one batch and marks them
+ *  clean. With a journal the batch is committed to it as one transaction
+ *  instead of going home. Returns 0 or -errno, in which case all of them
+ *  stay dirty.
+ */
+static int gros_cache_writeback( Disk * disk, Cache * cache,
+                                 std::vector< CacheBlock * > & dirty ) {
+    std::vector< BlockIO > ios( dirty.size() );
+    size_t                 i;
+    int                    status;
+
+    if( dirty.empty() )
+        return 0;
+    for( i = 0; i < dirty.size(); i++ ) {
+        ios[ i ].block_num = dirty[ i ]->block_num;
+        ios[ i ].buf       = dirty[ i ]->data;
+    }
+    if( disk->journal != NULL )
+        status = gros_journal_commit( disk, &ios[ 0 ], ( int ) ios.size() );
+    else
+        status = gros_write_blocks( disk, &ios[ 0 ], ( int ) ios.size() );
+    if( status < 0 )
+        return status;
+    for( i = 0; i < dirty.size(); i++ )
+        dirty[ i ]->dirty = false;
+    cache->ndirty     -= ( int ) dirty.size();
+    cache->writebacks += ( int64_t ) dirty.size();
+    return 0;
+}
+
+
+/**
+ * Reads a block the cache does not hold. A block committed to the journal
+ *  but not checkpointed yet is stale at home and comes from the journal.
+ */
+static int gros_cache_fill( Disk * disk, int block_num, char * buf ) {
+    if( disk->journal != NULL && gros_journal_lookup( disk, block_num, buf ) )
+        return 0;
+    return gros_read_block( disk, block_num, buf );
+}
+
+
+/**
+ * Makes room for one more block by evicting the least recently used one.
+ *  A dirty victim is written back together with the next oldest dirty
+ *  blocks, so memory pressure turns into a few large writes instead of
+ *  one small write per eviction. With a journal dirty blocks stay until
+ *  their transaction is committed whole, so the oldest clean block goes
+ *  instead; if there is none, returns -EBUSY and the cache goes over its
+ *  budget until the next commit.
+ */
+static int gros_cache_evict( Disk * disk, Cache * cache ) {
+    std::vector< CacheBlock * > dirty;
+    CacheBlock *                cb;
+    int                         status;
+
+    if( disk->journal != NULL ) {
+        for( cb = cache->oldest; cb != NULL && cb->dirty; cb = cb->newer )
+            ;
+        if( cb == NULL ) {
+            if( cache->flushing )
+                pthread_cond_signal( &cache->wake );
+            return -EBUSY;
+        }
+        gros_cache_drop( cache, cb );
+        return 0;
+    }
+    if( cache->oldest->dirty ) {
+        for( cb = cache->oldest; cb != NULL
+             && dirty.size() < GROS_CACHE_WB_BATCH; cb = cb->newer )
+            if( cb->dirty )
+                dirty.push_back( cb );
+        if( ( status = gros_cache_writeback( disk, cache, dirty ) ) < 0 )
+            return status;
+    }
+    gros_cache_drop( cache, cache->oldest );
+    return 0;
+}
+
+
+/**
+ * Adds an empty entry for block `block_num`, evicting if the cache is
+ *  full. Returns NULL if no room could be made.
+ */
+static CacheBlock * gros_cache_insert( Disk * disk, Cache * cache, int block_num ) {
+    CacheBlock * cb;
+    unsigned     bucket;
+    int          status;
+
+    if( cache->nblocks >= cache->max_blocks
+        && ( status = gros_cache_evict( disk, cache ) ) < 0 && status != -EBUSY )
+        return NULL;
+
+    bucket        = gros_cache_bucket( cache, block_num );
+    cb            = new CacheBlock();
+    cb->block_num = block_num;
+    cb->dirty     = false;
+    cb->readahead = false;
+    cb->logging   = false;
+    cb->data      = new char[ BLOCK_SIZE ];
+    cb->newer     = NULL;
+    cb->older     = NULL;
+    cb->hnext     = cache->table[ bucket ];
+    cache->table[ bucket ] = cb;
+    cache->nblocks++;
+    gros_cache_link_newest( cache, cb );
+    return cb;
+}
+
+
+/**
+ * Marks a cached block dirty, waking the flusher if that takes the cache
+ *  over its dirty limit.
+ */
+static void gros_cache_dirty( Cache * cache, CacheBlock * cb ) {
+    cb->readahead = false;
+    cb->logging   = false;
+    if( cb->dirty )
+        return;
+    cb->dirty   = true;
+    cb->dirtied = time( NULL );
+    cache->ndirty++;
+    if( cache->flushing && cache->ndirty * 100 >= cache->max_blocks * GROS_DIRTY_HIGH )
+        pthread_cond_signal( &cache->wake );
+}
+
+
+/**
+ * Finds where the checksum of block `block_num` is kept: sets `table` to
+ *  the block of the checksum area and `slot` to the entry within it.
+ *  Returns false if the block has no checksum (checksums are off, or it is
+ *  part of the checksum area or beyond it).
+ */
+static bool gros_csum_where( Disk * disk, int block_num, int * table, int * slot ) {
+    Csum * csum = disk->csum;
+
+    if( csum == NULL || ( block_num >= csum->start
+                          && block_num < csum->start + csum->nblocks ) )
+        return false;
+    * table = block_num / ( int ) GROS_CSUMS_PER_BLOCK;
+    * slot  = block_num % ( int ) GROS_CSUMS_PER_BLOCK;
+    if( * table >= csum->nblocks )
+        return false;
+    * table += csum->start;
+    return true;
+}
+
+
+/**
+ * Returns the cached block of the checksum area at `table`, reading it in
+ *  if needed, or NULL if it could not be. Called with the lock held.
+ */
+static CacheBlock * gros_csum_table( Disk * disk, Cache * cache, int table ) {
+    CacheBlock * cb;
+
+    if( ( cb = gros_cache_find( cache, table ) ) != NULL ) {
+        gros_cache_touch( cache, cb );
+        return cb;
+    }
+    if( ( cb = gros_cache_insert( disk, cache, table ) ) == NULL )
+        return NULL;
+    if( gros_cache_fill( disk, table, cb->data ) < 0 ) {
+        gros_cache_drop( cache, cb );
+        return NULL;
+    }
+    return cb;
+}
+
+
+/**
+ * Records `data` as the new contents of block `block_num` in the checksum
+ *  area, or, if `data` is NULL, that the block is not to be checked. A
+ *  block not `logged` in the journal along with its checksum is tagged
+ *  GROS_CSUM_UNLOGGED. The checksum block is dirtied in the cache, with
+ *  the cache lock held, or read and rewritten in place under the checksum
+ *  lock on an uncached disk. Returns 0 or -errno.
+ */
+static int gros_csum_set( Disk * disk, int block_num, const char * data, bool logged ) {
+    Cache *      cache = disk->cache;
+    CacheBlock * cb;
+    char         buf[ BLOCK_SIZE ];
+    uint32_t     sum;
+    int          table;
+    int          slot;
+    int          status;
+
+    if( ! gros_csum_where( disk, block_num, &table, &slot ) )
+        return 0;
+    sum = data != NULL ? gros_block_csum( data ) : GROS_CSUM_NONE;
+    if( data != NULL && ! logged )
+        sum |= GROS_CSUM_UNLOGGED;
+    if( cache == NULL ) {
+        // other threads update the other checksums in the same block
+        pthread_mutex_lock( &disk->csum->lock );
+        if( ( status = gros_read_block( disk, table, buf ) ) == 0 ) {
+            std::memcpy( buf + slot * sizeof( uint32_t ), &sum, sizeof( uint32_t ) );
+            status = gros_write_block( disk, table, buf );
+        }
+        pthread_mutex_unlock( &disk->csum->lock );
+        return status;
+    }
+    if( ( cb = gros_csum_table( disk, cache, table ) ) == NULL )
+        return -EIO;
+    std::memcpy( cb->data + slot * sizeof( uint32_t ), &sum, sizeof( uint32_t ) );
+    gros_cache_dirty( cache, cb );
+    return 0;
+}
+
+
+/**
+ * Reads the checksum entry of block `block_num` into `sum`, or
+ *  GROS_CSUM_NONE if the block is not to be checked. Called with the
+ *  cache lock held on a cached disk; the checksum lock is taken on an
+ *  uncached one. Returns 0 or -errno.
+ */
+static int gros_csum_get( Disk * disk, int block_num, uint32_t * sum ) {
+    Csum *       csum = disk->csum;
+    CacheBlock * cb;
+    char         buf[ BLOCK_SIZE ];
+    int          table;
+    int          slot;
+    int          status;
+
+    *sum = GROS_CSUM_NONE;
+    if( csum == NULL || ! csum->verify
+        || ! gros_csum_where( disk, block_num, &table, &slot ) )
+        return 0;
+    if( disk->cache == NULL ) {
+        pthread_mutex_lock( &csum->lock );
+        status = gros_read_block( disk, table, buf );
+        pthread_mutex_unlock( &csum->lock );
+        if( status < 0 )
+            return status;
+        std::memcpy( sum, buf + slot * sizeof( uint32_t ), sizeof( uint32_t ) );
+    } else {
+        if( ( cb = gros_csum_table( disk, disk->cache, table ) ) == NULL )
+            return -EIO;
+        std::memcpy( sum, cb->data + slot * sizeof( uint32_t ), sizeof( uint32_t ) );
+    }
+    return 0;
+}
+
+
+/**
+ * Returns 1 if `data`, just read from block `block_num`, matches its
+ *  checksum or is not to be checked, 0 if it does not match, or -errno
+ *  if the checksum could not be read. Nothing is reported. Locking is as
+ *  for gros_csum_get.
+ */
+static int gros_csum_match( Disk * disk, int block_num, const char * data ) {
+    uint32_t sum;
+    int      status;
+
+    if( ( status = gros_csum_get( disk, block_num, &sum ) ) < 0 )
+        return status;
+    return sum == GROS_CSUM_NONE
+           || ( sum & ~GROS_CSUM_UNLOGGED ) == gros_block_csum( data );
+}
+
+
+/**
+ * Checks `data`, just read from block `block_num`, against its checksum.
+ *  Blocks not written since the checksum area was formatted are not
+ *  checked. A block written in place, outside the journal, may have
+ *  reached the disk without its checksum before a crash, so a mismatch
+ *  there is reported and counted as unverified but the block is still
+ *  read; only blocks logged with their checksum fail. Locking is as for
+ *  gros_csum_get. Returns 0, -EIO on a mismatch, or -errno if the
+ *  checksum could not be read.
+ */
+static int gros_csum_check( Disk * disk, int block_num, const char * data ) {
+    Csum *   csum = disk->csum;
+    uint32_t sum;
+    int      status;
+
+    if( ( status = gros_csum_get( disk, block_num, &sum ) ) < 0 )
+        return status;
+    if( sum == GROS_CSUM_NONE || ( sum & ~GROS_CSUM_UNLOGGED ) == gros_block_csum( data ) )
+        return 0;
+    if( sum & GROS_CSUM_UNLOGGED ) {
+        __sync_fetch_and_add( &csum->unverified, 1 );
+        fprintf( stderr, "grosfs: checksum mismatch in block %d, "
+                         "written in place, left unverified\n", block_num );
+        return 0;
+    }
+    __sync_fetch_and_add( &csum->failures, 1 );
+    fprintf( stderr, "grosfs: checksum mismatch in block %d\n", block_num );
+    return -EIO;
+}
+
+/**
+ * Checks block `block_num`, read into `buf` without the cache lock, now
+ *  that the lock is held again. A block written meanwhile may not match
+ *  the checksum of its new contents; it is then taken from the cache, or
+ *  read again, before a mismatch counts. Returns 0 or -errno.
+ */
+static int gros_cache_verify( Disk * disk, Cache * cache, int block_num, char * buf ) {
+    CacheBlock * cb;
+    int          status;
+
+    if( ( status = gros_csum_match( disk, block_num, buf ) ) != 0 )
+        return status < 0 ? status : 0;
+    if( ( cb = gros_cache_find( cache, block_num ) ) != NULL ) {
+        std::memcpy( buf, cb->data, BLOCK_SIZE );
+        return 0;
+    }
+    if( ( status = gros_cache_fill( disk, block_num, buf ) ) < 0 )
+        return status;
+    return gros_csum_check( disk, block_num, buf );
+}
+
+
+/**
+ * Discards the queued blocks freed before write back `before` (see
+ *  gros_discard_mark), in runs of adjacent ones; the caller has made that
+ *  write back durable. Blocks the journal still has to checkpoint are
+ *  checkpointed first, so a replay cannot bring them back. Called with the
+ *  cache lock held, if there is a cache. The discard lock is held while
+ *  they are discarded, so a block written again meanwhile goes out after
+ *  its discard. Returns 0 or -errno, in which case the blocks not
+ *  discarded stay queued.
+ */
+static int gros_discard_queued( Disk * disk, uint32_t before ) {
+    std::vector< BlockIO >              ios;
+    std::map< int, uint32_t >::iterator it;
+    std::map< int, uint32_t >::iterator run;
+    int                                 n;
+    int                                 status = 0;
+
+    pthread_mutex_lock( &disk->discard_lock );
+    for( it = disk->discards.begin(); it != disk->discards.end(); ++it ) {
+        if( it->second >= before )
+            continue;
+        BlockIO io = { it->first, NULL };
+        ios.push_back( io );
+    }
+    if( disk->journal != NULL && ! ios.empty() ) {
+        // the release may wait for the journal with the cache lock let go
+        pthread_mutex_unlock( &disk->discard_lock );
+        status = gros_journal_release( disk, &ios[ 0 ], ( int ) ios.size() );
+        pthread_mutex_lock( &disk->discard_lock );
+    }
+    for( run = disk->discards.begin(); status == 0 && run != disk->discards.end(); run = it ) {
+        for( it = run, n = 0; it != disk->discards.end() && it->first == run->first + n
+                              && it->second < before; ++it )
+            n++;
+        if( n == 0 )
+            ++it;
+        else if( ( status = gros_discard_blocks( disk, run->first, n ) ) == 0 )
+            disk->discards.erase( run, it );
+    }
+    pthread_mutex_unlock( &disk->discard_lock );
+    return status;
+}
+
+
+/**
+ * Notes that every change made so far, the freeing of queued blocks
+ *  included, has been written back or committed whole. Returns the number
+ *  to hand gros_discard_queued once that is durable.
+ */
+static uint32_t gros_discard_mark( Disk * disk ) {
+    uint32_t before;
+
+    pthread_mutex_lock( &disk->discard_lock );
+    before = ++disk->discard_epoch;
+    pthread_mutex_unlock( &disk->discard_lock );
+    return before;
+}
+
+
+/**
+ * Takes the `n` blocks of `ios`, about to be written, off the discard
+ *  queue.
+ */
+static void gros_discard_cancel( Disk * disk, BlockIO * ios, int n ) {
+    int i;
+
+    pthread_mutex_lock( &disk->discard_lock );
+    for( i = 0; i < n; i++ )
+        disk->discards.erase( ios[ i ].block_num );
+    pthread_mutex_unlock( &disk->discard_lock );
+}
+
+
+/**
+ * Puts a write-back cache of `budget` bytes in front of the disk. From then
+ *  on blocks moved with the gros_b* calls are served from memory and only
+ *  written to the image on gros_bsync, when evicted, by the flusher, or
+ *  when the cache is detached. Returns 0, or -EEXIST if the disk already has a cache.
+ *
+ * @param Disk  * disk     The disk to cache
+ * @param int64_t budget   Memory to spend on cached blocks, in bytes
+ */
+int gros_attach_cache( Disk * disk, int64_t budget ) {
+    Cache * cache;
+    int     bits = 0;
+
+    if( disk->cache != NULL )
+        return -EEXIST;
+
+    cache = new Cache();
+    cache->max_blocks = ( int ) std::min< int64_t >( budget / BLOCK_SIZE,
+                                                     disk->size / BLOCK_SIZE );
+    if( cache->max_blocks < GROS_CACHE_MIN_BLOCKS )
+        cache->max_blocks = GROS_CACHE_MIN_BLOCKS;
+    // about one block per bucket when full
+    while( ( 1 << bits ) < cache->max_blocks )
+        bits++;
+    cache->shift      = 32 - bits;
+    cache->table      = new CacheBlock * [ 1 << bits ]();
+    cache->newest     = NULL;
+    cache->oldest     = NULL;
+    cache->nblocks    = 0;
+    cache->ndirty     = 0;
+    cache->hits       = 0;
+    cache->misses     = 0;
+    cache->writebacks = 0;
+    cache->prefetched = 0;
+    cache->prefetch_hits = 0;
+    cache->flushing   = false;
+    cache->stopping   = false;
+    cache->interval   = 0;
+    pthread_mutex_init( &cache->lock, NULL );
+    pthread_cond_init( &cache->wake, NULL );
+    disk->cache = cache;
+    return 0;
+}
+
+
+/**
+ * Stops read-ahead and the flusher, writes back the superblock and every
+ *  dirty block, checkpoints the journal if there is one, discards queued
+ *  freed blocks, frees the cache and leaves the disk uncached. Returns 0
+ *  or the -errno of a failed write back.
+ *
+ * @param Disk * disk   The disk to stop caching
+ */
+int gros_detach_cache( Disk * disk ) {
+    std::vector< CacheBlock * > dirty;
+    Cache *                     cache = disk->cache;
+    CacheBlock *                cb;
+    uint32_t                    before = 0;
+    int                         status;
+
+    if( cache == NULL )
+        return 0;
+    gros_stop_readahead( disk );
+    gros_stop_flusher( disk );
+    gros_bwrite_super( disk );
+
+    for( cb = cache->oldest; cb != NULL; cb = cb->newer )
+        if( cb->dirty )
+            dirty.push_back( cb );
+    if( ( status = gros_cache_writeback( disk, cache, dirty ) ) == 0 ) {
+        before = gros_discard_mark( disk );
+        // uncached reads go straight home, so nothing may be left in the
+        // journal; the checkpoint makes everything durable on the way
+        status = disk->journal != NULL ? gros_checkpoint( disk ) : gros_sync_disk( disk );
+    }
+    if( status == 0 )
+        status = gros_discard_queued( disk, before );
+
+    while( cache->oldest != NULL )
+        gros_cache_drop( cache, cache->oldest );
+    pthread_cond_destroy( &cache->wake );
+    pthread_mutex_destroy( &cache->lock );
+    delete [] cache->table;
+    delete cache;
+    disk->cache = NULL;
+    return status;
+}
+
+
+/**
+ * Reads block `block_num` into `buf`, from the cache when possible. A
+ *  missing block is read from the disk, without holding the cache lock,
+ *  and kept in the cache. With checksums on, a block read from the disk
+ *  is checked against its checksum first.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Destination of BLOCK_SIZE bytes
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          -EIO if it does not match a checksum logged
+ *                          with it (see gros_bwrite_blocks),
+ *                          or -errno if the block could not be read
+ */
+int gros_bread( Disk * disk, int block_num, char * buf ) {
+    Cache *      cache = disk->cache;
+    CacheBlock * cb;
+    bool         started;
+    int          status = 0;
+
+    if( cache == NULL ) {
+        if( ( status = gros_read_block( disk, block_num, buf ) ) < 0 )
+            return status;
+        return gros_csum_check( disk, block_num, buf );
+    }
+    if( ! gros_cache_valid( disk, block_num ) )
+        return -EINVAL;
+
+    pthread_mutex_lock( &cache->lock );
+    if( ( cb = gros_cache_find( cache, block_num ) ) != NULL ) {
+        cache->hits++;
+        cb->readahead = false;
+        gros_cache_touch( cache, cb );
+        std::memcpy( buf, cb->data, BLOCK_SIZE );
+    } else if( disk->journal != NULL && gros_journal_lookup( disk, block_num, buf ) ) {
+        cache->misses++;
+        if( ( status = gros_csum_check( disk, block_num, buf ) ) == 0
+            && ( cb = gros_cache_insert( disk, cache, block_num ) ) != NULL )
+            std::memcpy( cb->data, buf, BLOCK_SIZE );
+    } else {
+        // the read goes on without the lock, as gros_bprefetch's do; a
+        // write meanwhile takes the block off `inflight`, and the copy read
+        // is then not put in. A block another read has in flight is read
+        // again, but that read puts it in
+        cache->misses++;
+        started = cache->inflight.insert( block_num ).second;
+        pthread_mutex_unlock( &cache->lock );
+        status = gros_read_block( disk, block_num, buf );
+        pthread_mutex_lock( &cache->lock );
+        if( started && cache->inflight.erase( block_num ) == 0 )
+            started = false;
+        if( status == 0 && ( cb = gros_cache_find( cache, block_num ) ) != NULL ) {
+            // written meanwhile, or put in by the read that had it in flight
+            std::memcpy( buf, cb->data, BLOCK_SIZE );
+        } else if( status == 0
+                   && ( status = gros_cache_verify( disk, cache, block_num, buf ) ) == 0
+                   && started && ( cb = gros_cache_insert( disk, cache, block_num ) ) != NULL ) {
+            std::memcpy( cb->data, buf, BLOCK_SIZE );
+        }
+    }
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Writes `buf` as the new contents of block `block_num`. With a cache the
+ *  block is only marked dirty; it reaches the disk later.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        BLOCK_SIZE bytes of data
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          or -errno if the block could not be written
+ */
+int gros_bwrite( Disk * disk, int block_num, char * buf ) {
+    Cache *      cache = disk->cache;
+    CacheBlock * cb;
+    int          status = 0;
+
+    BlockIO      io    = { block_num, buf };
+
+    if( cache == NULL ) {
+        gros_discard_cancel( disk, &io, 1 );
+        if( ( status = gros_write_block( disk, block_num, buf ) ) < 0 )
+            return status;
+        return gros_csum_set( disk, block_num, buf, false );
+    }
+    if( ! gros_cache_valid( disk, block_num ) )
+        return -EINVAL;
+
+    pthread_mutex_lock( &cache->lock );
+    cache->inflight.erase( block_num );
+    gros_discard_cancel( disk, &io, 1 );
+    // the whole block is replaced, so a missing one need not be read first
+    if( ( cb = gros_cache_find( cache, block_num ) ) == NULL )
+        cb = gros_cache_insert( disk, cache, block_num );
+    if( cb == NULL ) {
+        if( disk->journal == NULL
+            || ( status = gros_journal_release( disk, &io, 1 ) ) == 0 )
+            status = gros_write_block( disk, block_num, buf );
+    } else {
+        gros_cache_touch( cache, cb );
+        std::memcpy( cb->data, buf, BLOCK_SIZE );
+        gros_cache_dirty( cache, cb );
+    }
+    // only a cached block goes through the journal with its checksum
+    if( status == 0 )
+        status = gros_csum_set( disk, block_num, buf,
+                                cb != NULL && disk->journal != NULL );
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Like gros_get_block, but through the cache: returns a pointer into the
+ *  mapped image when the disk is mapped and uncached, otherwise `buf` after
+ *  gros_bread-ing the block into it. Returns NULL if the block cannot be
+ *  read. Changes are kept by handing the pointer back to gros_bwrite.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Fallback buffer of BLOCK_SIZE bytes
+ */
+char * gros_bget( Disk * disk, int block_num, char * buf ) {
+    char * data;
+
+    if( disk->cache == NULL ) {
+        data = gros_get_block( disk, block_num, buf );
+        return data != NULL && gros_csum_check( disk, block_num, data ) == 0 ? data : NULL;
+    }
+    return gros_bread( disk, block_num, buf ) == 0 ? buf : NULL;
+}
+
+
+/**
+ * Reads a batch of blocks. Cached blocks are copied out of the cache and
+ *  the rest are fetched together with gros_read_blocks, without holding
+ *  the cache lock and without being added to the cache (bulk file data
+ *  would only push metadata out).
+ *  Prefetched blocks are dropped from the cache once read.
+ *
+ * @param Disk    * disk   The disk to read from
+ * @param BlockIO * ios    The blocks to read and where to put them
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_bread_blocks( Disk * disk, BlockIO * ios, int n ) {
+    Cache *                cache = disk->cache;
+    CacheBlock *           cb;
+    std::vector< BlockIO > misses;
+    int                    i;
+    int                    status = 0;
+
+    if( cache == NULL ) {
+        status = gros_read_blocks( disk, ios, n );
+        for( i = 0; i < n && status == 0; i++ )
+            status = gros_csum_check( disk, ios[ i ].block_num, ios[ i ].buf );
+        return status;
+    }
+    for( i = 0; i < n; i++ )
+        if( ! gros_cache_valid( disk, ios[ i ].block_num ) )
+            return -EINVAL;
+
+    pthread_mutex_lock( &cache->lock );
+    for( i = 0; i < n; i++ ) {
+        if( ( cb = gros_cache_find( cache, ios[ i ].block_num ) ) != NULL ) {
+            cache->hits++;
+            std::memcpy( ios[ i ].buf, cb->data, BLOCK_SIZE );
+            if( cb->readahead ) {
+                // read ahead data is used once, then makes room again
+                cache->prefetch_hits++;
+                gros_cache_drop( cache, cb );
+            }
+        } else if( disk->journal != NULL
+                   && gros_journal_lookup( disk, ios[ i ].block_num, ios[ i ].buf ) ) {
+            cache->hits++;
+        } else {
+            misses.push_back( ios[ i ] );
+        }
+    }
+    if( misses.empty() ) {
+        pthread_mutex_unlock( &cache->lock );
+        return 0;
+    }
+    // the reads go on without the lock; only the checks need it
+    pthread_mutex_unlock( &cache->lock );
+    status = gros_read_blocks( disk, &misses[ 0 ], ( int ) misses.size() );
+    pthread_mutex_lock( &cache->lock );
+    for( i = 0; i < ( int ) misses.size() && status == 0; i++ )
+        status = gros_cache_verify( disk, cache, misses[ i ].block_num, misses[ i ].buf );
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Reads the given blocks into the cache ahead of use, skipping those it
+ *  already holds. The reads are all put in flight at once with
+ *  gros_submit_block, without holding the cache lock, so other requests go
+ *  on meanwhile, and each block is put in as soon as its own read
+ *  completes; a block written in the meantime is not put in. The first
+ *  gros_bread_blocks that reads a prefetched block takes it out of the
+ *  cache again. Does nothing without a cache. Returns the number of blocks
+ *  prefetched or -errno.
+ *
+ * @param Disk      * disk     The disk to read from
+ * @param const int * blocks   The blocks to read, in any order
+ * @param int         n        Number of entries in `blocks`
+ */
+int gros_bprefetch( Disk * disk, const int * blocks, int n ) {
+    Cache *                   cache = disk->cache;
+    CacheBlock *              cb;
+    BlockQueue                queue = { 0, NULL };
+    std::vector< BlockReq >   reqs;
+    std::vector< BlockReq * > done;
+    std::vector< char >       data;
+    int                       added = 0;
+    int                       submitted;
+    int                       left;
+    int                       got;
+    int                       i;
+    int                       status = 0;
+
+    if( cache == NULL )
+        return 0;
+    for( i = 0; i < n; i++ )
+        if( ! gros_cache_valid( disk, blocks[ i ] ) )
+            return -EINVAL;
+
+    pthread_mutex_lock( &cache->lock );
+    for( i = 0; i < n; i++ ) {
+        if( gros_cache_find( cache, blocks[ i ] ) != NULL
+            || ! cache->inflight.insert( blocks[ i ] ).second )
+            continue;
+        BlockReq req;
+        std::memset( &req, 0, sizeof( req ) );
+        req.block_num = blocks[ i ];
+        reqs.push_back( req );
+    }
+    pthread_mutex_unlock( &cache->lock );
+    if( reqs.empty() )
+        return 0;
+
+    data.resize( reqs.size() * BLOCK_SIZE );
+    done.resize( reqs.size() );
+    for( submitted = 0; submitted < ( int ) reqs.size(); submitted++ ) {
+        reqs[ submitted ].buf = &data[ ( size_t ) submitted * BLOCK_SIZE ];
+        if( ( status = gros_submit_block( disk, &queue, &reqs[ submitted ] ) ) < 0 )
+            break;
+    }
+
+    pthread_mutex_lock( &cache->lock );
+    // the buffers must outlive every read put in flight, whatever fails
+    for( left = submitted; left > 0; left -= got ) {
+        pthread_mutex_unlock( &cache->lock );
+        got = gros_reap_blocks( disk, &queue, &done[ 0 ], left, 1 );
+        pthread_mutex_lock( &cache->lock );
+        if( got < 0 ) {
+            if( status == 0 )
+                status = got;
+            got = 0;
+            continue;
+        }
+        if( got == 0 )
+            break;
+        for( i = 0; i < got; i++ ) {
+            BlockReq * req = done[ i ];
+
+            req->data = req;
+            if( req->status < 0 && status == 0 )
+                status = req->status;
+            // a write since the read was started took the block off the list
+            if( cache->inflight.erase( req->block_num ) == 0 || req->status < 0
+                || gros_cache_find( cache, req->block_num ) != NULL )
+                continue;
+            if( ( cb = gros_cache_insert( disk, cache, req->block_num ) ) == NULL )
+                continue;
+            // the journal holds newer copies of blocks it has not checkpointed
+            if( disk->journal == NULL
+                || ! gros_journal_lookup( disk, req->block_num, cb->data ) )
+                std::memcpy( cb->data, req->buf, BLOCK_SIZE );
+            // a bad block is left for the real read to report
+            if( gros_csum_check( disk, req->block_num, cb->data ) < 0 ) {
+                gros_cache_drop( cache, cb );
+                continue;
+            }
+            cb->readahead = true;
+            added++;
+        }
+    }
+    // blocks whose read never started are not in flight any more
+    for( i = 0; i < ( int ) reqs.size(); i++ )
+        if( reqs[ i ].data == NULL )
+            cache->inflight.erase( reqs[ i ].block_num );
+    cache->prefetched += added;
+    pthread_mutex_unlock( &cache->lock );
+    return status < 0 ? status : added;
+}
+
+
+/**
+ * Writes a batch of blocks straight to the disk with gros_write_blocks,
+ *  dropping any cached copies they replace. They are written in place,
+ *  outside the journal, so their checksums are tagged GROS_CSUM_UNLOGGED
+ *  and a later mismatch leaves them unverified rather than unreadable.
+ *
+ * @param Disk    * disk   The disk to write to
+ * @param BlockIO * ios    The blocks to write and where their data is
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_bwrite_blocks( Disk * disk, BlockIO * ios, int n ) {
+    Cache *      cache = disk->cache;
+    CacheBlock * cb;
+    int          i;
+    int          status;
+
+    if( cache == NULL ) {
+        gros_discard_cancel( disk, ios, n );
+        status = gros_write_blocks( disk, ios, n );
+        for( i = 0; i < n && status == 0; i++ )
+            status = gros_csum_set( disk, ios[ i ].block_num, ios[ i ].buf, false );
+        return status;
+    }
+    for( i = 0; i < n; i++ )
+        if( ! gros_cache_valid( disk, ios[ i ].block_num ) )
+            return -EINVAL;
+
+    pthread_mutex_lock( &cache->lock );
+    // may let the lock go, so before any cached copy is dropped
+    if( disk->journal != NULL
+        && ( status = gros_journal_release( disk, ios, n ) ) < 0 ) {
+        pthread_mutex_unlock( &cache->lock );
+        return status;
+    }
+    gros_discard_cancel( disk, ios, n );
+    for( i = 0; i < n; i++ ) {
+        cache->inflight.erase( ios[ i ].block_num );
+        if( ( cb = gros_cache_find( cache, ios[ i ].block_num ) ) != NULL )
+            gros_cache_drop( cache, cb );
+    }
+    status = gros_write_blocks( disk, ios, n );
+    for( i = 0; i < n && status == 0; i++ )
+        status = gros_csum_set( disk, ios[ i ].block_num, ios[ i ].buf, false );
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Marks block `block_num` as free. A cached copy is dropped without being
+ *  written back, the block's checksum is cleared, and the block is queued
+ *  to be discarded with gros_discard_blocks. A crash must not leave the
+ *  block allocated on disk but discarded, so it only goes out, in sorted
+ *  runs, once the write back that frees it is durable: after the flusher
+ *  commits the transaction that frees it to the journal, on gros_bsync or
+ *  gros_flush_discards, or when the disk is closed. Writing the block
+ *  again takes it off the queue. Returns 0 or -errno.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ */
+int gros_bdiscard( Disk * disk, int block_num ) {
+    Cache *      cache = disk->cache;
+    CacheBlock * cb;
+    int          status;
+
+    if( block_num < 0 || ( int64_t ) block_num * BLOCK_SIZE + BLOCK_SIZE > disk->size )
+        return -EINVAL;
+    if( cache != NULL ) {
+        pthread_mutex_lock( &cache->lock );
+        cache->inflight.erase( block_num );
+        if( ( cb = gros_cache_find( cache, block_num ) ) != NULL )
+            gros_cache_drop( cache, cb );
+    }
+    pthread_mutex_lock( &disk->discard_lock );
+    disk->discards[ block_num ] = disk->discard_epoch;
+    pthread_mutex_unlock( &disk->discard_lock );
+    status = gros_csum_set( disk, block_num, NULL, true );
+    if( cache != NULL )
+        pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Discards the blocks gros_bdiscard has queued right away, which takes a
+ *  gros_bsync to make their freeing durable first. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose freed blocks to discard
+ */
+int gros_flush_discards( Disk * disk ) {
+    return gros_bsync( disk );
+}
+
+
+/**
+ * Writes the in-memory superblock out as block 0 if it changed since it
+ *  was last written; with a cache it only becomes a dirty block. Returns 0
+ *  or -errno, in which case it is still considered changed.
+ *
+ * @param Disk * disk   The disk holding the superblock
+ */
+int gros_bwrite_super( Disk * disk ) {
+    int status;
+
+    if( disk->super == NULL
+        || ! __atomic_exchange_n( &disk->super_dirty, 0, __ATOMIC_ACQ_REL ) )
+        return 0;
+    // the first BLOCK_SIZE bytes are what block 0 holds
+    if( ( status = gros_bwrite( disk, 0, ( char * ) disk->super ) ) < 0 )
+        __atomic_store_n( &disk->super_dirty, 1, __ATOMIC_RELEASE );
+    return status;
+}
+
+
+/**
+ * Commits the running transaction to the journal: waits until no
+ *  operation is under way, keeping new ones from starting, and copies the
+ *  superblock and every dirty block into one transaction. Operations go
+ *  on while it is logged with gros_journal_log, the lock let go; blocks
+ *  they dirty again meanwhile stay dirty for the next one. Blocks kept
+ *  past the budget are then let go. Called with the lock held, which is
+ *  let go while waiting. Returns 0 or -errno.
+ */
+static int gros_cache_commit( Disk * disk, Cache * cache ) {
+    std::vector< BlockIO > ios;
+    std::vector< char >    copies;
+    Journal *              journal = disk->journal;
+    CacheBlock *           cb;
+    CacheBlock *           next;
+    size_t                 i;
+    int                    status;
+
+    while( journal->locked )
+        pthread_cond_wait( &journal->quiet, &cache->lock );
+    journal->locked = true;
+    while( journal->handles > 0 || journal->writing )
+        pthread_cond_wait( &journal->quiet, &cache->lock );
+    journal->writing = true;
+
+    pthread_mutex_unlock( &cache->lock );
+    status = gros_bwrite_super( disk );
+    pthread_mutex_lock( &cache->lock );
+    if( status == 0 ) {
+        copies.resize( ( size_t ) cache->ndirty * BLOCK_SIZE );
+        for( cb = cache->oldest; cb != NULL; cb = cb->newer ) {
+            if( ! cb->dirty )
+                continue;
+            BlockIO io = { cb->block_num, &copies[ ios.size() * BLOCK_SIZE ] };
+            std::memcpy( io.buf, cb->data, BLOCK_SIZE );
+            cb->logging = true;
+            ios.push_back( io );
+        }
+    }
+    journal->locked = false;
+    pthread_cond_broadcast( &journal->quiet );
+
+    if( status == 0 && ! ios.empty() )
+        status = gros_journal_log( disk, &ios[ 0 ], ( int ) ios.size() );
+    // blocks written, dropped or discarded meanwhile are no longer logging
+    for( i = 0; i < ios.size(); i++ ) {
+        if( ( cb = gros_cache_find( cache, ios[ i ].block_num ) ) == NULL || ! cb->logging )
+            continue;
+        cb->logging = false;
+        if( status == 0 ) {
+            cb->dirty = false;
+            cache->ndirty--;
+            cache->writebacks++;
+        }
+    }
+    for( cb = cache->oldest; cb != NULL && cache->nblocks > cache->max_blocks; cb = next ) {
+        next = cb->newer;
+        if( ! cb->dirty )
+            gros_cache_drop( cache, cb );
+    }
+
+    journal->writing = false;
+    pthread_cond_broadcast( &journal->quiet );
+    return status;
+}
+
+
+/**
+ * With a journal, commits the running transaction: waits for the
+ *  operations under way to end, new ones waiting meanwhile (see
+ *  gros_journal_begin), and logs the in-memory superblock and every dirty
+ *  block as one transaction. Nothing is flushed. Must not be called
+ *  inside an operation. Does nothing without a journal or a cache.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose transaction to commit
+ */
+int gros_bcommit( Disk * disk ) {
+    Cache * cache = disk->cache;
+    int     status;
+
+    if( cache == NULL || disk->journal == NULL )
+        return 0;
+    pthread_mutex_lock( &cache->lock );
+    status = gros_cache_commit( disk, cache );
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Writes back the in-memory superblock and every dirty block in the
+ *  cache, flushes the disk to stable storage and then discards the freed
+ *  blocks gros_bdiscard had queued. With a journal the write back is a
+ *  gros_bcommit. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk to flush
+ */
+int gros_bsync( Disk * disk ) {
+    std::vector< CacheBlock * > dirty;
+    Cache *                     cache = disk->cache;
+    CacheBlock *                cb;
+    uint32_t                    before = 0;
+    int                         status;
+
+    if( ( status = gros_bwrite_super( disk ) ) < 0 )
+        return status;
+    if( cache != NULL ) {
+        pthread_mutex_lock( &cache->lock );
+        if( disk->journal != NULL ) {
+            status = gros_cache_commit( disk, cache );
+        } else {
+            for( cb = cache->oldest; cb != NULL; cb = cb->newer )
+                if( cb->dirty )
+                    dirty.push_back( cb );
+            status = gros_cache_writeback( disk, cache, dirty );
+        }
+        if( status == 0 )
+            before = gros_discard_mark( disk );
+        pthread_mutex_unlock( &cache->lock );
+    } else {
+        before = gros_discard_mark( disk );
+    }
+    if( status < 0 || ( status = gros_sync_disk( disk ) ) < 0 )
+        return status;
+
+    // the blocks are free on stable storage now
+    if( cache == NULL )
+        return gros_discard_queued( disk, before );
+    pthread_mutex_lock( &cache->lock );
+    status = gros_discard_queued( disk, before );
+    pthread_mutex_unlock( &cache->lock );
+    return status;
+}
+
+
+/**
+ * Writes the given dirty blocks home, all in flight at once through
+ *  gros_submit_block, and marks each clean as its own write completes, so
+ *  a failed write leaves only its block dirty. For a disk without a
+ *  journal; called with the lock held. Returns the number of blocks
+ *  written back.
+ */
+static int gros_cache_flush_batch( Disk * disk, Cache * cache,
+                                   std::vector< CacheBlock * > & dirty ) {
+    BlockQueue                queue = { 0, NULL };
+    std::vector< BlockReq >   reqs( dirty.size() );
+    std::vector< BlockReq * > done( dirty.size() );
+    CacheBlock *              cb;
+    int                       written = 0;
+    int                       left;
+    int                       got;
+    int                       i;
+
+    for( left = 0; left < ( int ) dirty.size(); left++ ) {
+        std::memset( &reqs[ left ], 0, sizeof( BlockReq ) );
+        reqs[ left ].block_num = dirty[ left ]->block_num;
+        reqs[ left ].buf       = dirty[ left ]->data;
+        reqs[ left ].write     = 1;
+        reqs[ left ].data      = dirty[ left ];
+        if( gros_submit_block( disk, &queue, &reqs[ left ] ) < 0 )
+            break;
+    }
+    // the requests point into `reqs`, so every one must be back first
+    for( ; left > 0; left -= got ) {
+        if( ( got = gros_reap_blocks( disk, &queue, &done[ 0 ], left, 1 ) ) < 0 ) {
+            got = 0;
+            continue;
+        }
+        if( got == 0 )
+            break;
+        for( i = 0; i < got; i++ ) {
+            if( done[ i ]->status < 0 )
+                continue;
+            cb        = ( CacheBlock * ) done[ i ]->data;
+            cb->dirty = false;
+            written++;
+        }
+    }
+    cache->ndirty     -= written;
+    cache->writebacks += written;
+    return written;
+}
+
+
+/**
+ * Writes back, in batches sorted by block number (see
+ *  gros_cache_flush_batch), the blocks that have been dirty for too long
+ *  and, if the cache is over its dirty limit, enough of the oldest ones
+ *  to bring it back down to GROS_DIRTY_LOW, counting blocks dirtied
+ *  during the round. Only for a disk without a journal, whose
+ *  transactions cannot be cut into batches. Called with the lock held;
+ *  the lock is let go between batches so requests are not held up for a
+ *  whole round. Returns the number of blocks written back.
+ */
+static int gros_cache_flush( Disk * disk, Cache * cache ) {
+    std::vector< int >          nums;
+    std::vector< CacheBlock * > dirty;
+    CacheBlock *                cb;
+    time_t                      now     = time( NULL );
+    int                         low     = cache->max_blocks * GROS_DIRTY_LOW / 100;
+    bool                        over    = cache->ndirty * 100
+                                          >= cache->max_blocks * GROS_DIRTY_HIGH;
+    int                         excess;
+    int                         written = 0;
+    int                         pass;
+    int                         got;
+    size_t                      i;
+    size_t                      j;
+
+    do {
+        nums.clear();
+        pass   = 0;
+        excess = over ? cache->ndirty - low : 0;
+        for( cb = cache->oldest; cb != NULL; cb = cb->newer ) {
+            if( ! cb->dirty )
+                continue;
+            if( excess > 0 )
+                excess--;
+            else if( now - cb->dirtied < cache->interval )
+                continue;
+            nums.push_back( cb->block_num );
+        }
+        std::sort( nums.begin(), nums.end() );
+
+        for( i = 0; i < nums.size(); i += GROS_CACHE_WB_BATCH ) {
+            // blocks may have been written or evicted while the lock was let go
+            dirty.clear();
+            for( j = i; j < nums.size() && j < i + GROS_CACHE_WB_BATCH; j++ )
+                if( ( cb = gros_cache_find( cache, nums[ j ] ) ) != NULL && cb->dirty )
+                    dirty.push_back( cb );
+            got   = gros_cache_flush_batch( disk, cache, dirty );
+            pass += got;
+            if( got < ( int ) dirty.size() )
+                return written + pass;
+            pthread_mutex_unlock( &cache->lock );
+            pthread_mutex_lock( &cache->lock );
+        }
+        written += pass;
+        // writes that came in meanwhile may have kept it over the low mark
+    } while( over && pass > 0 && cache->ndirty > low && ! cache->stopping );
+    return written;
+}
+
+
+/**
+ * Body of the flusher thread: looks for work once a second, or sooner when
+ *  gros_bwrite finds the cache over its dirty limit.
+ */
+static void * gros_flusher( void * arg ) {
+    Disk *          disk    = ( Disk * ) arg;
+    Cache *         cache   = disk->cache;
+    Journal *       journal = disk->journal;
+    struct timespec until;
+    uint32_t        before;
+    int             status;
+
+    pthread_mutex_lock( &cache->lock );
+    while( ! cache->stopping ) {
+        clock_gettime( CLOCK_REALTIME, &until );
+        until.tv_sec++;
+        pthread_cond_timedwait( &cache->wake, &cache->lock, &until );
+        if( cache->stopping )
+            break;
+        if( journal == NULL ) {
+            // the superblock joins the round as an ordinary dirty block
+            pthread_mutex_unlock( &cache->lock );
+            gros_bwrite_super( disk );
+            pthread_mutex_lock( &cache->lock );
+            if( ! cache->stopping )
+                gros_cache_flush( disk, cache );
+            continue;
+        }
+        // the journal's commit interval: the round is one transaction,
+        // made durable before it counts
+        if( ( cache->ndirty > 0 || __atomic_load_n( &disk->super_dirty, __ATOMIC_ACQUIRE ) )
+            && gros_cache_commit( disk, cache ) == 0 ) {
+            before = gros_discard_mark( disk );
+            pthread_mutex_unlock( &cache->lock );
+            status = gros_sync_disk( disk );
+            pthread_mutex_lock( &cache->lock );
+            // what the transaction freed can go now
+            if( status == 0 )
+                gros_discard_queued( disk, before );
+        }
+        if( journal->next > 1 && ! journal->writing
+            && ( time( NULL ) - journal->committed >= cache->interval
+                 || journal->next * 100 >= journal->nblocks * GROS_DIRTY_HIGH ) ) {
+            // reads and operations go on while the blocks go home
+            journal->writing = true;
+            gros_journal_checkpoint( disk );
+            journal->writing = false;
+            pthread_cond_broadcast( &journal->quiet );
+        }
+    }
+    pthread_mutex_unlock( &cache->lock );
+    return NULL;
+}
+
+
+/**
+ * Starts a thread that writes dirty blocks back in the background, so
+ *  requests only touch memory. Blocks are written once they have been
+ *  dirty for `interval` seconds, or, oldest first, as soon as more than
+ *  GROS_DIRTY_HIGH percent of the cache is dirty, until only
+ *  GROS_DIRTY_LOW percent is. Each round goes out sorted by block number.
+ *  With a journal each round instead commits the whole running
+ *  transaction, as gros_bcommit does, and flushes it to stable storage;
+ *  the journal is checkpointed once its oldest transaction is `interval`
+ *  seconds old or more than GROS_DIRTY_HIGH percent of it is used. Only
+ *  taking the transaction holds the cache lock; reads and operations go
+ *  on while it is written and while the journal is checkpointed.
+ *  Returns 0, -EINVAL if the disk has no cache, -EEXIST if the flusher is
+ *  already running, or -errno if the thread could not be started.
+ *
+ * @param Disk * disk       The cached disk to flush
+ * @param int    interval   Age in seconds at which a dirty block is written,
+ *                          or the journal checkpointed
+ */
+int gros_start_flusher( Disk * disk, int interval ) {
+    Cache * cache = disk->cache;
+    int     status;
+
+    if( cache == NULL || interval < 0 )
+        return -EINVAL;
+    if( cache->flushing )
+        return -EEXIST;
+
+    cache->interval = interval;
+    cache->stopping = false;
+    if( ( status = pthread_create( &cache->flusher, NULL, gros_flusher, disk ) ) != 0 )
+        return -status;
+    cache->flushing = true;
+    return 0;
+}
+
+
+/**
+ * Stops the flusher thread, if there is one, and waits for it to exit.
+ *  Dirty blocks it had not written yet stay in the cache.
+ *
+ * @param Disk * disk   The disk whose flusher to stop
+ */
+void gros_stop_flusher( Disk * disk ) {
+    Cache * cache = disk->cache;
+
+    if( cache == NULL || ! cache->flushing )
+        return;
+    pthread_mutex_lock( &cache->lock );
+    cache->stopping = true;
+    pthread_cond_signal( &cache->wake );
+    pthread_mutex_unlock( &cache->lock );
+    pthread_join( cache->flusher, NULL );
+    cache->flushing = false;
+}
+
+
+/**
+ * Like gros_bsync, but only writes back the listed blocks before flushing.
+ *  With a journal everything is committed anyway: the dirty blocks of one
+ *  transaction cannot be split without breaking it, and it is a single
+ *  write either way. Listing block 0 writes back the in-memory superblock.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk      * disk     The disk to flush
+ * @param const int * blocks   The blocks to write back, in any order
+ * @param int         n        Number of entries in `blocks`
+ */
+int gros_bsync_blocks( Disk * disk, const int * blocks, int n ) {
+    std::vector< int >          nums( blocks, blocks + n );
+    std::vector< CacheBlock * > dirty;
+    Cache *                     cache = disk->cache;
+    CacheBlock *                cb;
+    size_t                      i;
+    int                         status;
+
+    if( std::find( nums.begin(), nums.end(), 0 ) != nums.end()
+        && ( status = gros_bwrite_super( disk ) ) < 0 )
+        return status;
+    if( cache == NULL )
+        return gros_sync_disk( disk );
+    if( disk->journal != NULL )
+        return gros_bsync( disk );
+
+    std::sort( nums.begin(), nums.end() );
+    nums.erase( std::unique( nums.begin(), nums.end() ), nums.end() );
+    pthread_mutex_lock( &cache->lock );
+    for( i = 0; i < nums.size(); i++ )
+        if( ( cb = gros_cache_find( cache, nums[ i ] ) ) != NULL && cb->dirty )
+            dirty.push_back( cb );
+    status = gros_cache_writeback( disk, cache, dirty );
+    pthread_mutex_unlock( &cache->lock );
+    if( status < 0 )
+        return status;
+    return gros_sync_disk( disk );
+}
+
+
+/**
+ * Reads block 9 over and over, for the test of reads racing writes.
+ */
+static void * gros_test_cache_reader( void * arg ) {
+    Disk * disk = ( Disk * ) arg;
+    char   out[ BLOCK_SIZE ];
+    int    i;
+
+    for( i = 0; i < 200; i++ )
+        if( gros_bread( disk, 9, out ) < 0 )
+            break;
+    return NULL;
+}
+
+
+TEST_CASE( "Blocks can be cached in front of the disk", "[cache]" ) {
+    Disk * disk = gros_open_disk();
+    char   buf[ BLOCK_SIZE ];
+    char   out[ BLOCK_SIZE ];
+    int    i;
+
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == -EEXIST );
+    Cache * cache = disk->cache;
+    REQUIRE( cache->max_blocks == 64 );
+
+    SECTION( "Writes stay in memory until synced" ) {
+        memset( buf, 0, BLOCK_SIZE );
+        REQUIRE( gros_write_block( disk, 5, buf ) == 0 );
+        memset( buf, 0x5a, BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 5, buf ) == 0 );
+        REQUIRE( cache->ndirty == 1 );
+
+        REQUIRE( gros_read_block( disk, 5, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0 );
+        REQUIRE( gros_bread( disk, 5, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( cache->ndirty == 0 );
+        REQUIRE( gros_read_block( disk, 5, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "Repeated reads are served from memory" ) {
+        REQUIRE( gros_bread( disk, 7, out ) == 0 );
+        REQUIRE( cache->misses == 1 );
+        for( i = 0; i < 10; i++ )
+            REQUIRE( gros_bread( disk, 7, out ) == 0 );
+        REQUIRE( cache->hits == 10 );
+        REQUIRE( cache->misses == 1 );
+        REQUIRE( cache->inflight.empty() );
+    }
+
+    SECTION( "A read racing writes never caches a copy older than the last write" ) {
+        pthread_t reader;
+        BlockIO   io = { 9, buf };
+        REQUIRE( pthread_create( &reader, NULL, gros_test_cache_reader, disk ) == 0 );
+        for( i = 0; i < 200; i++ ) {
+            memset( buf, i, BLOCK_SIZE );
+            // batch writes go around the cache, so a miss may be reading
+            REQUIRE( gros_bwrite_blocks( disk, &io, 1 ) == 0 );
+        }
+        REQUIRE( pthread_join( reader, NULL ) == 0 );
+        REQUIRE( cache->inflight.empty() );
+        REQUIRE( gros_bread( disk, 9, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "The budget is kept by evicting and writing back old blocks" ) {
+        for( i = 0; i < 200; i++ ) {
+            memset( buf, i, BLOCK_SIZE );
+            REQUIRE( gros_bwrite( disk, 100 + i, buf ) == 0 );
+            REQUIRE( cache->nblocks <= 64 );
+        }
+        REQUIRE( cache->writebacks > 0 );
+        for( i = 0; i < 200; i++ ) {
+            REQUIRE( gros_bread( disk, 100 + i, out ) == 0 );
+            REQUIRE( out[ 17 ] == ( char ) i );
+        }
+        REQUIRE( gros_detach_cache( disk ) == 0 );
+        REQUIRE( disk->cache == NULL );
+        for( i = 0; i < 200; i++ ) {
+            REQUIRE( gros_read_block( disk, 100 + i, out ) == 0 );
+            REQUIRE( out[ 17 ] == ( char ) i );
+        }
+    }
+
+    SECTION( "Batch writes replace cached copies" ) {
+        BlockIO ios[ 2 ];
+        memset( buf, 1, BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 9, buf ) == 0 );
+        memset( out, 2, BLOCK_SIZE );
+        ios[ 0 ].block_num = 9;
+        ios[ 0 ].buf       = out;
+        ios[ 1 ].block_num = 10;
+        ios[ 1 ].buf       = out;
+        REQUIRE( gros_bwrite_blocks( disk, ios, 2 ) == 0 );
+        REQUIRE( cache->ndirty == 0 );
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( gros_bread( disk, 9, buf ) == 0 );
+        REQUIRE( buf[ 0 ] == 2 );
+    }
+
+    SECTION( "The flusher writes back blocks that stay dirty too long" ) {
+        memset( buf, 0x33, BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 12, buf ) == 0 );
+        REQUIRE( gros_start_flusher( disk, 0 ) == 0 );
+        REQUIRE( gros_start_flusher( disk, 0 ) == -EEXIST );
+        int64_t written = 0;
+        for( i = 0; i < 50 && written == 0; i++ ) {
+            usleep( 100000 );
+            pthread_mutex_lock( &cache->lock );
+            written = cache->writebacks;
+            pthread_mutex_unlock( &cache->lock );
+        }
+        gros_stop_flusher( disk );
+        REQUIRE( cache->ndirty == 0 );
+        REQUIRE( gros_read_block( disk, 12, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "The flusher keeps the dirty share of the cache down" ) {
+        int dirty;
+        // all of it is dirty by the flusher's first round
+        for( i = 0; i < 48; i++ ) {
+            memset( buf, i, BLOCK_SIZE );
+            REQUIRE( gros_bwrite( disk, 100 + i, buf ) == 0 );
+        }
+        REQUIRE( gros_start_flusher( disk, 3600 ) == 0 );
+        for( i = 0; i < 50; i++ ) {
+            pthread_mutex_lock( &cache->lock );
+            dirty = cache->ndirty;
+            pthread_mutex_unlock( &cache->lock );
+            if( dirty <= 64 * GROS_DIRTY_LOW / 100 )
+                break;
+            usleep( 100000 );
+        }
+        gros_stop_flusher( disk );
+        REQUIRE( cache->ndirty <= 64 * GROS_DIRTY_LOW / 100 );
+        REQUIRE( cache->ndirty > 0 );
+    }
+
+    SECTION( "Syncing some blocks leaves the others dirty" ) {
+        int which = 21;
+        memset( buf, 0x44, BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 20, buf ) == 0 );
+        REQUIRE( gros_bwrite( disk, 21, buf ) == 0 );
+        REQUIRE( gros_bsync_blocks( disk, &which, 1 ) == 0 );
+        REQUIRE( cache->ndirty == 1 );
+        REQUIRE( gros_read_block( disk, 21, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0x44 );
+    }
+
+    SECTION( "Freed blocks are dropped and discarded once their freeing is durable" ) {
+        char zeros[ BLOCK_SIZE ];
+        memset( zeros, 0, BLOCK_SIZE );
+        memset( buf, 0x66, BLOCK_SIZE );
+        for( i = 0; i < 4; i++ )
+            REQUIRE( gros_write_block( disk, 40 + i, buf ) == 0 );
+        REQUIRE( gros_bwrite( disk, 40, buf ) == 0 );
+        REQUIRE( gros_bdiscard( disk, 40 ) == 0 );
+        REQUIRE( cache->ndirty == 0 );
+        REQUIRE( gros_bdiscard( disk, 41 ) == 0 );
+        REQUIRE( gros_bdiscard( disk, 42 ) == 0 );
+        REQUIRE( disk->discards.size() == 3 );
+        // reused before the batch went out
+        REQUIRE( gros_bwrite( disk, 42, buf ) == 0 );
+        REQUIRE( disk->discards.size() == 2 );
+        REQUIRE( gros_read_block( disk, 40, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( disk->discards.empty() );
+        REQUIRE( gros_read_block( disk, 40, out ) == 0 );
+        REQUIRE( memcmp( out, zeros, BLOCK_SIZE ) == 0 );
+        REQUIRE( gros_read_block( disk, 41, out ) == 0 );
+        REQUIRE( memcmp( out, zeros, BLOCK_SIZE ) == 0 );
+        REQUIRE( gros_read_block( disk, 42, out ) == 0 );
+        REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+
+        // however many gather, they wait for the write back that frees them
+        for( i = 0; i < 64; i++ )
+            REQUIRE( gros_bdiscard( disk, 100 + i ) == 0 );
+        REQUIRE( disk->discards.size() == 64 );
+        REQUIRE( gros_flush_discards( disk ) == 0 );
+        REQUIRE( disk->discards.empty() );
+        REQUIRE( gros_bdiscard( disk, -1 ) == -EINVAL );
+    }
+
+    SECTION( "Bad block numbers are rejected" ) {
+        REQUIRE( gros_bread( disk, -1, out ) == -EINVAL );
+        REQUIRE( gros_bwrite( disk, ( int ) ( disk->size / BLOCK_SIZE ), buf ) == -EINVAL );
+    }
+    gros_close_disk( disk );
+}
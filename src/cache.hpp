@@ -0,0 +1,257 @@
+/**
+ * cache.hpp
+ */
+
+#ifndef __CACHE_HPP_INCLUDED__   // if cache.hpp hasn't been included yet...
+#define __CACHE_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "disk.hpp"
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <set>
+
+#define GROS_CACHE_DEFAULT_SIZE ( 16 * 1024 * 1024 ) // 16 mb
+#define GROS_CACHE_MIN_BLOCKS   16       // smallest cache worth having
+#define GROS_CACHE_WB_BATCH     64       // dirty blocks written per eviction
+#define GROS_WRITEBACK_INTERVAL 5        // seconds between write backs
+#define GROS_DIRTY_HIGH         50       // % of the cache dirty that wakes the flusher
+#define GROS_DIRTY_LOW          25       // % of the cache it then leaves dirty
+#define GROS_READAHEAD_WINDOW   ( 128 * 1024 ) // largest read-ahead, in bytes
+
+typedef struct _cacheblock {
+    int                  block_num;
+    bool                 dirty;       /* newer than the copy on disk */
+    time_t               dirtied;     /* when it last became dirty */
+    bool                 readahead;   /* prefetched and not read yet */
+    bool                 logging;     /* being committed as it is, see gros_cache_commit */
+    char               * data;        /* BLOCK_SIZE bytes */
+    struct _cacheblock * hnext;       /* next block in the same hash bucket */
+    struct _cacheblock * newer;       /* LRU neighbours */
+    struct _cacheblock * older;
+} CacheBlock;
+
+typedef struct _cache {
+    CacheBlock    ** table;           /* hash buckets, indexed by block number */
+    int              shift;           /* 32 - log2( number of buckets ) */
+    CacheBlock     * newest;          /* most recently used block */
+    CacheBlock     * oldest;          /* eviction candidate */
+    int              nblocks;         /* blocks held */
+    int              max_blocks;      /* memory budget, in blocks */
+    int              ndirty;
+    int64_t          hits;
+    int64_t          misses;
+    int64_t          writebacks;      /* blocks written back to the disk */
+    int64_t          prefetched;      /* blocks read ahead */
+    int64_t          prefetch_hits;   /* read ahead blocks that were then read */
+    std::set< int >  inflight;        /* being read in, see gros_bread */
+    pthread_mutex_t  lock;
+
+    // background write back, see gros_start_flusher
+    pthread_t        flusher;
+    pthread_cond_t   wake;            /* wakes the flusher ahead of time */
+    bool             flushing;        /* the flusher thread is running */
+    bool             stopping;        /* the flusher has been asked to exit */
+    int              interval;        /* age in seconds at which dirty blocks go */
+} Cache;
+
+/**
+ * Puts a write-back cache of `budget` bytes in front of the disk. From then
+ *  on blocks moved with the gros_b* calls are served from memory and only
+ *  written to the image on gros_bsync, when evicted, by the flusher, or
+ *  when the cache is detached. Returns 0, or -EEXIST if the disk already has a cache.
+ *
+ * @param Disk  * disk     The disk to cache
+ * @param int64_t budget   Memory to spend on cached blocks, in bytes
+ */
+int gros_attach_cache( Disk * disk, int64_t budget );
+
+/**
+ * Starts a thread that writes dirty blocks back in the background, so
+ *  requests only touch memory. Blocks are written once they have been
+ *  dirty for `interval` seconds, or, oldest first, as soon as more than
+ *  GROS_DIRTY_HIGH percent of the cache is dirty, until only
+ *  GROS_DIRTY_LOW percent is. Each round goes out sorted by block number.
+ *  With a journal each round instead commits the whole running
+ *  transaction, as gros_bcommit does, and flushes it to stable storage;
+ *  the journal is checkpointed once its oldest transaction is `interval`
+ *  seconds old or more than GROS_DIRTY_HIGH percent of it is used. Only
+ *  taking the transaction holds the cache lock; reads and operations go
+ *  on while it is written and while the journal is checkpointed.
+ *  Returns 0, -EINVAL if the disk has no cache, -EEXIST if the flusher is
+ *  already running, or -errno if the thread could not be started.
+ *
+ * @param Disk * disk       The cached disk to flush
+ * @param int    interval   Age in seconds at which a dirty block is written,
+ *                          or the journal checkpointed
+ */
+int gros_start_flusher( Disk * disk, int interval );
+
+/**
+ * Stops the flusher thread, if there is one, and waits for it to exit.
+ *  Dirty blocks it had not written yet stay in the cache.
+ *
+ * @param Disk * disk   The disk whose flusher to stop
+ */
+void gros_stop_flusher( Disk * disk );
+
+/**
+ * Stops read-ahead and the flusher, writes back the superblock and every
+ *  dirty block, discards queued freed blocks, checkpoints the journal if
+ *  there is one, frees the cache and leaves the disk uncached. Returns 0
+ *  or the -errno of a failed write back.
+ *
+ * @param Disk * disk   The disk to stop caching
+ */
+int gros_detach_cache( Disk * disk );
+
+/**
+ * Reads block `block_num` into `buf`, from the cache when possible. A
+ *  missing block is read from the disk, without holding the cache lock,
+ *  and kept in the cache. With checksums on, a block read from the disk
+ *  is checked against its checksum first.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Destination of BLOCK_SIZE bytes
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          -EIO if it does not match a checksum logged
+ *                          with it (see gros_bwrite_blocks),
+ *                          or -errno if the block could not be read
+ */
+int gros_bread( Disk * disk, int block_num, char * buf );
+
+/**
+ * Writes `buf` as the new contents of block `block_num`. With a cache the
+ *  block is only marked dirty; it reaches the disk later.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        BLOCK_SIZE bytes of data
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          or -errno if the block could not be written
+ */
+int gros_bwrite( Disk * disk, int block_num, char * buf );
+
+/**
+ * Like gros_get_block, but through the cache: returns a pointer into the
+ *  mapped image when the disk is mapped and uncached, otherwise `buf` after
+ *  gros_bread-ing the block into it. Returns NULL if the block cannot be
+ *  read. Changes are kept by handing the pointer back to gros_bwrite.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Fallback buffer of BLOCK_SIZE bytes
+ */
+char * gros_bget( Disk * disk, int block_num, char * buf );
+
+/**
+ * Reads a batch of blocks. Cached blocks are copied out of the cache and
+ *  the rest are fetched together with gros_read_blocks, without holding
+ *  the cache lock and without being added to the cache (bulk file data
+ *  would only push metadata out).
+ *  Prefetched blocks are dropped from the cache once read.
+ *
+ * @param Disk    * disk   The disk to read from
+ * @param BlockIO * ios    The blocks to read and where to put them
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_bread_blocks( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Reads the given blocks into the cache ahead of use, skipping those it
+ *  already holds. The reads are all put in flight at once with
+ *  gros_submit_block, without holding the cache lock, so other requests go
+ *  on meanwhile, and each block is put in as soon as its own read
+ *  completes; a block written in the meantime is not put in. The first
+ *  gros_bread_blocks that reads a prefetched block takes it out of the
+ *  cache again. Does nothing without a cache. Returns the number of blocks
+ *  prefetched or -errno.
+ *
+ * @param Disk      * disk     The disk to read from
+ * @param const int * blocks   The blocks to read, in any order
+ * @param int         n        Number of entries in `blocks`
+ */
+int gros_bprefetch( Disk * disk, const int * blocks, int n );
+
+/**
+ * Writes a batch of blocks straight to the disk with gros_write_blocks,
+ *  dropping any cached copies they replace. They are written in place,
+ *  outside the journal, so their checksums are tagged GROS_CSUM_UNLOGGED
+ *  and a later mismatch leaves them unverified rather than unreadable.
+ *
+ * @param Disk    * disk   The disk to write to
+ * @param BlockIO * ios    The blocks to write and where their data is
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_bwrite_blocks( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Marks block `block_num` as free. A cached copy is dropped without being
+ *  written back, the block's checksum is cleared, and the block is queued
+ *  to be discarded with gros_discard_blocks. A crash must not leave the
+ *  block allocated on disk but discarded, so it only goes out, in sorted
+ *  runs, once the write back that frees it is durable: after the flusher
+ *  commits the transaction that frees it to the journal, on gros_bsync or
+ *  gros_flush_discards, or when the disk is closed. Writing the block
+ *  again takes it off the queue. Returns 0 or -errno.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ */
+int gros_bdiscard( Disk * disk, int block_num );
+
+/**
+ * Discards the blocks gros_bdiscard has queued right away, which takes a
+ *  gros_bsync to make their freeing durable first. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose freed blocks to discard
+ */
+int gros_flush_discards( Disk * disk );
+
+/**
+ * Writes the in-memory superblock out as block 0 if it changed since it
+ *  was last written; with a cache it only becomes a dirty block. Returns 0
+ *  or -errno, in which case it is still considered changed.
+ *
+ * @param Disk * disk   The disk holding the superblock
+ */
+int gros_bwrite_super( Disk * disk );
+
+/**
+ * With a journal, commits the running transaction: waits for the
+ *  operations under way to end, new ones waiting meanwhile (see
+ *  gros_journal_begin), and logs the in-memory superblock and every dirty
+ *  block as one transaction. Nothing is flushed. Must not be called
+ *  inside an operation. Does nothing without a journal or a cache.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose transaction to commit
+ */
+int gros_bcommit( Disk * disk );
+
+/**
+ * Writes back the in-memory superblock and every dirty block in the
+ *  cache, discards the freed blocks gros_bdiscard has queued and flushes
+ *  the disk to stable storage. With a journal the write back is a
+ *  gros_bcommit. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk to flush
+ */
+int gros_bsync( Disk * disk );
+
+/**
+ * Like gros_bsync, but only writes back the listed blocks before flushing.
+ *  With a journal everything is committed anyway: the dirty blocks of one
+ *  transaction cannot be split without breaking it, and it is a single
+ *  write either way. Listing block 0 writes back the in-memory superblock.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk      * disk     The disk to flush
+ * @param const int * blocks   The blocks to write back, in any order
+ * @param int         n        Number of entries in `blocks`
+ */
+int gros_bsync_blocks( Disk * disk, const int * blocks, int n );
+
+#endif
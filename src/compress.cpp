@@ -0,0 +1,692 @@
+/**
+ * compress.cpp
+ */
+
+#include "compress.hpp"
+#include "files.hpp"
+#include "readahead.hpp"
+#include "icache.hpp"
+#include "journal.hpp"
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+
+#define GROS_LZ4_MINMATCH     4     // shortest match worth encoding
+#define GROS_LZ4_LASTLITERALS 5     // the last bytes are always literals
+#define GROS_LZ4_MFLIMIT      12    // no match starts this close to the end
+#define GROS_LZ4_HASH_BITS    12
+#define GROS_LZ4_MAX_OFFSET   65535
+
+
+static uint32_t gros_lz4_read32( const unsigned char * p ) {
+    uint32_t v;
+
+    std::memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+
+static unsigned gros_lz4_hash( uint32_t v ) {
+    return ( v * 2654435761u ) >> ( 32 - GROS_LZ4_HASH_BITS );
+}
+
+
+/**
+ * Appends a length that did not fit in its token nibble: runs of 255 and
+ *  the rest. Returns the new output position, or NULL if out of room.
+ */
+static unsigned char * gros_lz4_put_length( unsigned char * op, unsigned char * oend,
+                                            int len ) {
+    for( ; len >= 255; len -= 255 ) {
+        if( op >= oend )
+            return NULL;
+        * op++ = 255;
+    }
+    if( op >= oend )
+        return NULL;
+    * op++ = ( unsigned char ) len;
+    return op;
+}
+
+
+/**
+ * Emits one sequence: the literals from `anchor` to `ip`, then, unless
+ *  `mlen` is 0 (the last sequence), a match of `mlen` bytes `offset` bytes
+ *  back. Returns the new output position, or NULL if out of room.
+ */
+static unsigned char * gros_lz4_sequence( unsigned char * op, unsigned char * oend,
+                                          const unsigned char * anchor,
+                                          const unsigned char * ip,
+                                          int offset, int mlen ) {
+    unsigned char * token;
+    int             lit = ( int ) ( ip - anchor );
+
+    if( op >= oend )
+        return NULL;
+    token = op++;
+    * token = ( unsigned char ) ( std::min( lit, 15 ) << 4 );
+    if( lit >= 15 && ( op = gros_lz4_put_length( op, oend, lit - 15 ) ) == NULL )
+        return NULL;
+    if( oend - op < lit )
+        return NULL;
+    std::memcpy( op, anchor, lit );
+    op += lit;
+    if( mlen == 0 )
+        return op;
+
+    if( oend - op < 2 )
+        return NULL;
+    * op++ = ( unsigned char ) ( offset & 0xff );
+    * op++ = ( unsigned char ) ( offset >> 8 );
+    mlen -= GROS_LZ4_MINMATCH;
+    * token |= ( unsigned char ) std::min( mlen, 15 );
+    if( mlen >= 15 && ( op = gros_lz4_put_length( op, oend, mlen - 15 ) ) == NULL )
+        return NULL;
+    return op;
+}
+
+
+/**
+ * Compresses `n` bytes of `src` into `dst` in the LZ4 block format. Returns
+ *  the compressed size, or 0 if it would not fit in `cap` bytes.
+ *
+ * @param const char * src   The data to compress
+ * @param int          n     Number of bytes in `src`
+ * @param char       * dst   Destination of at most `cap` bytes
+ * @param int          cap   Room in `dst`
+ */
+int gros_lz4_compress( const char * src, int n, char * dst, int cap ) {
+    const unsigned char * base   = ( const unsigned char * ) src;
+    const unsigned char * ip     = base;
+    const unsigned char * anchor = base;
+    const unsigned char * end    = base + n;
+    const unsigned char * match;
+    unsigned char       * op     = ( unsigned char * ) dst;
+    unsigned char       * oend   = op + cap;
+    int                   table[ 1 << GROS_LZ4_HASH_BITS ];
+    unsigned              h;
+    int                   mlen;
+
+    if( n <= 0 || cap <= 0 )
+        return 0;
+    std::fill( table, table + ( 1 << GROS_LZ4_HASH_BITS ), -1 );
+
+    while( n > GROS_LZ4_MFLIMIT && ip < end - GROS_LZ4_MFLIMIT ) {
+        h          = gros_lz4_hash( gros_lz4_read32( ip ) );
+        match      = table[ h ] < 0 ? NULL : base + table[ h ];
+        table[ h ] = ( int ) ( ip - base );
+        if( match == NULL || ip - match > GROS_LZ4_MAX_OFFSET
+            || gros_lz4_read32( match ) != gros_lz4_read32( ip ) ) {
+            ip++;
+            continue;
+        }
+
+        mlen = GROS_LZ4_MINMATCH;
+        while( ip + mlen < end - GROS_LZ4_LASTLITERALS && match[ mlen ] == ip[ mlen ] )
+            mlen++;
+        if( ( op = gros_lz4_sequence( op, oend, anchor, ip,
+                                      ( int ) ( ip - match ), mlen ) ) == NULL )
+            return 0;
+        ip    += mlen;
+        anchor = ip;
+    }
+
+    if( ( op = gros_lz4_sequence( op, oend, anchor, end, 0, 0 ) ) == NULL )
+        return 0;
+    return ( int ) ( op - ( unsigned char * ) dst );
+}
+
+
+/**
+ * Reads a length continued past its token nibble. Returns false if the
+ *  input ends first.
+ */
+static bool gros_lz4_get_length( const unsigned char ** ip, const unsigned char * iend,
+                                 int * len ) {
+    unsigned char b;
+
+    do {
+        if( * ip >= iend )
+            return false;
+        b     = * ( * ip )++;
+        * len += b;
+    } while( b == 255 );
+    return true;
+}
+
+
+/**
+ * Expands `n` bytes of LZ4 block data from `src` into `dst`. Returns the
+ *  number of bytes produced, or -EIO if the data is malformed or would
+ *  expand past `cap` bytes.
+ *
+ * @param const char * src   Compressed data
+ * @param int          n     Number of bytes in `src`
+ * @param char       * dst   Destination of at most `cap` bytes
+ * @param int          cap   Room in `dst`
+ */
+int gros_lz4_decompress( const char * src, int n, char * dst, int cap ) {
+    const unsigned char * ip   = ( const unsigned char * ) src;
+    const unsigned char * iend = ip + n;
+    unsigned char       * out  = ( unsigned char * ) dst;
+    unsigned char       * op   = out;
+    unsigned char       * oend = out + cap;
+    unsigned char         token;
+    int                   len;
+    int                   offset;
+
+    while( ip < iend ) {
+        token = * ip++;
+        len   = token >> 4;
+        if( len == 15 && ! gros_lz4_get_length( &ip, iend, &len ) )
+            return -EIO;
+        if( iend - ip < len || oend - op < len )
+            return -EIO;
+        std::memcpy( op, ip, len );
+        ip += len;
+        op += len;
+        // the last sequence has no match
+        if( ip == iend )
+            break;
+
+        if( iend - ip < 2 )
+            return -EIO;
+        offset = ip[ 0 ] | ( ip[ 1 ] << 8 );
+        ip    += 2;
+        if( offset == 0 || offset > op - out )
+            return -EIO;
+        len = token & 15;
+        if( len == 15 && ! gros_lz4_get_length( &ip, iend, &len ) )
+            return -EIO;
+        len += GROS_LZ4_MINMATCH;
+        if( oend - op < len )
+            return -EIO;
+        if( offset >= len ) {
+            std::memcpy( op, op - offset, len );
+            op += len;
+        } else {
+            // overlapping match: repeats the last `offset` bytes
+            for( ; len > 0; len--, op++ )
+                * op = op[ -offset ];
+        }
+    }
+    return ( int ) ( op - out );
+}
+
+
+/**
+ * Returns how many bytes of the file the cluster at `cluster` holds.
+ */
+static int gros_z_length( Inode * inode, int cluster ) {
+    return std::max( 0, std::min( GROS_ZCLUSTER_SIZE,
+                                  inode->f_size - cluster * GROS_ZCLUSTER_SIZE ) );
+}
+
+
+/**
+ * Reads the data of a cluster into `data` (GROS_ZCLUSTER_SIZE bytes), with
+ *  zeroes past the end of the file. Returns 0 or -EIO.
+ */
+static int gros_z_load( Disk * disk, Inode * inode, int cluster, char * data ) {
+    int                 map[ GROS_ZCLUSTER ];
+    BlockIO             ios[ GROS_ZCLUSTER ];
+    std::vector< char > zbuf;
+    ZHeader           * header;
+    int                 len  = gros_z_length( inode, cluster );
+    int                 nblk = ( len + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+    int                 n    = 0;
+    int                 got;
+    int                 i;
+
+    std::memset( data, 0, GROS_ZCLUSTER_SIZE );
+    if( len == 0 )
+        return 0;
+    gros_bmap_range( disk, inode, cluster * GROS_ZCLUSTER, GROS_ZCLUSTER, map );
+    if( std::find( map, map + nblk, GROS_ZBLOCK ) == map + nblk ) {
+        for( i = 0; i < nblk; i++ ) {
+            if( map[ i ] <= 0 )
+                continue;
+            ios[ n ].block_num = map[ i ];
+            ios[ n++ ].buf     = data + i * BLOCK_SIZE;
+        }
+        return gros_bread_blocks( disk, ios, n ) < 0 ? -EIO : 0;
+    }
+
+    zbuf.resize( GROS_ZCLUSTER_SIZE );
+    for( n = 0; n < nblk && map[ n ] > 0; n++ ) {
+        ios[ n ].block_num = map[ n ];
+        ios[ n ].buf       = &zbuf[ n * BLOCK_SIZE ];
+    }
+    if( n == 0 || gros_bread_blocks( disk, ios, n ) < 0 )
+        return -EIO;
+    header = ( ZHeader * ) &zbuf[ 0 ];
+    if( header->magic != GROS_ZMAGIC || header->size > GROS_ZCLUSTER_SIZE
+        || header->zsize > n * BLOCK_SIZE - sizeof( ZHeader ) )
+        return -EIO;
+    got = gros_lz4_decompress( &zbuf[ sizeof( ZHeader ) ], ( int ) header->zsize,
+                               data, GROS_ZCLUSTER_SIZE );
+    if( got != ( int ) header->size )
+        return -EIO;
+    if( got > len )
+        std::memset( data + len, 0, got - len );
+    return 0;
+}
+
+
+/**
+ * Returns a block to aim the allocation of a cluster's blocks at: the
+ *  first block it has, or else the block after the last one of the cluster
+ *  before it, or else the file's home group.
+ */
+static int gros_z_goal( Disk * disk, Inode * inode, int cluster, const int * map ) {
+    int prev[ GROS_ZCLUSTER ];
+    int i;
+
+    for( i = 0; i < GROS_ZCLUSTER; i++ )
+        if( map[ i ] > 0 )
+            return map[ i ];
+    if( cluster > 0 ) {
+        gros_bmap_range( disk, inode, ( cluster - 1 ) * GROS_ZCLUSTER, GROS_ZCLUSTER, prev );
+        for( i = GROS_ZCLUSTER - 1; i >= 0; i-- )
+            if( prev[ i ] > 0 )
+                return prev[ i ] + 1;
+    }
+    return gros_inode_goal( disk, inode->f_inode_num );
+}
+
+
+/**
+ * Stores the first `len` bytes of `data` as the cluster at `cluster`:
+ *  compressed if that saves at least one block and `raw` is zero, raw
+ *  otherwise. The data goes to newly allocated blocks, as few runs as
+ *  there is room for near the cluster's old ones; only once it is written
+ *  is the block map switched to them, in the same journal operation that
+ *  frees the old blocks, so a crash leaves either cluster whole. Returns
+ *  0 or -errno.
+ */
+static int gros_z_store( Disk * disk, Inode * inode, int cluster, char * data,
+                         int len, int raw ) {
+    int                 map[ GROS_ZCLUSTER ];
+    int                 fresh[ GROS_ZCLUSTER ];
+    BlockIO             ios[ GROS_ZCLUSTER ];
+    std::vector< char > zbuf;
+    ZHeader           * header;
+    char              * payload = data;
+    int                 nblk    = ( len + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+    int                 need    = nblk;
+    int                 zsize   = 0;
+    int                 n       = 0;
+    int                 status  = 0;
+    int                 goal;
+    int                 first;
+    int                 count;
+    int                 want;
+    int                 i;
+
+    if( ! raw && nblk > 1 ) {
+        zbuf.resize( GROS_ZCLUSTER_SIZE );
+        zsize = gros_lz4_compress( data, len, &zbuf[ sizeof( ZHeader ) ],
+                                   ( nblk - 1 ) * BLOCK_SIZE - sizeof( ZHeader ) );
+    }
+    if( zsize > 0 ) {
+        header        = ( ZHeader * ) &zbuf[ 0 ];
+        header->magic = GROS_ZMAGIC;
+        header->zsize = ( uint32_t ) zsize;
+        header->size  = ( uint32_t ) len;
+        need          = ( int ) ( sizeof( ZHeader ) + zsize + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        payload       = &zbuf[ 0 ];
+    }
+
+    gros_bmap_range( disk, inode, cluster * GROS_ZCLUSTER, GROS_ZCLUSTER, map );
+    goal = gros_z_goal( disk, inode, cluster, map );
+    while( n < need ) {
+        if( ( first = gros_allocate_data_blocks( disk, goal, need - n, &count ) ) < 0 ) {
+            while( n > 0 )
+                gros_free_data_block( disk, fresh[ --n ] );
+            return -ENOSPC;
+        }
+        for( i = 0; i < count; i++ ) {
+            fresh[ n ]         = first + i;
+            ios[ n ].block_num = first + i;
+            ios[ n ].buf       = payload + n * BLOCK_SIZE;
+            n++;
+        }
+        goal = first + count;
+    }
+    if( n > 0 && gros_bwrite_blocks( disk, ios, n ) < 0 ) {
+        while( n > 0 )
+            gros_free_data_block( disk, fresh[ --n ] );
+        return -EIO;
+    }
+
+    // the data is in place; switch the map over and let the old blocks go
+    gros_journal_begin( disk );
+    for( i = 0; i < GROS_ZCLUSTER; i++ ) {
+        want = i < need ? fresh[ i ] : i < nblk ? GROS_ZBLOCK : -1;
+        if( map[ i ] != want
+            && ( status = gros_bmap_set( disk, inode, cluster * GROS_ZCLUSTER + i,
+                                         want ) ) < 0 )
+            break;
+    }
+    for( i = 0; status >= 0 && i < GROS_ZCLUSTER; i++ )
+        if( map[ i ] > 0 )
+            gros_free_data_block( disk, map[ i ] );
+    gros_journal_end( disk );
+    return status < 0 ? status : 0;
+}
+
+
+/**
+ * Turns compression of a regular file's data on or off. Data written from
+ *  then on is stored in clusters of GROS_ZCLUSTER blocks, each compressed
+ *  into as few blocks as it needs, or left raw when that would not save a
+ *  block. Raw data already in the file stays readable, so compression can
+ *  be turned on at any time; it can only be turned off while the file is
+ *  empty. Returns 0, -EINVAL for a directory or -EBUSY.
+ *
+ * @param Disk  * disk    Disk containing the file system
+ * @param Inode * inode   The file
+ * @param int     on      Nonzero to compress the file's data
+ */
+int gros_i_compress( Disk * disk, Inode * inode, int on ) {
+    int status = 0;
+
+    if( gros_is_dir( inode->f_acl ) )
+        return -EINVAL;
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
+    if( on ) {
+        inode->f_acl = ( short ) ( inode->f_acl | GROS_ACL_COMPRESS );
+    } else if( inode->f_size > 0 && ( inode->f_acl & GROS_ACL_COMPRESS ) ) {
+        status = -EBUSY;
+    } else {
+        inode->f_acl = ( short ) ( inode->f_acl & ~GROS_ACL_COMPRESS );
+    }
+    if( status == 0 )
+        gros_save_inode( disk, inode );
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
+    return status;
+}
+
+
+/**
+ * gros_i_read for a file with compressed data: decompresses the clusters
+ *  holding bytes offset .. offset + size - 1. Returns the number of bytes
+ *  read or -EIO.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param char  * buf      Destination of `size` bytes
+ * @param int     size     Number of bytes to read
+ * @param int     offset   Offset into the file to start reading from
+ */
+int gros_z_read( Disk * disk, Inode * inode, char * buf, int size, int offset ) {
+    std::vector< char > data( GROS_ZCLUSTER_SIZE );
+    int                 end = std::min( offset + size, inode->f_size );
+    int                 cluster;
+    int                 base;
+    int                 from;
+    int                 to;
+
+    if( size <= 0 || offset >= end )
+        return 0;
+    gros_readahead( disk, inode, offset / BLOCK_SIZE,
+                    ( end - 1 ) / BLOCK_SIZE - offset / BLOCK_SIZE + 1 );
+
+    for( cluster = offset / GROS_ZCLUSTER_SIZE;
+         cluster * GROS_ZCLUSTER_SIZE < end; cluster++ ) {
+        base = cluster * GROS_ZCLUSTER_SIZE;
+        from = std::max( offset, base );
+        to   = std::min( end, base + GROS_ZCLUSTER_SIZE );
+        if( gros_z_load( disk, inode, cluster, &data[ 0 ] ) < 0 )
+            return -EIO;
+        std::memcpy( buf + ( from - offset ), &data[ from - base ], to - from );
+    }
+    return end - offset;
+}
+
+
+/**
+ * gros_i_write for a file with compressed data: every cluster the write
+ *  touches is read back, patched, and compressed again. Returns the number
+ *  of bytes written or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param char  * buf      The `size` bytes to write
+ * @param int     size     Number of bytes to write
+ * @param int     offset   Offset into the file to start writing at
+ */
+int gros_z_write( Disk * disk, Inode * inode, char * buf, int size, int offset ) {
+    std::vector< char > data( GROS_ZCLUSTER_SIZE );
+    int                 end    = offset + size;
+    int                 status = 0;
+    int                 cluster;
+    int                 base;
+    int                 from;
+    int                 to;
+    int                 old;
+
+    if( size <= 0 )
+        return 0;
+    // a write past the end first fills the gap with zeroes
+    gros_i_ensure_size( disk, inode, offset );
+
+    for( cluster = offset / GROS_ZCLUSTER_SIZE;
+         cluster * GROS_ZCLUSTER_SIZE < end; cluster++ ) {
+        base = cluster * GROS_ZCLUSTER_SIZE;
+        from = std::max( offset, base ) - base;
+        to   = std::min( end, base + GROS_ZCLUSTER_SIZE ) - base;
+        old  = gros_z_length( inode, cluster );
+        // a cluster rewritten up to its end need not be read first
+        if( from > 0 || to < old ) {
+            if( ( status = gros_z_load( disk, inode, cluster, &data[ 0 ] ) ) < 0 )
+                break;
+        } else {
+            std::fill( data.begin(), data.end(), 0 );
+        }
+        std::memcpy( &data[ from ], buf + ( base + from - offset ), to - from );
+        if( ( status = gros_z_store( disk, inode, cluster, &data[ 0 ],
+                                     std::max( old, to ), 0 ) ) < 0 )
+            break;
+        inode->f_size = std::max( inode->f_size, base + to );
+    }
+    gros_save_inode( disk, inode );
+    return status < 0 ? status : size;
+}
+
+
+/**
+ * Stores the cluster holding byte `offset` of a compressed file raw, so the
+ *  file can be cut there block by block. Returns 0 or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param int     offset   A byte in the cluster to unpack
+ */
+int gros_z_unpack( Disk * disk, Inode * inode, int offset ) {
+    std::vector< char > data( GROS_ZCLUSTER_SIZE );
+    int                 cluster = offset / GROS_ZCLUSTER_SIZE;
+    int                 len     = gros_z_length( inode, cluster );
+    int                 status;
+
+    if( len == 0 )
+        return 0;
+    if( ( status = gros_z_load( disk, inode, cluster, &data[ 0 ] ) ) < 0 )
+        return status;
+    return gros_z_store( disk, inode, cluster, &data[ 0 ], len, 1 );
+}
+
+
+TEST_CASE( "LZ4 blocks round trip", "[compress]" ) {
+    const int           n = 3 * BLOCK_SIZE + 123;
+    std::vector< char > in( n );
+    std::vector< char > z( n + n / 255 + 16 );
+    std::vector< char > out( n );
+    int                 zsize;
+    int                 i;
+
+    SECTION( "Repetitive data shrinks" ) {
+        for( i = 0; i < n; i++ )
+            in[ i ] = "2016-05-01 12:00:00 INFO request served\n"[ i % 40 ];
+        zsize = gros_lz4_compress( &in[ 0 ], n, &z[ 0 ], ( int ) z.size() );
+        REQUIRE( zsize > 0 );
+        REQUIRE( zsize < n / 10 );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], zsize, &out[ 0 ], n ) == n );
+        REQUIRE( in == out );
+    }
+
+    SECTION( "Noise fits only with room to spare" ) {
+        uint32_t x = 12345;
+        for( i = 0; i < n; i++ ) {
+            x = x * 1103515245 + 12345;
+            in[ i ] = ( char ) ( x >> 16 );
+        }
+        REQUIRE( gros_lz4_compress( &in[ 0 ], n, &z[ 0 ], n - 1 ) == 0 );
+        zsize = gros_lz4_compress( &in[ 0 ], n, &z[ 0 ], ( int ) z.size() );
+        REQUIRE( zsize >= n );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], zsize, &out[ 0 ], n ) == n );
+        REQUIRE( in == out );
+    }
+
+    SECTION( "Short and overlapping runs" ) {
+        REQUIRE( gros_lz4_compress( "abc", 3, &z[ 0 ], 16 ) == 4 );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], 4, &out[ 0 ], n ) == 3 );
+        std::fill( in.begin(), in.end(), 'a' );
+        zsize = gros_lz4_compress( &in[ 0 ], n, &z[ 0 ], ( int ) z.size() );
+        REQUIRE( zsize < 100 );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], zsize, &out[ 0 ], n ) == n );
+        REQUIRE( in == out );
+    }
+
+    SECTION( "Malformed input is refused" ) {
+        for( i = 0; i < n; i++ )
+            in[ i ] = ( char ) ( i % 7 );
+        zsize = gros_lz4_compress( &in[ 0 ], n, &z[ 0 ], ( int ) z.size() );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], zsize, &out[ 0 ], n - 1 ) == -EIO );
+        REQUIRE( gros_lz4_decompress( &z[ 0 ], zsize - 1, &out[ 0 ], n ) != n );
+        const char bad[] = { 0x00, 0x05, 0x00 };  // match before the start
+        REQUIRE( gros_lz4_decompress( bad, 3, &out[ 0 ], n ) == -EIO );
+    }
+}
+
+
+TEST_CASE( "Compressed files take fewer blocks and read back intact", "[compress][files]" ) {
+    Disk  * disk = gros_open_disk();
+    gros_make_fs( disk );
+
+    Inode * inode = gros_new_inode( disk );
+    int     size  = 20 * BLOCK_SIZE + 100;
+    char  * in    = new char[ size ];
+    char  * out   = new char[ size ];
+    int     used;
+    int     map[ 24 ];
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = "May 01 12:00:00 host app[42]: connection accepted\n"[ i % 50 ];
+    used = gros_superblock( disk )->fs_num_used_blocks;
+    REQUIRE( gros_i_compress( disk, inode, 1 ) == 0 );
+    REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+    REQUIRE( inode->f_size == size );
+
+    SECTION( "Logs shrink to a block per cluster" ) {
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks - used < 6 );
+        gros_bmap_range( disk, inode, 0, 24, map );
+        REQUIRE( map[ 0 ] > 0 );
+        REQUIRE( map[ 1 ] == GROS_ZBLOCK );
+        REQUIRE( gros_i_read( disk, inode, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        REQUIRE( gros_i_compress( disk, inode, 0 ) == -EBUSY );
+    }
+
+    SECTION( "Overwrites, appends and reads at any offset" ) {
+        memset( in + 5000, 'z', 300 );
+        REQUIRE( gros_i_write( disk, inode, in + 5000, 300, 5000 ) == 300 );
+        memset( in + size - 10, 'e', 10 );
+        REQUIRE( gros_i_write( disk, inode, in + size - 10, 10, size - 10 ) == 10 );
+        REQUIRE( gros_i_read( disk, inode, out, 777, 4900 ) == 777 );
+        REQUIRE( memcmp( in + 4900, out, 777 ) == 0 );
+        REQUIRE( gros_i_read( disk, inode, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        REQUIRE( gros_i_write( disk, inode, in, 100, size ) == 100 );
+        REQUIRE( inode->f_size == size + 100 );
+    }
+
+    SECTION( "A rewritten cluster moves to new blocks" ) {
+        int before[ 24 ];
+        gros_bmap_range( disk, inode, 0, 24, before );
+        used = gros_superblock( disk )->fs_num_used_blocks;
+        memset( in + 100, 'w', 50 );
+        REQUIRE( gros_i_write( disk, inode, in + 100, 50, 100 ) == 50 );
+        gros_bmap_range( disk, inode, 0, 24, map );
+        REQUIRE( map[ 0 ] > 0 );
+        REQUIRE( map[ 0 ] != before[ 0 ] );
+        REQUIRE( map[ 8 ] == before[ 8 ] );
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used );
+        REQUIRE( gros_i_read( disk, inode, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+    }
+
+    SECTION( "Incompressible data stays raw" ) {
+        uint32_t x = 99;
+        for( i = 0; i < size; i++ ) {
+            x = x * 1103515245 + 12345;
+            in[ i ] = ( char ) ( x >> 16 );
+        }
+        REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+        gros_bmap_range( disk, inode, 0, 24, map );
+        for( i = 0; i < 21; i++ )
+            REQUIRE( map[ i ] > 0 );
+        REQUIRE( gros_i_read( disk, inode, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+    }
+
+    SECTION( "Truncating cuts through a cluster" ) {
+        REQUIRE( gros_i_truncate( disk, inode, 3 * BLOCK_SIZE + 7 ) == 0 );
+        REQUIRE( inode->f_size == 3 * BLOCK_SIZE + 7 );
+        REQUIRE( gros_i_read( disk, inode, out, size, 0 ) == 3 * BLOCK_SIZE + 7 );
+        REQUIRE( memcmp( in, out, 3 * BLOCK_SIZE + 7 ) == 0 );
+        REQUIRE( gros_i_truncate( disk, inode, 0 ) == 0 );
+        REQUIRE( gros_i_compress( disk, inode, 0 ) == 0 );
+    }
+
+    delete [] in;
+    delete [] out;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Unlinking a compressed file frees every block it held", "[compress][files]" ) {
+    Disk  * disk = gros_open_disk();
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+
+    Inode * root = gros_get_inode( disk, gros_namei( disk, "/" ) );
+    Inode * inode;
+    int     size = 40 * BLOCK_SIZE;
+    char  * in   = new char[ size ];
+    int     used;
+    int     num;
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = "May 01 12:00:00 host app[42]: connection accepted\n"[ i % 50 ];
+    used = gros_superblock( disk )->fs_num_used_blocks;
+    REQUIRE( ( num = gros_i_mknod( disk, root, "log" ) ) > 0 );
+    inode = gros_get_inode( disk, num );
+    REQUIRE( gros_i_compress( disk, inode, 1 ) == 0 );
+    REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+    REQUIRE( gros_superblock( disk )->fs_num_used_blocks > used + 1 );
+    gros_put_inode( disk, inode );
+
+    REQUIRE( gros_i_unlink( disk, root, "log" ) == 0 );
+    REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used );
+
+    delete [] in;
+    gros_put_inode( disk, root );
+    gros_close_disk( disk );
+}
@@ -0,0 +1,107 @@
+/**
+ * compress.hpp
+ */
+
+#ifndef __COMPRESS_HPP_INCLUDED__   // if compress.hpp hasn't been included yet...
+#define __COMPRESS_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <stdint.h>
+
+#define GROS_ACL_COMPRESS 0x1000    // f_acl bit 12: the file's data is compressed
+#define GROS_XATTR_COMPRESS "user.grosfs.compress"  // "1" or "0", see gros_i_compress
+
+#define GROS_ZCLUSTER     8         // file blocks compressed together
+#define GROS_ZCLUSTER_SIZE ( GROS_ZCLUSTER * BLOCK_SIZE )
+#define GROS_ZMAGIC       0x5a736f72 // "rosZ"
+
+// block map entry of a block whose data lives in the compressed blocks
+// at the start of its cluster
+#define GROS_ZBLOCK       -2
+
+/**
+ * Header in front of the compressed payload of a cluster. A cluster is
+ *  compressed when its block map holds at least one GROS_ZBLOCK entry; its
+ *  first blocks then hold the header and the payload back to back.
+ */
+typedef struct _zheader {
+    uint32_t magic;     /* GROS_ZMAGIC */
+    uint32_t zsize;     /* bytes of compressed payload after the header */
+    uint32_t size;      /* bytes of file data it expands to */
+} ZHeader;
+
+/**
+ * Compresses `n` bytes of `src` into `dst` in the LZ4 block format. Returns
+ *  the compressed size, or 0 if it would not fit in `cap` bytes.
+ *
+ * @param const char * src   The data to compress
+ * @param int          n     Number of bytes in `src`
+ * @param char       * dst   Destination of at most `cap` bytes
+ * @param int          cap   Room in `dst`
+ */
+int gros_lz4_compress( const char * src, int n, char * dst, int cap );
+
+/**
+ * Expands `n` bytes of LZ4 block data from `src` into `dst`. Returns the
+ *  number of bytes produced, or -EIO if the data is malformed or would
+ *  expand past `cap` bytes.
+ *
+ * @param const char * src   Compressed data
+ * @param int          n     Number of bytes in `src`
+ * @param char       * dst   Destination of at most `cap` bytes
+ * @param int          cap   Room in `dst`
+ */
+int gros_lz4_decompress( const char * src, int n, char * dst, int cap );
+
+/**
+ * Turns compression of a regular file's data on or off. Data written from
+ *  then on is stored in clusters of GROS_ZCLUSTER blocks, each compressed
+ *  into as few blocks as it needs, or left raw when that would not save a
+ *  block. Raw data already in the file stays readable, so compression can
+ *  be turned on at any time; it can only be turned off while the file is
+ *  empty. Returns 0, -EINVAL for a directory or -EBUSY.
+ *
+ * @param Disk  * disk    Disk containing the file system
+ * @param Inode * inode   The file
+ * @param int     on      Nonzero to compress the file's data
+ */
+int gros_i_compress( Disk * disk, Inode * inode, int on );
+
+/**
+ * gros_i_read for a file with compressed data: decompresses the clusters
+ *  holding bytes offset .. offset + size - 1. Returns the number of bytes
+ *  read or -EIO.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param char  * buf      Destination of `size` bytes
+ * @param int     size     Number of bytes to read
+ * @param int     offset   Offset into the file to start reading from
+ */
+int gros_z_read( Disk * disk, Inode * inode, char * buf, int size, int offset );
+
+/**
+ * gros_i_write for a file with compressed data: every cluster the write
+ *  touches is read back, patched, and compressed again. Returns the number
+ *  of bytes written or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param char  * buf      The `size` bytes to write
+ * @param int     size     Number of bytes to write
+ * @param int     offset   Offset into the file to start writing at
+ */
+int gros_z_write( Disk * disk, Inode * inode, char * buf, int size, int offset );
+
+/**
+ * Stores the cluster holding byte `offset` of a compressed file raw, so the
+ *  file can be cut there block by block. Returns 0 or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    The compressed file
+ * @param int     offset   A byte in the cluster to unpack
+ */
+int gros_z_unpack( Disk * disk, Inode * inode, int offset );
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * csum.cpp
+ */
+
+#include "csum.hpp"
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+#include <errno.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <nmmintrin.h>
+#define GROS_CRC32C_X86
+#elif defined( __ARM_FEATURE_CRC32 )
+#include <arm_acle.h>
+#define GROS_CRC32C_ARM
+#endif
+
+#define GROS_CRC32C_POLY 0x82f63b78   // Castagnoli, bit reflected
+
+static uint32_t       gros_crc32c_table[ 8 ][ 256 ];
+static bool           gros_crc32c_hw_ok = false;
+static pthread_once_t gros_crc32c_once  = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Builds the slicing-by-8 tables and checks for a crc32 instruction.
+ */
+static void gros_crc32c_init( void ) {
+    uint32_t crc;
+    int      i;
+    int      j;
+
+    for( i = 0; i < 256; i++ ) {
+        crc = ( uint32_t ) i;
+        for( j = 0; j < 8; j++ )
+            crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? GROS_CRC32C_POLY : 0 );
+        gros_crc32c_table[ 0 ][ i ] = crc;
+    }
+    for( i = 0; i < 256; i++ )
+        for( j = 1; j < 8; j++ )
+            gros_crc32c_table[ j ][ i ] = ( gros_crc32c_table[ j - 1 ][ i ] >> 8 )
+                ^ gros_crc32c_table[ 0 ][ gros_crc32c_table[ j - 1 ][ i ] & 0xff ];
+
+#if defined( GROS_CRC32C_X86 )
+    gros_crc32c_hw_ok = __builtin_cpu_supports( "sse4.2" );
+#elif defined( GROS_CRC32C_ARM )
+    gros_crc32c_hw_ok = true;
+#endif
+}
+
+
+/**
+ * Table driven CRC32C, eight bytes at a time. `crc` is not inverted.
+ */
+static uint32_t gros_crc32c_sw( uint32_t crc, const unsigned char * p, size_t len ) {
+    uint32_t lo;
+    uint32_t hi;
+
+    while( len > 0 && ( ( uintptr_t ) p & 7 ) != 0 ) {
+        crc = ( crc >> 8 ) ^ gros_crc32c_table[ 0 ][ ( crc ^ * p++ ) & 0xff ];
+        len--;
+    }
+    while( len >= 8 ) {
+        std::memcpy( &lo, p, 4 );
+        std::memcpy( &hi, p + 4, 4 );
+        lo ^= crc;
+        crc = gros_crc32c_table[ 7 ][ lo & 0xff ]
+              ^ gros_crc32c_table[ 6 ][ ( lo >> 8 ) & 0xff ]
+              ^ gros_crc32c_table[ 5 ][ ( lo >> 16 ) & 0xff ]
+              ^ gros_crc32c_table[ 4 ][ lo >> 24 ]
+              ^ gros_crc32c_table[ 3 ][ hi & 0xff ]
+              ^ gros_crc32c_table[ 2 ][ ( hi >> 8 ) & 0xff ]
+              ^ gros_crc32c_table[ 1 ][ ( hi >> 16 ) & 0xff ]
+              ^ gros_crc32c_table[ 0 ][ hi >> 24 ];
+        p   += 8;
+        len -= 8;
+    }
+    while( len-- > 0 )
+        crc = ( crc >> 8 ) ^ gros_crc32c_table[ 0 ][ ( crc ^ * p++ ) & 0xff ];
+    return crc;
+}
+
+
+#if defined( GROS_CRC32C_X86 )
+/**
+ * CRC32C with the SSE4.2 crc32 instruction. `crc` is not inverted.
+ */
+__attribute__(( target( "sse4.2" ) ))
+static uint32_t gros_crc32c_hw( uint32_t crc, const unsigned char * p, size_t len ) {
+    while( len > 0 && ( ( uintptr_t ) p & 7 ) != 0 ) {
+        crc = _mm_crc32_u8( crc, * p++ );
+        len--;
+    }
+#if defined( __x86_64__ )
+    uint64_t q;
+    while( len >= 8 ) {
+        std::memcpy( &q, p, 8 );
+        crc  = ( uint32_t ) _mm_crc32_u64( crc, q );
+        p   += 8;
+        len -= 8;
+    }
+#endif
+    uint32_t w;
+    while( len >= 4 ) {
+        std::memcpy( &w, p, 4 );
+        crc  = _mm_crc32_u32( crc, w );
+        p   += 4;
+        len -= 4;
+    }
+    while( len-- > 0 )
+        crc = _mm_crc32_u8( crc, * p++ );
+    return crc;
+}
+#elif defined( GROS_CRC32C_ARM )
+/**
+ * CRC32C with the ARMv8 crc32c instructions. `crc` is not inverted.
+ */
+static uint32_t gros_crc32c_hw( uint32_t crc, const unsigned char * p, size_t len ) {
+    uint64_t q;
+
+    while( len > 0 && ( ( uintptr_t ) p & 7 ) != 0 ) {
+        crc = __crc32cb( crc, * p++ );
+        len--;
+    }
+    while( len >= 8 ) {
+        std::memcpy( &q, p, 8 );
+        crc  = __crc32cd( crc, q );
+        p   += 8;
+        len -= 8;
+    }
+    while( len-- > 0 )
+        crc = __crc32cb( crc, * p++ );
+    return crc;
+}
+#endif
+
+
+/**
+ * Returns the CRC32C (Castagnoli) of `len` bytes, continuing from `crc`
+ *  (start from 0). Uses the CPU's crc32 instruction when there is one
+ *  (SSE4.2 on x86, the CRC extension on ARMv8) and a table otherwise.
+ *
+ * @param uint32_t     crc   CRC of the data before `buf`
+ * @param const char * buf   The data
+ * @param size_t       len   Number of bytes in `buf`
+ */
+uint32_t gros_crc32c( uint32_t crc, const char * buf, size_t len ) {
+    const unsigned char * p = ( const unsigned char * ) buf;
+
+    pthread_once( &gros_crc32c_once, gros_crc32c_init );
+#if defined( GROS_CRC32C_X86 ) || defined( GROS_CRC32C_ARM )
+    if( gros_crc32c_hw_ok )
+        return ~gros_crc32c_hw( ~crc, p, len );
+#endif
+    return ~gros_crc32c_sw( ~crc, p, len );
+}
+
+
+/**
+ * Returns the checksum entry for a block holding `data`: its CRC32C without
+ *  the GROS_CSUM_UNLOGGED bit, moved off GROS_CSUM_NONE if need be.
+ *
+ * @param const char * data   BLOCK_SIZE bytes
+ */
+uint32_t gros_block_csum( const char * data ) {
+    uint32_t crc = gros_crc32c( 0, data, BLOCK_SIZE ) & ~GROS_CSUM_UNLOGGED;
+
+    return crc == GROS_CSUM_NONE ? 2 : crc;
+}
+
+
+/**
+ * Returns how many blocks hold the checksums of a disk with `num_blocks`
+ *  blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_csum_size( int num_blocks ) {
+    return ( int ) ( ( num_blocks + GROS_CSUMS_PER_BLOCK - 1 ) / GROS_CSUMS_PER_BLOCK );
+}
+
+
+/**
+ * Clears the checksum area at blocks start .. start + nblocks - 1, so no
+ *  block is checked until it is written. Returns 0 or -errno.
+ *
+ * @param Disk * disk      The disk to hold the checksums
+ * @param int    start     First block of the checksum area
+ * @param int    nblocks   Size of the checksum area, in blocks
+ */
+int gros_format_csum( Disk * disk, int start, int nblocks ) {
+    if( nblocks <= 0 )
+        return -EINVAL;
+    // discarded blocks read as zeros without taking up space in the image
+    return gros_discard_blocks( disk, start, nblocks );
+}
+
+
+/**
+ * Starts keeping checksums in the area at `start`: from then on blocks
+ *  written with the gros_b* calls get their checksum updated, and blocks
+ *  those calls read from the disk are verified against it. The checksum
+ *  blocks themselves are cached and written back like any other metadata.
+ *  On a disk without a cache each block written costs two more I/Os, as
+ *  its checksum block is read and written back under the checksum lock,
+ *  and each block read one more. Returns 0, -EEXIST if checksums are already kept, or -EINVAL if the
+ *  area does not fit the disk.
+ *
+ * @param Disk * disk      The disk to protect
+ * @param int    start     First block of the checksum area
+ * @param int    nblocks   Size of the checksum area, in blocks
+ */
+int gros_open_csum( Disk * disk, int start, int nblocks ) {
+    Csum * csum;
+
+    if( disk->csum != NULL )
+        return -EEXIST;
+    if( start < 1 || nblocks < gros_csum_size( ( int ) ( disk->size / BLOCK_SIZE ) )
+        || ( int64_t ) ( start + nblocks ) * BLOCK_SIZE > disk->size )
+        return -EINVAL;
+
+    csum           = new Csum();
+    csum->start      = start;
+    csum->nblocks    = nblocks;
+    csum->verify     = true;
+    csum->failures   = 0;
+    csum->unverified = 0;
+    pthread_mutex_init( &csum->lock, NULL );
+    disk->csum       = csum;
+    return 0;
+}
+
+
+/**
+ * Stops keeping checksums.
+ *
+ * @param Disk * disk   The disk to stop protecting
+ */
+void gros_close_csum( Disk * disk ) {
+    if( disk->csum != NULL )
+        pthread_mutex_destroy( &disk->csum->lock );
+    delete disk->csum;
+    disk->csum = NULL;
+}
+
+
+TEST_CASE( "CRC32C matches the reference values", "[csum]" ) {
+    char   buf[ 4096 + 7 ];
+    size_t i;
+
+    REQUIRE( gros_crc32c( 0, "123456789", 9 ) == 0xe3069283 );
+    REQUIRE( gros_crc32c( 0, "", 0 ) == 0 );
+
+    SECTION( "The table and the instruction agree at any alignment and length" ) {
+        for( i = 0; i < sizeof( buf ); i++ )
+            buf[ i ] = ( char ) ( i * 131 + 7 );
+        for( i = 0; i < 8; i++ ) {
+            const unsigned char * p = ( const unsigned char * ) buf + i;
+            uint32_t sw = ~gros_crc32c_sw( ~0u, p, 4096 - i );
+            REQUIRE( gros_crc32c( 0, buf + i, 4096 - i ) == sw );
+        }
+    }
+
+    SECTION( "CRCs can be continued" ) {
+        memset( buf, 'c', sizeof( buf ) );
+        uint32_t whole = gros_crc32c( 0, buf, 1000 );
+        REQUIRE( gros_crc32c( gros_crc32c( 0, buf, 333 ), buf + 333, 667 ) == whole );
+    }
+}
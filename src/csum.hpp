@@ -0,0 +1,94 @@
+/**
+ * csum.hpp
+ */
+
+#ifndef __CSUM_HPP_INCLUDED__   // if csum.hpp hasn't been included yet...
+#define __CSUM_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "disk.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// checksums kept in one block of the checksum area
+#define GROS_CSUMS_PER_BLOCK ( BLOCK_SIZE / sizeof( uint32_t ) )
+
+// a checksum entry nothing was ever written to: the block is not checked
+#define GROS_CSUM_NONE       0
+
+// set in the checksum entry of a block written in place rather than through
+// the journal: a crash between the write and its checksum's commit can leave
+// the two disagreeing, so a mismatch there leaves the block unverified
+#define GROS_CSUM_UNLOGGED   0x1u
+
+typedef struct _csum {
+    int     start;      /* first block of the checksum area */
+    int     nblocks;    /* size of the checksum area, in blocks */
+    bool    verify;     /* check blocks read from the disk */
+    int64_t failures;   /* blocks that did not match their checksum */
+    int64_t unverified; /* blocks written in place read back anyway */
+    pthread_mutex_t lock;   /* serializes the checksum blocks of an uncached disk */
+} Csum;
+
+/**
+ * Returns the CRC32C (Castagnoli) of `len` bytes, continuing from `crc`
+ *  (start from 0). Uses the CPU's crc32 instruction when there is one
+ *  (SSE4.2 on x86, the CRC extension on ARMv8) and a table otherwise.
+ *
+ * @param uint32_t     crc   CRC of the data before `buf`
+ * @param const char * buf   The data
+ * @param size_t       len   Number of bytes in `buf`
+ */
+uint32_t gros_crc32c( uint32_t crc, const char * buf, size_t len );
+
+/**
+ * Returns the checksum entry for a block holding `data`: its CRC32C without
+ *  the GROS_CSUM_UNLOGGED bit, moved off GROS_CSUM_NONE if need be.
+ *
+ * @param const char * data   BLOCK_SIZE bytes
+ */
+uint32_t gros_block_csum( const char * data );
+
+/**
+ * Returns how many blocks hold the checksums of a disk with `num_blocks`
+ *  blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_csum_size( int num_blocks );
+
+/**
+ * Clears the checksum area at blocks start .. start + nblocks - 1, so no
+ *  block is checked until it is written. Returns 0 or -errno.
+ *
+ * @param Disk * disk      The disk to hold the checksums
+ * @param int    start     First block of the checksum area
+ * @param int    nblocks   Size of the checksum area, in blocks
+ */
+int gros_format_csum( Disk * disk, int start, int nblocks );
+
+/**
+ * Starts keeping checksums in the area at `start`: from then on blocks
+ *  written with the gros_b* calls get their checksum updated, and blocks
+ *  those calls read from the disk are verified against it. The checksum
+ *  blocks themselves are cached and written back like any other metadata.
+ *  On a disk without a cache each block written costs two more I/Os, as
+ *  its checksum block is read and written back under the checksum lock,
+ *  and each block read one more. Returns 0, -EEXIST if checksums are already kept, or -EINVAL if the
+ *  area does not fit the disk.
+ *
+ * @param Disk * disk      The disk to protect
+ * @param int    start     First block of the checksum area
+ * @param int    nblocks   Size of the checksum area, in blocks
+ */
+int gros_open_csum( Disk * disk, int start, int nblocks );
+
+/**
+ * Stops keeping checksums.
+ *
+ * @param Disk * disk   The disk to stop protecting
+ */
+void gros_close_csum( Disk * disk );
+
+#endif
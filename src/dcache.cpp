@@ -0,0 +1,340 @@
+/**
+ * dcache.cpp
+ */
+
+#include "dcache.hpp"
+#include <cstring>
+#include <errno.h>
+
+
+/**
+ * Returns the hash bucket of `name` in directory `dir`: FNV-1a over the
+ *  name, seeded with the directory, spread with Fibonacci hashing like the
+ *  block cache.
+ */
+static unsigned gros_dcache_bucket( DCache * dc, int dir, const char * name ) {
+    uint32_t hash = 2166136261u ^ ( uint32_t ) dir;
+
+    for( ; * name != '\0'; name++ ) {
+        hash ^= ( unsigned char ) * name;
+        hash *= 16777619u;
+    }
+    return ( hash * 2654435769u ) >> dc->shift;
+}
+
+
+/**
+ * Returns the entry for `name` in directory `dir`, or NULL if it is not
+ *  cached.
+ */
+static DCacheEntry * gros_dcache_find( DCache * dc, int dir, const char * name ) {
+    DCacheEntry * e = dc->table[ gros_dcache_bucket( dc, dir, name ) ];
+
+    while( e != NULL && ( e->dir != dir || strcmp( e->name, name ) != 0 ) )
+        e = e->hnext;
+    return e;
+}
+
+
+/**
+ * Takes an entry out of the LRU list.
+ */
+static void gros_dcache_unlink_lru( DCache * dc, DCacheEntry * e ) {
+    if( e->newer != NULL ) e->newer->older = e->older;
+    else                   dc->newest      = e->older;
+    if( e->older != NULL ) e->older->newer = e->newer;
+    else                   dc->oldest      = e->newer;
+    e->newer = e->older = NULL;
+}
+
+
+/**
+ * Puts an entry at the newest end of the LRU list.
+ */
+static void gros_dcache_link_newest( DCache * dc, DCacheEntry * e ) {
+    e->older = dc->newest;
+    e->newer = NULL;
+    if( dc->newest != NULL ) dc->newest->newer = e;
+    else                     dc->oldest        = e;
+    dc->newest = e;
+}
+
+
+/**
+ * Removes an entry from the cache and frees it.
+ */
+static void gros_dcache_drop( DCache * dc, DCacheEntry * e ) {
+    DCacheEntry ** link = &dc->table[ gros_dcache_bucket( dc, e->dir, e->name ) ];
+
+    while( * link != e )
+        link = &( * link )->hnext;
+    * link = e->hnext;
+    gros_dcache_unlink_lru( dc, e );
+    dc->nentries--;
+    delete e;
+}
+
+
+/**
+ * Remembers what names in directories stand for, and which ones do not
+ *  exist, so resolving a path does not read every directory along it.
+ *  Up to `max_entries` names are kept, least recently used first out.
+ *  Returns 0, -EEXIST if the disk already has a dentry cache or -EINVAL.
+ *
+ * @param Disk * disk          The disk holding the file system
+ * @param int    max_entries   Names to keep
+ */
+int gros_open_dcache( Disk * disk, int max_entries ) {
+    DCache * dc;
+    int      bits = 6;
+
+    if( disk->dcache != NULL )
+        return -EEXIST;
+    if( max_entries < 1 )
+        return -EINVAL;
+
+    dc = new DCache();
+    // about one name per bucket when full
+    while( ( 1 << bits ) < max_entries && bits < 24 )
+        bits++;
+    dc->shift       = 32 - bits;
+    dc->table       = new DCacheEntry * [ 1 << bits ]();
+    dc->newest      = NULL;
+    dc->oldest      = NULL;
+    dc->nentries    = 0;
+    dc->max_entries = max_entries;
+    dc->seq         = 0;
+    dc->hits        = 0;
+    dc->misses      = 0;
+    pthread_mutex_init( &dc->lock, NULL );
+    disk->dcache = dc;
+    return 0;
+}
+
+
+/**
+ * Drops the dentry cache.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+void gros_close_dcache( Disk * disk ) {
+    DCache * dc = disk->dcache;
+
+    if( dc == NULL )
+        return;
+    while( dc->oldest != NULL )
+        gros_dcache_drop( dc, dc->oldest );
+    pthread_mutex_destroy( &dc->lock );
+    delete [] dc->table;
+    delete dc;
+    disk->dcache = NULL;
+}
+
+
+/**
+ * Looks up `name` in directory `dir`. Returns 1 and sets `inode_num` to
+ *  the inode it names, or to -1 if it is known not to exist, or returns 0
+ *  if the name is not cached (always, without a dentry cache).
+ *
+ * @param Disk       * disk        The disk holding the file system
+ * @param int          dir         Inode number of the directory
+ * @param const char * name        The name to look up
+ * @param int        * inode_num   Set to the inode number on a hit
+ */
+int gros_dcache_lookup( Disk * disk, int dir, const char * name, int * inode_num ) {
+    DCache      * dc = disk->dcache;
+    DCacheEntry * e;
+
+    if( dc == NULL )
+        return 0;
+    pthread_mutex_lock( &dc->lock );
+    if( ( e = gros_dcache_find( dc, dir, name ) ) == NULL ) {
+        dc->misses++;
+        pthread_mutex_unlock( &dc->lock );
+        return 0;
+    }
+    dc->hits++;
+    gros_dcache_unlink_lru( dc, e );
+    gros_dcache_link_newest( dc, e );
+    * inode_num = e->inode;
+    pthread_mutex_unlock( &dc->lock );
+    return 1;
+}
+
+
+/**
+ * Returns a ticket to pass to gros_dcache_add, taken before the directory
+ *  is read.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+int64_t gros_dcache_seq( Disk * disk ) {
+    DCache  * dc = disk->dcache;
+    int64_t   seq;
+
+    if( dc == NULL )
+        return 0;
+    pthread_mutex_lock( &dc->lock );
+    seq = dc->seq;
+    pthread_mutex_unlock( &dc->lock );
+    return seq;
+}
+
+
+/**
+ * Remembers that `name` in directory `dir` is inode `inode_num`, or does
+ *  not exist if `inode_num` is -1. Nothing is remembered if a directory
+ *  was changed since `seq` was taken, since what was read may be stale.
+ *
+ * @param Disk       * disk        The disk holding the file system
+ * @param int          dir         Inode number of the directory
+ * @param const char * name        The name looked up
+ * @param int          inode_num   What the directory said, or -1
+ * @param int64_t      seq         Returned by gros_dcache_seq before reading it
+ */
+void gros_dcache_add( Disk * disk, int dir, const char * name, int inode_num,
+                      int64_t seq ) {
+    DCache      * dc = disk->dcache;
+    DCacheEntry * e;
+    unsigned      b;
+
+    if( dc == NULL || strlen( name ) > FILENAME_MAX_LENGTH )
+        return;
+    pthread_mutex_lock( &dc->lock );
+    if( dc->seq != seq ) {
+        pthread_mutex_unlock( &dc->lock );
+        return;
+    }
+    if( ( e = gros_dcache_find( dc, dir, name ) ) != NULL ) {
+        // another lookup got here first
+        e->inode = inode_num;
+        pthread_mutex_unlock( &dc->lock );
+        return;
+    }
+
+    e        = new DCacheEntry();
+    e->dir   = dir;
+    e->inode = inode_num;
+    strcpy( e->name, name );
+    b        = gros_dcache_bucket( dc, dir, name );
+    e->hnext = dc->table[ b ];
+    dc->table[ b ] = e;
+    gros_dcache_link_newest( dc, e );
+    dc->nentries++;
+    while( dc->nentries > dc->max_entries )
+        gros_dcache_drop( dc, dc->oldest );
+    pthread_mutex_unlock( &dc->lock );
+}
+
+
+/**
+ * Forgets `name` in directory `dir`. Called after an entry is added to or
+ *  removed from the directory.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param int          dir    Inode number of the directory
+ * @param const char * name   The name that changed
+ */
+void gros_dcache_forget( Disk * disk, int dir, const char * name ) {
+    DCache      * dc = disk->dcache;
+    DCacheEntry * e;
+
+    if( dc == NULL )
+        return;
+    pthread_mutex_lock( &dc->lock );
+    // lookups that read the directory before the change must not add to the cache
+    dc->seq++;
+    if( ( e = gros_dcache_find( dc, dir, name ) ) != NULL )
+        gros_dcache_drop( dc, e );
+    pthread_mutex_unlock( &dc->lock );
+}
+
+
+/**
+ * Forgets every name in directory `dir` and every name for it, once the
+ *  directory is removed and its inode number may be given to another file.
+ *
+ * @param Disk * disk   The disk holding the file system
+ * @param int    dir    Inode number of the removed directory
+ */
+void gros_dcache_forget_dir( Disk * disk, int dir ) {
+    DCache      * dc = disk->dcache;
+    DCacheEntry * e;
+    DCacheEntry * older;
+
+    if( dc == NULL )
+        return;
+    pthread_mutex_lock( &dc->lock );
+    dc->seq++;
+    for( e = dc->newest; e != NULL; e = older ) {
+        older = e->older;
+        if( e->dir == dir || e->inode == dir )
+            gros_dcache_drop( dc, e );
+    }
+    pthread_mutex_unlock( &dc->lock );
+}
+
+
+TEST_CASE( "Names are resolved through the dentry cache", "[dcache][files]" ) {
+    Disk   * disk = gros_open_ram( EMULATOR_SIZE );
+    DCache * dc;
+    int      dir;
+    int      file;
+    int      num;
+    int64_t  misses;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( ( dc = disk->dcache ) != NULL );
+    REQUIRE( gros_open_dcache( disk, 8 ) == -EEXIST );
+    REQUIRE( ( dir = gros_mkdir( disk, "/deep" ) ) > 0 );
+    REQUIRE( ( file = gros_mknod( disk, "/deep/file" ) ) > 0 );
+
+    SECTION( "A path resolved twice is not read again" ) {
+        REQUIRE( gros_namei( disk, "/deep/file" ) == file );
+        misses = dc->misses;
+        REQUIRE( gros_namei( disk, "/deep/file" ) == file );
+        REQUIRE( dc->misses == misses );
+        REQUIRE( gros_dcache_lookup( disk, dir, "file", &num ) == 1 );
+        REQUIRE( num == file );
+    }
+
+    SECTION( "Missing names are remembered until they are created" ) {
+        REQUIRE( gros_namei( disk, "/deep/later" ) == -1 );
+        REQUIRE( gros_dcache_lookup( disk, dir, "later", &num ) == 1 );
+        REQUIRE( num == -1 );
+        REQUIRE( gros_mknod( disk, "/deep/later" ) > 0 );
+        REQUIRE( gros_namei( disk, "/deep/later" ) > 0 );
+    }
+
+    SECTION( "Removed names are forgotten" ) {
+        REQUIRE( gros_namei( disk, "/deep/file" ) == file );
+        REQUIRE( gros_unlink( disk, "/deep/file" ) == 0 );
+        REQUIRE( gros_namei( disk, "/deep/file" ) == -1 );
+        REQUIRE( gros_namei( disk, "/deep" ) == dir );
+        REQUIRE( gros_rmdir( disk, "/deep" ) == 0 );
+        REQUIRE( gros_dcache_lookup( disk, 0, "deep", &num ) == 0 );
+        REQUIRE( gros_namei( disk, "/deep" ) == -1 );
+    }
+
+    SECTION( "A lookup racing with a change is not remembered" ) {
+        int64_t seq = gros_dcache_seq( disk );
+        gros_dcache_forget( disk, dir, "other" );
+        gros_dcache_add( disk, dir, "other", 42, seq );
+        REQUIRE( gros_dcache_lookup( disk, dir, "other", &num ) == 0 );
+    }
+
+    SECTION( "The least recently used names go first" ) {
+        gros_close_dcache( disk );
+        REQUIRE( gros_open_dcache( disk, 2 ) == 0 );
+        dc = disk->dcache;
+        REQUIRE( gros_namei( disk, "/deep/file" ) == file );
+        REQUIRE( dc->nentries == 2 );
+        REQUIRE( gros_namei( disk, "/other" ) == -1 );
+        REQUIRE( dc->nentries == 2 );
+        REQUIRE( gros_dcache_lookup( disk, 0, "deep", &num ) == 0 );
+        REQUIRE( gros_dcache_lookup( disk, 0, "other", &num ) == 1 );
+    }
+
+    gros_close_disk( disk );
+}
@@ -0,0 +1,108 @@
+/**
+ * dcache.hpp
+ */
+
+#ifndef __DCACHE_HPP_INCLUDED__   // if dcache.hpp hasn't been included yet...
+#define __DCACHE_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "files.hpp"
+#include <pthread.h>
+#include <stdint.h>
+
+#define GROS_DCACHE_DEFAULT 4096    // names kept in memory
+
+typedef struct _dcacheentry {
+    int                   dir;      /* inode number of the directory */
+    int                   inode;    /* what the name is for, -1 if it does not exist */
+    char                  name[ FILENAME_MAX_LENGTH + 1 ];
+    struct _dcacheentry * hnext;    /* next entry in the same hash bucket */
+    struct _dcacheentry * newer;    /* LRU neighbours */
+    struct _dcacheentry * older;
+} DCacheEntry;
+
+typedef struct _dcache {
+    DCacheEntry    ** table;        /* hash buckets, indexed by directory and name */
+    int               shift;        /* 32 - log2( number of buckets ) */
+    DCacheEntry     * newest;       /* entry looked up last */
+    DCacheEntry     * oldest;       /* eviction candidate */
+    int               nentries;
+    int               max_entries;
+    int64_t           seq;          /* bumped by every change to a directory */
+    int64_t           hits;
+    int64_t           misses;
+    pthread_mutex_t   lock;
+} DCache;
+
+/**
+ * Remembers what names in directories stand for, and which ones do not
+ *  exist, so resolving a path does not read every directory along it.
+ *  Up to `max_entries` names are kept, least recently used first out.
+ *  Returns 0, -EEXIST if the disk already has a dentry cache or -EINVAL.
+ *
+ * @param Disk * disk          The disk holding the file system
+ * @param int    max_entries   Names to keep
+ */
+int gros_open_dcache( Disk * disk, int max_entries );
+
+/**
+ * Drops the dentry cache.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+void gros_close_dcache( Disk * disk );
+
+/**
+ * Looks up `name` in directory `dir`. Returns 1 and sets `inode_num` to
+ *  the inode it names, or to -1 if it is known not to exist, or returns 0
+ *  if the name is not cached (always, without a dentry cache).
+ *
+ * @param Disk       * disk        The disk holding the file system
+ * @param int          dir         Inode number of the directory
+ * @param const char * name        The name to look up
+ * @param int        * inode_num   Set to the inode number on a hit
+ */
+int gros_dcache_lookup( Disk * disk, int dir, const char * name, int * inode_num );
+
+/**
+ * Returns a ticket to pass to gros_dcache_add, taken before the directory
+ *  is read.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+int64_t gros_dcache_seq( Disk * disk );
+
+/**
+ * Remembers that `name` in directory `dir` is inode `inode_num`, or does
+ *  not exist if `inode_num` is -1. Nothing is remembered if a directory
+ *  was changed since `seq` was taken, since what was read may be stale.
+ *
+ * @param Disk       * disk        The disk holding the file system
+ * @param int          dir         Inode number of the directory
+ * @param const char * name        The name looked up
+ * @param int          inode_num   What the directory said, or -1
+ * @param int64_t      seq         Returned by gros_dcache_seq before reading it
+ */
+void gros_dcache_add( Disk * disk, int dir, const char * name, int inode_num,
+                      int64_t seq );
+
+/**
+ * Forgets `name` in directory `dir`. Called after an entry is added to or
+ *  removed from the directory.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param int          dir    Inode number of the directory
+ * @param const char * name   The name that changed
+ */
+void gros_dcache_forget( Disk * disk, int dir, const char * name );
+
+/**
+ * Forgets every name in directory `dir` and every name for it, once the
+ *  directory is removed and its inode number may be given to another file.
+ *
+ * @param Disk * disk   The disk holding the file system
+ * @param int    dir    Inode number of the removed directory
+ */
+void gros_dcache_forget_dir( Disk * disk, int dir );
+
+#endif
@@ -0,0 +1,608 @@
+/**
+ * dedup.cpp
+ */
+
+#include "dedup.hpp"
+#include "files.hpp"
+#include "csum.hpp"
+#include <cstring>
+#include <vector>
+#include <set>
+#include <map>
+#include <errno.h>
+
+
+/**
+ * Returns how many blocks hold the reference counts of a disk with
+ *  `num_blocks` blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_dedup_refs_size( int num_blocks ) {
+    return ( int ) ( ( num_blocks + GROS_REFS_PER_BLOCK - 1 ) / GROS_REFS_PER_BLOCK );
+}
+
+
+/**
+ * Returns how many blocks hold the fingerprint index of a disk with
+ *  `num_blocks` blocks: room for one fingerprint per block, twice over.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_dedup_index_size( int num_blocks ) {
+    return ( int ) ( ( 2 * ( int64_t ) num_blocks + GROS_DEDUP_SLOTS - 1 )
+                     / GROS_DEDUP_SLOTS );
+}
+
+
+/**
+ * Clears the reference counts at blocks start .. start + ref_blocks - 1
+ *  and the fingerprint index right after them. Returns 0 or -errno.
+ *
+ * @param Disk * disk           The disk to hold the areas
+ * @param int    start          First block of the reference counts
+ * @param int    ref_blocks     Size of the reference count area, in blocks
+ * @param int    index_blocks   Size of the fingerprint index, in blocks
+ */
+int gros_format_dedup( Disk * disk, int start, int ref_blocks, int index_blocks ) {
+    if( ref_blocks <= 0 || index_blocks <= 0 )
+        return -EINVAL;
+    return gros_discard_blocks( disk, start, ref_blocks + index_blocks );
+}
+
+
+/**
+ * Starts honoring the reference counts at `start`, with the fingerprint
+ *  index right after them: shared blocks are copied before they are
+ *  written and only freed with their last reference. New data is only
+ *  looked up and indexed once `enabled` is set. Both areas are cached and
+ *  written back like any other metadata. Returns 0, -EEXIST if the disk
+ *  already has them, or -EINVAL if they do not fit the disk.
+ *
+ * @param Disk * disk           The disk to deduplicate
+ * @param int    start          First block of the reference counts
+ * @param int    ref_blocks     Size of the reference count area, in blocks
+ * @param int    index_blocks   Size of the fingerprint index, in blocks
+ */
+int gros_open_dedup( Disk * disk, int start, int ref_blocks, int index_blocks ) {
+    Dedup * dedup;
+
+    if( disk->dedup != NULL )
+        return -EEXIST;
+    if( start < 1 || index_blocks < 1
+        || ref_blocks < gros_dedup_refs_size( ( int ) ( disk->size / BLOCK_SIZE ) )
+        || ( int64_t ) ( start + ref_blocks + index_blocks ) * BLOCK_SIZE > disk->size )
+        return -EINVAL;
+
+    dedup               = new Dedup();
+    dedup->ref_start    = start;
+    dedup->ref_blocks   = ref_blocks;
+    dedup->index_start  = start + ref_blocks;
+    dedup->index_blocks = index_blocks;
+    dedup->enabled      = false;
+    dedup->shared       = 0;
+    pthread_mutex_init( &dedup->lock, NULL );
+    disk->dedup         = dedup;
+    return 0;
+}
+
+
+/**
+ * Stops deduplicating.
+ *
+ * @param Disk * disk   The disk to stop deduplicating
+ */
+void gros_close_dedup( Disk * disk ) {
+    if( disk->dedup != NULL )
+        pthread_mutex_destroy( &disk->dedup->lock );
+    delete disk->dedup;
+    disk->dedup = NULL;
+}
+
+
+/**
+ * Reads the reference count entry of block `block_num` into `value`.
+ *  Returns 0 or -errno.
+ */
+static int gros_dedup_get_ref( Disk * disk, int block_num, uint32_t * value ) {
+    uint32_t refs[ GROS_REFS_PER_BLOCK ];
+
+    if( gros_bread( disk, disk->dedup->ref_start + block_num / GROS_REFS_PER_BLOCK,
+                    ( char * ) refs ) < 0 )
+        return -EIO;
+    * value = refs[ block_num % GROS_REFS_PER_BLOCK ];
+    return 0;
+}
+
+
+/**
+ * Sets the reference count entry of block `block_num` to `value`.
+ *  Returns 0 or -errno.
+ */
+static int gros_dedup_set_ref( Disk * disk, int block_num, uint32_t value ) {
+    uint32_t refs[ GROS_REFS_PER_BLOCK ];
+    int      where = disk->dedup->ref_start + block_num / GROS_REFS_PER_BLOCK;
+
+    if( gros_bread( disk, where, ( char * ) refs ) < 0 )
+        return -EIO;
+    refs[ block_num % GROS_REFS_PER_BLOCK ] = value;
+    return gros_bwrite( disk, where, ( char * ) refs ) < 0 ? -EIO : 0;
+}
+
+
+/**
+ * Returns 1 if block `block_num` is referenced more than once, 0 if not,
+ *  or -errno.
+ *
+ * @param Disk * disk        The disk containing the block
+ * @param int    block_num   Index of the block
+ */
+int gros_block_shared( Disk * disk, int block_num ) {
+    uint32_t ref;
+    int      status;
+
+    if( disk->dedup == NULL )
+        return 0;
+    pthread_mutex_lock( &disk->dedup->lock );
+    status = gros_dedup_get_ref( disk, block_num, &ref );
+    pthread_mutex_unlock( &disk->dedup->lock );
+    if( status < 0 )
+        return status;
+    return ( ref & GROS_DEDUP_EXTRA ) != 0;
+}
+
+
+/**
+ * Drops a reference to block `block_num`, as gros_unshare_block does.
+ *  Called with the dedup lock held.
+ */
+static int gros_dedup_drop( Disk * disk, int block_num ) {
+    uint32_t ref;
+    int      status;
+
+    if( ( status = gros_dedup_get_ref( disk, block_num, &ref ) ) < 0 )
+        return status;
+    if( ( ref & GROS_DEDUP_EXTRA ) != 0 )
+        return ( status = gros_dedup_set_ref( disk, block_num, ref - 1 ) ) < 0 ? status : 1;
+    // whatever the index still says about the block no longer holds
+    if( ref != 0 && ( status = gros_dedup_set_ref( disk, block_num, 0 ) ) < 0 )
+        return status;
+    return 0;
+}
+
+
+/**
+ * Drops a reference to block `block_num`. Returns 1 if others remain, so
+ *  the block must stay allocated, 0 if that was the last one, or -errno.
+ *
+ * @param Disk * disk        The disk containing the block
+ * @param int    block_num   Index of the block
+ */
+int gros_unshare_block( Disk * disk, int block_num ) {
+    int status;
+
+    if( disk->dedup == NULL )
+        return 0;
+    pthread_mutex_lock( &disk->dedup->lock );
+    status = gros_dedup_drop( disk, block_num );
+    pthread_mutex_unlock( &disk->dedup->lock );
+    return status;
+}
+
+
+/**
+ * Maps block `fblock` of a file to a newly allocated block in place of the
+ *  shared block `block_num`, dropping the file's reference to that one.
+ *  Returns the new block or -errno. Called with the dedup lock held.
+ */
+static int gros_dedup_move( Disk * disk, Inode * inode, int fblock, int block_num ) {
+    int fresh;
+    int status;
+
+    if( ( fresh = gros_allocate_data_block( disk ) ) < 0 )
+        return -ENOSPC;
+    if( ( status = gros_bmap_set( disk, inode, fblock, fresh ) ) < 0
+        || ( status = gros_dedup_drop( disk, block_num ) ) < 0 )
+        return status;
+    return fresh;
+}
+
+
+/**
+ * Gives block `fblock` of a file a copy of its own if the block is shared,
+ *  so it can be changed in place. Returns 0 or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file; saved by the caller
+ * @param int     fblock   Block to copy, relative to the file
+ */
+int gros_dedup_private( Disk * disk, Inode * inode, int fblock ) {
+    char     data[ BLOCK_SIZE ];
+    BlockIO  io;
+    uint32_t ref;
+    int      block_num;
+    int      status;
+
+    gros_bmap_range( disk, inode, fblock, 1, &block_num );
+    if( block_num <= 0 || disk->dedup == NULL )
+        return 0;
+
+    // the block cannot become shared between the test and the copy
+    pthread_mutex_lock( &disk->dedup->lock );
+    if( ( status = gros_dedup_get_ref( disk, block_num, &ref ) ) == 0
+        && ( ref & GROS_DEDUP_EXTRA ) != 0 ) {
+        io.block_num = block_num;
+        io.buf       = data;
+        if( gros_bread_blocks( disk, &io, 1 ) < 0 )
+            status = -EIO;
+        else if( ( io.block_num = gros_dedup_move( disk, inode, fblock, block_num ) ) < 0 )
+            status = io.block_num;
+        else
+            status = gros_bwrite_blocks( disk, &io, 1 ) < 0 ? -EIO : 0;
+    }
+    pthread_mutex_unlock( &disk->dedup->lock );
+    return status;
+}
+
+
+/**
+ * Returns the fingerprint index slot `i` of the probe sequence of `fp`,
+ *  as the block holding it and the slot within that block.
+ */
+static void gros_dedup_slot( Dedup * dedup, uint32_t fp, int i, int * block, int * slot ) {
+    * block = dedup->index_start + ( int ) ( fp % ( uint32_t ) dedup->index_blocks );
+    * slot  = ( int ) ( ( fp / ( uint32_t ) dedup->index_blocks + i ) % GROS_DEDUP_SLOTS );
+}
+
+
+/**
+ * Looks fingerprint `fp` up in the index and returns the blocks recorded
+ *  with it that still hold file data, as candidates to compare.
+ */
+static void gros_dedup_lookup( Disk * disk, uint32_t fp, std::vector< int > & found ) {
+    DedupSlot slots[ GROS_DEDUP_SLOTS ];
+    uint32_t  ref;
+    int       block;
+    int       slot;
+    int       i;
+
+    gros_dedup_slot( disk->dedup, fp, 0, &block, &slot );
+    if( gros_bread( disk, block, ( char * ) slots ) < 0 )
+        return;
+    for( i = 0; i < GROS_DEDUP_PROBE; i++ ) {
+        gros_dedup_slot( disk->dedup, fp, i, &block, &slot );
+        if( slots[ slot ].block == 0 )
+            break;
+        if( slots[ slot ].fp == fp
+            && gros_dedup_get_ref( disk, slots[ slot ].block, &ref ) == 0
+            && ( ref & GROS_DEDUP_INDEXED ) != 0
+            && ( ref & GROS_DEDUP_EXTRA ) != GROS_DEDUP_EXTRA )
+            found.push_back( slots[ slot ].block );
+    }
+}
+
+
+/**
+ * Records in the index that block `block_num` holds data with fingerprint
+ *  `fp`. The first empty slot of the probe sequence is taken, or else the
+ *  first one: the index forgets rather than grows. Returns 0 or -errno.
+ */
+static int gros_dedup_insert( Disk * disk, uint32_t fp, int block_num ) {
+    DedupSlot slots[ GROS_DEDUP_SLOTS ];
+    uint32_t  ref;
+    int       block;
+    int       slot;
+    int       home;
+    int       i;
+    int       status;
+
+    gros_dedup_slot( disk->dedup, fp, 0, &block, &home );
+    if( gros_bread( disk, block, ( char * ) slots ) < 0 )
+        return -EIO;
+    for( i = 0; i < GROS_DEDUP_PROBE; i++ ) {
+        gros_dedup_slot( disk->dedup, fp, i, &block, &slot );
+        if( slots[ slot ].block == 0 || slots[ slot ].block == block_num )
+            break;
+    }
+    if( i == GROS_DEDUP_PROBE )
+        slot = home;
+    slots[ slot ].fp    = fp;
+    slots[ slot ].block = block_num;
+    if( gros_bwrite( disk, block, ( char * ) slots ) < 0 )
+        return -EIO;
+
+    if( ( status = gros_dedup_get_ref( disk, block_num, &ref ) ) < 0 )
+        return status;
+    if( ( ref & GROS_DEDUP_INDEXED ) == 0 )
+        return gros_dedup_set_ref( disk, block_num, ref | GROS_DEDUP_INDEXED );
+    return 0;
+}
+
+
+/**
+ * Deduplicates and writes the data blocks of a write. ios[ i ] is the new
+ *  contents of block fblocks[ i ] of the file. Each is fingerprinted and
+ *  looked up in the index; a block already on disk with the same data,
+ *  compared byte for byte, is mapped in its place and takes another
+ *  reference, and the block it replaces is freed. Shared blocks that are
+ *  written are first moved to a block of their own. The rest are written
+ *  before the dedup lock is dropped, so no other write can share a block
+ *  while its data changes. Reorders `ios`. Returns 0 or -errno.
+ *
+ * @param Disk      * disk      Disk containing the file system
+ * @param Inode     * inode     Inode of the file; saved by the caller
+ * @param const int * fblocks   Blocks written, relative to the file
+ * @param BlockIO   * ios       Blocks the write maps them to, and their data
+ * @param int         n         Number of entries in `fblocks` and `ios`
+ */
+int gros_dedup_blocks( Disk * disk, Inode * inode, const int * fblocks,
+                       BlockIO * ios, int n ) {
+    char                          data[ BLOCK_SIZE ];
+    std::set< int >               targets;  /* blocks this write overwrites */
+    std::multimap< uint32_t, int > pending; /* fingerprints of entries kept so far */
+    std::multimap< uint32_t, int >::iterator it;
+    std::vector< uint32_t >       fps( ( size_t ) n );
+    std::vector< int >            found;
+    std::vector< int >            replaced; /* blocks to free once unlocked */
+    BlockIO                       io;
+    Dedup                       * dedup = disk->dedup;
+    uint32_t                      ref;
+    int                           kept  = 0;
+    int                           cand;
+    int                           status = 0;
+    int                           i;
+    size_t                        j;
+
+    if( dedup == NULL )
+        return n > 0 && gros_bwrite_blocks( disk, ios, n ) < 0 ? -EIO : 0;
+    for( i = 0; i < n; i++ )
+        targets.insert( ios[ i ].block_num );
+
+    pthread_mutex_lock( &dedup->lock );
+    for( i = 0; i < n; i++ ) {
+        cand = -1;
+        if( dedup->enabled ) {
+            fps[ i ] = gros_crc32c( 0, ios[ i ].buf, BLOCK_SIZE );
+
+            // an earlier block of this write with the same data
+            for( it = pending.lower_bound( fps[ i ] );
+                 cand < 0 && it != pending.end() && it->first == fps[ i ]; ++it )
+                if( std::memcmp( ios[ it->second ].buf, ios[ i ].buf, BLOCK_SIZE ) == 0 )
+                    cand = ios[ it->second ].block_num;
+
+            // or a block on disk that keeps its data
+            found.clear();
+            if( cand < 0 )
+                gros_dedup_lookup( disk, fps[ i ], found );
+            for( j = 0; cand < 0 && j < found.size(); j++ ) {
+                if( found[ j ] != ios[ i ].block_num && targets.count( found[ j ] ) )
+                    continue;
+                io.block_num = found[ j ];
+                io.buf       = data;
+                if( gros_bread_blocks( disk, &io, 1 ) == 0
+                    && std::memcmp( data, ios[ i ].buf, BLOCK_SIZE ) == 0 )
+                    cand = found[ j ];
+            }
+        }
+
+        // the block already holds this data
+        if( cand == ios[ i ].block_num )
+            continue;
+
+        if( cand > 0 ) {
+            if( ( status = gros_dedup_get_ref( disk, cand, &ref ) ) < 0
+                || ( status = gros_dedup_set_ref( disk, cand, ref + 1 ) ) < 0 )
+                break;
+            replaced.push_back( ios[ i ].block_num );
+            if( ( status = gros_bmap_set( disk, inode, fblocks[ i ], cand ) ) < 0 )
+                break;
+            dedup->shared++;
+            continue;
+        }
+
+        // a shared block is never written in place
+        if( ( status = gros_dedup_get_ref( disk, ios[ i ].block_num, &ref ) ) < 0 )
+            break;
+        if( ( ref & GROS_DEDUP_EXTRA ) != 0 ) {
+            if( ( status = gros_dedup_move( disk, inode, fblocks[ i ],
+                                            ios[ i ].block_num ) ) < 0 )
+                break;
+            ios[ i ].block_num = status;
+        }
+
+        if( dedup->enabled ) {
+            if( ( status = gros_dedup_insert( disk, fps[ i ], ios[ i ].block_num ) ) < 0 )
+                break;
+            pending.insert( std::make_pair( fps[ i ], kept ) );
+        }
+        ios[ kept++ ] = ios[ i ];
+    }
+    if( status >= 0 )
+        status = kept > 0 && gros_bwrite_blocks( disk, ios, kept ) < 0 ? -EIO : 0;
+    pthread_mutex_unlock( &dedup->lock );
+
+    // freeing drops a reference under the lock itself
+    for( j = 0; j < replaced.size(); j++ )
+        gros_free_data_block( disk, replaced[ j ] );
+    return status;
+}
+
+
+
+/**
+ * Returns whether block `block_num` is marked used in its block group's
+ *  bitmap.
+ */
+static int gros_dedup_test_used( Disk * disk, int block_num ) {
+    char         buf[ BLOCK_SIZE ];
+    char         sbuf[ BLOCK_SIZE ];
+    Superblock * superblock = ( Superblock * ) gros_bget( disk, 0, sbuf );
+    int          relative   = block_num - superblock->first_data_block;
+    Bitmap     * bm;
+    int          used;
+
+    gros_bread( disk, superblock->first_data_block
+                      + relative / BLOCK_SIZE * BLOCK_SIZE, buf );
+    bm   = gros_init_bitmap( BLOCK_SIZE, buf );
+    used = gros_is_bit_set( bm, relative % BLOCK_SIZE );
+    delete bm;
+    return used;
+}
+
+
+TEST_CASE( "Identical data blocks are stored once", "[dedup][files]" ) {
+    Disk  * disk = gros_open_disk();
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( disk->dedup != NULL );
+    disk->dedup->enabled = true;
+
+    Inode * a    = gros_new_inode( disk );
+    Inode * b    = gros_new_inode( disk );
+    int     size = 8 * BLOCK_SIZE;
+    char  * in   = new char[ size ];
+    char  * out  = new char[ size ];
+    int     map_a[ 8 ];
+    int     map_b[ 8 ];
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = ( char ) ( 'a' + i / BLOCK_SIZE );
+    REQUIRE( gros_i_write( disk, a, in, size, 0 ) == size );
+    REQUIRE( gros_i_write( disk, b, in, size, 0 ) == size );
+
+    SECTION( "A second copy takes no blocks" ) {
+        REQUIRE( disk->dedup->shared == 8 );
+        gros_bmap_range( disk, a, 0, 8, map_a );
+        gros_bmap_range( disk, b, 0, 8, map_b );
+        for( i = 0; i < 8; i++ ) {
+            REQUIRE( map_a[ i ] == map_b[ i ] );
+            REQUIRE( gros_block_shared( disk, map_a[ i ] ) == 1 );
+        }
+        REQUIRE( gros_i_read( disk, b, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+    }
+
+    SECTION( "Writing a shared block copies it first" ) {
+        REQUIRE( gros_i_write( disk, b, ( char * ) "changed", 7, 2 * BLOCK_SIZE + 5 ) == 7 );
+        gros_bmap_range( disk, a, 0, 8, map_a );
+        gros_bmap_range( disk, b, 0, 8, map_b );
+        REQUIRE( map_a[ 2 ] != map_b[ 2 ] );
+        REQUIRE( map_a[ 3 ] == map_b[ 3 ] );
+        REQUIRE( gros_block_shared( disk, map_a[ 2 ] ) == 0 );
+        REQUIRE( gros_block_shared( disk, map_b[ 2 ] ) == 0 );
+        REQUIRE( gros_dedup_test_used( disk, map_b[ 2 ] ) );
+        REQUIRE( gros_i_read( disk, a, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        REQUIRE( gros_i_read( disk, b, out, size, 0 ) == size );
+        REQUIRE( memcmp( out + 2 * BLOCK_SIZE + 5, "changed", 7 ) == 0 );
+    }
+
+    SECTION( "Blocks are only freed with their last reference" ) {
+        gros_bmap_range( disk, b, 0, 8, map_b );
+        REQUIRE( gros_i_truncate( disk, a, 0 ) == 0 );
+        for( i = 0; i < 8; i++ ) {
+            REQUIRE( gros_dedup_test_used( disk, map_b[ i ] ) );
+            REQUIRE( gros_block_shared( disk, map_b[ i ] ) == 0 );
+        }
+        REQUIRE( gros_i_read( disk, b, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        REQUIRE( gros_i_truncate( disk, b, BLOCK_SIZE ) == 0 );
+        for( i = 2; i < 8; i++ )
+            REQUIRE( ! gros_dedup_test_used( disk, map_b[ i ] ) );
+    }
+
+    SECTION( "Repeated blocks within one write are shared" ) {
+        Inode * c = gros_new_inode( disk );
+        memset( in, 'r', size );
+        REQUIRE( gros_i_write( disk, c, in, size, 0 ) == size );
+        gros_bmap_range( disk, c, 0, 8, map_a );
+        for( i = 1; i < 8; i++ )
+            REQUIRE( map_a[ i ] == map_a[ 0 ] );
+        REQUIRE( gros_i_read( disk, c, out, size, 0 ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        gros_put_inode( disk, c );
+    }
+
+    delete [] in;
+    delete [] out;
+    gros_put_inode( disk, a );
+    gros_put_inode( disk, b );
+    gros_close_disk( disk );
+}
+
+
+typedef struct _deduper {
+    Disk  * disk;
+    Inode * inode;      /* the file this thread rewrites */
+    int     seed;
+    int     wrong;      /* reads that did not return the last write */
+} Deduper;
+
+
+/**
+ * Rewrites a file over and over with data other threads write too, and
+ *  reads each version back, for the shared block race test.
+ */
+static void * gros_test_deduper( void * arg ) {
+    Deduper * d = ( Deduper * ) arg;
+    char      in[ 4 * BLOCK_SIZE ];
+    char      out[ 4 * BLOCK_SIZE ];
+    int       i;
+
+    for( i = 0; i < 32; i++ ) {
+        memset( in, 'a' + ( d->seed + i ) % 3, sizeof( in ) );
+        if( gros_i_write( d->disk, d->inode, in, sizeof( in ), 0 ) != sizeof( in )
+            || gros_i_read( d->disk, d->inode, out, sizeof( out ), 0 ) != sizeof( out )
+            || memcmp( in, out, sizeof( in ) ) != 0 )
+            d->wrong++;
+    }
+    return NULL;
+}
+
+
+TEST_CASE( "Files rewritten at once never see each other's data", "[dedup][files]" ) {
+    Disk      * disk = gros_open_ram( EMULATOR_SIZE );
+    Deduper     d[ 4 ];
+    pthread_t   threads[ 4 ];
+    int         i;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    disk->dedup->enabled = true;
+    for( i = 0; i < 4; i++ ) {
+        d[ i ].disk  = disk;
+        d[ i ].inode = gros_new_inode( disk );
+        d[ i ].seed  = i;
+        d[ i ].wrong = 0;
+        REQUIRE( pthread_create( &threads[ i ], NULL, gros_test_deduper, &d[ i ] ) == 0 );
+    }
+    for( i = 0; i < 4; i++ ) {
+        REQUIRE( pthread_join( threads[ i ], NULL ) == 0 );
+        REQUIRE( d[ i ].wrong == 0 );
+        gros_put_inode( disk, d[ i ].inode );
+    }
+    REQUIRE( disk->dedup->shared > 0 );
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Blocks are not shared unless deduplication is enabled", "[dedup][files]" ) {
+    Disk  * disk = gros_open_disk();
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+
+    Inode * a = gros_new_inode( disk );
+    Inode * b = gros_new_inode( disk );
+    char    in[ 2 * BLOCK_SIZE ];
+
+    memset( in, 'd', sizeof( in ) );
+    REQUIRE( gros_i_write( disk, a, in, sizeof( in ), 0 ) == sizeof( in ) );
+    REQUIRE( gros_i_write( disk, b, in, sizeof( in ), 0 ) == sizeof( in ) );
+    REQUIRE( a->f_block[ 0 ] != b->f_block[ 0 ] );
+    REQUIRE( disk->dedup->shared == 0 );
+
+    gros_put_inode( disk, a );
+    gros_put_inode( disk, b );
+    gros_close_disk( disk );
+}
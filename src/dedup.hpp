@@ -0,0 +1,139 @@
+/**
+ * dedup.hpp
+ */
+
+#ifndef __DEDUP_HPP_INCLUDED__   // if dedup.hpp hasn't been included yet...
+#define __DEDUP_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <stdint.h>
+#include <pthread.h>
+
+// reference counts kept in one block of the reference count area
+#define GROS_REFS_PER_BLOCK    ( BLOCK_SIZE / sizeof( uint32_t ) )
+
+// a reference count entry holds the references a block has besides its
+// first owner, 0 for a block that is not shared, and this flag while the
+// block holds file data the fingerprint index may point at
+#define GROS_DEDUP_INDEXED     0x80000000u
+#define GROS_DEDUP_EXTRA       0x7fffffffu
+
+#define GROS_DEDUP_PROBE       8    // index slots looked at per fingerprint
+
+typedef struct _dedupslot {
+    uint32_t fp;        /* gros_crc32c of the block's data */
+    int32_t  block;     /* the block holding it, 0 for an empty slot */
+} DedupSlot;
+
+// fingerprint index slots kept in one block of the index
+#define GROS_DEDUP_SLOTS       ( BLOCK_SIZE / sizeof( DedupSlot ) )
+
+typedef struct _dedup {
+    int     ref_start;      /* first block of the reference counts */
+    int     ref_blocks;     /* size of the reference count area, in blocks */
+    int     index_start;    /* first block of the fingerprint index */
+    int     index_blocks;   /* size of the fingerprint index, in blocks */
+    bool    enabled;        /* look up and index the data of new writes */
+    int64_t shared;         /* blocks written as references to existing ones */
+    pthread_mutex_t lock;   /* serializes lookups, reference counts and the
+                               writes of blocks the index may point at */
+} Dedup;
+
+/**
+ * Returns how many blocks hold the reference counts of a disk with
+ *  `num_blocks` blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_dedup_refs_size( int num_blocks );
+
+/**
+ * Returns how many blocks hold the fingerprint index of a disk with
+ *  `num_blocks` blocks: room for one fingerprint per block, twice over.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_dedup_index_size( int num_blocks );
+
+/**
+ * Clears the reference counts at blocks start .. start + ref_blocks - 1
+ *  and the fingerprint index right after them. Returns 0 or -errno.
+ *
+ * @param Disk * disk           The disk to hold the areas
+ * @param int    start          First block of the reference counts
+ * @param int    ref_blocks     Size of the reference count area, in blocks
+ * @param int    index_blocks   Size of the fingerprint index, in blocks
+ */
+int gros_format_dedup( Disk * disk, int start, int ref_blocks, int index_blocks );
+
+/**
+ * Starts honoring the reference counts at `start`, with the fingerprint
+ *  index right after them: shared blocks are copied before they are
+ *  written and only freed with their last reference. New data is only
+ *  looked up and indexed once `enabled` is set. Both areas are cached and
+ *  written back like any other metadata. Returns 0, -EEXIST if the disk
+ *  already has them, or -EINVAL if they do not fit the disk.
+ *
+ * @param Disk * disk           The disk to deduplicate
+ * @param int    start          First block of the reference counts
+ * @param int    ref_blocks     Size of the reference count area, in blocks
+ * @param int    index_blocks   Size of the fingerprint index, in blocks
+ */
+int gros_open_dedup( Disk * disk, int start, int ref_blocks, int index_blocks );
+
+/**
+ * Stops deduplicating.
+ *
+ * @param Disk * disk   The disk to stop deduplicating
+ */
+void gros_close_dedup( Disk * disk );
+
+/**
+ * Returns 1 if block `block_num` is referenced more than once, 0 if not,
+ *  or -errno.
+ *
+ * @param Disk * disk        The disk containing the block
+ * @param int    block_num   Index of the block
+ */
+int gros_block_shared( Disk * disk, int block_num );
+
+/**
+ * Drops a reference to block `block_num`. Returns 1 if others remain, so
+ *  the block must stay allocated, 0 if that was the last one, or -errno.
+ *
+ * @param Disk * disk        The disk containing the block
+ * @param int    block_num   Index of the block
+ */
+int gros_unshare_block( Disk * disk, int block_num );
+
+/**
+ * Gives block `fblock` of a file a copy of its own if the block is shared,
+ *  so it can be changed in place. Returns 0 or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file; saved by the caller
+ * @param int     fblock   Block to copy, relative to the file
+ */
+int gros_dedup_private( Disk * disk, Inode * inode, int fblock );
+
+/**
+ * Deduplicates and writes the data blocks of a write. ios[ i ] is the new
+ *  contents of block fblocks[ i ] of the file. Each is fingerprinted and
+ *  looked up in the index; a block already on disk with the same data,
+ *  compared byte for byte, is mapped in its place and takes another
+ *  reference, and the block it replaces is freed. Shared blocks that are
+ *  written are first moved to a block of their own. The rest are written
+ *  before the dedup lock is dropped, so no other write can share a block
+ *  while its data changes. Reorders `ios`. Returns 0 or -errno.
+ *
+ * @param Disk      * disk      Disk containing the file system
+ * @param Inode     * inode     Inode of the file; saved by the caller
+ * @param const int * fblocks   Blocks written, relative to the file
+ * @param BlockIO   * ios       Blocks the write maps them to, and their data
+ * @param int         n         Number of entries in `fblocks` and `ios`
+ */
+int gros_dedup_blocks( Disk * disk, Inode * inode, const int * fblocks,
+                       BlockIO * ios, int n );
+
+#endif
@@ -0,0 +1,467 @@
+/**
+ * dindex.cpp
+ */
+
+#include "dindex.hpp"
+#include "cache.hpp"
+#include <cstring>
+#include <errno.h>
+#include <vector>
+
+
+/**
+ * Returns the hash a name is indexed under (FNV-1a).
+ *
+ * @param const char * name   The name of a directory entry
+ */
+uint32_t gros_dindex_hash( const char * name ) {
+    uint32_t hash = 2166136261u;
+    int      i;
+
+    for( i = 0; i < FILENAME_MAX_LENGTH && name[ i ] != '\0'; i++ ) {
+        hash ^= ( unsigned char ) name[ i ];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Orders an index entry against the key ( hash, slot ).
+ */
+static int gros_dindex_cmp( const DIndexEntry * e, uint32_t hash, int slot ) {
+    if( e->hash != hash )
+        return e->hash < hash ? -1 : 1;
+    return e->slot < slot ? -1 : e->slot > slot;
+}
+
+
+/**
+ * Returns the first position of `node` whose key is not below
+ *  ( hash, slot ), or its count if there is none.
+ */
+static int gros_dindex_find( DIndexNode * node, uint32_t hash, int slot ) {
+    int lo = 0;
+    int hi = node->count;
+    int mid;
+
+    while( lo < hi ) {
+        mid = ( lo + hi ) / 2;
+        if( gros_dindex_cmp( &node->entries[ mid ], hash, slot ) < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+/**
+ * Returns the position of the child of index node `node` that holds the
+ *  key ( hash, slot ): the last one whose smallest key is not above it.
+ */
+static int gros_dindex_route( DIndexNode * node, uint32_t hash, int slot ) {
+    int pos = gros_dindex_find( node, hash, slot );
+
+    if( pos < node->count && gros_dindex_cmp( &node->entries[ pos ], hash, slot ) == 0 )
+        return pos;
+    return pos > 0 ? pos - 1 : 0;
+}
+
+
+/**
+ * Reads index block `block` into `node`. Returns 0 or -EIO.
+ */
+static int gros_dindex_read( Disk * disk, int block, DIndexNode * node ) {
+    if( block <= 0 || gros_bread( disk, block, ( char * ) node ) < 0
+        || node->magic != GROS_DINDEX_MAGIC )
+        return -EIO;
+    return 0;
+}
+
+
+/**
+ * Writes `node` to index block `block`. Returns 0 or -EIO.
+ */
+static int gros_dindex_write( Disk * disk, int block, DIndexNode * node ) {
+    return gros_bwrite( disk, block, ( char * ) node ) < 0 ? -EIO : 0;
+}
+
+
+/**
+ * Returns a new index block near block `goal`, or -1 if the disk is full.
+ */
+static int gros_dindex_alloc( Disk * disk, int goal ) {
+    int count;
+
+    return gros_allocate_data_blocks( disk, goal, 1, &count );
+}
+
+
+/**
+ * Returns the root block of the index of `dir`, or -1 if it has none.
+ */
+static int gros_dindex_root( Disk * disk, Inode * dir ) {
+    DirEntry dot;
+    int      root;
+
+    if( ! ( dir->f_acl & GROS_ACL_INDEX )
+        || gros_i_read( disk, dir, ( char * ) &dot, sizeof( DirEntry ), 0 )
+           != ( int ) sizeof( DirEntry ) )
+        return -1;
+    std::memcpy( &root, dot.filename + GROS_DINDEX_ROOT_AT, sizeof( int ) );
+    return root;
+}
+
+
+/**
+ * Adds `e` under index block `block`. Returns 0, or 1 if the block was
+ *  split, setting `split` to the smallest key of the new block on its
+ *  right and to the block itself, or -errno.
+ */
+static int gros_dindex_insert_at( Disk * disk, int goal, int block, DIndexEntry * e,
+                                  DIndexEntry * split ) {
+    DIndexNode    node;
+    DIndexNode    right;
+    DIndexEntry   sub;
+    DIndexEntry   all[ GROS_DINDEX_FANOUT + 1 ];
+    int           pos;
+    int           status;
+    int           count;
+    int           half;
+    int           rblock;
+
+    if( gros_dindex_read( disk, block, &node ) < 0 )
+        return -EIO;
+    if( node.level > 0 ) {
+        pos    = gros_dindex_route( &node, e->hash, e->slot );
+        status = gros_dindex_insert_at( disk, goal, node.entries[ pos ].child, e, &sub );
+        if( status <= 0 )
+            return status;
+        // the child was split: its new right neighbour goes after it
+        e = &sub;
+        pos++;
+    } else {
+        pos = gros_dindex_find( &node, e->hash, e->slot );
+    }
+
+    if( node.count < ( int ) GROS_DINDEX_FANOUT ) {
+        std::memmove( &node.entries[ pos + 1 ], &node.entries[ pos ],
+                      ( node.count - pos ) * sizeof( DIndexEntry ) );
+        node.entries[ pos ] = * e;
+        node.count++;
+        return gros_dindex_write( disk, block, &node );
+    }
+
+    // a full block keeps the lower half and a new one after it takes the rest
+    if( ( rblock = gros_dindex_alloc( disk, goal ) ) < 0 )
+        return -ENOSPC;
+    count = node.count + 1;
+    std::memcpy( all, node.entries, pos * sizeof( DIndexEntry ) );
+    all[ pos ] = * e;
+    std::memcpy( all + pos + 1, node.entries + pos,
+                 ( node.count - pos ) * sizeof( DIndexEntry ) );
+    half = count / 2;
+
+    std::memset( &right, 0, sizeof( right ) );
+    right.magic = GROS_DINDEX_MAGIC;
+    right.level = node.level;
+    right.count = count - half;
+    right.next  = node.next;
+    std::memcpy( right.entries, all + half, right.count * sizeof( DIndexEntry ) );
+    node.count  = half;
+    node.next   = node.level == 0 ? rblock : -1;
+    std::memcpy( node.entries, all, half * sizeof( DIndexEntry ) );
+    if( gros_dindex_write( disk, rblock, &right ) < 0
+        || gros_dindex_write( disk, block, &node ) < 0 )
+        return -EIO;
+
+    split->hash  = right.entries[ 0 ].hash;
+    split->slot  = right.entries[ 0 ].slot;
+    split->child = rblock;
+    return 1;
+}
+
+
+/**
+ * Frees index block `block` and every block under it.
+ */
+static void gros_dindex_free( Disk * disk, int block ) {
+    DIndexNode node;
+    int        i;
+
+    if( gros_dindex_read( disk, block, &node ) == 0 && node.level > 0 )
+        for( i = 0; i < node.count; i++ )
+            gros_dindex_free( disk, node.entries[ i ].child );
+    gros_free_data_block( disk, block );
+}
+
+
+/**
+ * Indexes every entry of directory `dir`, so lookups, inserts and removals
+ *  read a few blocks of the index instead of the whole directory, and
+ *  marks it with GROS_ACL_INDEX. Returns 0 or -errno.
+ *
+ * @param Disk  * disk   The disk holding the file system
+ * @param Inode * dir    The directory to index
+ */
+int gros_dindex_build( Disk * disk, Inode * dir ) {
+    DirEntry     dot;
+    DirIter      iter;
+    DirEntry   * e;
+    DIndexNode   node;
+    int          root;
+    int          slot = 0;
+    int          status;
+
+    if( dir->f_acl & GROS_ACL_INDEX )
+        return 0;
+    if( dir->f_size < ( int ) sizeof( DirEntry ) )
+        return -EINVAL;
+    if( ( root = gros_dindex_alloc( disk, dir->f_block[ 0 ] ) ) < 0 )
+        return -ENOSPC;
+    std::memset( &node, 0, sizeof( node ) );
+    node.magic = GROS_DINDEX_MAGIC;
+    node.level = 0;
+    node.count = 0;
+    node.next  = -1;
+    if( gros_dindex_write( disk, root, &node ) < 0 ) {
+        gros_free_data_block( disk, root );
+        return -EIO;
+    }
+
+    // the root goes into the "." entry before the first insert looks for it
+    gros_i_read( disk, dir, ( char * ) &dot, sizeof( DirEntry ), 0 );
+    std::memcpy( dot.filename + GROS_DINDEX_ROOT_AT, &root, sizeof( int ) );
+    gros_i_write( disk, dir, ( char * ) &dot, sizeof( DirEntry ), 0 );
+    dir->f_acl = ( short ) ( dir->f_acl | GROS_ACL_INDEX );
+
+    gros_opendir( dir, &iter, 0 );
+    while( ( e = gros_readdir( disk, &iter ) ) != NULL ) {
+        if( ( status = gros_dindex_insert( disk, dir, e->filename, slot++ ) ) < 0 ) {
+            gros_dindex_drop( disk, dir );
+            return status;
+        }
+    }
+    return gros_save_inode( disk, dir ) < 0 ? -EIO : 0;
+}
+
+
+/**
+ * Finds `name` in indexed directory `dir`. Returns the position of its
+ *  entry, filling in `entry`, or -ENOENT.
+ *
+ * @param Disk       * disk    The disk holding the file system
+ * @param Inode      * dir     The directory to look in
+ * @param const char * name    The name to find
+ * @param DirEntry   * entry   Set to the directory entry
+ */
+int gros_dindex_lookup( Disk * disk, Inode * dir, const char * name, DirEntry * entry ) {
+    DIndexNode node;
+    uint32_t   hash  = gros_dindex_hash( name );
+    int        block = gros_dindex_root( disk, dir );
+    int        slot;
+    int        pos;
+
+    if( gros_dindex_read( disk, block, &node ) < 0 )
+        return -ENOENT;
+    while( node.level > 0 ) {
+        block = node.entries[ gros_dindex_route( &node, hash, -1 ) ].child;
+        if( gros_dindex_read( disk, block, &node ) < 0 )
+            return -ENOENT;
+    }
+
+    // names with the same hash may go on into the next leaves
+    pos = gros_dindex_find( &node, hash, -1 );
+    for( ;; ) {
+        if( pos == node.count ) {
+            if( node.next < 0 || gros_dindex_read( disk, node.next, &node ) < 0 )
+                return -ENOENT;
+            pos = 0;
+            continue;
+        }
+        if( node.entries[ pos ].hash != hash )
+            return -ENOENT;
+        slot = node.entries[ pos++ ].slot;
+        if( gros_i_read( disk, dir, ( char * ) entry, sizeof( DirEntry ),
+                         slot * sizeof( DirEntry ) ) == ( int ) sizeof( DirEntry )
+            && ! strncmp( entry->filename, name, FILENAME_MAX_LENGTH ) )
+            return slot;
+    }
+}
+
+
+/**
+ * Adds the entry for `name` at position `slot` of indexed directory `dir`
+ *  to its index. Returns 0 or -errno.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param Inode      * dir    The directory
+ * @param const char * name   Name of the entry
+ * @param int          slot   Position of the entry in the directory
+ */
+int gros_dindex_insert( Disk * disk, Inode * dir, const char * name, int slot ) {
+    DIndexNode  node;
+    DIndexEntry e;
+    DIndexEntry split;
+    int         root = gros_dindex_root( disk, dir );
+    int         left;
+    int         status;
+
+    if( root < 0 )
+        return -EINVAL;
+    e.hash  = gros_dindex_hash( name );
+    e.slot  = slot;
+    e.child = -1;
+    if( ( status = gros_dindex_insert_at( disk, dir->f_block[ 0 ], root, &e, &split ) ) <= 0 )
+        return status;
+
+    // the root was split: what it kept moves to a new block below it
+    if( gros_dindex_read( disk, root, &node ) < 0 )
+        return -EIO;
+    if( ( left = gros_dindex_alloc( disk, dir->f_block[ 0 ] ) ) < 0 )
+        return -ENOSPC;
+    if( gros_dindex_write( disk, left, &node ) < 0 )
+        return -EIO;
+    node.level++;
+    node.count               = 2;
+    node.next                = -1;
+    node.entries[ 0 ].hash   = 0;
+    node.entries[ 0 ].slot   = -1;
+    node.entries[ 0 ].child  = left;
+    node.entries[ 1 ]        = split;
+    return gros_dindex_write( disk, root, &node );
+}
+
+
+/**
+ * Takes the entry for `name` at position `slot` of indexed directory `dir`
+ *  out of its index. Returns 0 or -ENOENT if it is not indexed there.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param Inode      * dir    The directory
+ * @param const char * name   Name of the entry
+ * @param int          slot   Position of the entry in the directory
+ */
+int gros_dindex_remove( Disk * disk, Inode * dir, const char * name, int slot ) {
+    DIndexNode node;
+    uint32_t   hash  = gros_dindex_hash( name );
+    int        block = gros_dindex_root( disk, dir );
+    int        pos;
+
+    if( gros_dindex_read( disk, block, &node ) < 0 )
+        return -ENOENT;
+    while( node.level > 0 ) {
+        block = node.entries[ gros_dindex_route( &node, hash, slot ) ].child;
+        if( gros_dindex_read( disk, block, &node ) < 0 )
+            return -ENOENT;
+    }
+
+    // leaves are not merged; an empty one stays in the chain
+    pos = gros_dindex_find( &node, hash, slot );
+    if( pos == node.count || gros_dindex_cmp( &node.entries[ pos ], hash, slot ) != 0 )
+        return -ENOENT;
+    std::memmove( &node.entries[ pos ], &node.entries[ pos + 1 ],
+                  ( node.count - pos - 1 ) * sizeof( DIndexEntry ) );
+    node.count--;
+    return gros_dindex_write( disk, block, &node );
+}
+
+
+/**
+ * Frees the index of directory `dir` and clears GROS_ACL_INDEX. Does
+ *  nothing if it has none.
+ *
+ * @param Disk  * disk   The disk holding the file system
+ * @param Inode * dir    The directory
+ */
+void gros_dindex_drop( Disk * disk, Inode * dir ) {
+    int root = gros_dindex_root( disk, dir );
+
+    if( root < 0 )
+        return;
+    gros_dindex_free( disk, root );
+    dir->f_acl = ( short ) ( dir->f_acl & ~GROS_ACL_INDEX );
+    gros_save_inode( disk, dir );
+}
+
+
+/**
+ * Returns the number of levels of the index of `dir`, 1 for a lone leaf.
+ */
+static int gros_dindex_test_depth( Disk * disk, Inode * dir ) {
+    DIndexNode node;
+
+    if( gros_dindex_read( disk, gros_dindex_root( disk, dir ), &node ) < 0 )
+        return 0;
+    return node.level + 1;
+}
+
+
+TEST_CASE( "Large directories are looked up through a hashed index", "[dindex][files]" ) {
+    Disk     * disk = gros_open_ram( 64 * 1024 * 1024 );
+    Inode    * dir;
+    DirEntry   entry;
+    char       name[ 32 ];
+    int        n = 1000;
+    int        nums[ 1000 ];
+    int        used;
+    int        i;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( gros_mkdir( disk, "/big" ) > 0 );
+    dir = gros_get_inode( disk, gros_namei( disk, "/big" ) );
+    REQUIRE( dir != NULL );
+
+    for( i = 0; i < n; i++ ) {
+        snprintf( name, sizeof( name ), "file%d", i );
+        REQUIRE( ( nums[ i ] = gros_i_mknod( disk, dir, name ) ) > 0 );
+        // small directories stay plain arrays
+        if( i + 3 < GROS_DINDEX_MIN )
+            REQUIRE( ! ( dir->f_acl & GROS_ACL_INDEX ) );
+    }
+    REQUIRE( ( dir->f_acl & GROS_ACL_INDEX ) );
+    REQUIRE( gros_dindex_test_depth( disk, dir ) == 2 );
+
+    SECTION( "Every name is found, and only those" ) {
+        for( i = 0; i < n; i++ ) {
+            snprintf( name, sizeof( name ), "file%d", i );
+            REQUIRE( gros_dindex_lookup( disk, dir, name, &entry ) >= 2 );
+            REQUIRE( entry.inode_num == nums[ i ] );
+        }
+        REQUIRE( gros_dindex_lookup( disk, dir, "..", &entry ) == 1 );
+        REQUIRE( gros_dindex_lookup( disk, dir, "missing", &entry ) == -ENOENT );
+        REQUIRE( gros_namei( disk, "/big/file777" ) == nums[ 777 ] );
+    }
+
+    SECTION( "Removing entries keeps the index in step with the directory" ) {
+        for( i = 0; i < n; i += 2 ) {
+            snprintf( name, sizeof( name ), "file%d", i );
+            REQUIRE( gros_i_unlink( disk, dir, name ) == 0 );
+        }
+        REQUIRE( dir->f_size == ( int ) ( ( 2 + n / 2 ) * sizeof( DirEntry ) ) );
+        for( i = 0; i < n; i++ ) {
+            snprintf( name, sizeof( name ), "file%d", i );
+            if( i % 2 == 0 ) {
+                REQUIRE( gros_dindex_lookup( disk, dir, name, &entry ) == -ENOENT );
+            } else {
+                REQUIRE( gros_dindex_lookup( disk, dir, name, &entry ) >= 2 );
+                REQUIRE( entry.inode_num == nums[ i ] );
+            }
+        }
+        REQUIRE( gros_i_unlink( disk, dir, "file0" ) == -1 );
+    }
+
+    SECTION( "Removing the directory frees its index" ) {
+        gros_put_inode( disk, dir );
+        dir  = NULL;
+        used = gros_superblock( disk )->fs_num_used_blocks;
+        REQUIRE( gros_rmdir( disk, "/big" ) == 0 );
+        REQUIRE( gros_namei( disk, "/big" ) == -1 );
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks < used - n );
+    }
+
+    gros_put_inode( disk, dir );
+    gros_close_disk( disk );
+}
@@ -0,0 +1,101 @@
+/**
+ * dindex.hpp
+ */
+
+#ifndef __DINDEX_HPP_INCLUDED__   // if dindex.hpp hasn't been included yet...
+#define __DINDEX_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "files.hpp"
+#include <stdint.h>
+
+#define GROS_ACL_INDEX    0x2000    // f_acl bit 13: the directory has a hashed index
+#define GROS_DINDEX_MIN   64        // entries a directory has when it is indexed
+#define GROS_DINDEX_MAGIC 0x78646e49 // "Indx"
+
+// the root block of the index is kept in the unused tail of the name of
+// the directory's "." entry, which is always its first
+#define GROS_DINDEX_ROOT_AT ( FILENAME_MAX_LENGTH - sizeof( int ) )
+
+typedef struct _dindexentry {
+    uint32_t hash;      /* hash of the name, see gros_dindex_hash */
+    int      slot;      /* position of the entry in the directory */
+    int      child;     /* in an index node, the node below; unused in a leaf */
+} DIndexEntry;
+
+#define GROS_DINDEX_FANOUT ( ( BLOCK_SIZE - 4 * sizeof( int ) ) / sizeof( DIndexEntry ) )
+
+/**
+ * A block of the index: a B+tree on ( hash, slot ). Leaves point at
+ *  directory entries and are chained in key order; an index node holds the
+ *  smallest key below each of its children. The root never moves: when it
+ *  is split, its entries move to a new block under it.
+ */
+typedef struct _dindexnode {
+    uint32_t    magic;      /* GROS_DINDEX_MAGIC */
+    int         level;      /* 0 for a leaf */
+    int         count;      /* entries in use */
+    int         next;       /* next leaf, -1 after the last; unused in index nodes */
+    DIndexEntry entries[ GROS_DINDEX_FANOUT ];
+} DIndexNode;
+
+/**
+ * Returns the hash a name is indexed under (FNV-1a).
+ *
+ * @param const char * name   The name of a directory entry
+ */
+uint32_t gros_dindex_hash( const char * name );
+
+/**
+ * Indexes every entry of directory `dir`, so lookups, inserts and removals
+ *  read a few blocks of the index instead of the whole directory, and
+ *  marks it with GROS_ACL_INDEX. Returns 0 or -errno.
+ *
+ * @param Disk  * disk   The disk holding the file system
+ * @param Inode * dir    The directory to index
+ */
+int gros_dindex_build( Disk * disk, Inode * dir );
+
+/**
+ * Finds `name` in indexed directory `dir`. Returns the position of its
+ *  entry, filling in `entry`, or -ENOENT.
+ *
+ * @param Disk       * disk    The disk holding the file system
+ * @param Inode      * dir     The directory to look in
+ * @param const char * name    The name to find
+ * @param DirEntry   * entry   Set to the directory entry
+ */
+int gros_dindex_lookup( Disk * disk, Inode * dir, const char * name, DirEntry * entry );
+
+/**
+ * Adds the entry for `name` at position `slot` of indexed directory `dir`
+ *  to its index. Returns 0 or -errno.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param Inode      * dir    The directory
+ * @param const char * name   Name of the entry
+ * @param int          slot   Position of the entry in the directory
+ */
+int gros_dindex_insert( Disk * disk, Inode * dir, const char * name, int slot );
+
+/**
+ * Takes the entry for `name` at position `slot` of indexed directory `dir`
+ *  out of its index. Returns 0 or -ENOENT if it is not indexed there.
+ *
+ * @param Disk       * disk   The disk holding the file system
+ * @param Inode      * dir    The directory
+ * @param const char * name   Name of the entry
+ * @param int          slot   Position of the entry in the directory
+ */
+int gros_dindex_remove( Disk * disk, Inode * dir, const char * name, int slot );
+
+/**
+ * Frees the index of directory `dir` and clears GROS_ACL_INDEX. Does
+ *  nothing if it has none.
+ *
+ * @param Disk  * disk   The disk holding the file system
+ * @param Inode * dir    The directory
+ */
+void gros_dindex_drop( Disk * disk, Inode * dir );
+
+#endif
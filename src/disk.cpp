@@ -3,57 +3,767 @@
  */
 
 #include "disk.hpp"
+#include "cache.hpp"
+#include "journal.hpp"
+#include "csum.hpp"
+#include "dedup.hpp"
+#include "freemap.hpp"
+#include "prealloc.hpp"
+#include "icache.hpp"
+#include "dcache.hpp"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <vector>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
 
 /**
- * Returns a new instance of a disk emulator residing in memory
- *  Disk size will be EMULATOR_SIZE defined in "grosfs.h"
- *  Disk * mem will be a char array of EMULATOR_SIZE items
+ * Reads exactly `len` bytes at byte offset `offset` of `fd` into `buf`,
+ *  retrying on short transfers and interrupted calls. pread does not move
+ *  the shared file offset, so concurrent callers never race on a seek.
+ *  Returns 0 on success, -errno on failure or -EIO if the file ends early.
+ *
+ * @param int    fd      The file descriptor to read from
+ * @param char * buf     Destination for the read data
+ * @param size_t len     Number of bytes to read
+ * @param off_t  offset  Byte offset into the file to start reading from
  */
-Disk * gros_open_disk() {
-    int    result;
+int gros_pread_full( int fd, char * buf, size_t len, off_t offset ) {
+    ssize_t n;
+
+    while( len > 0 ) {
+        n = pread( fd, buf, len, offset );
+        if( n < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -errno;
+        }
+        if( n == 0 )
+            return -EIO;    // unexpected end of file
+        buf    += n;
+        len    -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Writes exactly `len` bytes from `buf` at byte offset `offset` of `fd`,
+ *  retrying on short transfers and interrupted calls.
+ *  Returns 0 on success, -errno on failure.
+ *
+ * @param int          fd      The file descriptor to write to
+ * @param const char * buf     The data to write
+ * @param size_t       len     Number of bytes to write
+ * @param off_t        offset  Byte offset into the file to start writing at
+ */
+int gros_pwrite_full( int fd, const char * buf, size_t len, off_t offset ) {
+    ssize_t n;
+
+    while( len > 0 ) {
+        n = pwrite( fd, buf, len, offset );
+        if( n < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -errno;
+        }
+        if( n == 0 )
+            return -EIO;
+        buf    += n;
+        len    -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+
+/**
+ * Transfers exactly the bytes described by `iov` at byte offset `offset`
+ *  of `fd` with preadv/pwritev, retrying on short transfers and interrupted
+ *  calls. The iovec array is consumed in the process.
+ *  Returns 0 on success, -errno on failure or -EIO if the file ends early.
+ *
+ * @param int            fd       The file descriptor to transfer with
+ * @param struct iovec * iov      The buffers to transfer
+ * @param int            iovcnt   Number of entries in `iov`
+ * @param off_t          offset   Byte offset into the file
+ * @param int            write    Nonzero to write, zero to read
+ */
+static int gros_prwv_full( int fd, struct iovec * iov, int iovcnt, off_t offset,
+                           int write ) {
+    ssize_t n;
+
+    while( iovcnt > 0 ) {
+        n = write ? pwritev( fd, iov, iovcnt, offset )
+                  : preadv( fd, iov, iovcnt, offset );
+        if( n < 0 ) {
+            if( errno == EINTR )
+                continue;
+            return -errno;
+        }
+        if( n == 0 )
+            return -EIO;
+        offset += n;
+        // skip over the buffers that were completely transferred
+        while( iovcnt > 0 && ( size_t ) n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if( iovcnt > 0 ) {
+            iov->iov_base = ( char * ) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * The file backend: blocks live in an image file, reached with
+ *  preadv/pwritev, a memory mapping or an io_uring depending on the engine.
+ */
+static int gros_file_readv( Disk * disk, struct iovec * iov, int iovcnt,
+                            int64_t offset ) {
+    return gros_prwv_full( disk->fd, iov, iovcnt, ( off_t ) offset, 0 );
+}
+
+
+static int gros_file_writev( Disk * disk, struct iovec * iov, int iovcnt,
+                             int64_t offset ) {
+    return gros_prwv_full( disk->fd, iov, iovcnt, ( off_t ) offset, 1 );
+}
+
+
+static int gros_file_sync( Disk * disk ) {
+    int status;
+
+    if( disk->map != NULL )
+        status = msync( disk->map, ( size_t ) disk->size, MS_SYNC );
+    else
+        status = fsync( disk->fd );
+    return status == 0 ? 0 : -errno;
+}
+
+
+static int gros_file_discard( Disk * disk, int64_t offset, int64_t len ) {
+    char         zeros[ BLOCK_SIZE ];
+    struct iovec iov[ GROS_MAX_IOV ];
+    int          iovcnt;
+    int          status;
+
+    if( fallocate( disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   ( off_t ) offset, ( off_t ) len ) == 0 )
+        return 0;
+    if( errno != EOPNOTSUPP && errno != ENOSYS )
+        return -errno;
+    // the host file system cannot punch holes: zero the blocks instead
+    std::memset( zeros, 0, BLOCK_SIZE );
+    while( len > 0 ) {
+        for( iovcnt = 0; iovcnt < GROS_MAX_IOV && len > 0; iovcnt++ ) {
+            iov[ iovcnt ].iov_base = zeros;
+            iov[ iovcnt ].iov_len  = BLOCK_SIZE;
+            len -= BLOCK_SIZE;
+        }
+        if( ( status = gros_prwv_full( disk->fd, iov, iovcnt, ( off_t ) offset, 1 ) ) < 0 )
+            return status;
+        offset += ( int64_t ) iovcnt * BLOCK_SIZE;
+    }
+    return 0;
+}
+
+
+static void gros_file_close( Disk * disk ) {
+    gros_set_engine( disk, GROS_IO_PREAD ); // unmaps, drains and flushes
+    close( disk->fd );
+}
+
+
+static const DiskOps gros_file_ops = {
+    "file", gros_file_readv, gros_file_writev, gros_file_sync, gros_file_discard,
+    gros_file_close
+};
+
+
+/**
+ * The RAM backend: blocks live in anonymous memory, exposed through
+ *  disk->map so the mapped fast paths apply to it as well.
+ */
+static int gros_ram_readv( Disk * disk, struct iovec * iov, int iovcnt,
+                           int64_t offset ) {
+    int i;
+
+    for( i = 0; i < iovcnt; offset += iov[ i++ ].iov_len )
+        std::memcpy( iov[ i ].iov_base, disk->map + offset, iov[ i ].iov_len );
+    return 0;
+}
+
+
+static int gros_ram_writev( Disk * disk, struct iovec * iov, int iovcnt,
+                            int64_t offset ) {
+    int i;
+
+    for( i = 0; i < iovcnt; offset += iov[ i++ ].iov_len )
+        std::memcpy( disk->map + offset, iov[ i ].iov_base, iov[ i ].iov_len );
+    return 0;
+}
+
+
+static int gros_ram_sync( Disk * disk ) {
+    return 0;   // nothing is ever durable
+}
+
+
+static int gros_ram_discard( Disk * disk, int64_t offset, int64_t len ) {
+    // dropped anonymous pages come back zeroed
+    if( madvise( disk->map + offset, ( size_t ) len, MADV_DONTNEED ) != 0 )
+        std::memset( disk->map + offset, 0, ( size_t ) len );
+    return 0;
+}
+
+
+static void gros_ram_close( Disk * disk ) {
+    munmap( disk->map, ( size_t ) disk->size );
+}
+
+
+static const DiskOps gros_ram_ops = {
+    "ram", gros_ram_readv, gros_ram_writev, gros_ram_sync, gros_ram_discard,
+    gros_ram_close
+};
+
+
+/**
+ * The latency backend: a wrapper that delays each request before handing
+ *  it to the disk underneath.
+ */
+typedef struct _slowdisk {
+    Disk *          lower;
+    int64_t         latency_ns;
+    int64_t         bandwidth;   /* bytes per second, 0 = unlimited */
+    int64_t         busy_until;  /* when the channel finishes its backlog */
+    pthread_mutex_t lock;
+} SlowDisk;
+
+
+static int64_t gros_now_ns() {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t ) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Sleeps for as long as a request moving `len` bytes would take: it waits
+ *  for the transfers queued before it, moves its own bytes, then pays the
+ *  fixed per-request latency.
+ */
+static void gros_slow_wait( SlowDisk * slow, struct iovec * iov, int iovcnt ) {
+    struct timespec ts;
+    int64_t         len = 0;
+    int64_t         now;
+    int64_t         done;
+    int             i;
+
+    for( i = 0; i < iovcnt; i++ )
+        len += ( int64_t ) iov[ i ].iov_len;
+
+    now = gros_now_ns();
+    pthread_mutex_lock( &slow->lock );
+    if( slow->bandwidth > 0 ) {
+        slow->busy_until  = std::max( now, slow->busy_until );
+        slow->busy_until += len * 1000000000LL / slow->bandwidth;
+        done = slow->busy_until;
+    } else {
+        done = now;
+    }
+    pthread_mutex_unlock( &slow->lock );
+    done += slow->latency_ns;
+
+    while( ( now = gros_now_ns() ) < done ) {
+        ts.tv_sec  = ( time_t ) ( ( done - now ) / 1000000000LL );
+        ts.tv_nsec = ( long ) ( ( done - now ) % 1000000000LL );
+        nanosleep( &ts, NULL );
+    }
+}
+
+
+static int gros_slow_readv( Disk * disk, struct iovec * iov, int iovcnt,
+                            int64_t offset ) {
+    SlowDisk * slow = ( SlowDisk * ) disk->priv;
+
+    gros_slow_wait( slow, iov, iovcnt );
+    return slow->lower->ops->readv( slow->lower, iov, iovcnt, offset );
+}
+
+
+static int gros_slow_writev( Disk * disk, struct iovec * iov, int iovcnt,
+                             int64_t offset ) {
+    SlowDisk * slow = ( SlowDisk * ) disk->priv;
+
+    gros_slow_wait( slow, iov, iovcnt );
+    return slow->lower->ops->writev( slow->lower, iov, iovcnt, offset );
+}
+
+
+static int gros_slow_sync( Disk * disk ) {
+    SlowDisk * slow = ( SlowDisk * ) disk->priv;
+
+    gros_slow_wait( slow, NULL, 0 );
+    return gros_sync_disk( slow->lower );
+}
+
+
+static int gros_slow_discard( Disk * disk, int64_t offset, int64_t len ) {
+    SlowDisk * slow = ( SlowDisk * ) disk->priv;
+
+    gros_slow_wait( slow, NULL, 0 );
+    return slow->lower->ops->discard( slow->lower, offset, len );
+}
+
+
+static void gros_slow_close( Disk * disk ) {
+    SlowDisk * slow = ( SlowDisk * ) disk->priv;
+
+    gros_close_disk( slow->lower );
+    pthread_mutex_destroy( &slow->lock );
+    delete slow;
+}
+
+
+static const DiskOps gros_slow_ops = {
+    "latency", gros_slow_readv, gros_slow_writev, gros_slow_sync, gros_slow_discard,
+    gros_slow_close
+};
+
+
+/**
+ * Returns a new Disk of `size` bytes on the given backend, with no engine,
+ *  cache, journal, checksums, deduplication, free space summary,
+ *  reservations, inode or dentry cache, ring or superblock set up yet.
+ */
+static Disk * gros_new_disk( const DiskOps * ops, int64_t size ) {
     Disk * disk = new Disk();
-    disk->size  = EMULATOR_SIZE;
-    disk->isnew = access( "grosfs.filesystem", F_OK ) == -1;
-    disk->fd = open( "grosfs.filesystem", O_RDWR | O_CREAT, ( mode_t ) 0600 );
+
+    disk->isnew  = true;
+    disk->size   = size - size % BLOCK_SIZE;
+    disk->ops    = ops;
+    disk->priv   = NULL;
+    disk->fd     = -1;
+    disk->engine = GROS_IO_PREAD;
+    disk->map    = NULL;
+    disk->ring   = NULL;
+    disk->cache     = NULL;
+    disk->journal   = NULL;
+    disk->readahead = NULL;
+    disk->csum      = NULL;
+    disk->dedup     = NULL;
+    disk->freemap   = NULL;
+    disk->prealloc  = NULL;
+    disk->icache    = NULL;
+    disk->dcache    = NULL;
+    disk->super       = NULL;
+    disk->super_dirty = 0;
+    disk->discard_epoch = 0;
+    pthread_mutex_init( &disk->super_lock, NULL );
+    pthread_mutex_init( &disk->alloc_lock, NULL );
+    pthread_mutex_init( &disk->discard_lock, NULL );
+    pthread_mutex_init( &disk->ring_lock, NULL );
+    return disk;
+}
+
+
+/**
+ * Returns a new instance of a disk emulator backed by "grosfs.filesystem"
+ *  in the current directory. A new image will be EMULATOR_SIZE bytes.
+ */
+Disk * gros_open_disk() {
+    return gros_open_image( GROS_DEFAULT_IMAGE, EMULATOR_SIZE );
+}
+
+
+/**
+ * Returns a new instance of a disk emulator backed by the image file at
+ *  `path`. If the image does not exist yet it is created and extended to
+ *  `size` bytes (rounded down to a whole number of blocks); otherwise the
+ *  size of the existing image is used and `size` is ignored.
+ *
+ * @param const char * path   Path to the image file
+ * @param int64_t      size   Size in bytes of a newly created image
+ */
+Disk * gros_open_image( const char * path, int64_t size ) {
+    struct stat stbuf;
+    Disk *      disk = gros_new_disk( &gros_file_ops, size );
+
+    disk->isnew  = access( path, F_OK ) == -1;
+    disk->fd = open( path, O_RDWR | O_CREAT, ( mode_t ) 0600 );
     if( disk->fd == -1 ) {
         printf( "Could not open device for file system..\n" );
         exit( 1 );
     }
-    result = ( int ) lseek( disk->fd, EMULATOR_SIZE, SEEK_SET );
-    if( result == -1 ) {
+
+    if( ! disk->isnew && fstat( disk->fd, &stbuf ) == 0 && stbuf.st_size > 1 ) {
+        // existing images carry one trailing byte past the last block
+        size = stbuf.st_size - 1;
+    }
+    disk->size = size - size % BLOCK_SIZE;
+    if( disk->size < BLOCK_SIZE ) {
         close( disk->fd );
-        printf( "Could not extend file to desired file system size..\n" );
+        printf( "File system size is too small..\n" );
         exit( 1 );
     }
-    result = ( int ) write( disk->fd, "", 1 );
-    if( result < 0 ) {
+
+    // writing a single byte past the end extends the file to the desired
+    // size; the image stays sparse until blocks are written
+    if( disk->isnew && gros_pwrite_full( disk->fd, "", 1, disk->size ) < 0 ) {
         close( disk->fd );
-        printf( "Could not write a byte to the end of the file..\n" );
+        printf( "Could not extend file to desired file system size..\n" );
         exit( 1 );
-    };
+    }
     return disk;
 }
 
 
 /**
- * Effectively closes a connection to the disk emulator, deleting
- * memory in disk->mem and deleting the Disk object.
+ * Returns a new disk that keeps its blocks in `size` bytes of memory
+ *  (rounded down to whole blocks). Nothing survives gros_close_disk. The
+ *  memory is exposed the same way as a memory mapped image, so the disk
+ *  reports GROS_IO_MMAP and cannot switch engines. Returns NULL if the
+ *  memory cannot be allocated.
+ *
+ * @param int64_t size   Size of the disk in bytes
+ */
+Disk * gros_open_ram( int64_t size ) {
+    Disk * disk = gros_new_disk( &gros_ram_ops, size );
+    void * mem;
+
+    if( disk->size < BLOCK_SIZE ) {
+        delete disk;
+        return NULL;
+    }
+    // anonymous pages start out zeroed and are only backed once touched
+    mem = mmap( NULL, ( size_t ) disk->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if( mem == MAP_FAILED ) {
+        delete disk;
+        return NULL;
+    }
+    disk->map    = ( char * ) mem;
+    disk->engine = GROS_IO_MMAP;
+    return disk;
+}
+
+
+/**
+ * Returns a new disk that forwards every transfer to `lower` after a delay
+ *  modelling a real device: `latency_us` microseconds per request, plus the
+ *  time to move the data at `bandwidth` bytes per second (0 for no limit).
+ *  Transfers share the bandwidth as if they went through a single channel.
+ *  Closing the returned disk closes `lower` too.
+ *
+ * @param Disk  * lower        The disk that actually holds the blocks
+ * @param int64_t latency_us   Fixed cost of each request, in microseconds
+ * @param int64_t bandwidth    Transfer rate in bytes per second, 0 = unlimited
+ */
+Disk * gros_open_latency( Disk * lower, int64_t latency_us, int64_t bandwidth ) {
+    Disk *     disk = gros_new_disk( &gros_slow_ops, lower->size );
+    SlowDisk * slow = new SlowDisk();
+
+    slow->lower      = lower;
+    slow->latency_ns = latency_us * 1000;
+    slow->bandwidth  = bandwidth;
+    slow->busy_until = 0;
+    pthread_mutex_init( &slow->lock, NULL );
+    disk->priv  = slow;
+    disk->isnew = lower->isnew;
+    return disk;
+}
+
+
+/**
+ * Parses a human readable size such as "4096", "512K", "64M" or "100G"
+ *  into a number of bytes. Returns -EINVAL if the string is not a valid
+ *  size or the size does not fit in 64 bits.
+ *
+ * @param const char * str   The string to parse
+ */
+int64_t gros_parse_size( const char * str ) {
+    char *  end;
+    int64_t size;
+    int64_t mult = 1;
+
+    if( str == NULL || * str == '\0' )
+        return -EINVAL;
+
+    errno = 0;
+    size  = ( int64_t ) strtoll( str, &end, 10 );
+    if( errno != 0 || end == str || size < 0 )
+        return -EINVAL;
+
+    switch( * end ) {
+        case 'T': case 't': mult <<= 10; // fall through
+        case 'G': case 'g': mult <<= 10; // fall through
+        case 'M': case 'm': mult <<= 10; // fall through
+        case 'K': case 'k': mult <<= 10; end++; break;
+        case '\0': break;
+        default: return -EINVAL;
+    }
+    // a typo must not wrap around into a small size that looks valid
+    if( * end != '\0' || size > INT64_MAX / mult )
+        return -EINVAL;
+    return size * mult;
+}
+
+
+/**
+ * Effectively closes a connection to the disk emulator, dropping the cached
+ * names, saving the cached inodes, releasing the blocks reserved for growing files, writing back the
+ * superblock and freeing its block cache, discarding the blocks freed since
+ * the last sync, checkpointing its journal and deleting the Disk object.
  *
  * @param Disk * disk    The pointer to the disk to close
  */
 void gros_close_disk( Disk * disk ) {
-    close( disk->fd );
+    if( disk->dcache != NULL )
+        gros_close_dcache( disk );
+    if( disk->icache != NULL )
+        gros_close_icache( disk );
+    if( disk->prealloc != NULL )
+        gros_close_prealloc( disk );
+    gros_bwrite_super( disk );
+    if( disk->cache != NULL )
+        gros_detach_cache( disk );
+    gros_flush_discards( disk );
+    if( disk->journal != NULL )
+        gros_close_journal( disk );
+    if( disk->csum != NULL )
+        gros_close_csum( disk );
+    if( disk->dedup != NULL )
+        gros_close_dedup( disk );
+    if( disk->freemap != NULL )
+        gros_close_freemap( disk );
+    disk->ops->close( disk );
+    pthread_mutex_destroy( &disk->ring_lock );
+    pthread_mutex_destroy( &disk->discard_lock );
+    pthread_mutex_destroy( &disk->super_lock );
+    pthread_mutex_destroy( &disk->alloc_lock );
+    delete disk->super;
     delete disk;
 }
 
 
+/**
+ * Finishes a request the ring completed with result `res`: a short transfer
+ *  is completed synchronously, then the request is put on its queue's
+ *  completed list. Called with the ring lock held.
+ *
+ * @param Disk     * disk   The disk the request was submitted to
+ * @param BlockReq * req    The completed request
+ * @param int        res    Bytes transferred, or -errno
+ */
+static void gros_complete_block( Disk * disk, BlockReq * req, int res ) {
+    size_t  want = 0;
+    int     i;
+
+    for( i = 0; i < req->iovcnt; i++ )
+        want += req->iovs[ i ].iov_len;
+
+    if( res < 0 ) {
+        req->status = res;
+    } else if( ( size_t ) res < want ) {
+        // the kernel may stop early; move the rest the slow way
+        struct iovec * iov    = req->iovs;
+        int            iovcnt = req->iovcnt;
+        size_t         n      = ( size_t ) res;
+
+        while( n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        iov->iov_base = ( char * ) iov->iov_base + n;
+        iov->iov_len -= n;
+        req->status = gros_prwv_full( disk->fd, iov, iovcnt,
+                                      ( off_t ) req->block_num * BLOCK_SIZE
+                                      + res, req->write );
+    } else {
+        req->status = 0;
+    }
+
+    req->queue->inflight--;
+    req->next        = req->queue->done;
+    req->queue->done = req;
+}
+
+
+/**
+ * Moves every completion the ring has ready to its request.
+ *
+ * @param Disk * disk   The disk whose ring to reap
+ */
+static void gros_collect_ring( Disk * disk ) {
+    void * data;
+    int    res;
+
+    while( gros_uring_reap( disk->ring, &data, &res ) == 1 )
+        gros_complete_block( disk, ( BlockReq * ) data, res );
+}
+
+
+/**
+ * Queues a request on the disk's ring, reaping completions to make room
+ *  while the ring is full. Called with the ring lock held.
+ *
+ * @param Disk     * disk   The disk to submit to
+ * @param BlockReq * req    The request, with iovs and iovcnt set
+ */
+static int gros_queue_ring( Disk * disk, BlockReq * req ) {
+    int status;
+
+    while( ( status = gros_uring_queue( disk->ring, req->write, req->iovs,
+                                        req->iovcnt,
+                                        ( off_t ) req->block_num * BLOCK_SIZE,
+                                        req ) ) == -EBUSY ) {
+        if( ( status = gros_uring_submit( disk->ring, 1 ) ) < 0 )
+            return status;
+        gros_collect_ring( disk );
+    }
+    if( status == 0 )
+        req->queue->inflight++;
+    return status;
+}
+
+
+/**
+ * Waits for everything on the disk's ring to complete. Called with the
+ *  ring lock held.
+ *
+ * @param Disk * disk   The disk whose ring to drain
+ */
+static void gros_drain_ring( Disk * disk ) {
+    while( disk->ring->queued + disk->ring->inflight > 0 )
+        if( gros_uring_submit( disk->ring, 1 ) >= 0 )
+            gros_collect_ring( disk );
+}
+
+
+/**
+ * Switches the I/O engine used to move blocks to and from the image.
+ *  GROS_IO_PREAD issues one pread/pwrite per block. GROS_IO_MMAP maps the
+ *  whole image into memory so blocks can be accessed in place through
+ *  gros_block_ptr. GROS_IO_URING sends batches and gros_submit_block
+ *  requests through an io_uring. Returns 0 on success or -errno if the
+ *  engine could not be set up (e.g. io_uring is unavailable), in which case
+ *  the disk keeps its current engine. Only the file backend has engines
+ *  to switch between; other backends return -EOPNOTSUPP.
+ *
+ * @param Disk * disk     The disk to configure
+ * @param int    engine   One of the GROS_IO_* engines
+ */
+int gros_set_engine( Disk * disk, int engine ) {
+    void   * map  = NULL;
+    IORing * ring = NULL;
+
+    if( engine == disk->engine )
+        return 0;
+    if( disk->ops != &gros_file_ops )
+        return -EOPNOTSUPP;
+
+    // bring the new engine up before tearing the old one down
+    if( engine == GROS_IO_MMAP ) {
+        map = mmap( NULL, ( size_t ) disk->size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, disk->fd, 0 );
+        if( map == MAP_FAILED )
+            return -errno;
+    } else if( engine == GROS_IO_URING ) {
+        if( ( ring = gros_uring_open( disk->fd, GROS_URING_DEPTH ) ) == NULL )
+            return -errno;
+    } else if( engine != GROS_IO_PREAD ) {
+        return -EINVAL;
+    }
+
+    if( disk->map != NULL ) {
+        msync( disk->map, ( size_t ) disk->size, MS_SYNC );
+        munmap( disk->map, ( size_t ) disk->size );
+    }
+    pthread_mutex_lock( &disk->ring_lock );
+    if( disk->ring != NULL ) {
+        // completions of outstanding requests stay on their queues
+        gros_drain_ring( disk );
+        gros_uring_close( disk->ring );
+    }
+    disk->map    = ( char * ) map;
+    disk->ring   = ring;
+    disk->engine = engine;
+    pthread_mutex_unlock( &disk->ring_lock );
+    return 0;
+}
+
+
+/**
+ * Returns a pointer to the in-memory image of block `block_num`, or NULL
+ *  if the disk is not memory mapped (or the block number is out of range).
+ *  Changes made through the pointer land directly in the image, so callers
+ *  can skip the copy into a stack buffer and the matching write back.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ */
+char * gros_block_ptr( Disk * disk, int block_num ) {
+    int64_t byte_offset = ( int64_t ) block_num * BLOCK_SIZE;
+
+    if( disk->map == NULL || block_num < 0
+        || byte_offset + BLOCK_SIZE > disk->size )
+        return NULL;
+    return disk->map + byte_offset;
+}
+
+
+/**
+ * Returns a readable (and writable) image of block `block_num`: a pointer
+ *  into the mapped image when the disk is memory mapped, otherwise `buf`
+ *  after reading the block into it. Returns NULL if the block cannot be read.
+ *  Modified blocks must still be handed back to gros_write_block, which is
+ *  free when the pointer came from the mapping.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Fallback buffer of BLOCK_SIZE bytes
+ */
+char * gros_get_block( Disk * disk, int block_num, char * buf ) {
+    char * ptr = gros_block_ptr( disk, block_num );
+
+    if( ptr != NULL )
+        return ptr;
+    return gros_read_block( disk, block_num, buf ) == 0 ? buf : NULL;
+}
+
+
+/**
+ * Flushes everything written to the disk to stable storage through the
+ *  backend: msync for a memory mapped image, fsync for an image file.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk to flush
+ */
+int gros_sync_disk( Disk * disk ) {
+    return disk->ops->sync( disk );
+}
+
+
 /**
  * Read a block from the disk into a provided buffer.
  *
@@ -61,19 +771,26 @@ void gros_close_disk( Disk * disk ) {
  * @param int    block_num  Index of block to read
  * @param char * buf        Pointer to the destination for the read data
  *                        * Must be allocated to be size BLOCK_SIZE
+ * @return               0 on success, -EINVAL on a bad block number,
+ *                        or -errno if the underlying read failed
  */
 int gros_read_block( Disk * disk, int block_num, char * buf ) {
+    struct iovec iov;
+
     if( block_num < 0 )
-        return -1;
+        return -EINVAL;
 
-    int byte_offset = block_num * BLOCK_SIZE;
+    int64_t byte_offset = ( int64_t ) block_num * BLOCK_SIZE;
     if( ( byte_offset + BLOCK_SIZE ) > disk->size )
-        return -1;
+        return -EINVAL;
 
-    lseek( disk->fd, byte_offset, SEEK_SET );
-    read( disk->fd, buf, BLOCK_SIZE );
-
-    return 0;
+    if( disk->map != NULL ) {
+        std::memcpy( buf, disk->map + byte_offset, BLOCK_SIZE );
+        return 0;
+    }
+    iov.iov_base = buf;
+    iov.iov_len  = BLOCK_SIZE;
+    return disk->ops->readv( disk, &iov, 1, byte_offset );
 }
 
 
@@ -84,22 +801,284 @@ int gros_read_block( Disk * disk, int block_num, char * buf ) {
  * @param int    block_num  Index of block to write
  * @param char * buf        Pointer to the data to write
  *                        * Must be allocated to be size BLOCK_SIZE
+ * @return               0 on success, -EINVAL on a bad block number,
+ *                        or -errno if the underlying write failed
  */
 int gros_write_block( Disk * disk, int block_num, char * buf ) {
+    struct iovec iov;
+
     if( block_num < 0 )
-        return -1;
+        return -EINVAL;
 
-    int byte_offset = block_num * BLOCK_SIZE;
+    int64_t byte_offset = ( int64_t ) block_num * BLOCK_SIZE;
     if( ( byte_offset + BLOCK_SIZE ) > disk->size )
-        return -1;
+        return -EINVAL;
+
+    if( disk->map != NULL ) {
+        // callers handed a pointer from gros_block_ptr already wrote in place
+        if( buf != disk->map + byte_offset )
+            std::memcpy( disk->map + byte_offset, buf, BLOCK_SIZE );
+        return 0;
+    }
+    iov.iov_base = buf;
+    iov.iov_len  = BLOCK_SIZE;
+    return disk->ops->writev( disk, &iov, 1, byte_offset );
+}
+
 
-    lseek( disk->fd, byte_offset, SEEK_SET );
-    write( disk->fd, buf, BLOCK_SIZE );
+/**
+ * Orders block transfers by block number. Transfers of the same block keep
+ *  their relative order, so the last write to a block in a batch can be
+ *  told apart from the earlier ones.
+ */
+static bool gros_blockio_before( const BlockIO * a, const BlockIO * b ) {
+    return a->block_num < b->block_num;
+}
+
+
+/**
+ * Moves a batch of blocks between the disk and memory. Physically adjacent
+ *  blocks are merged into runs and each run is transferred with a single
+ *  preadv/pwritev call (a memcpy per block on a memory mapped disk). Under
+ *  GROS_IO_URING all runs are put in flight at once and waited for together.
+ *  Only the last write to a block in a batch goes out, so it wins whatever
+ *  order the runs complete in.
+ *
+ * @param Disk    * disk   The disk to transfer with
+ * @param BlockIO * ios    The blocks to transfer
+ * @param int       n      Number of entries in `ios`
+ * @param int       write  Nonzero to write, zero to read
+ */
+static int gros_transfer_blocks( Disk * disk, BlockIO * ios, int n, int write ) {
+    std::vector< struct iovec > iov( ( size_t ) n );
+    std::vector< BlockIO * >    order( ( size_t ) n );
+    std::vector< BlockReq >     runs;
+    BlockReq                    req;
+    BlockQueue                  queue = { 0, NULL };
+    int                         i;
+    int                         run;
+    int                         status = 0;
+    int64_t                     nblocks = disk->size / BLOCK_SIZE;
+
+    for( i = 0; i < n; i++ ) {
+        if( ios[ i ].block_num < 0 || ios[ i ].block_num >= nblocks )
+            return -EINVAL;
+        order[ i ] = &ios[ i ];
+    }
+
+    if( disk->map != NULL ) {
+        for( i = 0; i < n; i++ ) {
+            status = write ? gros_write_block( disk, ios[ i ].block_num, ios[ i ].buf )
+                           : gros_read_block( disk, ios[ i ].block_num, ios[ i ].buf );
+            if( status < 0 )
+                return status;
+        }
+        return 0;
+    }
+
+    std::stable_sort( order.begin(), order.end(), gros_blockio_before );
+    if( write ) {
+        // runs in flight together may land in any order
+        for( i = 0, run = 0; i < n; i++ )
+            if( i + 1 == n || order[ i + 1 ]->block_num != order[ i ]->block_num )
+                order[ run++ ] = order[ i ];
+        n = run;
+    }
+
+    std::memset( &req, 0, sizeof( req ) );
+    req.write = write;
+    req.queue = &queue;
+    for( i = 0; i < n; i += run ) {
+        // extend the run while the next block sits right after this one
+        run = 0;
+        do {
+            iov[ i + run ].iov_base = order[ i + run ]->buf;
+            iov[ i + run ].iov_len  = BLOCK_SIZE;
+            run++;
+        } while( i + run < n && run < GROS_MAX_IOV
+                 && order[ i + run ]->block_num
+                    == order[ i + run - 1 ]->block_num + 1 );
+
+        req.block_num = order[ i ]->block_num;
+        req.iovs      = &iov[ i ];
+        req.iovcnt    = run;
+        runs.push_back( req );
+    }
+
+    pthread_mutex_lock( &disk->ring_lock );
+    if( disk->ring == NULL ) {
+        pthread_mutex_unlock( &disk->ring_lock );
+        for( i = 0; i < ( int ) runs.size() && status == 0; i++ )
+            status = write ? disk->ops->writev( disk, runs[ i ].iovs, runs[ i ].iovcnt,
+                                                ( int64_t ) runs[ i ].block_num * BLOCK_SIZE )
+                           : disk->ops->readv( disk, runs[ i ].iovs, runs[ i ].iovcnt,
+                                               ( int64_t ) runs[ i ].block_num * BLOCK_SIZE );
+        return status;
+    }
+
+    for( i = 0; i < ( int ) runs.size(); i++ )
+        if( ( status = gros_queue_ring( disk, &runs[ i ] ) ) < 0 )
+            break;
+    // the runs live on this stack frame, so every one must be back first
+    while( queue.inflight > 0 )
+        if( gros_uring_submit( disk->ring, 1 ) >= 0 )
+            gros_collect_ring( disk );
+    pthread_mutex_unlock( &disk->ring_lock );
+    for( i = 0; i < ( int ) runs.size() && status == 0; i++ )
+        status = runs[ i ].status;
+    return status;
+}
+
+
+/**
+ * Reads a batch of blocks, each into its own buffer. Physically adjacent
+ *  blocks are read together with a single preadv call; under GROS_IO_URING
+ *  all of those reads are in flight at the same time.
+ *
+ * @param Disk    * disk   The disk to read from
+ * @param BlockIO * ios    The blocks to read and where to put them
+ * @param int       n      Number of entries in `ios`
+ * @return                 0 on success, -EINVAL if any block number is out
+ *                         of range (nothing is read), or -errno
+ */
+int gros_read_blocks( Disk * disk, BlockIO * ios, int n ) {
+    return gros_transfer_blocks( disk, ios, n, 0 );
+}
+
+
+/**
+ * Writes a batch of blocks, each from its own buffer. Physically adjacent
+ *  blocks are written together with a single pwritev call; under
+ *  GROS_IO_URING all of those writes are in flight at the same time. A
+ *  block listed more than once ends up with the data of its last entry.
+ *
+ * @param Disk    * disk   The disk to write to
+ * @param BlockIO * ios    The blocks to write and where their data is
+ * @param int       n      Number of entries in `ios`
+ * @return                 0 on success, -EINVAL if any block number is out
+ *                         of range (nothing is written), or -errno
+ */
+int gros_write_blocks( Disk * disk, BlockIO * ios, int n ) {
+    return gros_transfer_blocks( disk, ios, n, 1 );
+}
+
+
+/**
+ * Tells the backend that blocks start .. start + n - 1 hold nothing any
+ *  more. An image file has the range punched out, so it takes no space on
+ *  the host, and a RAM disk gives the pages back. The blocks read as zeros
+ *  afterwards.
+ *
+ * @param Disk * disk    The disk holding the blocks
+ * @param int    start   First block to discard
+ * @param int    n       Number of blocks to discard
+ * @return               0 on success, -EINVAL if any block is out of
+ *                       range (nothing is discarded), or -errno
+ */
+int gros_discard_blocks( Disk * disk, int start, int n ) {
+    int status;
+
+    if( start < 0 || n < 0
+        || ( int64_t ) ( start + n ) * BLOCK_SIZE > disk->size )
+        return -EINVAL;
+    if( n == 0 )
+        return 0;
+    // requests still on the ring must not land after the hole is punched
+    pthread_mutex_lock( &disk->ring_lock );
+    if( disk->ring != NULL )
+        gros_drain_ring( disk );
+    status = disk->ops->discard( disk, ( int64_t ) start * BLOCK_SIZE,
+                                 ( int64_t ) n * BLOCK_SIZE );
+    pthread_mutex_unlock( &disk->ring_lock );
+    return status;
+}
+
+
+/**
+ * Starts reading or writing `req->block_num` from or into `req->buf` and
+ *  returns without waiting for it. The request and its buffer must stay
+ *  untouched until gros_reap_blocks hands the request back from `queue`.
+ *  Under GROS_IO_URING the request is queued on the ring; on the other
+ *  engines it is carried out right away and simply waits to be reaped.
+ *  Each thread submits to a queue of its own, starting out as
+ *  { 0, NULL }, so its completions are not handed to anyone else.
+ *
+ * @param Disk       * disk    The disk to transfer with
+ * @param BlockQueue * queue   Where the request goes once complete
+ * @param BlockReq   * req     The request, with block_num, buf and write set
+ * @return                     0 if the request was accepted, -EINVAL on a
+ *                             bad block number, or -errno
+ */
+int gros_submit_block( Disk * disk, BlockQueue * queue, BlockReq * req ) {
+    int status;
+
+    if( req->block_num < 0
+        || ( int64_t ) req->block_num * BLOCK_SIZE + BLOCK_SIZE > disk->size )
+        return -EINVAL;
+
+    req->iov.iov_base = req->buf;
+    req->iov.iov_len  = BLOCK_SIZE;
+    req->iovs         = &req->iov;
+    req->iovcnt       = 1;
+    req->queue        = queue;
+    req->status       = 0;
+
+    pthread_mutex_lock( &disk->ring_lock );
+    if( disk->ring != NULL ) {
+        status = gros_queue_ring( disk, req );
+        pthread_mutex_unlock( &disk->ring_lock );
+        return status;
+    }
+    pthread_mutex_unlock( &disk->ring_lock );
 
+    req->status = req->write ? gros_write_block( disk, req->block_num, req->buf )
+                             : gros_read_block( disk, req->block_num, req->buf );
+    pthread_mutex_lock( &disk->ring_lock );
+    req->next   = queue->done;
+    queue->done = req;
+    pthread_mutex_unlock( &disk->ring_lock );
     return 0;
 }
 
 
+/**
+ * Collects completed requests from `queue`, in no particular order, with
+ *  their `status` filled in. Waits until at least `min` requests are
+ *  returned or nothing submitted to the queue is left in flight.
+ *
+ * @param Disk       * disk    The disk the requests were submitted to
+ * @param BlockQueue * queue   The queue they were submitted to
+ * @param BlockReq  ** done    Out array for up to `max` completed requests
+ * @param int          max     Size of `done`
+ * @param int          min     Number of completions to wait for
+ * @return                     Number of requests returned, or -errno
+ */
+int gros_reap_blocks( Disk * disk, BlockQueue * queue, BlockReq ** done, int max, int min ) {
+    int n      = 0;
+    int status = 0;
+
+    pthread_mutex_lock( &disk->ring_lock );
+    // get anything still queued moving before looking for completions
+    if( disk->ring != NULL && ( status = gros_uring_submit( disk->ring, 0 ) ) >= 0 )
+        gros_collect_ring( disk );
+
+    while( status >= 0 && n < max ) {
+        if( queue->done != NULL ) {
+            done[ n++ ]  = queue->done;
+            queue->done  = queue->done->next;
+            continue;
+        }
+        // completions for other queues are handed to them on the way
+        if( n >= min || disk->ring == NULL || queue->inflight == 0 )
+            break;
+        if( ( status = gros_uring_submit( disk->ring, 1 ) ) >= 0 )
+            gros_collect_ring( disk );
+    }
+    pthread_mutex_unlock( &disk->ring_lock );
+    return n > 0 || status >= 0 ? n : status;
+}
+
+
 TEST_CASE( "Disk emulator can be accessed properly", "[disk]" ) {
 
     Disk * disk = gros_open_disk();
@@ -134,6 +1113,16 @@ TEST_CASE( "Disk emulator can be accessed properly", "[disk]" ) {
         REQUIRE( ret == 0 );
     }
 
+    SECTION( "gros_read_block returns what gros_write_block wrote" ) {
+        char out[ BLOCK_SIZE ];
+        int  last = ( disk->size / BLOCK_SIZE ) - 1;
+        for( int i = 0; i < BLOCK_SIZE; i++ )
+            buf[ i ] = ( char ) ( i * 7 );
+        REQUIRE( gros_write_block( disk, last, buf ) == 0 );
+        REQUIRE( gros_read_block( disk, last, out ) == 0 );
+        REQUIRE( memcmp( buf, out, BLOCK_SIZE ) == 0 );
+    }
+
     SECTION( "gros_write_block will fail on a negative block number" ) {
         int ret = gros_write_block( disk, -1, buf );
         REQUIRE( ret != 0 );
@@ -148,6 +1137,349 @@ TEST_CASE( "Disk emulator can be accessed properly", "[disk]" ) {
     gros_close_disk( disk );
 }
 
+TEST_CASE( "Batches of blocks can be read and written", "[disk]" ) {
+    Disk *  disk = gros_open_disk();
+    char    bufs[ 6 ][ BLOCK_SIZE ];
+    char    out[ 6 ][ BLOCK_SIZE ];
+    // two adjacent runs (10-12 and 20-21) plus a lone block, out of order
+    int     blocks[ 6 ] = { 11, 20, 10, 30, 12, 21 };
+    BlockIO ios[ 6 ];
+    int     i;
+
+    for( i = 0; i < 6; i++ ) {
+        memset( bufs[ i ], 'a' + i, BLOCK_SIZE );
+        ios[ i ].block_num = blocks[ i ];
+        ios[ i ].buf       = bufs[ i ];
+    }
+    REQUIRE( gros_write_blocks( disk, ios, 6 ) == 0 );
+
+    SECTION( "Each block lands where it was asked to" ) {
+        for( i = 0; i < 6; i++ ) {
+            REQUIRE( gros_read_block( disk, blocks[ i ], out[ i ] ) == 0 );
+            REQUIRE( memcmp( out[ i ], bufs[ i ], BLOCK_SIZE ) == 0 );
+        }
+    }
+
+    SECTION( "A batch read returns each block into its own buffer" ) {
+        for( i = 0; i < 6; i++ )
+            ios[ i ].buf = out[ 5 - i ];
+        REQUIRE( gros_read_blocks( disk, ios, 6 ) == 0 );
+        for( i = 0; i < 6; i++ )
+            REQUIRE( memcmp( out[ 5 - i ], bufs[ i ], BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "A batch read through io_uring returns the same blocks" ) {
+        if( gros_set_engine( disk, GROS_IO_URING ) < 0 )
+            WARN( "io_uring unavailable, using the synchronous path" );
+        for( i = 0; i < 6; i++ )
+            ios[ i ].buf = out[ i ];
+        REQUIRE( gros_read_blocks( disk, ios, 6 ) == 0 );
+        for( i = 0; i < 6; i++ )
+            REQUIRE( memcmp( out[ i ], bufs[ i ], BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "The last write to a block listed twice wins" ) {
+        if( gros_set_engine( disk, GROS_IO_URING ) < 0 )
+            WARN( "io_uring unavailable, using the synchronous path" );
+        for( i = 0; i < 6; i++ )
+            ios[ i ].block_num = 40 + i % 2;
+        REQUIRE( gros_write_blocks( disk, ios, 6 ) == 0 );
+        REQUIRE( gros_read_block( disk, 40, out[ 0 ] ) == 0 );
+        REQUIRE( memcmp( out[ 0 ], bufs[ 4 ], BLOCK_SIZE ) == 0 );
+        REQUIRE( gros_read_block( disk, 41, out[ 1 ] ) == 0 );
+        REQUIRE( memcmp( out[ 1 ], bufs[ 5 ], BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "A batch with a bad block number is rejected" ) {
+        ios[ 3 ].block_num = -1;
+        REQUIRE( gros_read_blocks( disk, ios, 6 ) == -EINVAL );
+    }
+    gros_close_disk( disk );
+}
+
+TEST_CASE( "Block requests complete asynchronously", "[disk]" ) {
+    Disk *     disk = gros_open_disk();
+    char       bufs[ 8 ][ BLOCK_SIZE ];
+    char       in[ BLOCK_SIZE ];
+    BlockReq   reqs[ 8 ];
+    BlockReq * done[ 8 ];
+    BlockQueue queue = { 0, NULL };
+    int        seen  = 0;
+    int        i;
+    int        n;
+
+    SECTION( "Without io_uring requests are carried out on submission" ) {
+    }
+
+    SECTION( "Through io_uring requests are reaped once complete" ) {
+        if( gros_set_engine( disk, GROS_IO_URING ) < 0 )
+            WARN( "io_uring unavailable, using the synchronous path" );
+    }
+
+    for( i = 0; i < 8; i++ ) {
+        memset( bufs[ i ], 'k' + i, BLOCK_SIZE );
+        reqs[ i ].block_num = 40 + i * 3;
+        reqs[ i ].buf       = bufs[ i ];
+        reqs[ i ].write     = 1;
+        reqs[ i ].data      = &reqs[ i ];
+        REQUIRE( gros_submit_block( disk, &queue, &reqs[ i ] ) == 0 );
+    }
+    reqs[ 0 ].block_num = -1;
+    REQUIRE( gros_submit_block( disk, &queue, &reqs[ 0 ] ) == -EINVAL );
+    reqs[ 0 ].block_num = 40;
+
+    while( seen < 8 ) {
+        n = gros_reap_blocks( disk, &queue, done, 8, 1 );
+        REQUIRE( n > 0 );
+        for( i = 0; i < n; i++ ) {
+            REQUIRE( done[ i ]->status == 0 );
+            REQUIRE( done[ i ]->data == done[ i ] );
+        }
+        seen += n;
+    }
+    REQUIRE( gros_reap_blocks( disk, &queue, done, 8, 1 ) == 0 );
+    REQUIRE( queue.inflight == 0 );
+
+    for( i = 0; i < 8; i++ ) {
+        REQUIRE( gros_read_block( disk, 40 + i * 3, in ) == 0 );
+        REQUIRE( memcmp( in, bufs[ i ], BLOCK_SIZE ) == 0 );
+    }
+    gros_close_disk( disk );
+}
+
+
+typedef struct {
+    Disk * disk;
+    int    first;   /* first of the blocks to write */
+    int    seen;    /* requests reaped back, none of them another's */
+} GrosTestSubmitter;
+
+/** Writes 16 blocks through its own queue and reaps them back. */
+static void * gros_test_submitter( void * arg ) {
+    GrosTestSubmitter * t = ( GrosTestSubmitter * ) arg;
+    BlockQueue          queue = { 0, NULL };
+    BlockReq            reqs[ 16 ];
+    BlockReq *          done[ 16 ];
+    static char         buf[ BLOCK_SIZE ];
+    int                 i;
+    int                 n;
+
+    for( i = 0; i < 16; i++ ) {
+        reqs[ i ].block_num = t->first + i;
+        reqs[ i ].buf       = buf;
+        reqs[ i ].write     = 1;
+        reqs[ i ].data      = t;
+        if( gros_submit_block( t->disk, &queue, &reqs[ i ] ) < 0 )
+            return NULL;
+    }
+    while( ( n = gros_reap_blocks( t->disk, &queue, done, 16, 1 ) ) > 0 )
+        for( i = 0; i < n; i++ )
+            if( done[ i ]->data == t && done[ i ]->status == 0 )
+                t->seen++;
+    return NULL;
+}
+
+TEST_CASE( "Each submitter reaps its own requests", "[disk]" ) {
+    Disk *            disk = gros_open_disk();
+    GrosTestSubmitter t[ 4 ];
+    pthread_t         threads[ 4 ];
+    int               i;
+
+    if( gros_set_engine( disk, GROS_IO_URING ) < 0 )
+        WARN( "io_uring unavailable, using the synchronous path" );
+    for( i = 0; i < 4; i++ ) {
+        t[ i ].disk  = disk;
+        t[ i ].first = 100 + i * 16;
+        t[ i ].seen  = 0;
+        REQUIRE( pthread_create( &threads[ i ], NULL, gros_test_submitter, &t[ i ] ) == 0 );
+    }
+    for( i = 0; i < 4; i++ ) {
+        REQUIRE( pthread_join( threads[ i ], NULL ) == 0 );
+        REQUIRE( t[ i ].seen == 16 );
+    }
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "A RAM disk keeps blocks in memory", "[disk]" ) {
+    Disk * disk = gros_open_ram( 64 * BLOCK_SIZE + 100 );
+    char   buf[ BLOCK_SIZE ];
+    char   out[ BLOCK_SIZE ];
+
+    REQUIRE( disk != NULL );
+    REQUIRE( disk->isnew );
+    REQUIRE( disk->size == 64 * BLOCK_SIZE );
+    REQUIRE( disk->fd == -1 );
+    REQUIRE( gros_set_engine( disk, GROS_IO_MMAP ) == 0 );
+    REQUIRE( gros_set_engine( disk, GROS_IO_PREAD ) == -EOPNOTSUPP );
+
+    REQUIRE( gros_read_block( disk, 63, out ) == 0 );
+    REQUIRE( out[ 0 ] == 0 );
+    memset( buf, 0x42, BLOCK_SIZE );
+    REQUIRE( gros_write_block( disk, 63, buf ) == 0 );
+    REQUIRE( gros_read_block( disk, 63, out ) == 0 );
+    REQUIRE( memcmp( buf, out, BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_block_ptr( disk, 63 )[ 5 ] == 0x42 );
+    REQUIRE( gros_write_block( disk, 64, buf ) == -EINVAL );
+    REQUIRE( gros_sync_disk( disk ) == 0 );
+    gros_close_disk( disk );
+
+    REQUIRE( gros_open_ram( BLOCK_SIZE - 1 ) == NULL );
+}
+
+
+TEST_CASE( "Discarded blocks read as zeros and free their space", "[disk]" ) {
+    Disk *      disk = gros_open_image( "grosfs.discard", 64 * BLOCK_SIZE );
+    char        buf[ BLOCK_SIZE ];
+    char        out[ BLOCK_SIZE ];
+    char        zeros[ BLOCK_SIZE ];
+    struct stat before;
+    struct stat after;
+    int         i;
+
+    memset( buf, 0x5a, BLOCK_SIZE );
+    memset( zeros, 0, BLOCK_SIZE );
+    for( i = 8; i < 40; i++ )
+        REQUIRE( gros_write_block( disk, i, buf ) == 0 );
+    REQUIRE( gros_sync_disk( disk ) == 0 );
+    REQUIRE( fstat( disk->fd, &before ) == 0 );
+
+    REQUIRE( gros_discard_blocks( disk, 10, 20 ) == 0 );
+    REQUIRE( gros_discard_blocks( disk, 60, 5 ) == -EINVAL );
+    REQUIRE( gros_read_block( disk, 10, out ) == 0 );
+    REQUIRE( memcmp( out, zeros, BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_read_block( disk, 29, out ) == 0 );
+    REQUIRE( memcmp( out, zeros, BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_read_block( disk, 30, out ) == 0 );
+    REQUIRE( memcmp( out, buf, BLOCK_SIZE ) == 0 );
+
+    // the image stays the same size but holes take no space
+    REQUIRE( fstat( disk->fd, &after ) == 0 );
+    REQUIRE( after.st_size == before.st_size );
+    if( after.st_blocks >= before.st_blocks )
+        WARN( "the host file system does not punch holes" );
+    gros_close_disk( disk );
+    unlink( "grosfs.discard" );
+
+    // a RAM disk gives the memory back
+    disk = gros_open_ram( 64 * BLOCK_SIZE );
+    REQUIRE( gros_write_block( disk, 3, buf ) == 0 );
+    REQUIRE( gros_discard_blocks( disk, 3, 1 ) == 0 );
+    REQUIRE( gros_read_block( disk, 3, out ) == 0 );
+    REQUIRE( memcmp( out, zeros, BLOCK_SIZE ) == 0 );
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "A latency disk delays each request", "[disk]" ) {
+    Disk *  disk = gros_open_latency( gros_open_ram( 64 * BLOCK_SIZE ), 1000,
+                                      4 * 1024 * 1024 );
+    char    bufs[ 16 ][ BLOCK_SIZE ];
+    BlockIO ios[ 16 ];
+    int64_t start;
+    int     i;
+
+    REQUIRE( disk->size == 64 * BLOCK_SIZE );
+    REQUIRE( disk->map == NULL );
+
+    SECTION( "Each request pays the fixed latency" ) {
+        start = gros_now_ns();
+        for( i = 0; i < 10; i++ )
+            REQUIRE( gros_read_block( disk, i, bufs[ 0 ] ) == 0 );
+        // 10 x 1 ms, plus 10 x 4 KB at 4 MB/s
+        REQUIRE( gros_now_ns() - start >= 10 * 1000000LL );
+    }
+
+    SECTION( "Large transfers are limited by the bandwidth" ) {
+        for( i = 0; i < 16; i++ ) {
+            memset( bufs[ i ], i, BLOCK_SIZE );
+            ios[ i ].block_num = i;
+            ios[ i ].buf       = bufs[ i ];
+        }
+        start = gros_now_ns();
+        REQUIRE( gros_write_blocks( disk, ios, 16 ) == 0 );
+        // 64 KB at 4 MB/s take 15.6 ms
+        REQUIRE( gros_now_ns() - start >= 15 * 1000000LL );
+        REQUIRE( gros_read_block( disk, 9, bufs[ 0 ] ) == 0 );
+        REQUIRE( bufs[ 0 ][ 100 ] == 9 );
+    }
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Disk emulator can be memory mapped", "[disk]" ) {
+    Disk * disk = gros_open_disk();
+    char   buf[ BLOCK_SIZE ];
+    char   out[ BLOCK_SIZE ];
+
+    REQUIRE( gros_block_ptr( disk, 0 ) == NULL );
+    REQUIRE( gros_set_engine( disk, GROS_IO_MMAP ) == 0 );
+    REQUIRE( disk->engine == GROS_IO_MMAP );
+
+    SECTION( "Writes are visible through the block pointer" ) {
+        memset( buf, 0x3c, BLOCK_SIZE );
+        REQUIRE( gros_write_block( disk, 2, buf ) == 0 );
+        REQUIRE( memcmp( gros_block_ptr( disk, 2 ), buf, BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "Changes made in place are read back and survive unmapping" ) {
+        char * ptr = gros_block_ptr( disk, 3 );
+        REQUIRE( ptr != NULL );
+        memset( ptr, 0x7e, BLOCK_SIZE );
+        REQUIRE( gros_write_block( disk, 3, ptr ) == 0 );
+        REQUIRE( gros_sync_disk( disk ) == 0 );
+        REQUIRE( gros_set_engine( disk, GROS_IO_PREAD ) == 0 );
+        REQUIRE( gros_read_block( disk, 3, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0x7e );
+        REQUIRE( out[ BLOCK_SIZE - 1 ] == 0x7e );
+    }
+
+    SECTION( "Out of range blocks have no pointer" ) {
+        REQUIRE( gros_block_ptr( disk, -1 ) == NULL );
+        REQUIRE( gros_block_ptr( disk, ( int ) ( disk->size / BLOCK_SIZE ) ) == NULL );
+    }
+    gros_close_disk( disk );
+}
+
+TEST_CASE( "Disk emulator addresses blocks past 2 GB", "[disk]" ) {
+    const char * path = "grosfs.large.filesystem";
+    int64_t      size = ( int64_t ) 3 << 30; // 3 GB, sparse on the host
+    char         buf[ BLOCK_SIZE ];
+    char         out[ BLOCK_SIZE ];
+
+    unlink( path );
+    Disk * disk = gros_open_image( path, size );
+    REQUIRE( disk->isnew );
+    REQUIRE( disk->size == size );
+
+    int last = ( int ) ( disk->size / BLOCK_SIZE ) - 1;
+    memset( buf, 0x5a, BLOCK_SIZE );
+    REQUIRE( gros_write_block( disk, last, buf ) == 0 );
+    REQUIRE( gros_read_block( disk, last, out ) == 0 );
+    REQUIRE( memcmp( buf, out, BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_read_block( disk, last + 1, out ) != 0 );
+    gros_close_disk( disk );
+
+    // reopening an existing image keeps its size, whatever is requested
+    disk = gros_open_image( path, EMULATOR_SIZE );
+    REQUIRE( ! disk->isnew );
+    REQUIRE( disk->size == size );
+    gros_close_disk( disk );
+    unlink( path );
+}
+
+TEST_CASE( "Human readable sizes can be parsed", "[disk]" ) {
+    REQUIRE( gros_parse_size( "4096" ) == 4096 );
+    REQUIRE( gros_parse_size( "4K" ) == 4096 );
+    REQUIRE( gros_parse_size( "64M" ) == ( int64_t ) 64 << 20 );
+    REQUIRE( gros_parse_size( "100G" ) == ( int64_t ) 100 << 30 );
+    REQUIRE( gros_parse_size( "" ) == -EINVAL );
+    REQUIRE( gros_parse_size( "12Q" ) == -EINVAL );
+    REQUIRE( gros_parse_size( "-5" ) == -EINVAL );
+    REQUIRE( gros_parse_size( "99999999T" ) == -EINVAL );
+    REQUIRE( gros_parse_size( "8388607T" ) == ( int64_t ) 8388607 << 40 );
+}
+
 TEST_CASE( "Testing Catch", "[test]" ) {
     REQUIRE( 1 == 1 );
     REQUIRE( 2 == 2 );
@@ -7,34 +7,241 @@
 
 //#include "grosfs.hpp"
 #include "../include/catch.hpp"
+#include "uring.hpp"
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <set>
+#include <map>
 
 #define EMULATOR_SIZE 4194304   // 4 mb
 #define BLOCK_SIZE    4096      // 4 kb
 
+#define GROS_DEFAULT_IMAGE "grosfs.filesystem"
+
+#define GROS_MAX_IOV  256       // most blocks moved by one preadv/pwritev
+
+#define GROS_IO_PREAD 0         // one pread/pwrite per block
+#define GROS_IO_MMAP  1         // image mapped into memory
+#define GROS_IO_URING 2         // batches and async requests through io_uring
+
 #define DATA_BLOCKS   0.9       // 90% data blocks
 #define INODE_BLOCKS  0.1       // 10% inode blocks
 
+typedef struct _blockreq {
+    int                block_num; /* index of the block to transfer */
+    char             * buf;       /* BLOCK_SIZE bytes to read into or write from */
+    int                write;     /* nonzero to write, zero to read */
+    int                status;    /* once completed: 0 or -errno */
+    void             * data;      /* left alone, for the caller's bookkeeping */
+
+    // owned by the disk layer while the request is in flight
+    struct iovec       iov;
+    struct iovec     * iovs;      /* buffers to move, &iov for a single block */
+    int                iovcnt;
+    struct _blockqueue * queue;   /* where the request goes once complete */
+    struct _blockreq * next;
+} BlockReq;
+
+typedef struct _blockqueue {
+    int        inflight;  /* requests submitted but not complete yet */
+    BlockReq * done;      /* completed requests waiting for gros_reap_blocks */
+} BlockQueue;
+
+struct _cache;
+struct _csum;
+struct _dcache;
+struct _dedup;
+struct _freemap;
+struct _icache;
+struct _diskops;
+struct _journal;
+struct _prealloc;
+struct _readahead;
+struct _superblock;
+
 typedef struct _disk {
-    bool isnew;
-    int size;
-    int fd;
+    bool       isnew;
+    int64_t    size;   /* size of the image, in bytes */
+    const struct _diskops * ops; /* the backend holding the blocks */
+    void     * priv;   /* backend specific state */
+    int        fd;     /* the image file of the file backend, else -1 */
+    int        engine; /* GROS_IO_* engine used to move blocks */
+    char     * map;    /* the mapped image under GROS_IO_MMAP, else NULL */
+    IORing   * ring;   /* the ring under GROS_IO_URING, else NULL */
+    pthread_mutex_t ring_lock; /* guards `ring` and the queues of requests on it,
+                                  innermost of the disk's locks */
+    struct _cache * cache; /* block cache in front of the image, see cache.hpp */
+    struct _journal * journal; /* metadata journal, see journal.hpp */
+    struct _readahead * readahead; /* prefetching into the cache, see readahead.hpp */
+    struct _csum * csum; /* block checksums, see csum.hpp */
+    struct _dedup * dedup; /* shared data blocks, see dedup.hpp */
+    struct _freemap * freemap; /* summary of the free blocks, see freemap.hpp */
+    struct _prealloc * prealloc; /* blocks reserved for growing files, see prealloc.hpp */
+    struct _icache * icache; /* inodes kept in memory, see icache.hpp */
+    struct _dcache * dcache; /* names in directories, see dcache.hpp */
+    std::map< int, uint32_t > discards; /* freed blocks waiting to be discarded, and
+                                           the write back that frees them, see gros_bdiscard */
+    uint32_t   discard_epoch;   /* write backs that may free queued blocks so far */
+    pthread_mutex_t discard_lock; /* guards `discards` and `discard_epoch`, inside the cache lock */
+    struct _superblock * super; /* the superblock kept in memory, see gros_superblock */
+    int        super_dirty;     /* nonzero while block 0 is older than `super` */
+    pthread_mutex_t super_lock; /* serializes changes to the free inode list */
+    pthread_mutex_t alloc_lock; /* serializes changes to the block bitmaps, inside
+                                   a journal operation and outside the cache lock */
 } Disk;
 
 /**
- * Returns a new instance of a disk emulator residing in memory
- *  Disk size will be EMULATOR_SIZE defined in "grosfs.h"
- *  Disk *mem will be a char array of EMULATOR_SIZE items
+ * A block device backend. Every transfer moves whole, in range blocks, so
+ *  backends need not check bounds. Transfers return 0 or -errno and may
+ *  consume `iov`.
+ */
+typedef struct _diskops {
+    const char * name;
+    int  ( * readv )( Disk * disk, struct iovec * iov, int iovcnt, int64_t offset );
+    int  ( * writev )( Disk * disk, struct iovec * iov, int iovcnt, int64_t offset );
+    int  ( * sync )( Disk * disk );     /* make earlier writes durable */
+    int  ( * discard )( Disk * disk, int64_t offset, int64_t len ); /* drop blocks, which then read as zeros */
+    void ( * close )( Disk * disk );    /* release the backend's resources */
+} DiskOps;
+
+typedef struct _blockio {
+    int    block_num;   /* index of the block to transfer */
+    char * buf;         /* BLOCK_SIZE bytes to read into or write from */
+} BlockIO;
+
+/**
+ * Returns a new instance of a disk emulator backed by "grosfs.filesystem"
+ *  in the current directory. A new image will be EMULATOR_SIZE bytes.
  */
 Disk * gros_open_disk();
 
 /**
- * Effectively closes a connection to the disk emulator, deleting
- * memory in disk->mem and deleting the Disk object.
+ * Returns a new disk that keeps its blocks in `size` bytes of memory
+ *  (rounded down to whole blocks). Nothing survives gros_close_disk. The
+ *  memory is exposed the same way as a memory mapped image, so the disk
+ *  reports GROS_IO_MMAP and cannot switch engines. Returns NULL if the
+ *  memory cannot be allocated.
+ *
+ * @param int64_t size   Size of the disk in bytes
+ */
+Disk * gros_open_ram( int64_t size );
+
+/**
+ * Returns a new disk that forwards every transfer to `lower` after a delay
+ *  modelling a real device: `latency_us` microseconds per request, plus the
+ *  time to move the data at `bandwidth` bytes per second (0 for no limit).
+ *  Transfers share the bandwidth as if they went through a single channel.
+ *  Closing the returned disk closes `lower` too.
+ *
+ * @param Disk  * lower        The disk that actually holds the blocks
+ * @param int64_t latency_us   Fixed cost of each request, in microseconds
+ * @param int64_t bandwidth    Transfer rate in bytes per second, 0 = unlimited
+ */
+Disk * gros_open_latency( Disk * lower, int64_t latency_us, int64_t bandwidth );
+
+/**
+ * Returns a new instance of a disk emulator backed by the image file at
+ *  `path`. If the image does not exist yet it is created and extended to
+ *  `size` bytes (rounded down to a whole number of blocks); otherwise the
+ *  size of the existing image is used and `size` is ignored.
+ *
+ * @param const char * path   Path to the image file
+ * @param int64_t      size   Size in bytes of a newly created image
+ */
+Disk * gros_open_image( const char * path, int64_t size );
+
+/**
+ * Parses a human readable size such as "4096", "512K", "64M" or "100G"
+ *  into a number of bytes. Returns -EINVAL if the string is not a valid
+ *  size or the size does not fit in 64 bits.
+ *
+ * @param const char * str   The string to parse
+ */
+int64_t gros_parse_size( const char * str );
+
+/**
+ * Effectively closes a connection to the disk emulator, writing back and
+ * freeing its block cache, discarding the blocks freed since the last sync,
+ * checkpointing its journal and deleting the Disk object.
  *
  * @param Disk * disk    The pointer to the disk to close
  */
 void gros_close_disk( Disk * disk );
 
+/**
+ * Switches the I/O engine used to move blocks to and from the image.
+ *  GROS_IO_PREAD issues one pread/pwrite per block. GROS_IO_MMAP maps the
+ *  whole image into memory so blocks can be accessed in place through
+ *  gros_block_ptr. GROS_IO_URING sends batches and gros_submit_block
+ *  requests through an io_uring. Returns 0 on success or -errno if the
+ *  engine could not be set up (e.g. io_uring is unavailable), in which case
+ *  the disk keeps its current engine. Only the file backend has engines
+ *  to switch between; other backends return -EOPNOTSUPP.
+ *
+ * @param Disk * disk     The disk to configure
+ * @param int    engine   One of the GROS_IO_* engines
+ */
+int gros_set_engine( Disk * disk, int engine );
+
+/**
+ * Returns a pointer to the in-memory image of block `block_num`, or NULL
+ *  if the disk is not memory mapped (or the block number is out of range).
+ *  Changes made through the pointer land directly in the image; passing
+ *  the pointer back to gros_write_block is then a no-op.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ */
+char * gros_block_ptr( Disk * disk, int block_num );
+
+/**
+ * Returns a readable (and writable) image of block `block_num`: a pointer
+ *  into the mapped image when the disk is memory mapped, otherwise `buf`
+ *  after reading the block into it. Returns NULL if the block cannot be read.
+ *  Modified blocks must still be handed back to gros_write_block, which is
+ *  free when the pointer came from the mapping.
+ *
+ * @param Disk * disk       The disk containing the block
+ * @param int    block_num  Index of the block
+ * @param char * buf        Fallback buffer of BLOCK_SIZE bytes
+ */
+char * gros_get_block( Disk * disk, int block_num, char * buf );
+
+/**
+ * Flushes everything written to the disk to stable storage through the
+ *  backend: msync for a memory mapped image, fsync for an image file.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk to flush
+ */
+int gros_sync_disk( Disk * disk );
+
+/**
+ * Reads exactly `len` bytes at byte offset `offset` of `fd` into `buf`,
+ *  retrying on short transfers and interrupted calls.
+ *  Returns 0 on success, -errno on failure or -EIO if the file ends early.
+ *
+ * @param int    fd      The file descriptor to read from
+ * @param char * buf     Destination for the read data
+ * @param size_t len     Number of bytes to read
+ * @param off_t  offset  Byte offset into the file to start reading from
+ */
+int gros_pread_full( int fd, char * buf, size_t len, off_t offset );
+
+/**
+ * Writes exactly `len` bytes from `buf` at byte offset `offset` of `fd`,
+ *  retrying on short transfers and interrupted calls.
+ *  Returns 0 on success, -errno on failure.
+ *
+ * @param int          fd      The file descriptor to write to
+ * @param const char * buf     The data to write
+ * @param size_t       len     Number of bytes to write
+ * @param off_t        offset  Byte offset into the file to start writing at
+ */
+int gros_pwrite_full( int fd, const char * buf, size_t len, off_t offset );
+
 /**
  * Read a block from the disk into a provided buffer.
  *
@@ -42,6 +249,8 @@ void gros_close_disk( Disk * disk );
  * @param int    block_num  Index of block to read
  * @param char * buf        Pointer to the destination for the read data
  *                          * Must be allocated to be size BLOCK_SIZE
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          or -errno if the underlying read failed
  */
 int gros_read_block( Disk * disk, int block_num, char * buf );
 
@@ -52,7 +261,79 @@ int gros_read_block( Disk * disk, int block_num, char * buf );
  * @param int    block_num  Index of block to write
  * @param char * buf        Pointer to the data to write
  *                          * Must be allocated to be size BLOCK_SIZE
+ * @return                  0 on success, -EINVAL on a bad block number,
+ *                          or -errno if the underlying write failed
  */
 int gros_write_block( Disk * disk, int block_num, char * buf );
 
+/**
+ * Reads a batch of blocks, each into its own buffer. Physically adjacent
+ *  blocks are read together with a single preadv call.
+ *
+ * @param Disk    * disk   The disk to read from
+ * @param BlockIO * ios    The blocks to read and where to put them
+ * @param int       n      Number of entries in `ios`
+ * @return                 0 on success, -EINVAL if any block number is out
+ *                         of range (nothing is read), or -errno
+ */
+int gros_read_blocks( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Writes a batch of blocks, each from its own buffer. Physically adjacent
+ *  blocks are written together with a single pwritev call. A block listed
+ *  more than once ends up with the data of its last entry.
+ *
+ * @param Disk    * disk   The disk to write to
+ * @param BlockIO * ios    The blocks to write and where their data is
+ * @param int       n      Number of entries in `ios`
+ * @return                 0 on success, -EINVAL if any block number is out
+ *                         of range (nothing is written), or -errno
+ */
+int gros_write_blocks( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Tells the backend that blocks start .. start + n - 1 hold nothing any
+ *  more. An image file has the range punched out, so it takes no space on
+ *  the host, and a RAM disk gives the pages back. The blocks read as zeros
+ *  afterwards.
+ *
+ * @param Disk * disk    The disk holding the blocks
+ * @param int    start   First block to discard
+ * @param int    n       Number of blocks to discard
+ * @return               0 on success, -EINVAL if any block is out of
+ *                       range (nothing is discarded), or -errno
+ */
+int gros_discard_blocks( Disk * disk, int start, int n );
+
+/**
+ * Starts reading or writing `req->block_num` from or into `req->buf` and
+ *  returns without waiting for it. The request and its buffer must stay
+ *  untouched until gros_reap_blocks hands the request back from `queue`.
+ *  Under GROS_IO_URING the request is queued on the ring; on the other
+ *  engines it is carried out right away and simply waits to be reaped.
+ *  Each thread submits to a queue of its own, starting out as
+ *  { 0, NULL }, so its completions are not handed to anyone else.
+ *
+ * @param Disk       * disk    The disk to transfer with
+ * @param BlockQueue * queue   Where the request goes once complete
+ * @param BlockReq   * req     The request, with block_num, buf and write set
+ * @return                     0 if the request was accepted, -EINVAL on a
+ *                             bad block number, or -errno
+ */
+int gros_submit_block( Disk * disk, BlockQueue * queue, BlockReq * req );
+
+/**
+ * Collects completed requests from `queue`, in no particular order, with
+ *  their `status` filled in. Waits until at least `min` requests are
+ *  returned or nothing submitted to the queue is left in flight.
+ *
+ * @param Disk       * disk    The disk the requests were submitted to
+ * @param BlockQueue * queue   The queue they were submitted to
+ * @param BlockReq  ** done    Out array for up to `max` completed requests
+ * @param int          max     Size of `done`
+ * @param int          min     Number of completions to wait for
+ * @return                     Number of requests returned, or -errno
+ */
+int gros_reap_blocks( Disk * disk, BlockQueue * queue, BlockReq ** done, int max, int min );
+
 #endif
@@ -3,7 +3,16 @@
  */
 
 #include "files.hpp"
+#include "readahead.hpp"
+#include "compress.hpp"
+#include "dedup.hpp"
+#include "prealloc.hpp"
+#include "icache.hpp"
+#include "dcache.hpp"
+#include "dindex.hpp"
+#include "journal.hpp"
 #include <cstring>
+#include <vector>
 
 
 /**
@@ -31,7 +40,143 @@ void gros_mkroot( Disk * disk ) {
     gros_save_inode( disk, root_i );
     gros_i_write( disk, root_i, ( char * ) &(root[0]), sizeof( DirEntry ), 0 );
     gros_i_write( disk, root_i, ( char * ) &(root[1]), sizeof( DirEntry ), sizeof( DirEntry ) );
-    delete root_i;
+    gros_put_inode( disk, root_i );
+}
+
+
+/**
+ * Finds the first entry of directory `dir` named `name`, or if `name` is
+ *  NULL the first one for inode `inode_num`, reading the directory
+ *  through. Returns its position, filling in `entry`, or -1.
+ *
+ * @param Disk     * disk       Disk containing the file system
+ * @param Inode    * dir        The directory to search
+ * @param char     * name       Name of the entry, or NULL
+ * @param int        inode_num  Inode of the entry if `name` is NULL
+ * @param DirEntry * entry      Set to the entry found
+ */
+static int gros_dir_scan( Disk * disk, Inode * dir, const char * name, int inode_num,
+                          DirEntry * entry ) {
+    DirIter    iter;
+    DirEntry * e;
+
+    gros_opendir( dir, &iter, 0 );
+    while( ( e = gros_readdir( disk, &iter ) ) != NULL ) {
+        if( name != NULL ? ! strncmp( e->filename, name, FILENAME_MAX_LENGTH )
+                         : e->inode_num == inode_num ) {
+            * entry = * e;
+            return iter.offset / ( int ) sizeof( DirEntry ) - 1;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Finds `name` in directory `dir`, through its hashed index if it has one
+ *  and by reading it through otherwise. Returns the position of its
+ *  entry, filling in `entry`, or -1.
+ *
+ * @param Disk     * disk    Disk containing the file system
+ * @param Inode    * dir     The directory to search
+ * @param char     * name    Name of the entry
+ * @param DirEntry * entry   Set to the entry found
+ */
+static int gros_dir_find( Disk * disk, Inode * dir, const char * name, DirEntry * entry ) {
+    int slot;
+
+    if( ! ( dir->f_acl & GROS_ACL_INDEX ) )
+        return gros_dir_scan( disk, dir, name, -1, entry );
+    slot = gros_dindex_lookup( disk, dir, name, entry );
+    return slot < 0 ? -1 : slot;
+}
+
+
+/**
+ * Appends `direntry` to directory `dir`. A directory with a hashed index
+ *  has it added there too; one reaching GROS_DINDEX_MIN entries gets an
+ *  index. Returns 0 or -EIO.
+ *
+ * @param Disk     * disk       Disk containing the file system
+ * @param Inode    * dir        The directory
+ * @param DirEntry * direntry   The entry to add
+ */
+int gros_dir_add( Disk * disk, Inode * dir, DirEntry * direntry ) {
+    int slot = dir->f_size / ( int ) sizeof( DirEntry );
+
+    if( gros_i_write( disk, dir, ( char * ) direntry, sizeof( DirEntry ), dir->f_size )
+        != ( int ) sizeof( DirEntry ) )
+        return -EIO;
+    if( dir->f_acl & GROS_ACL_INDEX ) {
+        // a directory whose index falls behind is read through instead
+        if( gros_dindex_insert( disk, dir, direntry->filename, slot ) < 0 )
+            gros_dindex_drop( disk, dir );
+    } else if( slot + 1 >= GROS_DINDEX_MIN ) {
+        gros_dindex_build( disk, dir );
+    }
+    gros_dcache_forget( disk, dir->f_inode_num, direntry->filename );
+    return 0;
+}
+
+
+/**
+ * Removes the entry named `name` at position `slot` from directory `dir`:
+ *  the last entry moves into its place and the directory shrinks by one.
+ *
+ * @param Disk  * disk   Disk containing the file system
+ * @param Inode * dir    The directory
+ * @param int     slot   Position of the entry to remove
+ * @param char  * name   Its name
+ */
+static void gros_dir_remove( Disk * disk, Inode * dir, int slot, const char * name ) {
+    DirEntry last;
+    int      nslots  = dir->f_size / ( int ) sizeof( DirEntry );
+    bool     indexed = ( dir->f_acl & GROS_ACL_INDEX ) != 0;
+
+    if( indexed && gros_dindex_remove( disk, dir, name, slot ) < 0 ) {
+        gros_dindex_drop( disk, dir );
+        indexed = false;
+    }
+    if( slot != nslots - 1 ) {
+        gros_i_read( disk, dir, ( char * ) &last, sizeof( DirEntry ),
+                     ( nslots - 1 ) * sizeof( DirEntry ) );
+        gros_i_write( disk, dir, ( char * ) &last, sizeof( DirEntry ),
+                      slot * sizeof( DirEntry ) );
+        if( indexed
+            && ( gros_dindex_remove( disk, dir, last.filename, nslots - 1 ) < 0
+                 || gros_dindex_insert( disk, dir, last.filename, slot ) < 0 ) )
+            gros_dindex_drop( disk, dir );
+    }
+    gros_i_truncate( disk, dir, dir->f_size - sizeof( DirEntry ) );
+    gros_dcache_forget( disk, dir->f_inode_num, name );
+}
+
+
+/**
+ * Returns the inode number `name` stands for in directory `dir_num`, or -1
+ *  if there is no such entry. The dentry cache answers when it can;
+ *  otherwise the directory is searched and what it says is remembered.
+ *
+ * @param Disk * disk     Disk containing the file system
+ * @param int    dir_num  Inode number of the directory
+ * @param char * name     Name of the entry
+ */
+static int gros_lookup( Disk * disk, int dir_num, const char * name ) {
+    DirEntry   entry;
+    Inode    * dir;
+    int64_t    seq;
+    int        inode_num = -1;
+
+    if( gros_dcache_lookup( disk, dir_num, name, &inode_num ) )
+        return inode_num;
+    seq = gros_dcache_seq( disk );
+    if( ( dir = gros_get_inode( disk, dir_num ) ) == NULL )
+        return -1;
+    if( gros_dir_find( disk, dir, name, &entry ) >= 0 )
+        inode_num = entry.inode_num;
+    gros_put_inode( disk, dir );
+    gros_dcache_add( disk, dir_num, name, inode_num, seq );
+    return inode_num;
 }
 
 
@@ -42,44 +187,23 @@ void gros_mkroot( Disk * disk ) {
  * @param char * path  Path to the file, starting from root "/"
  */
 int gros_namei( Disk * disk, const char * path ) {
-    char     * filename;
-    Inode    * dir;
-    DirEntry * direntry = NULL;
-    DirEntry * tmp = NULL;
+    char * copy;
+    char * filename;
+    char * rest;
+    int    inode_num = 0; // start at root
 
     if ( ! strcmp( path, "/" ) || ! strcmp( path, "" )) {
         return 0;
     }
 
-    const char * target = strrchr( path, '/' ) + 1; // get filename this way
-
-    // start at root
-    dir      = gros_get_inode( disk, 0 );
-    // parse name from path
-    filename = strdup( path );
-    filename = strtok( filename, "/" );
-
-    gros_readdir_r( disk, dir, NULL, &direntry);
-    // traverse directory for filename in path
-    while( direntry != NULL && filename ) {
-        gros_readdir_r( disk, dir, direntry, &tmp);
-        if( ! strcmp( direntry -> filename, filename ) ) {
-            dir      = gros_get_inode( disk, direntry->inode_num );
-            filename = strtok( NULL, "/" );
-            if (filename) {
-                gros_readdir_r( disk, dir, NULL, &direntry );
-            }
-        } else {
-            direntry = tmp;
-        }
-    }
-
-    if ( ! direntry ) return -1;
-    if ( ! strcmp( direntry->filename, target ) ) {
-        return dir->f_inode_num;
-    } else {
-        return -1;
-    }
+    // resolve one name at a time
+    copy = strdup( path );
+    for( filename = strtok_r( copy, "/", &rest );
+         filename != NULL && inode_num >= 0;
+         filename = strtok_r( NULL, "/", &rest ) )
+        inode_num = gros_lookup( disk, inode_num, filename );
+    free( copy );
+    return inode_num;
 }
 
 
@@ -111,8 +235,15 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
     int        * siblock = NULL;     /* buffer to store indirects */
     int        * diblock = NULL;     /* buffer to store indirects */
     int        * tiblock = NULL;     /* buffer to store indirects */
-    Superblock * superblock = new Superblock(); /* reference to a superblock */
+    Superblock * superblock;         /* reference to a superblock */
     int          is_first;
+    int          n_ios      = 0;     /* number of data blocks queued in ios */
+    BlockIO    * ios;                /* data blocks to fetch in one batch */
+    char       * head       = NULL;  /* bounce buffer for a partial first block */
+    char       * tail       = NULL;  /* bounce buffer for a partial last block */
+    int          head_len   = 0;
+    int          tail_len   = 0;
+    int          tail_pos   = 0;
 
     file_size = inode->f_size;
     // by default, the double indirect block we gros_read from is the one given in
@@ -125,9 +256,11 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
     // if we don't have to read, don't gros_read. ¯\_(ツ)_/¯
     if( size <= 0 || offset >= file_size )
         return 0;
+    if( inode->f_acl & GROS_ACL_COMPRESS )
+        return gros_z_read( disk, inode, buf, size, offset );
 
     // get the superblock so we can get the data we need about the file system
-    gros_read_block( disk, 0, ( char * ) superblock );
+    superblock      = gros_superblock( disk );
     block_size      = superblock->fs_block_size;
     // the number of indirects a block can have
     n_indirects     = block_size / sizeof( int );
@@ -135,6 +268,12 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
     // this is the file's n-th block that we will gros_read
     cur_block       = offset / block_size;
     is_first        = 1;
+    ios             = new BlockIO[ size / block_size + 2 ];
+
+    // lets read-ahead spot a sequential reader and fetch what comes next
+    gros_readahead( disk, inode, cur_block,
+                    ( std::min( offset + size, file_size ) - 1 ) / block_size
+                    - cur_block + 1 );
 
     // while we have more bytes in the file to read and have not gros_read the
     // requested amount of bytes
@@ -152,7 +291,7 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
             // if we haven't fetched the triple indirect block yet, do so now
             if( tiblock == NULL ) {
                 tiblock = new int[ n_indirects ];
-                gros_read_block( disk,
+                gros_bread( disk,
                                  inode->f_block[ TRIPLE_INDRCT ],
                                  ( char * ) tiblock );
             }
@@ -175,7 +314,7 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
             diblock = diblock == NULL ? ( new int[ n_indirects ] ) : diblock;
             if( cur_di != di ) {
                 cur_di = di;
-                gros_read_block( disk, di, ( char * ) diblock );
+                gros_bread( disk, di, ( char * ) diblock );
             }
             // subtracting n+12 to obviate lower layers of indirection
             int pos = ( block_to_read - ( n_indirects + SINGLE_INDRCT ) ) /
@@ -193,7 +332,7 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
             // if we dont' already have the single indirects loaded into memory, load it
             if( cur_si != si ) {
                 cur_si = si;
-                gros_read_block( disk, si, ( char * ) siblock );
+                gros_bread( disk, si, ( char * ) siblock );
             }
             // relative index into single indirects
             block_to_read = siblock[ block_to_read - SINGLE_INDRCT ];
@@ -204,30 +343,244 @@ int gros_i_read( Disk * disk, Inode * inode, char * buf, int size, int offset )
             block_to_read = inode->f_block[ block_to_read ];
         }
 
-        gros_read_block( disk, block_to_read, data );
-        if ( is_first == 1 ) {
-            std::memcpy( buf, data + (offset % block_size), bytes_to_read );
-            is_first = 0;
+        // whole blocks are read straight into the caller's buffer, partial
+        // ones through a bounce buffer. nothing is read until the whole
+        // request is mapped, so adjacent blocks can be fetched together
+        if( block_to_read < 0 ) {
+            // never written, reads back as zeroes
+            std::memset( buf + bytes_read, 0, bytes_to_read );
+        } else if( is_first == 1 && bytes_to_read < block_size ) {
+            head     = new char[ block_size ];
+            head_len = bytes_to_read;
+            ios[ n_ios ].block_num = block_to_read;
+            ios[ n_ios++ ].buf     = head;
+        } else if( bytes_to_read < block_size ) {
+            tail     = new char[ block_size ];
+            tail_len = bytes_to_read;
+            tail_pos = bytes_read;
+            ios[ n_ios ].block_num = block_to_read;
+            ios[ n_ios++ ].buf     = tail;
         } else {
-            std::memcpy( buf + bytes_read, data, bytes_to_read );
+            ios[ n_ios ].block_num = block_to_read;
+            ios[ n_ios++ ].buf     = buf + bytes_read;
         }
+        is_first = 0;
         bytes_read += bytes_to_read;
 
         cur_block++;
     }
 
+    if( gros_bread_blocks( disk, ios, n_ios ) < 0 ) {
+        bytes_read = 0;
+    } else {
+        if( head != NULL )
+            std::memcpy( buf, head + ( offset % block_size ), head_len );
+        if( tail != NULL )
+            std::memcpy( buf + tail_pos, tail, tail_len );
+    }
+
     // free up the resources we allocated
     if( siblock != NULL ) delete[] siblock;
     if( diblock != NULL ) delete[] diblock;
     if( tiblock != NULL ) delete[] tiblock;
+    if( head != NULL ) delete[] head;
+    if( tail != NULL ) delete[] tail;
+    delete[] ios;
 
     return bytes_read;
 }
 
 int gros_read( Disk * disk, const char * path, char * buf, int size,
                int offset ) {
-    return gros_i_read( disk, gros_get_inode( disk, gros_namei( disk, path ) ),
-                        buf, size, offset );
+    Inode * inode = gros_get_inode( disk, gros_namei( disk, path ) );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_read( disk, inode, buf, size, offset );
+    gros_put_inode( disk, inode );
+    return status;
+}
+
+
+/**
+ * Maps `n` consecutive blocks of a file, starting at its block `first`, to
+ *  the blocks on disk that hold them. Holes map to -1, and blocks of a
+ *  compressed cluster to GROS_ZBLOCK. Indirect blocks are
+ *  read through the cache, each one once per call.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file
+ * @param int     first    First block to map, relative to the file
+ * @param int     n        Number of blocks to map
+ * @param int   * blocks   Out array of `n` block numbers
+ */
+void gros_bmap_range( Disk * disk, Inode * inode, int first, int n, int * blocks ) {
+    const int n_indirects = BLOCK_SIZE / sizeof( int );
+    int       ind[ 3 ][ BLOCK_SIZE / sizeof( int ) ]; /* indirects, outermost first */
+    int       have[ 3 ] = { -1, -1, -1 };             /* which block is in ind[ i ] */
+    int       path[ 3 ];                              /* index into each level */
+    int       levels;
+    int       block;
+    int       rel;
+    int       i;
+    int       j;
+
+    for( i = 0; i < n; i++ ) {
+        rel = first + i;
+        if( rel < SINGLE_INDRCT ) {
+            blocks[ i ] = inode->f_block[ rel ];
+            continue;
+        }
+        rel -= SINGLE_INDRCT;
+        if( rel < n_indirects ) {
+            levels    = 1;
+            block     = inode->f_block[ SINGLE_INDRCT ];
+            path[ 0 ] = rel;
+        } else if( ( rel -= n_indirects ) < n_indirects * n_indirects ) {
+            levels    = 2;
+            block     = inode->f_block[ DOUBLE_INDRCT ];
+            path[ 0 ] = rel / n_indirects;
+            path[ 1 ] = rel % n_indirects;
+        } else {
+            rel      -= n_indirects * n_indirects;
+            levels    = 3;
+            block     = inode->f_block[ TRIPLE_INDRCT ];
+            path[ 0 ] = rel / ( n_indirects * n_indirects );
+            path[ 1 ] = rel / n_indirects % n_indirects;
+            path[ 2 ] = rel % n_indirects;
+        }
+        // walk down, rereading an indirect block only when it changes
+        for( j = 0; j < levels && block > 0; j++ ) {
+            if( have[ j ] != block ) {
+                if( gros_bread( disk, block, ( char * ) ind[ j ] ) < 0 ) {
+                    block = -1;
+                    break;
+                }
+                have[ j ] = block;
+                if( j + 1 < 3 )
+                    have[ j + 1 ] = -1;
+            }
+            block = ind[ j ][ path[ j ] ];
+        }
+        blocks[ i ] = block > 0 || block == GROS_ZBLOCK ? block : -1;
+    }
+}
+
+
+/**
+ * Allocates a data block to hold indirect pointers and marks every entry
+ *  in it as unallocated (-1)
+ *
+ * @param Disk * disk  Disk containing the file system
+ */
+static int gros_allocate_indirect_block( Disk * disk ) {
+    int  block_num;
+    int  i;
+    int  entries[ BLOCK_SIZE / sizeof( int ) ];
+
+    if( ( block_num = gros_allocate_data_block( disk ) ) < 0 )
+        return block_num;
+    for( i = 0; i < ( int ) ( BLOCK_SIZE / sizeof( int ) ); i++ )
+        entries[ i ] = -1;
+    gros_bwrite( disk, block_num, ( char * ) entries );
+    return block_num;
+}
+
+
+/**
+ * Returns a new data block for block `fblock` of a file: the next block of
+ *  the extent next .. next + left - 1, first allocating a new extent of up
+ *  to `want` contiguous blocks, as close after block `goal` as there is
+ *  room, if it is used up. With reservation windows the extent comes out
+ *  of the file's window, see gros_prealloc_blocks. Returns the block
+ *  number or -1 if the disk is full.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file
+ * @param int     fblock   Block of the file to allocate, relative to the file
+ * @param int   * next     First unused block of the extent
+ * @param int   * left     Number of unused blocks in the extent
+ * @param int     goal     Block the extent should preferably start at, or -1
+ * @param int     want     Blocks the caller still expects to need
+ */
+static int gros_extent_block( Disk * disk, Inode * inode, int fblock, int * next,
+                              int * left, int goal, int want ) {
+    if( * left == 0 ) {
+        if( disk->prealloc != NULL )
+            * next = gros_prealloc_blocks( disk, inode, fblock, goal, want, left );
+        else
+            * next = gros_allocate_data_blocks( disk, goal, std::max( want, 1 ), left );
+        if( * next < 0 ) {
+            * left = 0;
+            return -1;
+        }
+    }
+    ( * left )--;
+    return ( * next )++;
+}
+
+
+/**
+ * Sets the block map entry of block `fblock` of a file to `value`,
+ *  allocating the indirect blocks on the way if needed. The inode itself is
+ *  not saved. Returns 0 or -errno.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file
+ * @param int     fblock   Block to map, relative to the file
+ * @param int     value    Block number (or -1, or GROS_ZBLOCK) to map it to
+ */
+int gros_bmap_set( Disk * disk, Inode * inode, int fblock, int value ) {
+    const int n_indirects = BLOCK_SIZE / sizeof( int );
+    int       ind[ BLOCK_SIZE / sizeof( int ) ];
+    int       path[ 3 ];
+    int       levels;
+    int       holder = -1;          /* block whose entries are in ind, -1 for the inode */
+    int     * entry;
+    int       rel    = fblock;
+    int       j;
+
+    if( rel < SINGLE_INDRCT ) {
+        inode->f_block[ rel ] = value;
+        return 0;
+    }
+    rel -= SINGLE_INDRCT;
+    if( rel < n_indirects ) {
+        levels    = 1;
+        entry     = &inode->f_block[ SINGLE_INDRCT ];
+        path[ 0 ] = rel;
+    } else if( ( rel -= n_indirects ) < n_indirects * n_indirects ) {
+        levels    = 2;
+        entry     = &inode->f_block[ DOUBLE_INDRCT ];
+        path[ 0 ] = rel / n_indirects;
+        path[ 1 ] = rel % n_indirects;
+    } else {
+        rel      -= n_indirects * n_indirects;
+        levels    = 3;
+        entry     = &inode->f_block[ TRIPLE_INDRCT ];
+        path[ 0 ] = rel / ( n_indirects * n_indirects );
+        path[ 1 ] = rel / n_indirects % n_indirects;
+        path[ 2 ] = rel % n_indirects;
+    }
+
+    for( j = 0; j < levels; j++ ) {
+        if( * entry <= 0 ) {
+            // nothing is mapped below a missing indirect block
+            if( value == -1 )
+                return 0;
+            if( ( * entry = gros_allocate_indirect_block( disk ) ) < 0 )
+                return -ENOSPC;
+            if( holder >= 0 && gros_bwrite( disk, holder, ( char * ) ind ) < 0 )
+                return -EIO;
+        }
+        holder = * entry;
+        if( gros_bread( disk, holder, ( char * ) ind ) < 0 )
+            return -EIO;
+        entry = &ind[ path[ j ] ];
+    }
+    * entry = value;
+    return gros_bwrite( disk, holder, ( char * ) ind ) < 0 ? -EIO : 0;
 }
 
 
@@ -262,28 +615,47 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
     int        * siblock = NULL;
     int        * diblock = NULL;
     int        * tiblock = NULL;       /* buffers to store indirects */
-    Superblock * superblock = new Superblock(); /* reference to a superblock */
-    Inode      * tosave;
+    Superblock * superblock;           /* reference to a superblock */
     int          is_first;
     int          min_size;
-
-    file_size = inode->f_size;
-    // by default, the double indirect block we gros_write to is the one given in the
-    // inode. this will change if we are in the triple indirect block
-    di = inode->f_block[ DOUBLE_INDRCT ];
-    // by default, the single indirect block we gros_write to is the one given in the
-    // inode. this will change if we are in the double indirect block
-    si = inode->f_block[ SINGLE_INDRCT ];
+    int          n_ios         = 0;    /* number of data blocks queued in ios */
+    BlockIO    * ios;                  /* data blocks to write in one batch */
+    int        * fblocks;              /* file block each entry of ios is for */
+    char       * partial[ 2 ]  = { NULL, NULL }; /* read-modify-write buffers */
+    int          n_partial     = 0;
+    int          last_block;           /* the last block (relative to file) to gros_write */
+    int          ext_next      = -1;
+    int          ext_left      = 0;    /* unused blocks of the extent new data goes to */
+    int          ext_goal;             /* where a new extent should go */
+    int          prev          = -1;   /* disk block of the file block before cur_block */
+    int          i;
 
     // if we don't have to write, don't write. ¯\_(ツ)_/¯
     if( size <= 0 )
         return 0;
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
+    file_size = inode->f_size;
+    if( inode->f_acl & GROS_ACL_COMPRESS ) {
+        bytes_written = gros_z_write( disk, inode, buf, size, offset );
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
+        return bytes_written;
+    }
 
     // if we're writing to some offset, make sure it's that size
     gros_i_ensure_size(disk, inode, offset);
 
+    // by default, the double indirect block we gros_write to is the one given in the
+    // inode. this will change if we are in the triple indirect block. Filling
+    // the gap above may just have allocated it
+    di = inode->f_block[ DOUBLE_INDRCT ];
+    // by default, the single indirect block we gros_write to is the one given in the
+    // inode. this will change if we are in the double indirect block
+    si = inode->f_block[ SINGLE_INDRCT ];
+
     // get the superblock so we can get the data we need about the file system
-    gros_read_block( disk, 0, (char *) superblock );
+    superblock     = gros_superblock( disk );
     block_size     = superblock->fs_block_size;
 
     // the number of indirects a block can have
@@ -292,7 +664,12 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
 
     // this is the file's n-th block that we will gros_write to
     cur_block      = offset / block_size;
+    last_block     = ( offset + size - 1 ) / block_size;
     is_first       = 1;
+    if( cur_block > 0 )
+        gros_bmap_range( disk, inode, cur_block - 1, 1, &prev );
+    ios            = new BlockIO[ size / block_size + 2 ];
+    fblocks        = new int[ size / block_size + 2 ];
 
     // while we have more bytes to gros_write
     while( bytes_written < size ) {
@@ -318,12 +695,12 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
                 );
                 // if there is no triple indirect block yet, we need to allocate one
                 if( inode->f_block[ TRIPLE_INDRCT ] == -1 ) {
-                    inode->f_block[ TRIPLE_INDRCT ] = gros_allocate_data_block(
+                    inode->f_block[ TRIPLE_INDRCT ] = gros_allocate_indirect_block(
                             disk );
-                    gros_save_inode( disk, inode );
+                    gros_inode_dirty( disk, inode );
                 }
                 // gros_read the triple indirect block into tiblock
-                gros_read_block( disk, inode->f_block[ TRIPLE_INDRCT ],
+                gros_bread( disk, inode->f_block[ TRIPLE_INDRCT ],
                                  ( char * ) tiblock );
             }
 
@@ -347,11 +724,11 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
                 gros_i_ensure_size( disk, inode,
                                     ( n_indirects + SINGLE_INDRCT ) *
                                     block_size );
-                // allocate a data block and save the inode
-                inode->f_block[ DOUBLE_INDRCT ] = gros_allocate_data_block(
+                // allocate a data block; the inode is saved at the end
+                inode->f_block[ DOUBLE_INDRCT ] = gros_allocate_indirect_block(
                         disk );
                 di = inode->f_block[ DOUBLE_INDRCT ];
-                gros_save_inode( disk, inode );
+                gros_inode_dirty( disk, inode );
             }
             else if( ti_index != -1 && di == -1 ) {
                 // if we're in a double indirect block from a triple indirect, but it
@@ -366,16 +743,16 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
                                       + n_indirects + SINGLE_INDRCT ) *
                                     block_size );
                 // allocate a double indirect block and save the tiblock
-                tiblock[ ti_index ] = gros_allocate_data_block( disk );
+                tiblock[ ti_index ] = gros_allocate_indirect_block( disk );
                 di = tiblock[ ti_index ];
-                gros_write_block( disk, inode->f_block[ TRIPLE_INDRCT ],
+                gros_bwrite( disk, inode->f_block[ TRIPLE_INDRCT ],
                                   ( char * ) tiblock );
             }
 
             diblock = diblock == NULL ? ( new int[ n_indirects ] ) : diblock;
             if( cur_di != di ) {
                 cur_di = di;
-                gros_read_block( disk, di, ( char * ) diblock );
+                gros_bread( disk, di, ( char * ) diblock );
             }
             // subtracting n+12 to obviate lower layers of indirection
             di_index = ( block_to_write - ( n_indirects + SINGLE_INDRCT ) )
@@ -393,11 +770,11 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
             if( ti_index == -1 && di_index == -1 && si == -1 ) {
                 // make sure all blocks before single indirect block are filled/allocated
                 gros_i_ensure_size( disk, inode, SINGLE_INDRCT * block_size );
-                // allocate a data block and save the inode
-                inode->f_block[ SINGLE_INDRCT ] = gros_allocate_data_block(
+                // allocate a data block; the inode is saved at the end
+                inode->f_block[ SINGLE_INDRCT ] = gros_allocate_indirect_block(
                         disk );
                 si = inode->f_block[ SINGLE_INDRCT ];
-                gros_save_inode( disk, inode );
+                gros_inode_dirty( disk, inode );
             } else if( ti_index == -1 && di_index != -1 && si == -1 ) {
                 // if we're in a single indirect block from the inode's double indirect,
                 // but the single indirect block hasn't been allocated yet
@@ -411,9 +788,9 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
                           SINGLE_INDRCT ) * block_size
                 );
                 // allocate a single indirect block and save the diblock
-                diblock[ di_index ] = gros_allocate_data_block( disk );
+                diblock[ di_index ] = gros_allocate_indirect_block( disk );
                 si = diblock[ di_index ];
-                gros_write_block( disk, inode->f_block[ DOUBLE_INDRCT ],
+                gros_bwrite( disk, inode->f_block[ DOUBLE_INDRCT ],
                                   ( char * ) diblock );
             }
             else if( ti_index != -1 && di_index != -1 && si == -1 ) {
@@ -434,104 +811,123 @@ int gros_i_write( Disk * disk, Inode * inode, char * buf, int size, int offset )
                         ) * block_size
                 );
                 // allocate a single indirect block and save the diblock
-                diblock[ di_index ] = gros_allocate_data_block( disk );
+                diblock[ di_index ] = gros_allocate_indirect_block( disk );
                 si = diblock[ di_index ];
-                gros_write_block( disk, di, ( char * ) diblock );
+                gros_bwrite( disk, di, ( char * ) diblock );
             }
             siblock = siblock == NULL ? ( new int[ n_indirects ] ) : siblock;
             // if we dont' already have the single indirects loaded into memory, load it
             if( cur_si != si ) {
                 cur_si = si;
-                gros_read_block( disk, si, ( char * ) siblock );
+                gros_bread( disk, si, ( char * ) siblock );
             }
             // relative index into single indirects
             si_index = block_to_write - SINGLE_INDRCT;
             block_to_write = siblock[ si_index ];
         }
-        /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
-         * since ti_index, di_index, si_index, inode->f_block[13], inode->f_block[12]
-         * all start as -1 when unallocated, using max lets us do this calculation
-         * for size and include them *only* if they have been set.
-         *
-         * we use min for cur_block and 12 because cur_block might be less than 12,
-         * in which case we the rest of the calculation will evaluate to zeroes and
-         * we don't need to be writing past the direct blocks.
-         * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-         min_size = ( // number of data blocks passed in triple indirects plus
-                        std::max( ti_index, 0 ) * n_indirects_sq +
-                        // number of data blocks passed in current double indirect plus
-                        std::max( di_index, 0 ) * n_indirects +
-                        // number of data blocks passed in current single indirect plus
-                        std::max( si_index, 0 ) +
-                        // all inode double indirects plus
-                        std::max( inode->f_block[ DOUBLE_INDRCT ], 0 ) *
-                        n_indirects_sq +
-                        // all inode single indirects plus
-                        std::max( inode->f_block[ SINGLE_INDRCT ], 0 ) *
-                        n_indirects +
-                        // direct blocks
-                        std::min<int>( std::max( cur_block, 0), SINGLE_INDRCT )
-                ) * block_size;
+        // make sure all blocks before this one are filled/allocated
+        min_size = cur_block * block_size;
         gros_i_ensure_size( disk, inode, min_size );
-        tosave = gros_get_inode(disk, inode->f_inode_num);
+        // new data carries on right after the block before it, or starts
+        // out in the inode's home group
+        ext_goal = prev > 0 ? prev + 1 : gros_inode_goal( disk, inode->f_inode_num );
 
         // we're in a single indirect block and the data block hasn't been allocated
+        // new blocks come from one extent, so a growing file stays contiguous
         if( si_index != -1 && block_to_write == -1 ) {
-            siblock[ si_index ] = gros_allocate_data_block( disk );
+            siblock[ si_index ] = gros_extent_block( disk, inode, cur_block, &ext_next,
+                                                     &ext_left, ext_goal,
+                                                     last_block - cur_block + 1 );
             block_to_write = siblock[ si_index ];
-            gros_write_block( disk, si, ( char * ) siblock );
+            gros_bwrite( disk, si, ( char * ) siblock );
         }
 
         // in a direct block
         if( cur_block < SINGLE_INDRCT ) {
+            if( inode->f_block[ cur_block ] == -1 )
+                inode->f_block[ cur_block ] = gros_extent_block( disk, inode, cur_block,
+                                                                 &ext_next, &ext_left,
+                                                                 ext_goal,
+                                                                 last_block - cur_block + 1 );
             block_to_write = inode->f_block[ cur_block ];
-            if( tosave->f_block[ cur_block ] == -1 ) {
-                tosave->f_block[ cur_block ] = gros_allocate_data_block( disk );
-                block_to_write = tosave->f_block[ cur_block ];
-            }
         }
 
         // if we are writing an entire block, we don't need to gros_read, since we're
-        // overwriting it. Otherwise, we need to save what we're not writing over
-        if( bytes_to_write < block_size )
-            gros_read_block( disk, block_to_write, data );
-
-        if ( is_first == 1 ) {
-            std::memcpy( data + (offset % block_size), buf, bytes_to_write );
+        // overwriting it, and it goes straight out of the caller's buffer.
+        // Otherwise, we need to save what we're not writing over
+        if( bytes_to_write < block_size ) {
+            partial[ n_partial ] = new char[ block_size ];
+            gros_bread( disk, block_to_write, partial[ n_partial ] );
+            if ( is_first == 1 ) {
+                std::memcpy( partial[ n_partial ] + (offset % block_size), buf,
+                             bytes_to_write );
+            } else {
+                std::memcpy( partial[ n_partial ], buf + bytes_written,
+                             bytes_to_write );
+            }
+            ios[ n_ios ].buf = partial[ n_partial++ ];
         } else {
-            std::memcpy( data, buf + bytes_written, bytes_to_write );
+            ios[ n_ios ].buf = buf + bytes_written;
         }
-        gros_write_block( disk, block_to_write, data );
+        fblocks[ n_ios ]         = cur_block;
+        ios[ n_ios++ ].block_num = block_to_write;
         bytes_written += bytes_to_write;
 
-        tosave->f_size = std::max(
+        inode->f_size = std::max(
                 // if we didn't gros_write to the end of the file
-                tosave->f_size,
+                inode->f_size,
                 // if we wrote past the end of the file
                 min_size + bytes_to_write +
                 (is_first == 1 ? (offset % block_size) : 0)
         );
-        inode->f_size = tosave->f_size;
-
-        gros_save_inode( disk, tosave );
 
         is_first = 0;
+        prev     = block_to_write;
         cur_block++;
     }
 
+    // directory entries are metadata and go through the cache (and with it
+    // the journal); file data blocks already on disk are shared rather than
+    // written again, and physically adjacent ones go out together
+    if( gros_is_dir( inode->f_acl ) ) {
+        for( i = 0; i < n_ios; i++ )
+            if( gros_bwrite( disk, ios[ i ].block_num, ios[ i ].buf ) < 0 )
+                bytes_written = -EIO;
+    } else if( ( n_ios = gros_dedup_blocks( disk, inode, fblocks, ios, n_ios ) ) < 0 ) {
+        bytes_written = n_ios;
+    }
+    gros_save_inode( disk, inode );
+
+    // blocks of the extent the write did not need after all, because some
+    // of the file was already there, go back
+    while( ext_left-- > 0 )
+        gros_free_data_block( disk, ext_next++ );
+
     // free up the resources we allocated
     if( siblock != NULL ) delete [] siblock;
     if( diblock != NULL ) delete [] diblock;
     if( tiblock != NULL ) delete [] tiblock;
+    if( partial[ 0 ] != NULL ) delete [] partial[ 0 ];
+    if( partial[ 1 ] != NULL ) delete [] partial[ 1 ];
+    delete [] ios;
+    delete [] fblocks;
 
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return bytes_written;
 }
 
 
 int gros_write( Disk * disk, const char * path, char * buf, int size,
                 int offset ) {
-    return gros_i_write( disk, gros_get_inode( disk, gros_namei( disk, path ) ),
-                         buf, size, offset );
+    Inode * inode = gros_get_inode( disk, gros_namei( disk, path ) );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_write( disk, inode, buf, size, offset );
+    gros_put_inode( disk, inode );
+    return status;
 }
 
 
@@ -550,24 +946,37 @@ int gros_i_ensure_size( Disk * disk, Inode * inode, int size ) {
     int          bytes_to_allocate; /* bytes to read from cur_block */
     char       * wrdata;            /* zero-filled data to write into file */
 
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
     file_size = inode->f_size;
 
     // if we don't have to extend, don't extend. ¯\_(ツ)_/¯
-    if( file_size >= size )
-      return 0;
+    if( file_size >= size ) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
+        return 0;
+    }
 
     bytes_to_allocate = size - file_size;
     wrdata = ( char * ) calloc( bytes_to_allocate, sizeof( char ) );
     offset = file_size;
     gros_i_write( disk, inode, wrdata, bytes_to_allocate, offset );
+    free( wrdata );
 
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return bytes_to_allocate;
 }
 
 int gros_ensure_size( Disk * disk, char * path, int size ) {
-    return gros_i_ensure_size( disk,
-                               gros_get_inode( disk, gros_namei( disk, path ) ),
-                               size );
+    Inode * inode = gros_get_inode( disk, gros_namei( disk, path ) );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_ensure_size( disk, inode, size );
+    gros_put_inode( disk, inode );
+    return status;
 }
 
 
@@ -581,10 +990,17 @@ int gros_ensure_size( Disk * disk, char * path, int size ) {
  */
 int gros_i_mknod( Disk * disk, Inode * inode, const char * filename ) {
     DirEntry * direntry = new DirEntry();
-    Inode    * new_file = gros_new_inode( disk );
+    Inode    * new_file;
     int        status   = 0;
-    if (!new_file)
+
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
+    new_file = gros_new_inode_near( disk, inode->f_block[ 0 ] );
+    if (!new_file) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
     	return -1;
+    }
 
     new_file->f_links   = 1;
     direntry->inode_num = new_file->f_inode_num;
@@ -592,15 +1008,18 @@ int gros_i_mknod( Disk * disk, Inode * inode, const char * filename ) {
 
     if ( gros_save_inode( disk, new_file ) < 1 ) {
         gros_free_inode( disk, new_file );
+        gros_put_inode( disk, new_file );
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
         return -1;
     }
-    gros_i_write( disk, inode, ( char * ) direntry, sizeof( DirEntry ),
-                  inode->f_size );
+    gros_dir_add( disk, inode, direntry );
 
     delete direntry;
-    if (status != 0) return status;
     status = new_file->f_inode_num;
-    delete new_file;
+    gros_put_inode( disk, new_file );
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return status;
 }
 
@@ -623,9 +1042,14 @@ int gros_mknod( Disk * disk, const char * path ) {
         return -ENAMETOOLONG;
     }
     Inode * inode = gros_get_inode( disk, gros_namei( disk, new_path ) );
+    int     status;
 
     delete [] new_path;
-    return gros_i_mknod( disk, inode, file );
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_mknod( disk, inode, file );
+    gros_put_inode( disk, inode );
+    return status;
 }
 
 
@@ -640,10 +1064,17 @@ int gros_mknod( Disk * disk, const char * path ) {
 int gros_i_mkdir( Disk * disk, Inode * inode, const char * dirname ) {
     DirEntry   entries[ 2 ];
     DirEntry * direntry = new DirEntry();
-    Inode    * new_dir  = gros_new_inode( disk );
+    Inode    * new_dir;
     int        status   = 0;
-    if (!new_dir)
+
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
+    new_dir = gros_new_inode_near( disk, gros_dir_goal( disk, inode ) );
+    if (!new_dir) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
     	return -1;
+    }
 
     direntry->inode_num = new_dir->f_inode_num;
     strcpy( direntry->filename, dirname );
@@ -661,19 +1092,23 @@ int gros_i_mkdir( Disk * disk, Inode * inode, const char * dirname ) {
     gros_save_inode( disk, inode ) < 0 ? status = -1 : status;
     if (gros_save_inode( disk, new_dir ) < 0) {
         gros_free_inode( disk, new_dir );
+        gros_put_inode( disk, new_dir );
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
         return -1;
     }
 
     // add new direntry to current directory
-    gros_i_write( disk, inode, ( char * ) direntry, sizeof( DirEntry ),
-                  inode->f_size );
+    gros_dir_add( disk, inode, direntry );
 
     // add first entries to new directory
     gros_i_write( disk, new_dir, ( char * ) entries, 2 * sizeof( DirEntry ), 0 );
 
     delete direntry;
     status = new_dir->f_inode_num;
-    delete new_dir;
+    gros_put_inode( disk, new_dir );
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return status;
 }
 
@@ -691,9 +1126,14 @@ int gros_mkdir( Disk * disk, const char * path ) {
     // add null terminator to end of filename
     new_path[ ( int ) ( dir - path ) - 1 ] = '\0';
     Inode * inode = gros_get_inode( disk, gros_namei( disk, new_path ) );
+    int     status;
 
     delete [] new_path;
-    return gros_i_mkdir( disk, inode, dir );
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_mkdir( disk, inode, dir );
+    gros_put_inode( disk, inode );
+    return status;
 }
 
 
@@ -707,44 +1147,42 @@ int gros_mkdir( Disk * disk, const char * path ) {
 * @param char  *  dirname  Name of directory to delete
 */
 int gros_i_rmdir( Disk * disk, Inode * inode, Inode * dir_inode ) {
-    DirEntry * result;
+    DirEntry   entry;
     Inode    * child_inode;
-    int        status           = 1;
-    int        direntry_counter = 0;
-    int        direntry_size    = sizeof( DirEntry );
-    char       buf[ direntry_size ];
-
-    gros_readdir_r( disk, dir_inode, NULL, &result );
-    gros_readdir_r( disk, dir_inode, result, &result );
-    gros_readdir_r( disk, dir_inode, result, &result );
-
-    while( result ) {
-        if( gros_is_dir(
-                gros_get_inode( disk, result->inode_num )->f_acl ) ) {
-            child_inode = gros_get_inode( disk, result->inode_num );
+    int        status;
+    int        size;
+    int        slot;
+
+    gros_journal_begin( disk );
+    // parents are locked before their children
+    gros_icache_lock( disk, inode );
+    gros_icache_lock( disk, dir_inode );
+    // whatever follows "." and ".." goes, the last entry moving up each time
+    while( ( size = dir_inode->f_size ) > 2 * ( int ) sizeof( DirEntry ) ) {
+        if( gros_i_read( disk, dir_inode, ( char * ) &entry, sizeof( DirEntry ),
+                         2 * sizeof( DirEntry ) ) != ( int ) sizeof( DirEntry ) )
+            break;
+        child_inode = gros_get_inode( disk, entry.inode_num );
+        if( child_inode != NULL && gros_is_dir( child_inode->f_acl ) ) {
             gros_i_rmdir( disk, dir_inode, child_inode );
         } else {
-            gros_i_unlink( disk, dir_inode, result->filename );
+            gros_i_unlink( disk, dir_inode, entry.filename );
         }
-        gros_readdir_r( disk, dir_inode, result, &result );
+        gros_put_inode( disk, child_inode );
+        if( dir_inode->f_size >= size )
+            break;
     }
 
-    gros_readdir_r( disk, inode, NULL, &result );
-    while( result && status ) {
-        if( result->inode_num == dir_inode->f_inode_num ) {
-            gros_i_read( disk, inode, buf, direntry_size,
-                         inode->f_size - direntry_size );
-            gros_i_write( disk, inode, buf, direntry_size,
-                          direntry_counter * direntry_size );
-            status = 0;
-        }
-        direntry_counter++;
-        gros_readdir_r( disk, inode, result, &result );
-    }
-    gros_i_truncate( disk, inode, inode->f_size - direntry_size );
+    slot   = gros_dir_scan( disk, inode, NULL, dir_inode->f_inode_num, &entry );
+    status = slot < 0 ? -1 : 0;
+    if( slot >= 0 )
+        gros_dir_remove( disk, inode, slot, entry.filename );
+    gros_dcache_forget_dir( disk, dir_inode->f_inode_num );
     gros_free_inode( disk, dir_inode );
 
-    status ? status = -1 : status;
+    gros_icache_unlock( disk, dir_inode );
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return status;
 }
 
@@ -771,8 +1209,13 @@ int gros_rmdir( Disk * disk, const char * path ) {
     }
 
     delete [] parent_path;
-    return gros_i_rmdir( disk, gros_get_inode( disk, parent_num ),
-                         gros_get_inode( disk, inode_num ) );
+    Inode * parent = gros_get_inode( disk, parent_num );
+    Inode * dir    = gros_get_inode( disk, inode_num );
+    int     status = gros_i_rmdir( disk, parent, dir );
+
+    gros_put_inode( disk, dir );
+    gros_put_inode( disk, parent );
+    return status;
 }
 
 
@@ -784,34 +1227,34 @@ int gros_rmdir( Disk * disk, const char * path ) {
 * @param char  *  filename   Name of file to delete
 */
 int gros_i_unlink( Disk * disk, Inode * inode, const char * filename ) {
-    DirEntry * result;
+    DirEntry   entry;
     Inode    * child_inode;
-    int        direntry_counter = 0;
-    int        status           = -1;
-    int        direntry_size    = sizeof( DirEntry );
-    char       buf[ direntry_size ];
-
-    gros_readdir_r( disk, inode, NULL, &result );
-    while( result && status < 0 ) {
-        if( strcmp( result->filename, filename ) == 0 ) {
-            child_inode = gros_get_inode( disk, result->inode_num );
-            child_inode->f_links--;
-
-            if( child_inode->f_links == 0 ) {
-                gros_free_inode( disk, child_inode );
-            }
-            gros_i_read( disk, inode, buf, direntry_size,
-                         inode->f_size - direntry_size );
-            gros_i_write( disk, inode, buf, direntry_size,
-                          direntry_counter * direntry_size );
-            status = 0;
+    int        slot;
+
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
+    if( ( slot = gros_dir_find( disk, inode, filename, &entry ) ) < 0 ) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
+        return -1;
+    }
+
+    if( ( child_inode = gros_get_inode( disk, entry.inode_num ) ) != NULL ) {
+        gros_icache_lock( disk, child_inode );
+        child_inode->f_links--;
+        if( child_inode->f_links == 0 ) {
+            gros_free_inode( disk, child_inode );
+        } else {
+            gros_inode_dirty( disk, child_inode );
         }
-        direntry_counter++;
-        gros_readdir_r( disk, inode, result, &result );
+        gros_icache_unlock( disk, child_inode );
+        gros_put_inode( disk, child_inode );
     }
-    gros_i_truncate( disk, inode, inode->f_size - direntry_size );
+    gros_dir_remove( disk, inode, slot, filename );
 
-    return status;
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
+    return 0;
 }
 
 
@@ -827,13 +1270,26 @@ int gros_unlink( Disk * disk, const char * path ) {
     parent_num = gros_namei( disk, parent_path );
 
     delete [] parent_path;
-    return gros_i_unlink( disk, gros_get_inode( disk, parent_num ), filename );
+    Inode * parent = gros_get_inode( disk, parent_num );
+    int     status;
+
+    if( parent == NULL )
+        return -ENOENT;
+    status = gros_i_unlink( disk, parent, filename );
+    gros_put_inode( disk, parent );
+    return status;
 }
 
 
 int gros_frename( Disk * disk, const char * from, const char * to ) {
+    int status;
+
+    // the new name and the old one must not be seen apart after a crash
+    gros_journal_begin( disk );
     gros_copy( disk, from, to );
-    return gros_unlink( disk, from );
+    status = gros_unlink( disk, from );
+    gros_journal_end( disk );
+    return status;
 }
 
 
@@ -867,7 +1323,12 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
     int        * siblock = NULL;     /* buffer to store indirects */
     int        * diblock = NULL;     /* buffer to store indirects */
     int        * tiblock = NULL;     /* buffer to store indirects */
-    Superblock * superblock = new Superblock(); /* reference to a superblock */
+    Superblock * superblock;         /* reference to a superblock */
+
+    // blocks reserved past the old end of file are of no use any more
+    gros_prealloc_release( disk, inode->f_inode_num );
+    gros_journal_begin( disk );
+    gros_icache_lock( disk, inode );
 
     file_size = inode->f_size;
     // by default, the double indirect block we read from is the one given in
@@ -880,18 +1341,33 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
     // handles extending case
     gros_i_ensure_size( disk, inode, size );
     // if we the file is already `size`, then return
-    if( file_size == size )
+    if( file_size == size ) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
         return 0;
+    }
+    // a compressed cluster can only be cut once it is stored raw, and the
+    // block at the new end of file is zeroed in place
+    if( ( ( inode->f_acl & GROS_ACL_COMPRESS ) && size % GROS_ZCLUSTER_SIZE != 0
+          && gros_z_unpack( disk, inode, size ) < 0 )
+        || ( size < file_size
+             && gros_dedup_private( disk, inode, size / BLOCK_SIZE ) < 0 ) ) {
+        gros_icache_unlock( disk, inode );
+        gros_journal_end( disk );
+        return -EIO;
+    }
     offset = size;
 
     // get the superblock so we can get the data we need about the file system
-    gros_read_block( disk, 0, (char*) superblock );
+    superblock      = gros_superblock( disk );
     block_size      = superblock->fs_block_size;
     // the number of indirects a block can have
     n_indirects     = block_size / sizeof( int );
     n_indirects_sq  = n_indirects * n_indirects;
     // this is the file's n-th block that we will free
     cur_block       = offset / block_size;
+    // a new end of file on a block boundary leaves no block to cut
+    last_of_file    = offset % block_size != 0;
 
     // while we have more blocks to free
     while( !done ) {
@@ -903,7 +1379,7 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
             // if we haven't fetched the triple indirect block yet, do so now
             if( tiblock == NULL ) {
                 tiblock = new int[ n_indirects ];
-                gros_read_block( disk,
+                gros_bread( disk,
                             inode->f_block[ TRIPLE_INDRCT ],
                             ( char * ) tiblock );
             }
@@ -926,7 +1402,7 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
             diblock = diblock == NULL ? ( new int[ n_indirects ] ) : diblock;
             if( cur_di != di ) {
                 cur_di = di;
-                gros_read_block( disk, di, ( char * ) diblock );
+                gros_bread( disk, di, ( char * ) diblock );
             }
             // subtracting n+12 to obviate lower layers of indirection
             di_index = ( block_to_free - ( n_indirects + SINGLE_INDRCT ) ) /
@@ -944,7 +1420,7 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
             // if we dont' already have the single indirects loaded into memory, load it
             if( cur_si != si ) {
                 cur_si = si;
-                gros_read_block( disk, si, ( char * ) siblock );
+                gros_bread( disk, si, ( char * ) siblock );
             }
             // relative index into single indirects
             si_index = block_to_free - SINGLE_INDRCT;
@@ -963,31 +1439,32 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
             done = 1;
         }
         else if( last_of_file == 1 ) { // if this block contains the new end of file
-            bytes_to_dealloc = block_size - ( inode->f_size % block_size );
-            gros_read_block( disk, block_to_free, data );
+            bytes_to_dealloc = block_size - ( size % block_size );
+            gros_bread( disk, block_to_free, data );
             // set zeros from the new end of the file to the end of the block
-            std::memset( data + ( inode->f_size % block_size ), 0,
-                         bytes_to_dealloc );
+            std::memset( data + ( size % block_size ), 0, bytes_to_dealloc );
             // save the block back
-            gros_write_block( disk, block_to_free, data );
+            gros_bwrite( disk, block_to_free, data );
             last_of_file = 0;
         }
         else { // just free this block
-            gros_free_data_block( disk, block_to_free );
+            // a block of a compressed cluster has nothing of its own to free
+            if( block_to_free != GROS_ZBLOCK )
+                gros_free_data_block( disk, block_to_free );
 
             if( si_index != -1 ) {
                 siblock[ si_index ] = -1;
-                gros_write_block( disk, si, ( char * ) siblock );
+                gros_bwrite( disk, si, ( char * ) siblock );
 
                 if( si_index == ( n_indirects - 1 ) && di_index != -1 ) {
                     gros_free_data_block( disk, diblock[ di_index ] );
                     diblock[ di_index ] = -1;
-                    gros_write_block( disk, di, ( char * ) diblock );
+                    gros_bwrite( disk, di, ( char * ) diblock );
 
                     if( di_index == ( n_indirects - 1 ) && ti_index != -1 ) {
                         gros_free_data_block( disk, diblock[ di_index ] );
                         tiblock[ ti_index ] = -1;
-                        gros_write_block( disk, inode->f_block[ TRIPLE_INDRCT ],
+                        gros_bwrite( disk, inode->f_block[ TRIPLE_INDRCT ],
                                           ( char * ) tiblock );
                         if( ti_index == ( n_indirects - 1 ) ) {
                             gros_free_data_block( disk,
@@ -1022,65 +1499,69 @@ int gros_i_truncate( Disk * disk, Inode * inode, int size ) {
     inode->f_size = size;
         gros_save_inode( disk, inode );
 
+    gros_icache_unlock( disk, inode );
+    gros_journal_end( disk );
     return 0;
 }
 
 
 int gros_truncate( Disk * disk, const char * path, int size ) {
-    return gros_i_truncate( disk,
-                            gros_get_inode( disk, gros_namei( disk, path ) ),
-                            size );
+    Inode * inode = gros_get_inode( disk, gros_namei( disk, path ) );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_truncate( disk, inode, size );
+    gros_put_inode( disk, inode );
+    return status;
 }
 
 
 /**
- * Readdir_r takes an inode corresponding to a directory file, a pointer to the
- *  caller's "current" direntry, and returns the next direntry in the out parameter
- *  `result`. If `current` is NULL, then this returns the first direntry into
- *  `result`. If there are no more direntries, then `result` will be NULL.
- *
- * @param Disk      * disk     The disk containing the file system
- * @param Inode     * dir      Directory instance
- * @param DirEntry  * current  Where to start traversing the directory from
- * @param DirEntry ** result   Out parameter for resulting direntry
+ * Starts reading directory `dir` at byte `offset`: 0 for its first entry,
+ *  or an `iter->offset` saved from an earlier pass to carry on after the
+ *  entry last returned then.
  *
- * @returns int       status   0 upon success
+ * @param Inode   * dir      Directory instance
+ * @param DirIter * iter     The cursor to set up
+ * @param int       offset   Where to start, in bytes
  */
-int gros_readdir_r( Disk * disk, Inode * dir, DirEntry * current,
-                    DirEntry ** result ) {
-    int         direntrysize = sizeof( DirEntry );
-    int         status       = 1;
-    int         offset       = 0;
-    DirEntry *cur_de = new DirEntry();
-    DirEntry *next_de = new DirEntry();
-
-    if( ! current ) {
-        gros_i_read( disk, dir, ( char * ) cur_de, direntrysize, offset );
-        * result = cur_de;
-        status = 0;
-    }
-
-    // read DirEntries until current entry is found
-    while( status && gros_i_read( disk, dir, ( char * ) cur_de, direntrysize, offset ) ) {
-        offset += direntrysize;
-        if( ! strcmp(cur_de->filename, current->filename) ) {
-            status = 0;
-            if( gros_i_read( disk, dir, ( char * ) next_de, direntrysize, offset ) )
-                * result = next_de;
-            else * result = NULL;
-        }
-    }
-    return status;
+void gros_opendir( Inode * dir, DirIter * iter, int offset ) {
+    iter->dir    = dir;
+    iter->offset = offset;
+    iter->next   = 0;
+    iter->count  = 0;
 }
 
 
-DirEntry * gros_readdir( Disk * disk, Inode * dir ) {
-    DirEntry * result = NULL;
-
-    if( gros_is_dir( dir->f_acl ) )
-        gros_readdir_r( disk, dir, NULL, &result );
-
-    return result;
+/**
+ * Returns the next entry of the directory `iter` reads, or NULL after the
+ *  last one. Entries are read GROS_DIRITER_BATCH at a time, so a whole
+ *  directory is read once. The entry is valid until the next call, and
+ *  `iter->offset` is then the offset of the entry after it.
+ *
+ * @param Disk    * disk   The disk containing the file system
+ * @param DirIter * iter   Cursor set up by gros_opendir
+ */
+DirEntry * gros_readdir( Disk * disk, DirIter * iter ) {
+    Inode * dir = iter->dir;
+    int     n;
+
+    if( iter->next == iter->count ) {
+        // gros_i_read returns whole blocks, so stop at the end of the directory
+        if( iter->offset >= dir->f_size )
+            return NULL;
+        n = gros_i_read( disk, dir, ( char * ) iter->entries,
+                         std::min( ( int ) sizeof( iter->entries ),
+                                   dir->f_size - iter->offset ),
+                         iter->offset );
+        if( n < ( int ) sizeof( DirEntry ) )
+            return NULL;
+        iter->next  = 0;
+        iter->count = n / ( int ) sizeof( DirEntry );
+    }
+    iter->offset += sizeof( DirEntry );
+    return &iter->entries[ iter->next++ ];
 }
 
 
@@ -1098,11 +1579,17 @@ int gros_i_copy( Disk * disk, Inode * from, Inode * todir, const char * filename
     direntry->inode_num = from->f_inode_num;
     strcpy( direntry->filename, filename );
 
-    gros_i_write( disk, todir, ( char * ) direntry, sizeof( DirEntry ),
-                  todir->f_size );
+    gros_journal_begin( disk );
+    // directories are locked before the files in them
+    gros_icache_lock( disk, todir );
+    gros_icache_lock( disk, from );
+    gros_dir_add( disk, todir, direntry );
 
     from->f_links += 1;
     gros_save_inode( disk, from ) < 0 ? status = -1 : status;
+    gros_icache_unlock( disk, from );
+    gros_icache_unlock( disk, todir );
+    gros_journal_end( disk );
 
     delete direntry;
     return status;
@@ -1122,18 +1609,23 @@ int gros_copy( Disk * disk, const char * from, const char * to ) {
     int       to_dir         = gros_namei( disk, dirname );
 
     delete [] dirname;
-    return gros_i_copy(
-            disk,
-            gros_get_inode( disk, from_inode_num ),
-            gros_get_inode( disk, to_dir ),
-            filename
-    );
+    Inode   * from_inode     = gros_get_inode( disk, from_inode_num );
+    Inode   * to_inode       = gros_get_inode( disk, to_dir );
+    int       status         = -ENOENT;
+
+    if( from_inode != NULL && to_inode != NULL )
+        status = gros_i_copy( disk, from_inode, to_inode, filename );
+    gros_put_inode( disk, to_inode );
+    gros_put_inode( disk, from_inode );
+    return status;
 }
 
 int gros_i_stat( Disk * disk, int inode_num, struct stat * stbuf ) {
     short                 ftyp, usr, grp, uni;
     Inode               * inode;
     inode = gros_get_inode( disk, inode_num );
+    if( inode == NULL )
+        return -ENOENT;
     ftyp  = ( short ) ( ( inode->f_acl >> 9 ) & 0x7 );
     usr   = ( short ) ( ( inode->f_acl >> 6 ) & 0x7 );
     grp   = ( short ) ( ( inode->f_acl >> 3 ) & 0x7 );
@@ -1196,6 +1688,7 @@ int gros_i_stat( Disk * disk, int inode_num, struct stat * stbuf ) {
     stbuf->st_size    = inode->f_size;
     stbuf->st_blocks  = ( inode->f_size / BLOCK_SIZE ) + 1;
     stbuf->st_blksize = BLOCK_SIZE;
+    gros_put_inode( disk, inode );
 
     pdebug << "returning" << std::endl;
     return 0;
@@ -1203,8 +1696,10 @@ int gros_i_stat( Disk * disk, int inode_num, struct stat * stbuf ) {
 
 
 int gros_i_chmod( Disk * disk, Inode * inode, mode_t mode ) {
-    // keep file type in place
-    inode->f_acl = ( short ) ( inode->f_acl & (0x7 << 9) );
+    gros_icache_lock( disk, inode );
+    // keep file type, compression and the directory index in place
+    inode->f_acl = ( short ) ( inode->f_acl & ( (0x7 << 9) | GROS_ACL_COMPRESS
+                                                | GROS_ACL_INDEX ) );
     // user
     inode->f_acl = ( short ) ( ( mode & S_IRUSR) ? inode->f_acl | (1 << 8) : inode->f_acl );
     inode->f_acl = ( short ) ( ( mode & S_IWUSR) ? inode->f_acl | (1 << 7) : inode->f_acl );
@@ -1217,5 +1712,322 @@ int gros_i_chmod( Disk * disk, Inode * inode, mode_t mode ) {
     inode->f_acl = ( short ) ( ( mode & S_IROTH) ? inode->f_acl | (1 << 2) : inode->f_acl );
     inode->f_acl = ( short ) ( ( mode & S_IWOTH) ? inode->f_acl | (1 << 1) : inode->f_acl );
     inode->f_acl = ( short ) ( ( mode & S_IXOTH) ? inode->f_acl | (1 << 0) : inode->f_acl );
+    gros_icache_unlock( disk, inode );
     return 0;
 }
+
+
+/**
+ * Adds the indirect blocks under `block_num` (and, for a directory, the
+ *  data blocks) to `blocks`. `level` is 0 for a data block, 1 for a single
+ *  indirect block, 2 for a double and 3 for a triple indirect block.
+ */
+static void gros_meta_blocks( Disk * disk, int block_num, int level, int isdir,
+                              std::vector< int > & blocks ) {
+    int entries[ BLOCK_SIZE / sizeof( int ) ];
+    int i;
+
+    if( block_num <= 0 )
+        return;
+    if( level == 0 ) {
+        if( isdir )
+            blocks.push_back( block_num );
+        return;
+    }
+    blocks.push_back( block_num );
+    if( gros_bread( disk, block_num, ( char * ) entries ) < 0 )
+        return;
+    for( i = 0; i < ( int ) ( BLOCK_SIZE / sizeof( int ) ); i++ )
+        gros_meta_blocks( disk, entries[ i ], level - 1, isdir, blocks );
+}
+
+
+/**
+* Makes a file durable without waiting for the rest of the cache: writes
+*  back its inode, its indirect blocks (and its entries if it is a
+*  directory), together with the superblock and the block group bitmaps
+*  that account for them, then flushes the disk. File data does not sit
+*  in the cache. Returns 0 or -errno.
+*
+* @param Disk  *  disk     Disk containing the file system
+* @param Inode *  inode    Inode of the file to sync
+*/
+int gros_i_fsync( Disk * disk, Inode * inode ) {
+    std::vector< int > blocks;
+    Superblock       * superblock = gros_superblock( disk );
+    int                isdir      = gros_is_dir( inode->f_acl );
+    int                i;
+
+    if( superblock == NULL )
+        return -EIO;
+    // a change only noted in the inode cache reaches the inode block first
+    if( disk->icache != NULL && gros_icache_flush( disk, inode ) < 0 )
+        return -EIO;
+    blocks.push_back( 0 );
+    for( i = 0; i < superblock->fs_num_block_groups; i++ )
+        blocks.push_back( superblock->first_data_block + i * BLOCK_SIZE );
+    blocks.push_back( 1 + inode->f_inode_num
+                          / ( superblock->fs_block_size / superblock->fs_inode_size ) );
+
+    for( i = 0; i < SINGLE_INDRCT; i++ )
+        gros_meta_blocks( disk, inode->f_block[ i ], 0, isdir, blocks );
+    gros_meta_blocks( disk, inode->f_block[ SINGLE_INDRCT ], 1, isdir, blocks );
+    gros_meta_blocks( disk, inode->f_block[ DOUBLE_INDRCT ], 2, isdir, blocks );
+    gros_meta_blocks( disk, inode->f_block[ TRIPLE_INDRCT ], 3, isdir, blocks );
+    return gros_bsync_blocks( disk, &blocks[ 0 ], ( int ) blocks.size() );
+}
+
+
+TEST_CASE( "File data spanning many blocks reads back intact", "[files]" ) {
+    Disk  * disk = gros_open_disk();
+    gros_make_fs( disk );
+    Inode * inode  = gros_new_inode( disk );
+    // 20 blocks, starting mid-block: direct and single indirect blocks,
+    // a partial first block and a partial last block
+    int     size   = 20 * BLOCK_SIZE;
+    int     offset = 1000;
+    char  * in     = new char[ size ];
+    char  * out    = new char[ size ];
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = ( char ) ( i % 251 );
+
+    REQUIRE( gros_i_write( disk, inode, in, size, offset ) == size );
+    REQUIRE( inode->f_size == offset + size );
+
+    SECTION( "The whole range comes back" ) {
+        REQUIRE( gros_i_read( disk, inode, out, size, offset ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+    }
+
+    SECTION( "The gap before the offset reads as zeroes" ) {
+        REQUIRE( gros_i_read( disk, inode, out, offset, 0 ) == offset );
+        for( i = 0; i < offset; i++ )
+            REQUIRE( out[ i ] == 0 );
+    }
+
+    SECTION( "An unaligned slice in the indirect blocks comes back" ) {
+        int start = 13 * BLOCK_SIZE + 17;
+        REQUIRE( gros_i_read( disk, inode, out, 3 * BLOCK_SIZE, start ) == 3 * BLOCK_SIZE );
+        REQUIRE( memcmp( in + start - offset, out, 3 * BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "The inode on disk sees the new size and blocks" ) {
+        Inode * copy = gros_get_inode( disk, inode->f_inode_num );
+        REQUIRE( copy->f_size == offset + size );
+        REQUIRE( gros_i_read( disk, copy, out, size, offset ) == size );
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        delete copy;
+    }
+
+    delete [] in;
+    delete [] out;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "A growing file is stored in contiguous blocks", "[files]" ) {
+    Disk  * disk  = gros_open_disk();
+    gros_make_fs( disk );
+    Inode * inode = gros_new_inode( disk );
+    Inode * other = gros_new_inode( disk );
+    int     size  = 40 * BLOCK_SIZE;
+    char  * in    = new char[ size ];
+    int     map[ 40 ];
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = ( char ) ( i % 239 );
+
+    // a new inode comes with its first block, the rest come from the write
+    SECTION( "One large write takes a single extent" ) {
+        REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+        gros_bmap_range( disk, inode, 0, 40, map );
+        for( i = 2; i < 40; i++ )
+            REQUIRE( map[ i ] == map[ 1 ] + i - 1 );
+    }
+
+    SECTION( "Extending a file with a gap fills it from one extent" ) {
+        REQUIRE( gros_i_write( disk, other, in, 100, 0 ) == 100 );
+        REQUIRE( gros_i_write( disk, inode, in, 100, 39 * BLOCK_SIZE ) == 100 );
+        gros_bmap_range( disk, inode, 0, 40, map );
+        for( i = 2; i < 39; i++ )
+            REQUIRE( map[ i ] == map[ 1 ] + i - 1 );
+    }
+
+    SECTION( "Overwriting mapped blocks allocates nothing" ) {
+        int next;
+        REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+        next = gros_allocate_data_block( disk );
+        gros_free_data_block( disk, next );
+        REQUIRE( gros_i_write( disk, inode, in + 1, size - BLOCK_SIZE, 100 )
+                 == size - BLOCK_SIZE );
+        REQUIRE( gros_allocate_data_block( disk ) == next );
+    }
+
+    delete [] in;
+    delete inode;
+    delete other;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Files and directories are placed near related data", "[files]" ) {
+    Disk       * disk = gros_open_ram( 64 * 1024 * 1024 );
+    char         sbuf[ BLOCK_SIZE ];
+    char         data[ 3 * BLOCK_SIZE ];
+    Superblock * superblock;
+    Inode      * a;
+    Inode      * b;
+    Inode      * sub;
+    Inode      * file;
+    int          map[ 6 ];
+    int          hole;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    superblock = ( Superblock * ) gros_bget( disk, 0, sbuf );
+    std::memset( data, 'x', sizeof( data ) );
+
+    SECTION( "Top level directories spread out, lower ones stay near their parent" ) {
+        REQUIRE( gros_mkdir( disk, "/a" ) >= 0 );
+        REQUIRE( gros_mkdir( disk, "/b" ) >= 0 );
+        REQUIRE( gros_mkdir( disk, "/a/sub" ) >= 0 );
+        a   = gros_get_inode( disk, gros_namei( disk, "/a" ) );
+        b   = gros_get_inode( disk, gros_namei( disk, "/b" ) );
+        sub = gros_get_inode( disk, gros_namei( disk, "/a/sub" ) );
+        REQUIRE( ( a->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE
+                 != ( b->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE );
+        REQUIRE( ( a->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE
+                 == ( sub->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE );
+
+        // and files follow their directory
+        REQUIRE( gros_mknod( disk, "/b/file" ) >= 0 );
+        file = gros_get_inode( disk, gros_namei( disk, "/b/file" ) );
+        REQUIRE( ( file->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE
+                 == ( b->f_block[ 0 ] - superblock->first_data_block ) / BLOCK_SIZE );
+        gros_put_inode( disk, a );
+        gros_put_inode( disk, b );
+        gros_put_inode( disk, sub );
+        gros_put_inode( disk, file );
+    }
+
+    SECTION( "Appending carries on after the file's last block" ) {
+        hole = gros_allocate_data_block( disk );
+        file = gros_new_inode_near( disk, hole + 1 );
+        REQUIRE( gros_i_write( disk, file, data, sizeof( data ), 0 ) == ( int ) sizeof( data ) );
+        gros_bmap_range( disk, file, 0, 3, map );
+        REQUIRE( map[ 0 ] == hole + 1 );
+        // a hole opens up before the file, which first fit would fill
+        gros_free_data_block( disk, hole );
+        REQUIRE( gros_i_write( disk, file, data, sizeof( data ), sizeof( data ) )
+                 == ( int ) sizeof( data ) );
+        gros_bmap_range( disk, file, 0, 6, map );
+        REQUIRE( map[ 3 ] == map[ 2 ] + 1 );
+        REQUIRE( map[ 5 ] == map[ 3 ] + 2 );
+        REQUIRE( gros_allocate_data_block( disk ) == hole );
+        gros_put_inode( disk, file );
+    }
+
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "A file can be synced on its own", "[files][cache]" ) {
+    Disk  * disk = gros_open_disk();
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_bsync( disk ) == 0 );
+
+    Inode * inode = gros_new_inode( disk );
+    Inode * other = gros_new_inode( disk );
+    char    in[ 3 * BLOCK_SIZE ];
+    memset( in, 'f', sizeof( in ) );
+    REQUIRE( gros_i_write( disk, inode, in, sizeof( in ), 20 * BLOCK_SIZE ) == sizeof( in ) );
+    // an inode in a different inode block stays dirty
+    other->f_inode_num = BLOCK_SIZE / sizeof( Inode ) * 3;
+    other->f_size      = 5;
+    gros_save_inode( disk, other );
+    REQUIRE( disk->cache->ndirty > 0 );
+
+    REQUIRE( gros_i_fsync( disk, inode ) == 0 );
+    Inode   copy;
+    char    block[ BLOCK_SIZE ];
+    int     per_block = BLOCK_SIZE / sizeof( Inode );
+    REQUIRE( gros_read_block( disk, 1 + inode->f_inode_num / per_block, block ) == 0 );
+    memcpy( &copy, ( Inode * ) block + inode->f_inode_num % per_block, sizeof( Inode ) );
+    REQUIRE( copy.f_size == 23 * BLOCK_SIZE );
+    REQUIRE( copy.f_block[ SINGLE_INDRCT ] == inode->f_block[ SINGLE_INDRCT ] );
+    REQUIRE( gros_read_block( disk, 1 + other->f_inode_num / per_block, block ) == 0 );
+    memcpy( &copy, ( Inode * ) block + other->f_inode_num % per_block, sizeof( Inode ) );
+    REQUIRE( copy.f_size != 5 );
+
+    delete inode;
+    delete other;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Directories are read through in one pass", "[files]" ) {
+    Disk     * disk = gros_open_ram( 64 * 1024 * 1024 );
+    Inode    * dir;
+    Inode    * root;
+    DirIter    iter;
+    DirEntry * e;
+    char       name[ 32 ];
+    int        n = 100;
+    int        saved;
+    int        i;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( gros_mkdir( disk, "/list" ) > 0 );
+    dir = gros_get_inode( disk, gros_namei( disk, "/list" ) );
+    REQUIRE( dir != NULL );
+    for( i = 0; i < n; i++ ) {
+        snprintf( name, sizeof( name ), "file%d", i );
+        REQUIRE( gros_i_mknod( disk, dir, name ) > 0 );
+    }
+
+    SECTION( "Every entry comes back once, in order" ) {
+        gros_opendir( dir, &iter, 0 );
+        REQUIRE( ( e = gros_readdir( disk, &iter ) ) != NULL );
+        REQUIRE( strcmp( e->filename, "." ) == 0 );
+        REQUIRE( ( e = gros_readdir( disk, &iter ) ) != NULL );
+        REQUIRE( strcmp( e->filename, ".." ) == 0 );
+        for( i = 0; i < n; i++ ) {
+            snprintf( name, sizeof( name ), "file%d", i );
+            REQUIRE( ( e = gros_readdir( disk, &iter ) ) != NULL );
+            REQUIRE( strcmp( e->filename, name ) == 0 );
+            REQUIRE( iter.offset == ( int ) ( ( i + 3 ) * sizeof( DirEntry ) ) );
+        }
+        REQUIRE( gros_readdir( disk, &iter ) == NULL );
+        REQUIRE( gros_readdir( disk, &iter ) == NULL );
+    }
+
+    SECTION( "A saved offset carries on where the last pass stopped" ) {
+        gros_opendir( dir, &iter, 0 );
+        for( i = 0; i < 40; i++ )
+            REQUIRE( gros_readdir( disk, &iter ) != NULL );
+        saved = iter.offset;
+        gros_opendir( dir, &iter, saved );
+        REQUIRE( ( e = gros_readdir( disk, &iter ) ) != NULL );
+        REQUIRE( strcmp( e->filename, "file38" ) == 0 );
+        gros_opendir( dir, &iter, dir->f_size );
+        REQUIRE( gros_readdir( disk, &iter ) == NULL );
+    }
+
+    SECTION( "Links are counted through subdirectories" ) {
+        REQUIRE( ( root = gros_get_inode( disk, 0 ) ) != NULL );
+        i = gros_namei( disk, "/list/file7" );
+        REQUIRE( gros_count_links( disk, root, i, 0 ) == 1 );
+        REQUIRE( gros_copy( disk, "/list/file7", "/again" ) == 0 );
+        REQUIRE( gros_count_links( disk, root, i, 0 ) == 2 );
+        gros_put_inode( disk, root );
+    }
+
+    gros_put_inode( disk, dir );
+    gros_close_disk( disk );
+}
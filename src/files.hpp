@@ -20,6 +20,16 @@ typedef struct _direntry {
     char filename[ FILENAME_MAX_LENGTH ]; /* the filename */
 } DirEntry;
 
+#define GROS_DIRITER_BATCH 16   // entries read at a time, a block's worth
+
+typedef struct _diriter {
+    Inode    * dir;         /* the directory being read */
+    int        offset;      /* byte offset of the entry after the last one returned */
+    int        next;        /* next of the buffered entries to return */
+    int        count;       /* entries buffered */
+    DirEntry   entries[ GROS_DIRITER_BATCH ];
+} DirIter;
+
 
 /**
  * Creates the primordial directory for the file system (i.e. root "/")
@@ -58,6 +68,34 @@ int gros_read( Disk * disk, const char * path, char * buf, int size,
                int offset );
 
 
+/**
+* Maps `n` consecutive blocks of a file, starting at its block `first`, to
+*  the blocks on disk that hold them. Holes map to -1, and blocks of a
+*  compressed cluster to GROS_ZBLOCK. Indirect blocks are
+*  read through the cache, each one once per call.
+*
+* @param Disk  * disk     Disk containing the file system
+* @param Inode * inode    Inode of the file
+* @param int     first    First block to map, relative to the file
+* @param int     n        Number of blocks to map
+* @param int   * blocks   Out array of `n` block numbers
+*/
+void gros_bmap_range( Disk * disk, Inode * inode, int first, int n, int * blocks );
+
+
+/**
+* Sets the block map entry of block `fblock` of a file to `value`,
+*  allocating the indirect blocks on the way if needed. The inode itself is
+*  not saved. Returns 0 or -errno.
+*
+* @param Disk  * disk     Disk containing the file system
+* @param Inode * inode    Inode of the file
+* @param int     fblock   Block to map, relative to the file
+* @param int     value    Block number (or -1, or GROS_ZBLOCK) to map it to
+*/
+int gros_bmap_set( Disk * disk, Inode * inode, int fblock, int value );
+
+
 /**
  * Writes `size` bytes (at `offset` bytes from 0) into file
  *  corresponding to given Inode on the given disk from given buffer
@@ -161,24 +199,39 @@ int gros_truncate( Disk * disk, const char * path, int size );
 
 
 /**
- * Readdir_r takes an inode corresponding to a directory file, a pointer to the
- *  caller's `current` direntry, and returns the next direntry in the out parameter
- *  `result`. If `current` is NULL, then this returns the first direntry into
- *  `result`. If there are no more direntries, then `result` will be NULL.
+ * Starts reading directory `dir` at byte `offset`: 0 for its first entry,
+ *  or an `iter->offset` saved from an earlier pass to carry on after the
+ *  entry last returned then.
  *
- * @param Disk      * disk     The disk containing the file system
- * @param Inode     * dir      Directory instance
- * @param DirEntry  * current  Where to start traversing the directory from
- * @param DirEntry ** result   Out parameter for resulting direntry
+ * @param Inode   * dir      Directory instance
+ * @param DirIter * iter     The cursor to set up
+ * @param int       offset   Where to start, in bytes
+ */
+void gros_opendir( Inode * dir, DirIter * iter, int offset );
+
+
+/**
+ * Returns the next entry of the directory `iter` reads, or NULL after the
+ *  last one. Entries are read GROS_DIRITER_BATCH at a time, so a whole
+ *  directory is read once. The entry is valid until the next call, and
+ *  `iter->offset` is then the offset of the entry after it.
  *
- * @returns int status
+ * @param Disk    * disk   The disk containing the file system
+ * @param DirIter * iter   Cursor set up by gros_opendir
  */
-int gros_readdir_r( Disk * disk, Inode * dir, DirEntry * current,
-                    DirEntry ** result );
+DirEntry * gros_readdir( Disk * disk, DirIter * iter );
 
 
-/* @param Inode * dir       directory instance */
-DirEntry * gros_readdir( Disk * disk, Inode * dir );
+/**
+ * Appends `direntry` to directory `dir`. A directory with a hashed index
+ *  has it added there too; one reaching GROS_DINDEX_MIN entries gets an
+ *  index. Returns 0 or -EIO.
+ *
+ * @param Disk     * disk       Disk containing the file system
+ * @param Inode    * dir        The directory
+ * @param DirEntry * direntry   The entry to add
+ */
+int gros_dir_add( Disk * disk, Inode * dir, DirEntry * direntry );
 
 
 /**
@@ -211,6 +264,18 @@ int gros_i_copy( Disk * disk, Inode * from, Inode * todir, const char * name );
 /* @param char*  to     FULL path (from root "/") to the new copied file */
 int gros_copy( Disk * disk, const char * from, const char * to );
 
+/**
+* Makes a file durable without waiting for the rest of the cache: writes
+*  back its inode, its indirect blocks (and its entries if it is a
+*  directory), together with the superblock and the block group bitmaps
+*  that account for them, then flushes the disk. File data does not sit
+*  in the cache. Returns 0 or -errno.
+*
+* @param Disk  *  disk     Disk containing the file system
+* @param Inode *  inode    Inode of the file to sync
+*/
+int gros_i_fsync( Disk * disk, Inode * inode );
+
 int gros_i_stat( Disk * disk, int inode_num, struct stat * stbuf );
 int gros_i_chmod( Disk * disk, Inode * inode, mode_t mode );
 
@@ -0,0 +1,360 @@
+/**
+ * freemap.cpp
+ */
+
+#include "freemap.hpp"
+#include <algorithm>
+#include <errno.h>
+
+
+/**
+ * Sets bit `i` of `bits` to `value`.
+ */
+static void gros_fm_put( std::vector< uint64_t > & bits, int i, bool value ) {
+    if( value )
+        bits[ i / 64 ] |= ( uint64_t ) 1 << ( i % 64 );
+    else
+        bits[ i / 64 ] &= ~( ( uint64_t ) 1 << ( i % 64 ) );
+}
+
+
+/**
+ * Returns the first bit in `from` .. `to` - 1 of `bits` that is `value`,
+ *  a word at a time, or -1.
+ */
+static int gros_fm_scan( const std::vector< uint64_t > & bits, int from, int to, bool value ) {
+    uint64_t word;
+    int      w;
+    int      bit;
+
+    if( from >= to )
+        return -1;
+    w    = from / 64;
+    word = ( value ? bits[ w ] : ~bits[ w ] ) & ( ~( uint64_t ) 0 << ( from % 64 ) );
+    for( ;; ) {
+        if( word != 0 ) {
+            bit = w * 64 + __builtin_ctzll( word );
+            return bit < to ? bit : -1;
+        }
+        if( ++w * 64 >= to )
+            return -1;
+        word = value ? bits[ w ] : ~bits[ w ];
+    }
+}
+
+
+/**
+ * Returns how many bits of group `group`'s bitmap stand for blocks on the
+ *  disk.
+ */
+static int gros_fm_limit( FreeMap * fm, int group ) {
+    int start = fm->first_data_block + group * BLOCK_SIZE;
+
+    return std::max( 0, std::min( fm->group_bits, fm->num_blocks - start ) );
+}
+
+
+/**
+ * Records whether word `w` of group `group`'s bitmap `bm` is full.
+ */
+static void gros_fm_word( FreeMap * fm, int group, Bitmap * bm, int w ) {
+    int limit = gros_fm_limit( fm, group );
+    int end   = std::min( ( w + 1 ) * 64, limit );
+
+    gros_fm_put( fm->full, group * fm->words + w,
+                 gros_find_unset_bit( bm, w * 64, end ) == -1 );
+}
+
+
+/**
+ * Builds the summary of group `group` from its bitmap `bm`. Called with
+ *  the lock held, or before the summary is shared.
+ */
+static void gros_fm_group( FreeMap * fm, int group, Bitmap * bm ) {
+    int limit = gros_fm_limit( fm, group );
+    int w;
+
+    fm->free[ group ] = limit - gros_count_set_bits( bm, 0, limit );
+    gros_fm_put( fm->has_free, group, fm->free[ group ] > 0 );
+    for( w = 0; w < fm->words; w++ )
+        gros_fm_word( fm, group, bm, w );
+}
+
+
+/**
+ * Builds the summary of the `groups` block group bitmaps of `group_bits`
+ *  bits each, the first at block `first_data_block` and the others every
+ *  BLOCK_SIZE blocks after it. Every bitmap is read once. Returns 0,
+ *  -EEXIST if the disk already has a summary, -EINVAL for a bad layout or
+ *  -EIO.
+ *
+ * @param Disk * disk               The disk holding the file system
+ * @param int    first_data_block   Block holding the bitmap of group 0
+ * @param int    groups             Number of block groups
+ * @param int    group_bits         Blocks covered by one bitmap
+ */
+int gros_open_freemap( Disk * disk, int first_data_block, int groups, int group_bits ) {
+    char      buf[ BLOCK_SIZE ];
+    char    * block;
+    Bitmap  * bm;
+    FreeMap * fm;
+    int       i;
+
+    if( disk->freemap != NULL )
+        return -EEXIST;
+    if( first_data_block < 1 || groups < 1 || group_bits < 1
+        || group_bits > BLOCK_SIZE * 8 )
+        return -EINVAL;
+
+    fm                   = new FreeMap();
+    fm->first_data_block = first_data_block;
+    fm->groups           = groups;
+    fm->group_bits       = group_bits;
+    fm->words            = ( group_bits + 63 ) / 64;
+    fm->num_blocks       = ( int ) ( disk->size / BLOCK_SIZE );
+    fm->free.assign( groups, 0 );
+    fm->has_free.assign( ( groups + 63 ) / 64, 0 );
+    fm->full.assign( ( ( int64_t ) groups * fm->words + 63 ) / 64, 0 );
+
+    for( i = 0; i < groups; i++ ) {
+        // groups past the end of the disk have no bitmap and no free blocks
+        if( gros_fm_limit( fm, i ) == 0 )
+            continue;
+        if( ( block = gros_bget( disk, first_data_block + i * BLOCK_SIZE, buf ) ) == NULL ) {
+            delete fm;
+            return -EIO;
+        }
+        bm = gros_init_bitmap( group_bits, block );
+        gros_fm_group( fm, i, bm );
+        delete bm;
+    }
+    pthread_mutex_init( &fm->lock, NULL );
+    disk->freemap = fm;
+    return 0;
+}
+
+
+/**
+ * Drops the summary.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+void gros_close_freemap( Disk * disk ) {
+    if( disk->freemap == NULL )
+        return;
+    pthread_mutex_destroy( &disk->freemap->lock );
+    delete disk->freemap;
+    disk->freemap = NULL;
+}
+
+
+/**
+ * Finds space to allocate from: sets `group` to the first group with a
+ *  free block, looking at group `start` first and wrapping around after
+ *  the last one, and `from` to the first bit of the first word of its
+ *  bitmap that is not full. Returns 0, or -ENOSPC if the disk is full.
+ *
+ * @param Disk * disk    The disk to allocate on
+ * @param int    start   The group to look at first
+ * @param int  * group   Set to the block group to search
+ * @param int  * from    Set to the bit to start searching its bitmap at
+ */
+int gros_freemap_find( Disk * disk, int start, int * group, int * from ) {
+    FreeMap * fm = disk->freemap;
+    int       g;
+    int       w;
+
+    if( start < 0 || start >= fm->groups )
+        start = 0;
+    pthread_mutex_lock( &fm->lock );
+    if( ( g = gros_fm_scan( fm->has_free, start, fm->groups, true ) ) < 0
+        && ( g = gros_fm_scan( fm->has_free, 0, start, true ) ) < 0 ) {
+        pthread_mutex_unlock( &fm->lock );
+        return -ENOSPC;
+    }
+    w = gros_fm_scan( fm->full, g * fm->words, ( g + 1 ) * fm->words, false );
+    pthread_mutex_unlock( &fm->lock );
+
+    * group = g;
+    * from  = w < 0 ? 0 : ( w - g * fm->words ) * 64;
+    return 0;
+}
+
+
+/**
+ * Returns the block group with the most free blocks, the first of them on
+ *  a tie, to spread unrelated data across the disk. Returns -1 if the disk
+ *  is full.
+ *
+ * @param Disk * disk    The disk to allocate on
+ */
+int gros_freemap_roomiest( Disk * disk ) {
+    FreeMap * fm   = disk->freemap;
+    int       best = -1;
+    int       g;
+
+    pthread_mutex_lock( &fm->lock );
+    for( g = 0; g < fm->groups; g++ )
+        if( fm->free[ g ] > 0 && ( best == -1 || fm->free[ g ] > fm->free[ best ] ) )
+            best = g;
+    pthread_mutex_unlock( &fm->lock );
+    return best;
+}
+
+
+/**
+ * Notes that the `n` bits from `index` on of the bitmap `bm` of group
+ *  `group` were just set (`used` nonzero) or cleared.
+ *
+ * @param Disk   * disk    The disk holding the file system
+ * @param int      group   The block group whose bitmap changed
+ * @param Bitmap * bm      The bitmap, after the change
+ * @param int      index   The first bit that changed
+ * @param int      n       Number of bits that changed
+ * @param int      used    Nonzero if the bits were set, 0 if they were cleared
+ */
+void gros_freemap_update( Disk * disk, int group, Bitmap * bm, int index, int n,
+                          int used ) {
+    FreeMap * fm = disk->freemap;
+    int       w;
+
+    if( fm == NULL || group < 0 || group >= fm->groups || n < 1
+        || index < 0 || index + n > gros_fm_limit( fm, group ) )
+        return;
+
+    pthread_mutex_lock( &fm->lock );
+    for( w = index / 64; w <= ( index + n - 1 ) / 64; w++ ) {
+        if( used )
+            gros_fm_word( fm, group, bm, w );
+        else
+            gros_fm_put( fm->full, group * fm->words + w, false );
+    }
+    fm->free[ group ] += used ? -n : n;
+    gros_fm_put( fm->has_free, group, fm->free[ group ] > 0 );
+    pthread_mutex_unlock( &fm->lock );
+}
+
+
+/**
+ * Summarizes group `group` again from its bitmap `bm`, for when the
+ *  summary is found to be out of date.
+ *
+ * @param Disk   * disk    The disk holding the file system
+ * @param int      group   The block group to summarize
+ * @param Bitmap * bm      Its bitmap
+ */
+void gros_freemap_refresh( Disk * disk, int group, Bitmap * bm ) {
+    FreeMap * fm = disk->freemap;
+
+    if( fm == NULL || group < 0 || group >= fm->groups )
+        return;
+    pthread_mutex_lock( &fm->lock );
+    gros_fm_group( fm, group, bm );
+    pthread_mutex_unlock( &fm->lock );
+}
+
+
+/**
+ * Returns the number of blocks left free by the block group bitmaps,
+ *  counted the slow way.
+ */
+static int gros_fm_test_free( Disk * disk ) {
+    char         buf[ BLOCK_SIZE ];
+    char         sbuf[ BLOCK_SIZE ];
+    Superblock * superblock = ( Superblock * ) gros_bget( disk, 0, sbuf );
+    int          total      = 0;
+    int          limit;
+    int          i;
+    Bitmap     * bm;
+
+    for( i = 0; i < superblock->fs_num_block_groups; i++ ) {
+        limit = std::min( BLOCK_SIZE, ( int ) ( disk->size / BLOCK_SIZE )
+                          - superblock->first_data_block - i * BLOCK_SIZE );
+        if( limit <= 0 )
+            continue;
+        gros_bread( disk, superblock->first_data_block + i * BLOCK_SIZE, buf );
+        bm     = gros_init_bitmap( BLOCK_SIZE, buf );
+        total += limit - gros_count_set_bits( bm, 0, limit );
+        delete bm;
+    }
+    return total;
+}
+
+
+TEST_CASE( "The free space summary follows allocation", "[freemap][FileSystem]" ) {
+    Disk      * disk = gros_open_ram( 64 * 1024 * 1024 );
+    FreeMap   * fm;
+    int         group;
+    int         from;
+    int         total;
+    int         block;
+    int         i;
+    std::vector< int > blocks;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( ( fm = disk->freemap ) != NULL );
+    REQUIRE( fm->groups > 1 );
+    REQUIRE( gros_open_freemap( disk, fm->first_data_block, fm->groups,
+                                fm->group_bits ) == -EEXIST );
+
+    total = 0;
+    for( i = 0; i < fm->groups; i++ )
+        total += fm->free[ i ];
+    REQUIRE( total == gros_fm_test_free( disk ) );
+
+    SECTION( "Filling the first group moves allocation to the next" ) {
+        int left = fm->free[ 0 ];
+        for( i = 0; i < left; i++ ) {
+            REQUIRE( gros_freemap_find( disk, 0, &group, &from ) == 0 );
+            REQUIRE( group == 0 );
+            REQUIRE( ( block = gros_allocate_data_block( disk ) ) > 0 );
+            REQUIRE( block < fm->first_data_block + BLOCK_SIZE );
+            blocks.push_back( block );
+        }
+        REQUIRE( fm->free[ 0 ] == 0 );
+        REQUIRE( gros_freemap_find( disk, 0, &group, &from ) == 0 );
+        REQUIRE( group == 1 );
+        REQUIRE( from == 0 );
+        // bit 0 is the bitmap itself
+        REQUIRE( gros_allocate_data_block( disk ) == fm->first_data_block + BLOCK_SIZE + 1 );
+
+        // a block freed in a full group is found again right away
+        gros_free_data_block( disk, blocks[ 1000 ] );
+        REQUIRE( gros_freemap_find( disk, 0, &group, &from ) == 0 );
+        REQUIRE( group == 0 );
+        REQUIRE( from == ( blocks[ 1000 ] - fm->first_data_block ) / 64 * 64 );
+        REQUIRE( gros_allocate_data_block( disk ) == blocks[ 1000 ] );
+        REQUIRE( fm->free[ 0 ] == 0 );
+    }
+
+    SECTION( "A full disk is reported without reading the bitmaps" ) {
+        while( gros_allocate_data_block( disk ) > 0 );
+        REQUIRE( gros_fm_test_free( disk ) == 0 );
+        REQUIRE( gros_freemap_find( disk, 0, &group, &from ) == -ENOSPC );
+        for( i = 0; i < fm->groups; i++ )
+            REQUIRE( fm->free[ i ] == 0 );
+    }
+
+    SECTION( "A stale summary is corrected from the bitmap" ) {
+        char     buf[ BLOCK_SIZE ];
+        Bitmap * bm;
+
+        // mark group 0 full behind the summary's back
+        gros_bread( disk, fm->first_data_block, buf );
+        std::memset( buf, 0xff, BLOCK_SIZE );
+        gros_bwrite( disk, fm->first_data_block, buf );
+        REQUIRE( ( block = gros_allocate_data_block( disk ) )
+                 > fm->first_data_block + BLOCK_SIZE );
+        REQUIRE( fm->free[ 0 ] == 0 );
+        bm = gros_init_bitmap( BLOCK_SIZE, buf );
+        gros_unset_bit( bm, 7 );
+        gros_bwrite( disk, fm->first_data_block, buf );
+        gros_freemap_refresh( disk, 0, bm );
+        REQUIRE( fm->free[ 0 ] == 1 );
+        REQUIRE( gros_allocate_data_block( disk ) == fm->first_data_block + 7 );
+        delete bm;
+    }
+
+    gros_close_disk( disk );
+}
@@ -0,0 +1,98 @@
+/**
+ * freemap.hpp
+ */
+
+#ifndef __FREEMAP_HPP_INCLUDED__   // if freemap.hpp hasn't been included yet...
+#define __FREEMAP_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * In-memory summary of the block group bitmaps, so allocation goes
+ *  straight to free space instead of reading every bitmap in turn. Bits of
+ *  a group that lie past the end of the disk count as used.
+ */
+typedef struct _freemap {
+    pthread_mutex_t         lock;
+    int                     first_data_block; /* bitmap of group 0 */
+    int                     groups;           /* number of block groups */
+    int                     group_bits;       /* blocks covered by a bitmap */
+    int                     words;            /* 64-bit words in a bitmap */
+    int                     num_blocks;       /* size of the disk, in blocks */
+    std::vector< int >      free;             /* free blocks per group */
+    std::vector< uint64_t > has_free;         /* bit per group with free blocks */
+    std::vector< uint64_t > full;             /* bit per bitmap word with no free bit */
+} FreeMap;
+
+/**
+ * Builds the summary of the `groups` block group bitmaps of `group_bits`
+ *  bits each, the first at block `first_data_block` and the others every
+ *  BLOCK_SIZE blocks after it. Every bitmap is read once. Returns 0,
+ *  -EEXIST if the disk already has a summary, -EINVAL for a bad layout or
+ *  -EIO.
+ *
+ * @param Disk * disk               The disk holding the file system
+ * @param int    first_data_block   Block holding the bitmap of group 0
+ * @param int    groups             Number of block groups
+ * @param int    group_bits         Blocks covered by one bitmap
+ */
+int gros_open_freemap( Disk * disk, int first_data_block, int groups, int group_bits );
+
+/**
+ * Drops the summary.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+void gros_close_freemap( Disk * disk );
+
+/**
+ * Finds space to allocate from: sets `group` to the first group with a
+ *  free block, looking at group `start` first and wrapping around after
+ *  the last one, and `from` to the first bit of the first word of its
+ *  bitmap that is not full. Returns 0, or -ENOSPC if the disk is full.
+ *
+ * @param Disk * disk    The disk to allocate on
+ * @param int    start   The group to look at first
+ * @param int  * group   Set to the block group to search
+ * @param int  * from    Set to the bit to start searching its bitmap at
+ */
+int gros_freemap_find( Disk * disk, int start, int * group, int * from );
+
+/**
+ * Returns the block group with the most free blocks, the first of them on
+ *  a tie, to spread unrelated data across the disk. Returns -1 if the disk
+ *  is full.
+ *
+ * @param Disk * disk    The disk to allocate on
+ */
+int gros_freemap_roomiest( Disk * disk );
+
+/**
+ * Notes that the `n` bits from `index` on of the bitmap `bm` of group
+ *  `group` were just set (`used` nonzero) or cleared.
+ *
+ * @param Disk   * disk    The disk holding the file system
+ * @param int      group   The block group whose bitmap changed
+ * @param Bitmap * bm      The bitmap, after the change
+ * @param int      index   The first bit that changed
+ * @param int      n       Number of bits that changed
+ * @param int      used    Nonzero if the bits were set, 0 if they were cleared
+ */
+void gros_freemap_update( Disk * disk, int group, Bitmap * bm, int index, int n,
+                          int used );
+
+/**
+ * Summarizes group `group` again from its bitmap `bm`, for when the
+ *  summary is found to be out of date.
+ *
+ * @param Disk   * disk    The disk holding the file system
+ * @param int      group   The block group to summarize
+ * @param Bitmap * bm      Its bitmap
+ */
+void gros_freemap_refresh( Disk * disk, int group, Bitmap * bm );
+
+#endif
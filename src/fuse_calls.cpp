@@ -15,11 +15,49 @@
 // Other Options below, regarding relative pathnames.)
 void * grosfs_init( struct fuse_conn_info * conn ) {
     pdebug << "in grosfs_init" << std::endl;
-    struct fusedata * mydata = new struct fusedata();
-    mydata->disk = gros_open_disk();
+    int status;
+    // the user data handed to fuse_main carries the parsed mount options
+    struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
+    if( mydata == NULL ) {
+        mydata = new struct fusedata();
+        mydata->disk_size  = EMULATOR_SIZE;
+        mydata->cache_size = GROS_CACHE_DEFAULT_SIZE;
+        mydata->writeback  = GROS_WRITEBACK_INTERVAL;
+        mydata->readahead  = GROS_READAHEAD_WINDOW;
+    }
+    if( mydata->image == NULL )
+        mydata->image = strdup( GROS_DEFAULT_IMAGE );
+    mydata->disk = gros_open_image( mydata->image, mydata->disk_size );
+    if( gros_set_engine( mydata->disk, mydata->engine ) < 0 )
+        perror( "Could not switch I/O engine, using pread/pwrite" );
+    // a mapped image is already served from the page cache
+    if( mydata->disk->engine != GROS_IO_MMAP && mydata->cache_size > 0 )
+        gros_attach_cache( mydata->disk, mydata->cache_size );
     if (mydata->disk->isnew) {
         gros_make_fs(mydata->disk);
     }
+    // the journal only protects writes that go through the cache
+    Superblock * superblock = gros_superblock( mydata->disk );
+    if( superblock != NULL && superblock->fs_journal_blocks > 0
+        && mydata->disk->cache == NULL )
+        fprintf( stderr, "grosfs: warning: no block cache (engine=mmap or "
+                 "cache=0), the journal is replayed but not used\n" );
+    // replaying the journal brings the metadata back to its last commit;
+    // serving the old metadata would let a later replay go over newer changes
+    if( ( status = gros_mount( mydata->disk ) ) < 0 ) {
+        fprintf( stderr, "grosfs: could not mount %s: %s\n", mydata->image,
+                 strerror( -status ) );
+        exit( 1 );
+    }
+    if( mydata->disk->csum != NULL && mydata->noverify )
+        mydata->disk->csum->verify = false;
+    if( mydata->disk->dedup != NULL && mydata->dedup )
+        mydata->disk->dedup->enabled = true;
+    // from here on requests only dirty the cache; the flusher writes it out
+    if( mydata->disk->cache != NULL && mydata->writeback > 0 )
+        gros_start_flusher( mydata->disk, mydata->writeback );
+    if( mydata->disk->cache != NULL && mydata->readahead > 0 )
+        gros_start_readahead( mydata->disk, mydata->readahead );
     return mydata;
 }
 
@@ -27,6 +65,8 @@ void * grosfs_init( struct fuse_conn_info * conn ) {
 void grosfs_destroy( void * private_data ) {
     pdebug << "in grosfs_destroy" << std::endl;
     struct fusedata * mydata = (struct fusedata *) private_data;
+    gros_stop_readahead( mydata->disk );
+    gros_stop_flusher( mydata->disk );
     gros_close_disk( mydata->disk );
     return;
 }
@@ -77,6 +117,7 @@ int grosfs_access( const char * path, int mask ) {
     if( inode_num < 0 ) return -ENOENT;
 
     inode = gros_get_inode( mydata->disk, inode_num );
+    if( inode == NULL ) return -ENOENT;
     usr = ( short ) ( inode->f_acl & 0x7 );
     grp = ( short ) ( ( inode->f_acl >> 3 ) & 0x7 );
     uni = ( short ) ( ( inode->f_acl >> 6 ) & 0x7 );
@@ -90,6 +131,7 @@ int grosfs_access( const char * path, int mask ) {
     x_ok = ( uni & 0x1 ) ||
            ( ( grp & 0x1 ) && ctxt->gid == inode->f_gid ) ||
            ( ( usr & 0x1 ) && ctxt->uid == inode->f_uid );
+    gros_put_inode( mydata->disk, inode );
 
     if( ( mask & R_OK && !r_ok ) ||
         ( mask & W_OK && !w_ok ) ||
@@ -109,16 +151,22 @@ int grosfs_readlink( const char * path, char * buf, size_t size ) {
     pdebug << "in grosfs_readlink" << std::endl;
     struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
     Inode    * inode = gros_get_inode( mydata->disk, gros_namei( mydata->disk, path ) );
+    if( inode == NULL )
+    	return -ENOENT;
     int first_bit  = inode->f_acl & 1;
     int second_bit = ( ( inode->f_acl & 2 ) >> 1 );
+    int status     = 0;
     if ( first_bit == 0 || second_bit == 0 || size < 1 )
-    	return -EINVAL;
-    if( ( inode == NULL || inode->f_links == 0 ) ) 
-    	return -ENOENT;
-    gros_i_read( mydata->disk, inode, buf, std::min( size, ( size_t )  inode->f_size ), 0 );
-    buf[ inode->f_size ] = '\0';
+    	status = -EINVAL;
+    else if( inode->f_links == 0 )
+    	status = -ENOENT;
+    else {
+        gros_i_read( mydata->disk, inode, buf, std::min( size, ( size_t )  inode->f_size ), 0 );
+        buf[ inode->f_size ] = '\0';
+    }
+    gros_put_inode( mydata->disk, inode );
 //    return std::min( ( int ) size, inode->f_size );
-    return 0;
+    return status;
 }
 
 // Open a directory for reading.
@@ -126,11 +174,13 @@ int grosfs_opendir( const char * path, struct fuse_file_info * fi ) {
     pdebug << "in grosfs_opendir" << std::endl;
     struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
     Inode    * inode = gros_get_inode( mydata->disk, gros_namei( mydata->disk, path ) );
+    int        status = 0;
     if ( inode == NULL || inode->f_links == 0) 
-    	return -ENOENT;
-    if ( !gros_is_dir( inode->f_acl ) )
-    	return -ENOTDIR;
-    return 0;
+    	status = -ENOENT;
+    else if ( !gros_is_dir( inode->f_acl ) )
+    	status = -ENOTDIR;
+    gros_put_inode( mydata->disk, inode );
+    return status;
 }
 
 // Return one or more directory entries (struct dirent) to the caller.
@@ -145,36 +195,30 @@ int grosfs_readdir( const char * path, void * buf, fuse_fill_dir_t filler,
 
     struct fuse_context * ctxt = fuse_get_context();
     struct fusedata *mydata = (struct fusedata *)ctxt->private_data;
-    struct stat *stbuf;
+    struct stat stbuf;
     int full = 0;
-    size_t off = 0;
     int inode_num = gros_namei(mydata->disk, path);
     // if we couldn't find the directory, error
     if (inode_num < 0) {
         return -ENOENT;
     }
     Inode *inode = gros_get_inode(mydata->disk, inode_num);
-    DirEntry * ent = NULL; // the current direntry
-    DirEntry * tmp = NULL; // the next direntry
-    // get the first direntry
-    gros_readdir_r(mydata->disk, inode, NULL, &ent);
-
-    while (ent != NULL && full != 1) {
-        // get the next direntry and put it into tmp
-        gros_readdir_r(mydata->disk, inode, ent, &tmp);
-        // if there are no more direntries, off = 0, else offset is to next
-        off = tmp == NULL ? 0 : ((24+strlen(ent->filename)+7)&~7);
-        if (off < offset) {
-            ent = tmp;
-            continue;
-        }
-        stbuf = new struct stat();
-        gros_i_stat( mydata->disk, ent->inode_num, stbuf );
+    if (inode == NULL) {
+        return -ENOENT;
+    }
+    DirEntry * ent; // the current direntry
+    DirIter iter;
+    // carry on from the entry the last call stopped at; the offset handed
+    // to filler for each entry is that of the one after it
+    gros_opendir(inode, &iter, (int) offset);
+
+    while (full != 1 && (ent = gros_readdir(mydata->disk, &iter)) != NULL) {
+        memset(&stbuf, 0, sizeof(stbuf));
+        gros_i_stat( mydata->disk, ent->inode_num, &stbuf );
         // full will be 1 if the buffer is full
-        full = filler( buf, ent->filename, stbuf, ( off_t ) off );
-        // tmp is the new current entry
-        ent = tmp;
+        full = filler( buf, ent->filename, &stbuf, ( off_t ) iter.offset );
     }
+    gros_put_inode(mydata->disk, inode);
 
     return 0;
 }
@@ -188,19 +232,27 @@ int grosfs_mknod( const char * path, mode_t mode, dev_t rdev ) {
     if( grosfs_access( path, mode ) < 0 ) //TODO: do we need this?
     	return -EACCES;
 
+    // the file is only created along with its mode and times
+    gros_journal_begin( mydata->disk );
     int inode_num = gros_mknod(mydata->disk, path);
-    if (inode_num < 0)
-        return inode_num;
-    Inode * inode = gros_get_inode(mydata->disk, inode_num);
+    Inode * inode = inode_num < 0 ? NULL : gros_get_inode(mydata->disk, inode_num);
+    if (inode == NULL) {
+        gros_journal_end( mydata->disk );
+        return inode_num < 0 ? inode_num : -EIO;
+    }
     inode->f_acl = 0; // regular file
 
     gros_i_chmod( mydata->disk, inode, mode );
+    if( mydata->compress )
+        inode->f_acl = ( short ) ( inode->f_acl | GROS_ACL_COMPRESS );
 
     inode->f_atime = time(NULL);
     inode->f_ctime = time(NULL);
     inode->f_mtime = time(NULL);
 
     gros_save_inode(mydata->disk, inode);
+    gros_put_inode(mydata->disk, inode);
+    gros_journal_end( mydata->disk );
     return 0;
 }
 
@@ -247,7 +299,18 @@ int grosfs_symlink( const char * to, const char * from ) {
     dirname[length-1] = '\0';
 
     Inode    * from_dir = gros_get_inode( mydata->disk, gros_namei( mydata->disk, dirname ) );
-    Inode    * inode    = gros_new_inode( mydata->disk );
+    if( from_dir == NULL ) {
+        delete [] dirname;
+        return -ENOENT;
+    }
+    gros_journal_begin( mydata->disk );
+    Inode    * inode    = gros_new_inode_near( mydata->disk, from_dir->f_block[ 0 ] );
+    if( inode == NULL ) {
+        gros_journal_end( mydata->disk );
+        gros_put_inode( mydata->disk, from_dir );
+        delete [] dirname;
+        return -ENOSPC;
+    }
     inode->f_acl        = 0x7ff; // 11 111 111 111
     inode->f_links      = 1;
     DirEntry * direntry = new DirEntry();
@@ -256,10 +319,12 @@ int grosfs_symlink( const char * to, const char * from ) {
     strcpy( direntry->filename, filename );
 
     gros_save_inode( mydata->disk, inode );
-    gros_i_write( mydata->disk, from_dir, ( char * ) direntry, sizeof( DirEntry ),
-                  from_dir->f_size );
+    gros_dir_add( mydata->disk, from_dir, direntry );
     gros_i_write( mydata->disk, inode, ( char * ) to, ( int ) strlen( to ), 0 );
 
+    gros_put_inode( mydata->disk, inode );
+    gros_journal_end( mydata->disk );
+    gros_put_inode( mydata->disk, from_dir );
     delete    direntry;
     delete [] dirname;
 
@@ -299,8 +364,12 @@ int grosfs_chmod( const char * path, mode_t mode ) {
         return -ENOENT;
     }
     Inode * inode = gros_get_inode( mydata->disk, inode_num );
+    if (inode == NULL) {
+        return -ENOENT;
+    }
     gros_i_chmod( mydata->disk, inode, mode );
     gros_save_inode( mydata->disk, inode );
+    gros_put_inode( mydata->disk, inode );
     return 0; // leave unimplemented
 }
 
@@ -318,9 +387,13 @@ int grosfs_chown( const char * path, uid_t uid, gid_t gid ) {
         return -ENOENT;
     }
     Inode * inode = gros_get_inode( mydata->disk, inode_num );
+    if (inode == NULL) {
+        return -ENOENT;
+    }
     inode->f_uid = uid;
     inode->f_gid = gid;
     gros_save_inode( mydata->disk, inode );
+    gros_put_inode( mydata->disk, inode );
     return 0; // leave unimplemented
 }
 
@@ -353,11 +426,13 @@ int grosfs_utimens( const char * path, const struct timespec ts[ 2 ] ) {
     struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
     int      inode_num = gros_namei( mydata->disk, path );
     Inode * inode      = gros_get_inode( mydata->disk, inode_num );
+    if( inode == NULL )
+        return -ENOENT;
     inode->f_atime     = ts[ 0 ].tv_sec * 1000 + ts[ 0 ].tv_nsec * 1000000;
     inode->f_mtime     = ts[ 1 ].tv_sec * 1000 + ts[ 1 ].tv_nsec * 1000000;
     gros_save_inode( mydata->disk, inode );
 
-    delete inode;
+    gros_put_inode( mydata->disk, inode );
     return 0;
 }
 
@@ -380,24 +455,33 @@ int grosfs_open( const char * path, struct fuse_file_info * fi ) {
         inode = gros_get_inode( mydata->disk, inode_num );
 
     if( ( inode != NULL && inode->f_links > 0 )
-        && fi->flags & ( O_CREAT | O_EXCL ) )
+        && fi->flags & ( O_CREAT | O_EXCL ) ) {
+        gros_put_inode( mydata->disk, inode );
         return -EEXIST;
-    else if( ( inode == NULL || inode->f_links == 0 )
-             && !( fi->flags & O_CREAT ) )
+    } else if( ( inode == NULL || inode->f_links == 0 )
+             && !( fi->flags & O_CREAT ) ) {
+        gros_put_inode( mydata->disk, inode );
         return -ENOENT;
-    else if( ( inode == NULL || inode->f_links == 0 )
-               && fi->flags & O_CREAT )
+    } else if( ( inode == NULL || inode->f_links == 0 )
+               && fi->flags & O_CREAT ) {
+        gros_put_inode( mydata->disk, inode );
         inode = gros_new_inode( mydata->disk );
+        if( inode == NULL )
+            return -ENOSPC;
+    }
 
 
     if( fi->flags & O_RDONLY || fi->flags & O_RDWR )
         mode |= R_OK;
     if( fi->flags & O_WRONLY || fi->flags & O_TRUNC || fi->flags & O_RDWR )
         mode |= W_OK;
-    if( grosfs_access( path, mode ) < 0 )
+    if( grosfs_access( path, mode ) < 0 ) {
+        gros_put_inode( mydata->disk, inode );
         return -EACCES;
+    }
     if( fi->flags & O_TRUNC )
         gros_i_truncate( mydata->disk, inode, 0 );
+    gros_put_inode( mydata->disk, inode );
 
     fi->fh = ( uint64_t ) inode_num;
     return 0;
@@ -418,8 +502,14 @@ int grosfs_read( const char * path, char * buf, size_t size, off_t offset,
     if( fi->fh == 0 )
         fi->fh = ( uint64_t ) gros_namei( mydata->disk, path );
 
-    return gros_i_read( mydata->disk, gros_get_inode( mydata->disk, ( int ) fi->fh ), buf,
-                        ( int ) size, ( int ) offset );
+    Inode * inode = gros_get_inode( mydata->disk, ( int ) fi->fh );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_read( mydata->disk, inode, buf, ( int ) size, ( int ) offset );
+    gros_put_inode( mydata->disk, inode );
+    return status;
 }
 
 
@@ -432,8 +522,15 @@ int grosfs_write( const char * path, const char * buf, size_t size, off_t offset
     if( fi->fh == 0 )
         fi->fh = ( uint64_t ) gros_namei( mydata->disk, path );
 
-    return gros_i_write( mydata->disk, gros_get_inode( mydata->disk, ( int ) fi->fh ),
-                         ( char * ) buf, ( int ) size, ( int ) offset );
+    Inode * inode = gros_get_inode( mydata->disk, ( int ) fi->fh );
+    int     status;
+
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_write( mydata->disk, inode, ( char * ) buf, ( int ) size,
+                           ( int ) offset );
+    gros_put_inode( mydata->disk, inode );
+    return status;
 }
 
 
@@ -443,22 +540,22 @@ int grosfs_write( const char * path, const char * buf, size_t size, off_t offset
 int grosfs_statfs( const char * path, struct statvfs * stbuf ) {
     pdebug << "in grosfs_statfs ( \"" << path << "\" ) " << std::endl;
     struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
-    Superblock  * sb  = new Superblock();
-    gros_read_block( mydata->disk, 0, ( char * ) sb );
+    Superblock  * sb          = gros_superblock( mydata->disk );
+    int           used_blocks = __atomic_load_n( &sb->fs_num_used_blocks, __ATOMIC_RELAXED );
+    int           used_inodes = __atomic_load_n( &sb->fs_num_used_inodes, __ATOMIC_RELAXED );
 
     stbuf->f_bsize   = ( unsigned long ) sb->fs_block_size;          /* file system block size */
     stbuf->f_frsize  = 0;                                            /* fragment size */
     stbuf->f_blocks  = ( fsblkcnt_t ) sb->fs_num_blocks;             /* size of fs in f_frsize units */
-    stbuf->f_bfree   = ( fsblkcnt_t ) ( sb->fs_num_blocks - sb->fs_num_used_blocks );   /* # free blocks */
-    stbuf->f_bavail  = ( fsblkcnt_t ) ( sb->fs_num_blocks - sb->fs_num_used_blocks );   /* # free blocks for unprivileged users */
+    stbuf->f_bfree   = ( fsblkcnt_t ) ( sb->fs_num_blocks - used_blocks );   /* # free blocks */
+    stbuf->f_bavail  = ( fsblkcnt_t ) ( sb->fs_num_blocks - used_blocks );   /* # free blocks for unprivileged users */
     stbuf->f_files   = ( fsfilcnt_t ) sb->fs_num_inodes;             /* # inodes */
-    stbuf->f_ffree   = ( fsfilcnt_t ) ( sb->fs_num_inodes - sb->fs_num_used_inodes );   /* # free inodes */
-    stbuf->f_favail  = ( fsfilcnt_t ) ( sb->fs_num_inodes - sb->fs_num_used_inodes );   /* # free inodes for unprivileged users */
+    stbuf->f_ffree   = ( fsfilcnt_t ) ( sb->fs_num_inodes - used_inodes );   /* # free inodes */
+    stbuf->f_favail  = ( fsfilcnt_t ) ( sb->fs_num_inodes - used_inodes );   /* # free inodes for unprivileged users */
     stbuf->f_fsid    = 0;                                            /* file system ID */
     stbuf->f_flag    = 0;                                            /* mount flags */
     stbuf->f_namemax = FILENAME_MAX_LENGTH;                          /* maximum filename length */
 
-    delete sb;
     return 0;
 }
 
@@ -470,7 +567,12 @@ int grosfs_statfs( const char * path, struct statvfs * stbuf ) {
 // but I don't know if that is true.
 int grosfs_release( const char * path, struct fuse_file_info * fi ) {
     pdebug << "in grosfs_release ( \"" << path << "\" ) " << std::endl;
-    return 0; // leave unimplemented
+    struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
+
+    // closing a file hands back the blocks reserved for it
+    if( fi->fh != 0 )
+        gros_prealloc_release( mydata->disk, ( int ) fi->fh );
+    return 0;
 }
 
 
@@ -490,17 +592,62 @@ int grosfs_releasedir( const char * path, struct fuse_file_info * fi ) {
 // (slowing performance) but achieve the desired guarantee.
 int grosfs_fsync( const char * path, int isdatasync, struct fuse_file_info * fi ) {
     pdebug << "in grosfs_fsync ( \"" << path << "\", " << isdatasync << " ) " << std::endl;
-    fsync(( ( struct fusedata * ) fuse_get_context()->private_data )->disk->fd);
-    return 0; // leave unimplemented
+    struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
+    int               inode_num;
+    int               status;
+
+    inode_num = gros_namei( mydata->disk, path );
+    if( inode_num < 0 ) return -ENOENT;
+
+    // only this file's blocks are waited for, not the whole cache
+    Inode * inode = gros_get_inode( mydata->disk, inode_num );
+    if( inode == NULL ) return -ENOENT;
+    status = gros_i_fsync( mydata->disk, inode );
+    gros_put_inode( mydata->disk, inode );
+    return status;
 }
 
+// Only "user.grosfs.compress" is supported: "1" compresses the file's data
+// from then on, "0" stops compressing an empty file.
 int grosfs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
     pdebug << "in grosfs_setxattr" << std::endl;
-    return -ENOSYS; // leave unimplemented
+    struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
+    int               inode_num;
+    int               status;
+
+    if( strcmp( name, GROS_XATTR_COMPRESS ) != 0 )
+        return -ENOSYS;
+    if( size != 1 || ( value[ 0 ] != '0' && value[ 0 ] != '1' ) )
+        return -EINVAL;
+    if( ( inode_num = gros_namei( mydata->disk, path ) ) < 0 )
+        return -ENOENT;
+    Inode * inode = gros_get_inode( mydata->disk, inode_num );
+    if( inode == NULL )
+        return -ENOENT;
+    status = gros_i_compress( mydata->disk, inode, value[ 0 ] == '1' );
+    gros_put_inode( mydata->disk, inode );
+    return status;
 }
 int grosfs_getxattr(const char* path, const char* name, char* value, size_t size) {
     pdebug << "in grosfs_getxattr" << std::endl;
-    return -ENOSYS; // leave unimplemented
+    struct fusedata * mydata = ( struct fusedata * ) fuse_get_context()->private_data;
+    int               inode_num;
+    int               on;
+
+    if( strcmp( name, GROS_XATTR_COMPRESS ) != 0 )
+        return -ENOSYS;
+    if( ( inode_num = gros_namei( mydata->disk, path ) ) < 0 )
+        return -ENOENT;
+    Inode * inode = gros_get_inode( mydata->disk, inode_num );
+    if( inode == NULL )
+        return -ENOENT;
+    on = ( inode->f_acl & GROS_ACL_COMPRESS ) != 0;
+    gros_put_inode( mydata->disk, inode );
+    // a size of 0 asks how big the value is
+    if( size == 0 )
+        return 1;
+    value[ 0 ] = on ? '1' : '0';
+    return 1;
 }
 int grosfs_listxattr(const char* path, char* list, size_t size) {
     pdebug << "in grosfs_listxattr" << std::endl;
@@ -515,7 +662,7 @@ int grosfs_removexattr(const char* path, const char* name) {
 // Like fsync, but for directories.
 int grosfs_fsyncdir( const char * path, int isdatasync, struct fuse_file_info * fi ) {
     pdebug << "in grosfs_fsyncdir ( \"" << path << "\", " << isdatasync << " ) " << std::endl;
-    return 0; // leave unimplemented
+    return grosfs_fsync( path, isdatasync, fi );
 }
 
 
@@ -554,10 +701,11 @@ int grosfs_bmap( const char * path, size_t blocksize, uint64_t * blockno ) {
     int        * diblock    = NULL;  /* buffer to store indirects */
     int        * tiblock    = NULL;  /* buffer to store indirects */
     int          inode_num  = gros_namei( mydata->disk, path );
-    Superblock * sb         = new Superblock();
+    Superblock * sb         = gros_superblock( mydata->disk );
     Inode      * inode      = gros_get_inode( mydata->disk, inode_num );
-    gros_read_block( mydata->disk, 0, ( char * ) sb );
 
+    if( inode == NULL )
+        return -ENOENT;
     block_size     = sb->fs_block_size;
     n_indirects    = block_size / sizeof( int );
     n_indirects_sq = n_indirects * n_indirects;
@@ -575,7 +723,7 @@ int grosfs_bmap( const char * path, size_t blocksize, uint64_t * blockno ) {
         // if we haven't fetched the triple indirect block yet, do so now
         if( tiblock == NULL ) {
             tiblock = new int[ n_indirects ];
-            gros_read_block( mydata->disk,
+            gros_bread( mydata->disk,
                              inode->f_block[ TRIPLE_INDRCT ],
                              ( char * ) tiblock );
         }
@@ -598,7 +746,7 @@ int grosfs_bmap( const char * path, size_t blocksize, uint64_t * blockno ) {
         diblock = diblock == NULL ? ( new int[ n_indirects ] ) : diblock;
         if( cur_di != di ) {
             cur_di = di;
-            gros_read_block( mydata->disk, di, ( char * ) diblock );
+            gros_bread( mydata->disk, di, ( char * ) diblock );
         }
         // subtracting n+12 to obviate lower layers of indirection
         int pos = ( block_to_read - ( n_indirects + SINGLE_INDRCT ) ) /
@@ -616,7 +764,7 @@ int grosfs_bmap( const char * path, size_t blocksize, uint64_t * blockno ) {
         // if we dont' already have the single indirects loaded into memory, load it
         if( cur_si != si ) {
             cur_si = si;
-            gros_read_block( mydata->disk, si, ( char * ) siblock );
+            gros_bread( mydata->disk, si, ( char * ) siblock );
         }
         // relative index into single indirects
         block_to_read = siblock[ block_to_read - SINGLE_INDRCT ];
@@ -630,6 +778,7 @@ int grosfs_bmap( const char * path, size_t blocksize, uint64_t * blockno ) {
     if( siblock != NULL ) delete [] siblock;
     if( diblock != NULL ) delete [] diblock;
     if( tiblock != NULL ) delete [] tiblock;
+    gros_put_inode( mydata->disk, inode );
 
     return block_to_read;
 }
@@ -32,9 +32,24 @@
 #include "grosfs.hpp"
 #include "disk.hpp"
 #include "files.hpp"
+#include "readahead.hpp"
+#include "compress.hpp"
+#include "dedup.hpp"
+#include "prealloc.hpp"
+#include "dcache.hpp"
+#include "journal.hpp"
 
 struct fusedata {
-    Disk * disk;
+    Disk  * disk;
+    char  * image;       /* absolute path of the image, from -o image= */
+    int64_t disk_size;   /* size of a newly created image, from -o size= */
+    int     engine;      /* GROS_IO_* engine, from -o engine= */
+    int64_t cache_size;  /* block cache budget in bytes, 0 for none */
+    int     writeback;   /* age in seconds at which dirty blocks go, 0 for no flusher */
+    int64_t readahead;   /* largest read-ahead window in bytes, 0 for none */
+    bool    noverify;    /* do not check blocks read against their checksums */
+    bool    compress;    /* compress the data of new files, from -o compress */
+    bool    dedup;       /* share duplicate data blocks, from -o dedup */
 };
 
 // Initialize the filesystem. This function can often be left unimplemented, but it can be a handy way to perform one-time setup such as allocating variable-sized data structures or initializing a new filesystem. The fuse_conn_info structure gives information about what features are supported by FUSE, and can be used to request certain capabilities (see below for more information). The return value of this function is available to all file operations in the private_data field of fuse_context. It is also passed as a parameter to the destroy() method. (Note: see the warning under Other Options below, regarding relative pathnames.)
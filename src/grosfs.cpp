@@ -1,5 +1,16 @@
 #include "grosfs.hpp"
 #include "files.hpp"
+#include "dedup.hpp"
+#include "freemap.hpp"
+#include "prealloc.hpp"
+#include "icache.hpp"
+#include "dcache.hpp"
+#include "dindex.hpp"
+#include "compress.hpp"
+#include "journal.hpp"
+#include <algorithm>
+#include <vector>
+#include <set>
 
 
 /**
@@ -14,23 +25,42 @@ void gros_make_fs( Disk * disk ) {
     superblock->fs_disk_size        = disk->size;
     superblock->fs_block_size       = BLOCK_SIZE;
     superblock->fs_inode_size       = sizeof( Inode );
-    int          num_blocks         = superblock->fs_disk_size
-                                      / superblock->fs_block_size;
+    int          num_blocks         = ( int ) ( superblock->fs_disk_size
+                                                / superblock->fs_block_size );
     int          num_inode_blocks   = ( int ) ceil( num_blocks * INODE_BLOCKS );
     int          inode_per_block    = ( int ) floor( superblock->fs_block_size
                                                      / superblock->fs_inode_size );
-    superblock->fs_num_blocks       = ( int ) floor( num_blocks * DATA_BLOCKS );
     superblock->fs_num_inodes       = num_inode_blocks * inode_per_block;
-    superblock->fs_num_block_groups = ( int ) ceil( 1.0f*superblock->fs_num_blocks
-                                                    / superblock->fs_block_size );
     superblock->fs_num_used_inodes  = 0;
     superblock->fs_num_used_blocks  = 0;
 
-    // free_data_list starts at the first block after the superblock + inodes
-    superblock->first_data_block    = 1 + num_inode_blocks;
+    // the journal follows the inodes, then the block checksums and the
+    // reference counts and fingerprints of shared blocks, then comes the
+    // free_data_list
+    superblock->fs_journal_start    = 1 + num_inode_blocks;
+    superblock->fs_journal_blocks   = gros_journal_size( num_blocks );
+    superblock->fs_csum_start       = superblock->fs_journal_start
+                                      + superblock->fs_journal_blocks;
+    superblock->fs_csum_blocks      = gros_csum_size( num_blocks );
+    superblock->fs_dedup_start      = superblock->fs_csum_start
+                                      + superblock->fs_csum_blocks;
+    superblock->fs_dedup_refs       = gros_dedup_refs_size( num_blocks );
+    superblock->fs_dedup_index      = gros_dedup_index_size( num_blocks );
+    superblock->first_data_block    = superblock->fs_dedup_start
+                                      + superblock->fs_dedup_refs
+                                      + superblock->fs_dedup_index;
+    // the data blocks are whatever the areas before them left of the disk
+    superblock->fs_num_blocks       = num_blocks - superblock->first_data_block;
+    superblock->fs_num_block_groups = ( int ) ceil( 1.0f*superblock->fs_num_blocks
+                                                    / superblock->fs_block_size );
 
     // initialize inodes on disk
     gros_init_inodes( disk, num_inode_blocks, inode_per_block );
+    gros_format_journal( disk, superblock->fs_journal_start,
+                         superblock->fs_journal_blocks );
+    gros_format_csum( disk, superblock->fs_csum_start, superblock->fs_csum_blocks );
+    gros_format_dedup( disk, superblock->fs_dedup_start, superblock->fs_dedup_refs,
+                       superblock->fs_dedup_index );
 
     // initialize free ilist with initial inode numbers
     for( i = 0; i < SB_ILIST_SIZE; i++ )
@@ -49,16 +79,124 @@ void gros_make_fs( Disk * disk ) {
         gros_set_bit( bitmap, 0 ); // set first block to used bc it's the bitmap
         block_group_count += superblock->fs_block_size
                              * superblock->fs_block_size;
-        gros_write_block( disk, block_num, bitmap->buf );
+        gros_bwrite( disk, block_num, bitmap->buf );
         free( buf );
     }
 
-    gros_write_block( disk, 0, ( char * ) superblock );
+    gros_bwrite( disk, 0, ( char * ) superblock );
+
+    // from here on the file system works on this copy
+    delete disk->super;
+    disk->super       = superblock;
+    disk->super_dirty = 0;
 
     gros_mkroot( disk ); // set up the root directory
 }
 
 
+/**
+ * Gets a file system ready for use: anything gros_make_fs left in the
+ *  cache is written home, then the journal is opened, which replays the
+ *  transactions a crash left in it, block checksums are turned on,
+ *  shared data blocks are honored, the free blocks are summarized,
+ *  growing files get blocks reserved for them and inodes and names are
+ *  cached. Transactions only end between whole operations, so the replay
+ *  brings the metadata back to a consistent state; nothing else is
+ *  checked. Without a cache nothing would go through the journal, so it
+ *  is only replayed and then closed.
+ *  Returns the number of transactions replayed or -errno.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+int gros_mount( Disk * disk ) {
+    Superblock * superblock;
+    int          replayed = 0;
+    int          status;
+
+    // a new file system goes home directly rather than through the journal
+    if( ( status = gros_bsync( disk ) ) < 0 )
+        return status;
+    if( ( superblock = gros_superblock( disk ) ) == NULL )
+        return -EIO;
+    if( superblock->fs_journal_blocks > 0
+        && ( replayed = gros_open_journal( disk, superblock->fs_journal_start,
+                                           superblock->fs_journal_blocks ) ) < 0 )
+        return replayed;
+    // the replay may have rewritten block 0 under the copy in memory
+    if( replayed > 0 && gros_bread( disk, 0, ( char * ) superblock ) < 0 )
+        return -EIO;
+    // uncached writes go straight home, so a journal would only look on
+    if( disk->journal != NULL && disk->cache == NULL
+        && ( status = gros_close_journal( disk ) ) < 0 )
+        return status;
+    if( superblock->fs_csum_blocks > 0 && disk->csum == NULL
+        && ( status = gros_open_csum( disk, superblock->fs_csum_start,
+                                      superblock->fs_csum_blocks ) ) < 0 )
+        return status;
+    if( superblock->fs_dedup_refs > 0 && disk->dedup == NULL
+        && ( status = gros_open_dedup( disk, superblock->fs_dedup_start,
+                                       superblock->fs_dedup_refs,
+                                       superblock->fs_dedup_index ) ) < 0 )
+        return status;
+    if( disk->freemap == NULL
+        && ( status = gros_open_freemap( disk, superblock->first_data_block,
+                                         superblock->fs_num_block_groups,
+                                         superblock->fs_block_size ) ) < 0 )
+        return status;
+    if( disk->prealloc == NULL && ( status = gros_open_prealloc( disk ) ) < 0 )
+        return status;
+    if( disk->icache == NULL
+        && ( status = gros_open_icache( disk, GROS_ICACHE_DEFAULT ) ) < 0 )
+        return status;
+    if( disk->dcache == NULL
+        && ( status = gros_open_dcache( disk, GROS_DCACHE_DEFAULT ) ) < 0 )
+        return status;
+    return replayed;
+}
+
+
+/**
+ * Returns the superblock of the file system on the disk. There is one
+ *  copy per disk, read from block 0 the first time it is asked for and
+ *  shared from then on; changes to it only reach block 0 on gros_bsync,
+ *  each round of the flusher and gros_close_disk, once they are marked
+ *  with gros_superblock_dirty. The used block and inode counts are updated
+ *  with atomic adds, the free inode list under the disk's super_lock.
+ *  Returns NULL if block 0 cannot be read.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+Superblock * gros_superblock( Disk * disk ) {
+    Superblock * superblock = __atomic_load_n( &disk->super, __ATOMIC_ACQUIRE );
+    Superblock * loaded     = NULL;
+
+    if( superblock != NULL )
+        return superblock;
+    superblock = new Superblock();
+    if( gros_bread( disk, 0, ( char * ) superblock ) < 0 ) {
+        delete superblock;
+        return NULL;
+    }
+    // threads racing to load it keep whichever copy was installed first
+    if( ! __atomic_compare_exchange_n( &disk->super, &loaded, superblock, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+        delete superblock;
+        return loaded;
+    }
+    return superblock;
+}
+
+
+/**
+ * Notes that the superblock was changed and must be written back.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+void gros_superblock_dirty( Disk * disk ) {
+    __atomic_store_n( &disk->super_dirty, 1, __ATOMIC_RELEASE );
+}
+
+
 /**
  * Initializes inodes on disk
  *
@@ -71,10 +209,11 @@ void gros_init_inodes( Disk * disk, int num_inode_blocks, int inodes_per_block )
     int     j;
     int     inode_num;
     int     rel_inode_index;
-    Inode   inodes[BLOCK_SIZE / sizeof(Inode)];
+    Inode   inodes[BLOCK_SIZE / sizeof(Inode) + 1];   // padded to a full block
     Inode * tmp;
 
     inode_num    = 0;
+    std::memset( inodes, 0, sizeof( inodes ) );
     tmp          = new Inode();
     tmp->f_links = 0;
 
@@ -90,7 +229,7 @@ void gros_init_inodes( Disk * disk, int num_inode_blocks, int inodes_per_block )
             rel_inode_index = j % inodes_per_block;
             std::memcpy(&(inodes[rel_inode_index]), tmp, sizeof(Inode));
         }
-        gros_write_block( disk, i, ( char * ) inodes );
+        gros_bwrite( disk, i, ( char * ) inodes );
     }
     delete tmp;
 }
@@ -132,23 +271,22 @@ void gros_fsck( Disk * disk ) {
     Inode      * inode;
     Superblock * superblock;
 
-    gros_read_block( disk, 0, buf );
     n_indirects      = BLOCK_SIZE / sizeof( int );
-    superblock       = ( Superblock * ) buf;
+    superblock       = gros_superblock( disk );
     allocd_blocks    = ( int * ) calloc( ( size_t ) superblock->fs_num_blocks,
                                          sizeof( int ) );
 
     num_free_blocks  = 0;
     num_free_inodes  = 0;
-    num_inode_blocks = ( int ) ceil( ( superblock->fs_disk_size
-                                       / superblock->fs_block_size )
+    num_inode_blocks = ( int ) ceil( ( int ) ( superblock->fs_disk_size
+                                               / superblock->fs_block_size )
                                      * INODE_BLOCKS );
     inodes_per_block = ( int ) floor( superblock->fs_block_size
                                       / superblock->fs_inode_size );
 
     // check file system size within bounds
-    if( superblock->fs_num_blocks * superblock->fs_block_size
-        + superblock->fs_num_inodes * sizeof( Inode ) + 1
+    if( ( int64_t ) superblock->fs_num_blocks * superblock->fs_block_size
+        + ( int64_t ) superblock->fs_num_inodes * sizeof( Inode ) + 1
         > superblock->fs_disk_size ) {
         perror( "Corrupt file system size" );
         // exit or request alternate superblock
@@ -157,7 +295,7 @@ void gros_fsck( Disk * disk ) {
 
     // scan inode blocks
     for( i = 1; i <= num_inode_blocks; i++ ) {
-        gros_read_block( disk, i, ( char * ) buf );
+        gros_bread( disk, i, ( char * ) buf );
 
         // scan individual inodes in block
         for( j = 0; j < inodes_per_block; j++ ) {
@@ -191,7 +329,7 @@ void gros_fsck( Disk * disk ) {
                             size += valid;
                         }
                         else if( k == SINGLE_INDRCT ) {
-                            gros_read_block( disk, inode->f_block[ k++ ], sbuf );
+                            gros_bread( disk, inode->f_block[ k++ ], sbuf );
                             l = 0;
                             while( l < n_indirects && valid ) {
                                 valid = gros_check_blocks( disk,
@@ -201,10 +339,10 @@ void gros_fsck( Disk * disk ) {
                             }
                         }
                         else if( k == DOUBLE_INDRCT ) {
-                            gros_read_block( disk, inode->f_block[ k++ ], dbuf );
+                            gros_bread( disk, inode->f_block[ k++ ], dbuf );
                             l = 0;
                             while( l < n_indirects && valid ) {
-                                gros_read_block( disk, ( int ) dbuf[ l++ ],
+                                gros_bread( disk, ( int ) dbuf[ l++ ],
                                                  sbuf );
                                 m = 0;
                                 while( m < n_indirects && valid ) {
@@ -216,14 +354,14 @@ void gros_fsck( Disk * disk ) {
                             }
                         }
                         else if( k == TRIPLE_INDRCT ) {
-                            gros_read_block( disk, inode->f_block[ k++ ], tbuf );
+                            gros_bread( disk, inode->f_block[ k++ ], tbuf );
                             l = 0;
                             while( l < n_indirects && valid ) {
-                                gros_read_block( disk, ( int ) tbuf[ l++ ],
+                                gros_bread( disk, ( int ) tbuf[ l++ ],
                                                  dbuf );
                                 m = 0;
                                 while( m < n_indirects && valid ) {
-                                    gros_read_block( disk,
+                                    gros_bread( disk,
                                                      ( int ) dbuf[ m++ ],
                                                      sbuf );
                                     n = 0;
@@ -240,37 +378,44 @@ void gros_fsck( Disk * disk ) {
                 }
                 else if( gros_is_dir( inode->f_acl ) ) {
                     Inode    * dir_node;
-                    DirEntry * direntry;
+                    DirEntry * direntry = NULL;
+                    DirIter    iter;
                     int        dir_num  = 0;
+                    int        parent   = -1;
+                    int        at;
 
                     // check first entry refers to own inode num,
                     //  check second entry is valid parent,
                     //  check there exists a path to it in the file system
-                    if( ! gros_readdir_r( disk, inode, NULL, &direntry ) ) {
+                    gros_opendir( inode, &iter, 0 );
+                    if( ( direntry = gros_readdir( disk, &iter ) ) != NULL )
                         dir_num = direntry->inode_num;
-                        gros_readdir_r( disk, inode, direntry, &direntry );
-                    }
+                    if( ( direntry = gros_readdir( disk, &iter ) ) != NULL )
+                        parent  = direntry->inode_num;
                     if( dir_num == inode->f_inode_num
-                        && gros_check_parent( disk,
-                                              direntry->inode_num,
-                                              inode->f_inode_num )
+                        && gros_check_parent( disk, parent, inode->f_inode_num )
                         && gros_count_links( disk, inode, inode->f_inode_num, 0 )
                            > 1
                         && inode->f_size > 0 ) {
 
                         // check for valid inodes in entries, or remove
-                        while( ! gros_readdir_r( disk, inode, direntry, &direntry ) ) {
+                        while( ( direntry = gros_readdir( disk, &iter ) ) != NULL ) {
+                            at       = iter.offset - ( int ) sizeof( DirEntry );
                             dir_node = gros_get_inode( disk, direntry->inode_num );
-                            if( inode->f_links < 1 || direntry->inode_num < 1
-                                || direntry->inode_num >= superblock->fs_num_inodes ) {
+                            if( dir_node != NULL
+                                && ( inode->f_links < 1 || direntry->inode_num < 1
+                                     || direntry->inode_num >= superblock->fs_num_inodes ) ) {
                                 if( gros_is_file( dir_node->f_acl ) )
                                     gros_unlink( disk, gros_pwd( disk, inode,
                                                                  direntry->filename ) );
                                 else if( gros_is_dir( dir_node->f_acl ) )
                                     gros_rmdir( disk, gros_pwd( disk, inode,
                                                                 direntry->filename ) );
+                                // the last entry moved into its place
+                                gros_opendir( inode, &iter, at );
                             }
                             else size += sizeof( DirEntry );
+                            gros_put_inode( disk, dir_node );
                         }
                     }
                 }
@@ -337,15 +482,18 @@ const char * gros_pwd( Disk * disk, Inode * parent_dir, const char * filename )
  */
 const char * gros_get_path_to_root( Disk * disk, char * filepath, Inode * dir ) {
     DirEntry * dir_inode;
+    DirIter    iter;
     char     * path;
 
     // check if filepath is NULL
     ! filepath ? filepath = ( char * ) "\0" : filepath;
 
+    gros_opendir( dir, &iter, 0 );
     // pass over directory entry pointing to self
-    gros_readdir_r( disk, dir, NULL, &dir_inode );
+    gros_readdir( disk, &iter );
     // parent directory entry
-    gros_readdir_r( disk, dir, dir_inode, &dir_inode );
+    if( ( dir_inode = gros_readdir( disk, &iter ) ) == NULL )
+        return filepath;
 
     // allocate char array big enough for paths + slash + null terminator
     path = ( char * ) calloc( strlen( filepath )
@@ -357,10 +505,12 @@ const char * gros_get_path_to_root( Disk * disk, char * filepath, Inode * dir )
 
     // recurse until root
     if( dir_inode->inode_num > 0 ) {
+        Inode * parent = gros_get_inode( disk, dir_inode->inode_num );
+
         // only add slash if not at root
         strncat( path, ( char * ) "/", 1 );
-        gros_get_path_to_root( disk, path,
-                               gros_get_inode( disk, dir_inode->inode_num ) );
+        gros_get_path_to_root( disk, path, parent );
+        gros_put_inode( disk, parent );
     }
 
     free( filepath );
@@ -380,13 +530,15 @@ const char * gros_get_path_to_root( Disk * disk, char * filepath, Inode * dir )
 int gros_check_parent( Disk * disk, int parent_num, int inode_num ) {
     int        is_parent = 0;
     Inode    * parent    = gros_get_inode( disk, parent_num );
-    DirEntry * direntry  = NULL;
+    DirEntry * direntry;
+    DirIter    iter;
 
-    if( gros_is_dir( parent->f_acl ) ) {
-        while( ! gros_readdir_r( disk, parent, direntry, &direntry )
-               && ! is_parent )
+    if( parent != NULL && gros_is_dir( parent->f_acl ) ) {
+        gros_opendir( parent, &iter, 0 );
+        while( ! is_parent && ( direntry = gros_readdir( disk, &iter ) ) != NULL )
             is_parent = ( direntry->inode_num == inode_num );
     }
+    gros_put_inode( disk, parent );
     return is_parent;
 }
 
@@ -401,18 +553,22 @@ int gros_check_parent( Disk * disk, int parent_num, int inode_num ) {
  * @param  int     links          The current number of links
  */
 int gros_count_links( Disk * disk, Inode * dir, int inode_num, int links ) {
-    int        dir_inode_num;
     Inode    * inode;
-    DirEntry * direntry = NULL;
+    DirEntry * direntry;
+    DirIter    iter;
 
-    while( ! gros_readdir_r( disk, dir, direntry, &direntry ) ) {
+    gros_opendir( dir, &iter, 0 );
+    while( ( direntry = gros_readdir( disk, &iter ) ) != NULL ) {
         // increment links if inode number found
         links += ( direntry->inode_num == inode_num );
 
-        // continue traversal, increment links if directory is found
+        // continue traversal below, not back up through "." and ".."
+        if( iter.offset <= 2 * ( int ) sizeof( DirEntry ) )
+            continue;
         inode = gros_get_inode( disk, direntry->inode_num );
-        if( gros_is_dir( inode->f_acl ) )
-            gros_count_links( disk, inode, inode_num, links );
+        if( inode != NULL && gros_is_dir( inode->f_acl ) )
+            links = gros_count_links( disk, inode, inode_num, links );
+        gros_put_inode( disk, inode );
     }
     return links;
 }
@@ -436,13 +592,12 @@ int gros_check_blocks( Disk * disk, int * allocd_blocks, int block_num ) {
     int          valid = 0;
     int          size  = 0;
 
-    gros_read_block( disk, 0, buf );
-    superblock = ( Superblock * ) buf;
+    superblock = gros_superblock( disk );
 
     // check block number is valid
     if( block_num > 0 || block_num < superblock->fs_num_blocks ) {
         // check if data block is marked used in bitmap
-        gros_read_block( disk, block_num % superblock->fs_num_block_groups,
+        gros_bread( disk, block_num % superblock->fs_num_block_groups,
                          bbuf );
         valid = gros_is_bit_set( ( Bitmap * ) bbuf, block_num );
 
@@ -455,7 +610,7 @@ int gros_check_blocks( Disk * disk, int * allocd_blocks, int block_num ) {
         // add to list if not duplicate and calculate size
         if( valid ) {
             allocd_blocks[ i ] = block_num;
-            gros_read_block( disk, block_num, bbuf );
+            gros_bread( disk, block_num, bbuf );
 
             // calculate size of block
 //            TODO check properly detects end of file, looks for 0
@@ -476,12 +631,15 @@ int gros_check_blocks( Disk * disk, int * allocd_blocks, int block_num ) {
 Inode * gros_find_free_inode( Disk * disk ) {
     int          i                = 0;
     int          free_inode_index = -1;
-    Superblock * superblock       = new Superblock();
+    Superblock * superblock       = gros_superblock( disk );
 
-    gros_read_block( disk, 0, ( char * ) superblock );
+    if( superblock == NULL )
+        return NULL;
+    pthread_mutex_lock( &disk->super_lock );
 
     // check if any inodes available for allocation
     if( superblock->fs_num_used_inodes >= superblock->fs_num_inodes ) {
+        pthread_mutex_unlock( &disk->super_lock );
         perror( "Not enough disk space to create file" );
         return NULL;
     }
@@ -493,15 +651,14 @@ Inode * gros_find_free_inode( Disk * disk ) {
     if( i < SB_ILIST_SIZE ) {
         free_inode_index = superblock->free_inodes[ i ];
         superblock->free_inodes[ i ] = -1;
-        superblock->fs_num_used_inodes += 1;
+        __sync_fetch_and_add( &superblock->fs_num_used_inodes, 1 );
 
         // repopulate free list if allocating last inode in list
         if( i == SB_ILIST_SIZE - 1 )
             gros_repopulate_ilist( disk, free_inode_index );
+        gros_superblock_dirty( disk );
     }
-
-    // save the superblock to disk with updated free ilist
-    gros_write_block( disk, 0, ( char * ) superblock );
+    pthread_mutex_unlock( &disk->super_lock );
 
     // otherwise, return that inode.
     return gros_get_inode( disk, free_inode_index );
@@ -509,7 +666,8 @@ Inode * gros_find_free_inode( Disk * disk ) {
 
 
 /**
-* Scan inode blocks for more free inode numbers for free ilist
+* Scan inode blocks for more free inode numbers for free ilist. Called with
+*  the disk's super_lock held once the file system is in use.
 *
 * @param Disk * disk         The disk that contains the file system
 * @param int    inode_index  The
@@ -519,20 +677,20 @@ void gros_repopulate_ilist( Disk * disk, int inode_index ) {
     int           j;
     int           rel_inode_index;
     char          buf[ BLOCK_SIZE ];
-    Superblock  * superblock  = new Superblock();
+    Superblock  * superblock  = gros_superblock( disk );
     Inode       * tmp         = new Inode();
     int           ilist_count = 0;
+    std::vector< int > ilist( SB_ILIST_SIZE );  /* only a full list replaces the old one */
 
-    gros_read_block( disk, 0, ( char * ) superblock );
-
-    int num_blocks       = superblock->fs_disk_size / superblock->fs_block_size;
+    int num_blocks       = ( int ) ( superblock->fs_disk_size
+                                     / superblock->fs_block_size );
     int num_inode_blocks = ( int ) ceil( num_blocks * INODE_BLOCKS );
     int inode_per_block  = ( int ) floor( superblock->fs_block_size
                                          / superblock->fs_inode_size );
     int starting_block   = inode_index / inode_per_block;
 
     for( i = starting_block; i <= num_inode_blocks; i++ ) {
-        gros_read_block( disk, i, ( char * ) buf );
+        gros_bread( disk, i, ( char * ) buf );
 
         for( j = 0; j < inode_per_block; j++ ) {
             rel_inode_index = j % inode_per_block;
@@ -540,9 +698,10 @@ void gros_repopulate_ilist( Disk * disk, int inode_index ) {
                          ( ( Inode * ) buf ) + rel_inode_index,
                          sizeof( Inode ) );
             if( tmp->f_links == 0 ) {
-                superblock->free_inodes[ ilist_count++ ] = tmp->f_inode_num;
+                ilist[ ilist_count++ ] = tmp->f_inode_num;
                 if( ilist_count == SB_ILIST_SIZE ) {
-                    gros_write_block( disk, 0, ( char * ) superblock );
+                    std::copy( ilist.begin(), ilist.end(), superblock->free_inodes );
+                    gros_superblock_dirty( disk );
                     return;
                 }
             }
@@ -557,7 +716,27 @@ void gros_repopulate_ilist( Disk * disk, int inode_index ) {
  * @param  Disk * disk    The disk that contains the file system
  */
 Inode * gros_new_inode( Disk * disk ) {
-    Inode * inode           = gros_find_free_inode( disk );
+    return gros_new_inode_near( disk, -1 );
+}
+
+
+/**
+ * Returns a new allocated inode like gros_new_inode, with its first data
+ *  block as close after block `goal` as there is room, or in the inode's
+ *  home group for a goal of -1. Returns NULL if no inode is free.
+ *
+ * @param  Disk * disk    The disk that contains the file system
+ * @param  int    goal    The block to place the inode's data near, or -1
+ */
+Inode * gros_new_inode_near( Disk * disk, int goal ) {
+    Inode * inode;
+    int     count;
+
+    gros_journal_begin( disk );
+    if( ( inode = gros_find_free_inode( disk ) ) == NULL ) {
+        gros_journal_end( disk );
+        return NULL;
+    }
     inode -> f_size         = 0;
     inode -> f_uid          = 0;            //through system call??
     inode -> f_gid          = 0;            //through system call??
@@ -566,41 +745,106 @@ Inode * gros_new_inode( Disk * disk ) {
     inode -> f_mtime        = time( NULL );
     inode -> f_atime        = time( NULL );
     inode -> f_links        = 0;            // set to 1 in gros_mknod
-    inode -> f_block[ 0 ]   = gros_allocate_data_block( disk );
+    inode -> f_block[ 0 ]   = gros_allocate_data_blocks(
+            disk, goal != -1 ? goal : gros_inode_goal( disk, inode->f_inode_num ),
+            1, &count );
+    gros_journal_end( disk );
     return inode;
 }
 
 
 /**
- * Returns the Inode corresponding to the given inode index
+ * Reads inode `inode_num` from its block into `inode`. Returns 0, -EINVAL
+ *  for an inode number outside the file system or -EIO.
  *
- * @param Disk * disk       The disk containing the file system
- * @param int    inode_num  The inode index to retrieve
-*/
-Inode * gros_get_inode( Disk * disk, int inode_num ) {
+ * @param Disk  * disk       The disk containing the file system
+ * @param int     inode_num  The inode index to read
+ * @param Inode * inode      Where to put it
+ */
+int gros_read_inode( Disk * disk, int inode_num, Inode * inode ) {
     int           inodes_per_block;
     int           block_num;
     int           rel_inode_index;
     char          buf[ BLOCK_SIZE ];
-    Superblock  * superblock = new Superblock();
-    Inode       * ret_inode = new Inode();
-
-    gros_read_block( disk, 0, ( char * ) superblock );
+    char        * block;
+    Superblock  * superblock;
+
+    // on a mapped disk the block points straight into the image, no copy needed
+    if( ( superblock = gros_superblock( disk ) ) == NULL )
+        return -EIO;
+    if( inode_num < 0 || inode_num >= superblock->fs_num_inodes )
+        return -EINVAL;
     inodes_per_block = ( int ) floor( 1.0f*superblock->fs_block_size
                                       / superblock->fs_inode_size );
-    delete superblock;
     block_num       = 1+inode_num / inodes_per_block;
     rel_inode_index = inode_num % inodes_per_block;
 
-    gros_read_block( disk, block_num, buf );
-    Inode * block_inodes = ( Inode * ) buf;
-    std::memcpy( ret_inode,
+    if( ( block = gros_bget( disk, block_num, buf ) ) == NULL )
+        return -EIO;
+    Inode * block_inodes = ( Inode * ) block;
+    std::memcpy( inode,
                  &( block_inodes[ rel_inode_index ] ),
                  sizeof( Inode ) );
+    return 0;
+}
+
+
+/**
+ * Returns the Inode corresponding to the given inode index, or NULL if
+ *  there is no such inode. With an inode cache every caller shares one
+ *  copy; either way it is given back with gros_put_inode.
+ *
+ * @param Disk * disk       The disk containing the file system
+ * @param int    inode_num  The inode index to retrieve
+*/
+Inode * gros_get_inode( Disk * disk, int inode_num ) {
+    Inode * ret_inode;
+
+    if( disk->icache != NULL )
+        return gros_icache_get( disk, inode_num );
+    ret_inode = new Inode();
+    if( gros_read_inode( disk, inode_num, ret_inode ) < 0 ) {
+        delete ret_inode;
+        return NULL;
+    }
     return ret_inode;
 }
 
 
+/**
+ * Gives back an Inode returned by gros_get_inode or gros_new_inode. Does
+ *  nothing for NULL.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The inode to give back
+ */
+void gros_put_inode( Disk * disk, Inode * inode ) {
+    if( inode == NULL )
+        return;
+    if( disk->icache != NULL )
+        gros_icache_put( disk, inode );
+    else
+        delete inode;
+}
+
+
+/**
+ * Notes that an Inode was changed without being saved. With an inode cache
+ *  it is saved once it is given back for the last time, or on
+ *  gros_i_fsync; without one, or with a journal, whose transaction the
+ *  change has to join, it is saved right away.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The changed inode
+ */
+void gros_inode_dirty( Disk * disk, Inode * inode ) {
+    if( disk->icache != NULL && disk->journal == NULL )
+        gros_icache_dirty( disk, inode );
+    else
+        gros_save_inode( disk, inode );
+}
+
+
 /**
  * Saves an Inode back to disk
  *
@@ -608,16 +852,31 @@ Inode * gros_get_inode( Disk * disk, int inode_num ) {
  * @param Inode * inode   The inode to save
  */
 int gros_save_inode( Disk * disk, Inode * inode ) {
+    if( disk->icache != NULL )
+        return gros_icache_save( disk, inode );
+    return gros_write_inode( disk, inode );
+}
+
+
+/**
+ * Writes an Inode into its block, leaving the inode cache alone. Returns
+ *  the inode number or -errno.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The inode to write
+ */
+int gros_write_inode( Disk * disk, Inode * inode ) {
     int          block_num;
     int          inodes_per_block;
     int          inode_num;
     int          rel_inode_index;
     int          status;
     char         buf[ BLOCK_SIZE ];
-    Superblock * superblock = new Superblock();
+    char       * block;
+    Superblock * superblock;
 
     // get data from superblock to calculate where inode should be
-    gros_read_block( disk, 0, ( char * ) superblock );
+    superblock       = gros_superblock( disk );
     inode_num        = inode->f_inode_num;
     inodes_per_block = ( int ) floor( superblock->fs_block_size
                                       / superblock->fs_inode_size );
@@ -625,12 +884,13 @@ int gros_save_inode( Disk * disk, Inode * inode ) {
     rel_inode_index  = inode_num % inodes_per_block;
 
     // save the inode to disk
-    gros_read_block( disk, block_num, buf );
-    std::memcpy( ( & ( ( Inode * ) buf )[ rel_inode_index ] ), inode,
+    if( ( block = gros_bget( disk, block_num, buf ) ) == NULL )
+        return -EIO;
+    std::memcpy( ( & ( ( Inode * ) block )[ rel_inode_index ] ), inode,
                  sizeof( Inode ) );
 
     // check if write back successful ( 0 = success ), else return error
-    if( ! ( status = gros_write_block( disk, block_num, buf ) ) )
+    if( ! ( status = gros_bwrite( disk, block_num, block ) ) )
         return inode_num;
     else
         return status;
@@ -649,54 +909,70 @@ void gros_free_inode( Disk * disk, Inode * inode ) {
     char tbuf[ BLOCK_SIZE ];
     int  i;
     int  j;
-    int  direct_blocks;
     int  done;
-    int  num_blocks;
     int  n_indirects;
 
-    num_blocks     = ( int ) ceil( inode->f_size / BLOCK_SIZE );
-    direct_blocks  = std::min( SINGLE_INDRCT, num_blocks );
+    gros_journal_begin( disk );
+    // blocks reserved for the file but never used go first, then a
+    // directory's index
+    gros_prealloc_release( disk, inode->f_inode_num );
+    gros_dindex_drop( disk, inode );
+
     n_indirects    = BLOCK_SIZE / sizeof( int );
 
-    // deallocate the direct blocks
+    // deallocate the direct blocks, up to the first unallocated one (an
+    // empty file still has its first block)
     done           = gros_free_blocks_list( disk,
                                             ( int * ) inode->f_block,
-                                            direct_blocks );
+                                            SINGLE_INDRCT );
 
-    // deallocate the single indirect blocks
-    if( ! done ) {
+    // deallocate the single indirect blocks, then the block listing them
+    if( ! done && inode->f_block[ SINGLE_INDRCT ] > 0 ) {
         // gros_read in the block of redirects to buffer
-        gros_read_block( disk, inode->f_block[ SINGLE_INDRCT ], sbuf );
+        gros_bread( disk, inode->f_block[ SINGLE_INDRCT ], sbuf );
         done = gros_free_blocks_list( disk, ( int * ) sbuf, n_indirects );
+        gros_free_data_block( disk, inode->f_block[ SINGLE_INDRCT ] );
     }
 
     // deallocate the double indirect blocks
-    if( ! done ) {
+    if( ! done && inode->f_block[ DOUBLE_INDRCT ] > 0 ) {
         // gros_read in the block of double redirects to buffer
-        gros_read_block( disk, inode->f_block[ DOUBLE_INDRCT ], dbuf );
+        gros_bread( disk, inode->f_block[ DOUBLE_INDRCT ], dbuf );
 
-        for( i = 0; i < BLOCK_SIZE / sizeof( int ); i++ ) {
-            gros_read_block( disk, ( int ) dbuf[ i ], sbuf ); // single indirects
+        for( i = 0; ! done && i < n_indirects; i++ ) {
+            if( ( ( int * ) dbuf )[ i ] <= 0 ) {
+                done = 1;
+                break;
+            }
+            gros_bread( disk, ( ( int * ) dbuf )[ i ], sbuf ); // single indirects
             done = gros_free_blocks_list( disk, ( int * ) sbuf, n_indirects );
-            if( done ) break;
+            gros_free_data_block( disk, ( ( int * ) dbuf )[ i ] );
         }
+        gros_free_data_block( disk, inode->f_block[ DOUBLE_INDRCT ] );
     }
 
     // deallocate the triple indirect blocks
-    if( ! done ) {
-        gros_read_block( disk, inode->f_block[ TRIPLE_INDRCT ], tbuf ); // triple
-
-        for( i = 0; i < n_indirects; i++ ) {
-            gros_read_block( disk, tbuf[ i ], dbuf ); // double indirects
-
-            for( j = 0; j < n_indirects; j++ ) {
-                gros_read_block( disk, dbuf[ i ], sbuf ); // single indirects
+    if( ! done && inode->f_block[ TRIPLE_INDRCT ] > 0 ) {
+        gros_bread( disk, inode->f_block[ TRIPLE_INDRCT ], tbuf ); // triple
+
+        for( i = 0; ! done && i < n_indirects; i++ ) {
+            if( ( ( int * ) tbuf )[ i ] <= 0 )
+                break;
+            gros_bread( disk, ( ( int * ) tbuf )[ i ], dbuf ); // double indirects
+
+            for( j = 0; ! done && j < n_indirects; j++ ) {
+                if( ( ( int * ) dbuf )[ j ] <= 0 ) {
+                    done = 1;
+                    break;
+                }
+                gros_bread( disk, ( ( int * ) dbuf )[ j ], sbuf ); // single indirects
                 done = gros_free_blocks_list( disk, ( int * ) sbuf,
                                               n_indirects );
-                if( done ) break;
+                gros_free_data_block( disk, ( ( int * ) dbuf )[ j ] );
             }
-            if( done ) break;
+            gros_free_data_block( disk, ( ( int * ) tbuf )[ i ] );
         }
+        gros_free_data_block( disk, inode->f_block[ TRIPLE_INDRCT ] );
     }
     inode->f_links = 0;
     for( i = 0; i <= TRIPLE_INDRCT; i++ ) {
@@ -706,6 +982,7 @@ void gros_free_inode( Disk * disk, Inode * inode ) {
     gros_save_inode( disk, inode );
     // try to put inode number on free list
     gros_update_free_list( disk, inode->f_inode_num );
+    gros_journal_end( disk );
 }
 
 
@@ -717,13 +994,12 @@ void gros_free_inode( Disk * disk, Inode * inode ) {
  * @param Inode *  inode_num  The inode number to try to add to free list
  */
 void gros_update_free_list( Disk * disk, int inode_num ) {
-    char         buf[ BLOCK_SIZE ];
     int          i;
     Superblock * superblock;
 
-    gros_read_block( disk, 0, buf );
-    superblock = ( Superblock * ) buf;
+    superblock = gros_superblock( disk );
     i          = 0;
+    pthread_mutex_lock( &disk->super_lock );
 
     // scan list for empty space
     while( i < SB_ILIST_SIZE && superblock->free_inodes[ i ] > 0 )
@@ -737,14 +1013,16 @@ void gros_update_free_list( Disk * disk, int inode_num ) {
         if( i < SB_ILIST_SIZE )
             superblock->free_inodes[ i ] = inode_num;
     }
-    superblock->fs_num_used_inodes--;
-    // update superblock on disk
-    gros_write_block( disk, 0, ( char * ) superblock );
+    __sync_fetch_and_sub( &superblock->fs_num_used_inodes, 1 );
+    gros_superblock_dirty( disk );
+    pthread_mutex_unlock( &disk->super_lock );
 }
 
 
 /**
- *  Given an array of `n` block numbers, deallocate each one.
+ *  Given an array of `n` block numbers, deallocate each one. Blocks of a
+ *  compressed cluster (GROS_ZBLOCK) own no block of their own and are
+ *  skipped; the list ends at the first unallocated block.
  *
  *  @param Disk * disk          The disk containing the file system
  *  @param int  * block_list    The array of block numbers
@@ -758,7 +1036,7 @@ int gros_free_blocks_list( Disk * disk, int * block_list, int n ) {
         block_num = block_list[ i++ ];
         if( block_num > 0 )  // block is allocated
             gros_free_data_block( disk, block_num );
-        else
+        else if( block_num != GROS_ZBLOCK )
             return 1;
     }
     return 0;
@@ -766,39 +1044,208 @@ int gros_free_blocks_list( Disk * disk, int * block_list, int n ) {
 
 
 /**
- * Deallocates a data block
+ * Deallocates a data block. A block that is already free is left alone, so
+ *  freeing it twice does not throw the used block count off.
  *
  * @param Disk * disk         The disk containing the file system
  * @param int    block_index  The block number of the block to deallocate
  */
 void gros_free_data_block( Disk * disk, int block_index ) {
     char buf[ BLOCK_SIZE ];
-    int relative_index, block_group, offset;
+    char * block;
+    int relative_index, block_group, offset, bitmap_block;
     Bitmap * bm;
-    Superblock * superblock = new Superblock();
-
-    // gros_write zeroes to block
-    gros_write_block( disk, block_index, buf );
+    Superblock * superblock;
 
-    // decrement number of used datablocks for the superblock
-    gros_read_block( disk, 0, ( char * ) superblock );
-    superblock->fs_num_used_blocks--;
-    gros_write_block( disk, 0, ( char * ) superblock );
+    // a block other files still share stays allocated
+    gros_journal_begin( disk );
+    if( gros_unshare_block( disk, block_index ) != 0 ) {
+        gros_journal_end( disk );
+        return;
+    }
 
     // calculate which block group this block is in
+    superblock      = gros_superblock( disk );
     relative_index  = block_index - superblock->first_data_block;
     block_group     = relative_index / BLOCK_SIZE;
     offset          = relative_index % BLOCK_SIZE;
+    bitmap_block    = superblock->first_data_block + block_group * BLOCK_SIZE;
 
     // mark the block as unused in its block group leader
-    gros_read_block( disk,
-                     superblock->first_data_block + block_group * BLOCK_SIZE,
-                     buf );
-    bm = gros_init_bitmap( BLOCK_SIZE, buf );
-    gros_unset_bit( bm, offset );
-    gros_write_block( disk,
-                      superblock->first_data_block + block_group * BLOCK_SIZE,
-                      buf );
+    pthread_mutex_lock( &disk->alloc_lock );
+    if( ( block = gros_bget( disk, bitmap_block, buf ) ) == NULL ) {
+        pthread_mutex_unlock( &disk->alloc_lock );
+        gros_journal_end( disk );
+        return;
+    }
+    bm = gros_init_bitmap( BLOCK_SIZE, block );
+    if( gros_is_bit_set( bm, offset ) == 1 ) {
+        gros_unset_bit( bm, offset );
+        gros_freemap_update( disk, block_group, bm, offset, 1, 0 );
+        gros_bwrite( disk, bitmap_block, block );
+
+        // the block's contents are dropped rather than overwritten, and the
+        // space goes back to the host along with other freed blocks
+        gros_bdiscard( disk, block_index );
+
+        // decrement number of used datablocks for the superblock
+        __sync_fetch_and_sub( &superblock->fs_num_used_blocks, 1 );
+        gros_superblock_dirty( disk );
+    }
+    pthread_mutex_unlock( &disk->alloc_lock );
+    gros_journal_end( disk );
+    delete bm;
+}
+
+
+/**
+ * Returns the start of the first run of `n` clear bits of `bm` in
+ *  `from` .. `limit` - 1, or of the longest shorter one, setting `len` to
+ *  its length. Returns -1 if there is no clear bit.
+ */
+static int gros_free_run( Bitmap * bm, int from, int limit, int n, int * len ) {
+    int best = -1;
+    int start;
+    int end;
+
+    * len = 0;
+    for( start = gros_find_unset_bit( bm, from, limit ); start != -1;
+         start = gros_find_unset_bit( bm, end, limit ) ) {
+        if( ( end = gros_find_set_bit( bm, start, std::min( limit, start + n ) ) ) == -1 )
+            end = std::min( limit, start + n );
+        if( end - start > * len ) {
+            best  = start;
+            * len = end - start;
+        }
+        if( * len == n )
+            break;
+    }
+    return best;
+}
+
+
+/**
+ * Finds a run of up to `n` free blocks in block group `group`, looking at
+ *  bit `from` of its bitmap first and passing over blocks reserved for
+ *  growing files, and marks the first `take` of them used (all of them if
+ *  `take` is 0). The bitmap is read, searched and written back under the
+ *  allocator lock, so two writers never get the same blocks. Returns the
+ *  first block number and sets `count` to the length of the run, or
+ *  returns -1 if the group has none.
+ */
+static int gros_take_data_blocks( Disk * disk, Superblock * superblock, int group,
+                                  int from, int n, int * count, int take ) {
+    char     buf[ BLOCK_SIZE ];
+    char     mbuf[ BLOCK_SIZE ];
+    char   * block;
+    int      block_num;
+    int      limit;
+    int      bitmap_index;
+    Bitmap * bitmap;
+    Bitmap * search;
+
+    // block num for block group free list
+    block_num = superblock->first_data_block + group * BLOCK_SIZE;
+    // the last group may run past the end of the disk
+    limit = ( int ) ( superblock->fs_disk_size / BLOCK_SIZE ) - block_num;
+    if( limit <= 0 )
+        return -1;
+    pthread_mutex_lock( &disk->alloc_lock );
+    // on a mapped disk the bitmap is searched and updated in place
+    if( ( block = gros_bget( disk, block_num, buf ) ) == NULL ) {
+        pthread_mutex_unlock( &disk->alloc_lock );
+        return -1;
+    }
+    bitmap = gros_init_bitmap( superblock->fs_block_size, block );
+    // reserved blocks are free on disk, so they are hidden in a copy
+    search = bitmap;
+    if( disk->prealloc != NULL ) {
+        std::memcpy( mbuf, block, BLOCK_SIZE );
+        search = gros_init_bitmap( superblock->fs_block_size, mbuf );
+        gros_prealloc_mask( disk, block_num, limit, search );
+    }
+
+    // the summary may point past a free bit that was not noted in it
+    if( ( bitmap_index = gros_free_run( search, from, limit, n, count ) ) == -1 && from > 0 )
+        bitmap_index = gros_free_run( search, 0, from, n, count );
+    // if there is a free block in this block group
+    if( bitmap_index != -1 ) {
+        take = take > 0 ? std::min( take, * count ) : * count;
+        // mark the data blocks as not free, all in one bitmap update
+        gros_set_bits( bitmap, bitmap_index, take );
+        gros_freemap_update( disk, group, bitmap, bitmap_index, take, 1 );
+        gros_bwrite( disk, block_num, block );
+        __sync_fetch_and_add( &superblock->fs_num_used_blocks, take );
+        gros_superblock_dirty( disk );
+        pthread_mutex_unlock( &disk->alloc_lock );
+        if( search != bitmap )
+            delete search;
+        delete bitmap;
+        return block_num + bitmap_index; // block num for free block
+    }
+    // the group is full whatever the summary said, unless what is left
+    // of it is reserved
+    if( search == bitmap || gros_free_run( bitmap, 0, limit, 1, count ) == -1 )
+        gros_freemap_refresh( disk, group, bitmap );
+    pthread_mutex_unlock( &disk->alloc_lock );
+    * count = 0;
+    if( search != bitmap )
+        delete search;
+    delete bitmap;
+    return -1;
+}
+
+
+/**
+ * Searches for a run of at most `n` free blocks from block `goal` on, as
+ *  gros_allocate_data_blocks describes, and marks the first `take` of them
+ *  used (all of them if `take` is 0).
+ */
+static int gros_find_data_blocks( Disk * disk, int goal, int n, int * count, int take ) {
+    int          i;
+    int          from;
+    int          tries;
+    int          start    = 0;     /* group holding the goal */
+    int          goal_bit = 0;     /* where the goal is in its bitmap */
+    int          block_num;
+    Superblock * superblock;
+
+    * count = 0;
+    if( n < 1 || ( superblock = gros_superblock( disk ) ) == NULL )
+        return -1;
+    if( goal >= superblock->first_data_block
+        && goal < superblock->fs_disk_size / BLOCK_SIZE ) {
+        start    = ( goal - superblock->first_data_block ) / BLOCK_SIZE;
+        goal_bit = ( goal - superblock->first_data_block ) % BLOCK_SIZE;
+    } else {
+        goal     = -1;
+    }
+
+    // the free space summary leads straight to a group and word with room;
+    // a group it is wrong about is summarized again, so tries are bounded
+    if( disk->freemap != NULL ) {
+        for( tries = 0; tries <= superblock->fs_num_block_groups
+                        && gros_freemap_find( disk, start, &i, &from ) == 0; tries++ ) {
+            if( goal != -1 && i == start )
+                from = std::max( from, goal_bit );
+            if( ( block_num = gros_take_data_blocks( disk, superblock, i, from,
+                                                     n, count, take ) ) != -1 )
+                return block_num;
+            // a group whose free blocks are all reserved stays in the
+            // summary, so the search goes on after it
+            goal  = -1;
+            start = ( i + 1 ) % superblock->fs_num_block_groups;
+        }
+        return -1;
+    }
+    for( tries = 0; tries < superblock->fs_num_block_groups; tries++ ) {
+        i = ( start + tries ) % superblock->fs_num_block_groups;
+        if( ( block_num = gros_take_data_blocks( disk, superblock, i,
+                                                 i == start ? goal_bit : 0,
+                                                 n, count, take ) ) != -1 )
+            return block_num;
+    }
+    return -1;    // no blocks available
 }
 
 
@@ -810,31 +1257,151 @@ void gros_free_data_block( Disk * disk, int block_index ) {
  * @param Disk * disk    The disk containing the file system
  */
 int gros_allocate_data_block( Disk * disk ) {
-    char         buf[ BLOCK_SIZE ];
-    int          i;
-    int          bitmap_index;
-    int          block_num;
-    Superblock * superblock = new Superblock;
+    int count;
 
-    gros_read_block( disk, 0, ( char * ) superblock );
+    return gros_allocate_data_blocks( disk, -1, 1, &count );
+}
 
-    for( i = 0; i < superblock->fs_num_block_groups; i++ ) {
-        // block num for block group free list
-        block_num = superblock->first_data_block + i * BLOCK_SIZE;
-        gros_read_block( disk, block_num, buf );
-        Bitmap * bitmap = gros_init_bitmap( superblock->fs_block_size, buf );
 
-        // if there is a free block in this block group
-        if( ( bitmap_index = gros_first_unset_bit( bitmap ) ) != -1 ) {
-            // mark the data block as not free
-            gros_set_bit( bitmap, bitmap_index );
-            gros_write_block( disk, block_num, buf );
-            superblock->fs_num_used_blocks++;
-            gros_write_block( disk, 0, ( char * ) superblock );
-            return block_num + bitmap_index; // block num for free block
+/**
+ * Allocates a run of physically contiguous data blocks, at most `n` of
+ *  them, with a single update of the superblock and of one bitmap. The
+ *  search starts at block `goal`, then goes on through the rest of its
+ *  group and the groups after it; without a goal (-1) it starts at the
+ *  first group with room. The first free run of `n` blocks in a group is
+ *  taken, or else the longest run there. Returns the first block number of
+ *  the run and sets `count` to its length, or returns -1 if there are no
+ *  blocks available.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    goal    The block the run should preferably start at, or -1
+ * @param int    n       The number of blocks wanted
+ * @param int  * count   Set to the number of blocks allocated
+ */
+int gros_allocate_data_blocks( Disk * disk, int goal, int n, int * count ) {
+    int block_num;
+
+    gros_journal_begin( disk );
+    block_num = gros_find_data_blocks( disk, goal, n, count, 0 );
+    gros_journal_end( disk );
+    return block_num;
+}
+
+
+/**
+ * Finds a run of free blocks like gros_allocate_data_blocks, but marks only
+ *  its first `take` blocks used. The rest of the run stays free on disk for
+ *  the caller to reserve in memory, see gros_prealloc_mask. Returns the
+ *  first block number of the run and sets `count` to its length, or
+ *  returns -1 if there are no blocks available.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    goal    The block the run should preferably start at, or -1
+ * @param int    n       The number of blocks wanted
+ * @param int    take    How many blocks at the start of the run to mark used
+ * @param int  * count   Set to the length of the run
+ */
+int gros_reserve_data_blocks( Disk * disk, int goal, int n, int take, int * count ) {
+    int block_num;
+
+    gros_journal_begin( disk );
+    block_num = gros_find_data_blocks( disk, goal, n, count, std::max( take, 1 ) );
+    gros_journal_end( disk );
+    return block_num;
+}
+
+
+/**
+ * Marks the free blocks from `first` on used, up to `n` of them and no
+ *  further than the first block already in use or the end of its block
+ *  group, with one update of their bitmap and of the superblock. Meant for
+ *  blocks the caller reserved with gros_reserve_data_blocks. Returns how
+ *  many blocks were marked, 0 if block `first` is in use.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    first   The first block to mark used
+ * @param int    n       The number of blocks wanted
+ */
+int gros_claim_data_blocks( Disk * disk, int first, int n ) {
+    char         buf[ BLOCK_SIZE ];
+    char       * block;
+    int          group;
+    int          offset;
+    int          end;
+    int          block_num;
+    int          claimed = 0;
+    Bitmap     * bitmap;
+    Superblock * superblock;
+
+    if( n < 1 || ( superblock = gros_superblock( disk ) ) == NULL
+        || first < superblock->first_data_block
+        || first >= superblock->fs_disk_size / BLOCK_SIZE )
+        return 0;
+    group     = ( first - superblock->first_data_block ) / BLOCK_SIZE;
+    offset    = ( first - superblock->first_data_block ) % BLOCK_SIZE;
+    block_num = superblock->first_data_block + group * BLOCK_SIZE;
+    n         = std::min( n, BLOCK_SIZE - offset );
+    n         = std::min( n, ( int ) ( superblock->fs_disk_size / BLOCK_SIZE ) - first );
+
+    gros_journal_begin( disk );
+    pthread_mutex_lock( &disk->alloc_lock );
+    if( ( block = gros_bget( disk, block_num, buf ) ) != NULL ) {
+        bitmap = gros_init_bitmap( superblock->fs_block_size, block );
+        if( ( end = gros_find_set_bit( bitmap, offset, offset + n ) ) == -1 )
+            end = offset + n;
+        if( ( claimed = end - offset ) > 0 ) {
+            gros_set_bits( bitmap, offset, claimed );
+            gros_freemap_update( disk, group, bitmap, offset, claimed, 1 );
+            gros_bwrite( disk, block_num, block );
+            __sync_fetch_and_add( &superblock->fs_num_used_blocks, claimed );
+            gros_superblock_dirty( disk );
         }
+        delete bitmap;
     }
-    return -1;    // no blocks available
+    pthread_mutex_unlock( &disk->alloc_lock );
+    gros_journal_end( disk );
+    return claimed;
+}
+
+
+/**
+ * Returns a block to aim the allocation of a new inode's data at: the first
+ *  block of its home group, which inode numbers are spread over evenly.
+ *
+ * @param Disk * disk        The disk containing the file system
+ * @param int    inode_num   The inode number
+ */
+int gros_inode_goal( Disk * disk, int inode_num ) {
+    Superblock * superblock = gros_superblock( disk );
+    int64_t      group;
+
+    if( superblock == NULL || superblock->fs_num_inodes < 1 )
+        return -1;
+    group = ( int64_t ) inode_num * superblock->fs_num_block_groups
+            / superblock->fs_num_inodes;
+    return superblock->first_data_block + ( int ) group * BLOCK_SIZE + 1;
+}
+
+
+/**
+ * Returns a block to aim a new directory at, Orlov style: directories made
+ *  at the top of the tree go to the group with the most free blocks, so
+ *  unrelated trees spread out; others stay near `parent`, their parent
+ *  directory. Returns -1 for no preference.
+ *
+ * @param Disk  * disk     The disk containing the file system
+ * @param Inode * parent   The directory the new one is made in
+ */
+int gros_dir_goal( Disk * disk, Inode * parent ) {
+    Superblock * superblock;
+    int          group;
+
+    if( parent->f_inode_num != 0 )
+        return parent->f_block[ 0 ];
+    if( disk->freemap == NULL || ( group = gros_freemap_roomiest( disk ) ) < 0 )
+        return -1;
+    superblock = gros_superblock( disk );
+    return superblock->first_data_block + group * BLOCK_SIZE + 1;
 }
 
 int gros_is_file( short acl ) {
@@ -875,7 +1442,7 @@ TEST_CASE( "OS File System can be properly created", "[FileSystem]" ) {
         REQUIRE( superblock->fs_inode_size == sizeof( Inode ) );
 
         REQUIRE( superblock->fs_num_blocks ==
-                 floor( num_blocks * DATA_BLOCKS ) );
+                 num_blocks - superblock->first_data_block );
         REQUIRE( superblock->fs_num_inodes ==
                  num_inode_blocks * inode_per_block );
         REQUIRE( superblock->fs_num_block_groups ==
@@ -883,7 +1450,18 @@ TEST_CASE( "OS File System can be properly created", "[FileSystem]" ) {
                        superblock->fs_block_size ) );
         REQUIRE( superblock->fs_num_used_inodes == 0 );
         REQUIRE( superblock->fs_num_used_blocks == 0 );
-        REQUIRE( superblock->first_data_block == 1 + num_inode_blocks );
+        REQUIRE( superblock->fs_journal_start == 1 + num_inode_blocks );
+        REQUIRE( superblock->fs_journal_blocks == gros_journal_size( num_blocks ) );
+        REQUIRE( superblock->fs_csum_start ==
+                 superblock->fs_journal_start + superblock->fs_journal_blocks );
+        REQUIRE( superblock->fs_csum_blocks == gros_csum_size( num_blocks ) );
+        REQUIRE( superblock->fs_dedup_start ==
+                 superblock->fs_csum_start + superblock->fs_csum_blocks );
+        REQUIRE( superblock->fs_dedup_refs == gros_dedup_refs_size( num_blocks ) );
+        REQUIRE( superblock->fs_dedup_index == gros_dedup_index_size( num_blocks ) );
+        REQUIRE( superblock->first_data_block == 1 + num_inode_blocks
+                 + superblock->fs_journal_blocks + superblock->fs_csum_blocks
+                 + superblock->fs_dedup_refs + superblock->fs_dedup_index );
     }
 
     int inode_count = 0;
@@ -911,6 +1489,8 @@ TEST_CASE( "A free inode can be found", "[FileSystem]" ) {
     inode = gros_find_free_inode( disk );
     int free_inode_index = -1;
     Superblock * superblock = new Superblock();
+    // the free list reaches block 0 on sync
+    REQUIRE( gros_bsync( disk ) == 0 );
     gros_read_block( disk, 0, ( char * ) superblock );
 
     REQUIRE( superblock->free_inodes[ 0 ] == -1 );
@@ -930,6 +1510,7 @@ TEST_CASE( "Ilist can be repopulated correctly", "[FileSystem]" ) {
     int rel_inode_index = 0;
     int ilist_count = 0;
 
+    REQUIRE( gros_bsync( disk ) == 0 );
     gros_read_block( disk, 0, ( char * ) superblock );
     int num_blocks = superblock->fs_disk_size / superblock->fs_block_size;
     int num_inode_blocks = ceil( num_blocks * INODE_BLOCKS );
@@ -1045,6 +1626,97 @@ TEST_CASE( "A data block can be allocated", "[FileSystem]" ) {
 }
 
 
+TEST_CASE( "Runs of contiguous data blocks can be allocated", "[FileSystem]" ) {
+    Disk * disk = gros_open_disk();
+    gros_make_fs( disk );
+    int    count;
+    int    first;
+    int    second;
+    int    i;
+
+    first = gros_allocate_data_blocks( disk, -1, 16, &count );
+    REQUIRE( first != -1 );
+    REQUIRE( count == 16 );
+    second = gros_allocate_data_blocks( disk, -1, 8, &count );
+    REQUIRE( second == first + 16 );
+    REQUIRE( count == 8 );
+
+    SECTION( "Every block of a run is marked used" ) {
+        char         buf[ BLOCK_SIZE ];
+        char         sbuf[ BLOCK_SIZE ];
+        Superblock * superblock = ( Superblock * ) gros_bget( disk, 0, sbuf );
+        gros_bread( disk, superblock->first_data_block, buf );
+        Bitmap     * bm = gros_init_bitmap( BLOCK_SIZE, buf );
+        for( i = first; i < second + 8; i++ )
+            REQUIRE( gros_is_bit_set( bm, i - superblock->first_data_block ) == 1 );
+        REQUIRE( gros_is_bit_set( bm, second + 8 - superblock->first_data_block ) == 0 );
+        delete bm;
+    }
+
+    SECTION( "A hole too small for the run is passed over" ) {
+        gros_free_data_block( disk, first + 3 );
+        gros_free_data_block( disk, first + 4 );
+        REQUIRE( gros_allocate_data_blocks( disk, -1, 4, &count ) == second + 8 );
+        REQUIRE( count == 4 );
+        REQUIRE( gros_allocate_data_blocks( disk, -1, 2, &count ) == first + 3 );
+        REQUIRE( count == 2 );
+    }
+
+    SECTION( "A nearly full disk hands out shorter runs" ) {
+        int total = 0;
+        while( gros_allocate_data_blocks( disk, -1, 1000, &count ) != -1 )
+            total += count;
+        REQUIRE( total > 0 );
+        gros_free_data_block( disk, first + 5 );
+        gros_free_data_block( disk, first + 6 );
+        REQUIRE( gros_allocate_data_blocks( disk, -1, 10, &count ) == first + 5 );
+        REQUIRE( count == 2 );
+        REQUIRE( gros_allocate_data_blocks( disk, -1, 10, &count ) == -1 );
+        REQUIRE( count == 0 );
+    }
+
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Data blocks are placed near a goal", "[FileSystem]" ) {
+    Disk       * disk = gros_open_ram( 64 * 1024 * 1024 );
+    char         sbuf[ BLOCK_SIZE ];
+    Superblock * superblock;
+    int          count;
+    int          goal;
+
+    gros_make_fs( disk );
+    superblock = ( Superblock * ) gros_bget( disk, 0, sbuf );
+    REQUIRE( superblock->fs_num_block_groups > 2 );
+    goal = superblock->first_data_block + 2 * BLOCK_SIZE + 100;
+
+    SECTION( "Without the free space summary" ) {
+        REQUIRE( disk->freemap == NULL );
+    }
+
+    SECTION( "With the free space summary" ) {
+        REQUIRE( gros_mount( disk ) >= 0 );
+        REQUIRE( disk->freemap != NULL );
+    }
+
+    REQUIRE( gros_allocate_data_blocks( disk, goal, 4, &count ) == goal );
+    REQUIRE( count == 4 );
+    // a goal that is taken moves on to the next free block
+    REQUIRE( gros_allocate_data_blocks( disk, goal + 2, 1, &count ) == goal + 4 );
+    // a goal past the end of the disk is no goal at all
+    REQUIRE( gros_allocate_data_blocks( disk, ( int ) ( disk->size / BLOCK_SIZE ), 1, &count )
+             < superblock->first_data_block + BLOCK_SIZE );
+
+    // a new inode's first block is near what it is placed with
+    Inode * inode = gros_new_inode_near( disk, goal );
+    REQUIRE( inode->f_block[ 0 ] == goal + 5 );
+    gros_put_inode( disk, inode );
+
+    gros_close_disk( disk );
+}
+
+
 TEST_CASE( "A data block can be deallocated", "[FileSystem]" ) {
     Disk * disk = gros_open_disk();
     gros_make_fs( disk );
@@ -1065,6 +1737,71 @@ TEST_CASE( "A data block can be deallocated", "[FileSystem]" ) {
 }
 
 
+TEST_CASE( "Freeing a data block twice leaves the used count alone", "[FileSystem]" ) {
+    Disk * disk = gros_open_ram( EMULATOR_SIZE );
+    int    used;
+    int    block_num;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    used = gros_superblock( disk )->fs_num_used_blocks;
+    REQUIRE( ( block_num = gros_allocate_data_block( disk ) ) > 0 );
+    REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used + 1 );
+    gros_free_data_block( disk, block_num );
+    gros_free_data_block( disk, block_num );
+    REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used );
+    gros_close_disk( disk );
+}
+
+
+typedef struct _allocator {
+    Disk *             disk;
+    std::vector< int > blocks;  /* what this thread was given */
+} Allocator;
+
+
+/**
+ * Allocates 64 data blocks one at a time, for the allocator race test.
+ */
+static void * gros_test_allocator( void * arg ) {
+    Allocator * a = ( Allocator * ) arg;
+    int         i;
+
+    for( i = 0; i < 64; i++ )
+        a->blocks.push_back( gros_allocate_data_block( a->disk ) );
+    return NULL;
+}
+
+
+TEST_CASE( "Writers allocating at once never get the same block", "[FileSystem]" ) {
+    Disk *          disk = gros_open_ram( EMULATOR_SIZE );
+    Allocator       a[ 4 ];
+    pthread_t       threads[ 4 ];
+    std::set< int > seen;
+    size_t          j;
+    int             used;
+    int             i;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    used = gros_superblock( disk )->fs_num_used_blocks;
+    for( i = 0; i < 4; i++ ) {
+        a[ i ].disk = disk;
+        REQUIRE( pthread_create( &threads[ i ], NULL, gros_test_allocator, &a[ i ] ) == 0 );
+    }
+    for( i = 0; i < 4; i++ ) {
+        REQUIRE( pthread_join( threads[ i ], NULL ) == 0 );
+        for( j = 0; j < a[ i ].blocks.size(); j++ ) {
+            REQUIRE( a[ i ].blocks[ j ] > 0 );
+            seen.insert( a[ i ].blocks[ j ] );
+        }
+    }
+    REQUIRE( seen.size() == 4 * 64 );
+    REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used + 4 * 64 );
+    gros_close_disk( disk );
+}
+
+
 TEST_CASE( "A list of data blocks can be deallocated", "[FileSystem]" ) {
     Disk * disk = gros_open_disk();
     gros_make_fs( disk );
@@ -1078,6 +1815,133 @@ TEST_CASE( "A list of data blocks can be deallocated", "[FileSystem]" ) {
 }
 
 
+TEST_CASE( "Inodes and data blocks work on a memory mapped disk",
+           "[FileSystem]" ) {
+    Disk * disk = gros_open_disk();
+    REQUIRE( gros_set_engine( disk, GROS_IO_MMAP ) == 0 );
+    gros_make_fs( disk );
+
+    Inode * inode = gros_new_inode( disk );
+    inode->f_size = 1234;
+    REQUIRE( gros_save_inode( disk, inode ) == inode->f_inode_num );
+
+    Inode * copy = gros_get_inode( disk, inode->f_inode_num );
+    REQUIRE( copy->f_size == 1234 );
+    REQUIRE( copy->f_block[ 0 ] == inode->f_block[ 0 ] );
+
+    int block = gros_allocate_data_block( disk );
+    REQUIRE( block != -1 );
+    REQUIRE( block != inode->f_block[ 0 ] );
+
+    delete copy;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "Inodes and data blocks work through the block cache",
+           "[FileSystem]" ) {
+    Disk * disk = gros_open_disk();
+    REQUIRE( gros_attach_cache( disk, GROS_CACHE_DEFAULT_SIZE ) == 0 );
+    gros_make_fs( disk );
+
+    Inode * inode = gros_new_inode( disk );
+    inode->f_size = 4321;
+    REQUIRE( gros_save_inode( disk, inode ) == inode->f_inode_num );
+    int block = gros_allocate_data_block( disk );
+    REQUIRE( block != -1 );
+
+    // metadata is only in memory until it is written back
+    REQUIRE( disk->cache->ndirty > 0 );
+    int64_t misses = disk->cache->misses;
+    Inode * copy = gros_get_inode( disk, inode->f_inode_num );
+    REQUIRE( copy->f_size == 4321 );
+    REQUIRE( disk->cache->misses == misses );
+    delete copy;
+
+    // and survives the cache going away
+    REQUIRE( gros_detach_cache( disk ) == 0 );
+    copy = gros_get_inode( disk, inode->f_inode_num );
+    REQUIRE( copy->f_size == 4321 );
+    REQUIRE( gros_allocate_data_block( disk ) != block );
+
+    delete copy;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "A file system can live on a RAM disk", "[FileSystem]" ) {
+    Disk * disk = gros_open_ram( EMULATOR_SIZE );
+    gros_make_fs( disk );
+
+    Inode * inode = gros_new_inode( disk );
+    inode->f_size = 99;
+    REQUIRE( gros_save_inode( disk, inode ) == inode->f_inode_num );
+    Inode * copy = gros_get_inode( disk, inode->f_inode_num );
+    REQUIRE( copy->f_size == 99 );
+    REQUIRE( gros_allocate_data_block( disk ) != -1 );
+
+    delete copy;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
+TEST_CASE( "The superblock is kept in memory until it is written back",
+           "[FileSystem]" ) {
+    Disk       * disk   = gros_open_disk();
+    Superblock * ondisk = new Superblock();
+    Superblock * superblock;
+    Inode      * inode;
+    int          used_blocks;
+    int          used_inodes;
+    int          first;
+    int          count;
+    int          i;
+
+    gros_make_fs( disk );
+    superblock = gros_superblock( disk );
+    REQUIRE( superblock == gros_superblock( disk ) );
+    REQUIRE( gros_bsync( disk ) == 0 );
+    used_blocks = superblock->fs_num_used_blocks;
+    used_inodes = superblock->fs_num_used_inodes;
+
+    REQUIRE( ( first = gros_allocate_data_blocks( disk, -1, 64, &count ) ) > 0 );
+    REQUIRE( count == 64 );
+    for( i = 0; i < 16; i++ )
+        gros_free_data_block( disk, first + i );
+    inode = gros_new_inode( disk );     // takes an inode and a block
+    REQUIRE( superblock->fs_num_used_blocks == used_blocks + 49 );
+    REQUIRE( superblock->fs_num_used_inodes == used_inodes + 1 );
+
+    // none of it has reached block 0 yet
+    REQUIRE( disk->super_dirty != 0 );
+    gros_read_block( disk, 0, ( char * ) ondisk );
+    REQUIRE( ondisk->fs_num_used_blocks == used_blocks );
+    REQUIRE( ondisk->fs_num_used_inodes == used_inodes );
+
+    SECTION( "A sync writes it back" ) {
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( disk->super_dirty == 0 );
+        gros_read_block( disk, 0, ( char * ) ondisk );
+        REQUIRE( memcmp( ondisk, superblock, BLOCK_SIZE ) == 0 );
+    }
+
+    SECTION( "Closing the disk writes it back" ) {
+        gros_close_disk( disk );
+        disk = gros_open_disk();
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used_blocks + 49 );
+        REQUIRE( gros_superblock( disk )->fs_num_used_inodes == used_inodes + 1 );
+        REQUIRE( gros_superblock( disk )->free_inodes[ inode->f_inode_num ] == -1 );
+    }
+
+    delete ondisk;
+    delete inode;
+    gros_close_disk( disk );
+}
+
+
 TEST_CASE("gros_is_file returns the right indicator") {
     REQUIRE(gros_is_file(0) == 1);
     REQUIRE(gros_is_file(1) == 0);
@@ -1096,3 +1960,138 @@ TEST_CASE("gros_is_dir returns the right indicator ") {
     REQUIRE(gros_is_dir(1756) == 0); //1756 = 0b11011011100
     REQUIRE(gros_is_dir(1757) == 1); //1757 = 0b11011011101
 }
+
+
+TEST_CASE( "Metadata is recovered from the journal after a crash", "[FileSystem][journal]" ) {
+    Disk * disk = gros_open_disk();
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) == 0 );
+    REQUIRE( disk->journal != NULL );
+
+    REQUIRE( gros_mkdir( disk, "/logged" ) >= 0 );
+    REQUIRE( gros_mknod( disk, "/logged/file" ) >= 0 );
+    REQUIRE( gros_bsync( disk ) == 0 );
+    REQUIRE( disk->journal->commits > 0 );
+
+    // a second disk on the same image sees what a crash would leave
+    Disk * after = gros_open_disk();
+    REQUIRE( gros_namei( after, "/logged/file" ) < 0 );
+    REQUIRE( gros_mount( after ) > 0 );
+    REQUIRE( after->journal == NULL );
+    REQUIRE( gros_namei( after, "/logged/file" ) >= 0 );
+    gros_close_disk( after );
+
+    gros_close_disk( disk );
+}
+
+
+typedef struct _csumwriter {
+    Disk * disk;
+    int    first;   /* first of the 32 blocks this writer fills */
+    char   fill;    /* what it fills them with */
+    int    status;
+} CsumWriter;
+
+
+/**
+ * Writes 32 blocks, each again and again, for the checksum test.
+ */
+static void * gros_test_csum_writer( void * arg ) {
+    CsumWriter * w = ( CsumWriter * ) arg;
+    char         buf[ BLOCK_SIZE ];
+    int          round;
+    int          i;
+
+    w->status = 0;
+    std::memset( buf, w->fill, BLOCK_SIZE );
+    for( round = 0; round < 4 && w->status == 0; round++ )
+        for( i = 0; i < 32 && w->status == 0; i++ )
+            w->status = gros_bwrite( w->disk, w->first + i, buf );
+    return NULL;
+}
+
+
+TEST_CASE( "Corrupted blocks are caught by their checksums", "[FileSystem][csum]" ) {
+    Disk * disk = gros_open_disk();
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) == 0 );
+    REQUIRE( disk->csum != NULL );
+
+    char buf[ BLOCK_SIZE ];
+    char out[ BLOCK_SIZE ];
+    int  block_num = gros_allocate_data_block( disk );
+    REQUIRE( block_num > 0 );
+    std::memset( buf, 'k', BLOCK_SIZE );
+    REQUIRE( gros_bwrite( disk, block_num, buf ) == 0 );
+    REQUIRE( gros_detach_cache( disk ) == 0 );
+
+    SECTION( "Intact blocks read back" ) {
+        REQUIRE( gros_bread( disk, block_num, out ) == 0 );
+        REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+        REQUIRE( gros_bread( disk, block_num, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'k' );
+        REQUIRE( disk->csum->failures == 0 );
+    }
+
+    SECTION( "A block changed behind the file system's back fails to read" ) {
+        buf[ 100 ] = 'x';
+        REQUIRE( gros_write_block( disk, block_num, buf ) == 0 );
+        REQUIRE( gros_bread( disk, block_num, out ) == -EIO );
+        REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+        REQUIRE( gros_bread( disk, block_num, out ) == -EIO );
+        BlockIO io = { block_num, out };
+        REQUIRE( gros_bread_blocks( disk, &io, 1 ) == -EIO );
+        REQUIRE( gros_bprefetch( disk, &block_num, 1 ) == 0 );
+        REQUIRE( disk->csum->failures == 4 );
+
+        // unless verification is turned off
+        disk->csum->verify = false;
+        REQUIRE( gros_bread( disk, block_num, out ) == 0 );
+        REQUIRE( out[ 100 ] == 'x' );
+    }
+
+    SECTION( "A block written in place is read back unverified after a mismatch" ) {
+        // as if a crash came between the data and its checksum's commit
+        REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+        std::memset( buf, 'm', BLOCK_SIZE );
+        BlockIO io = { block_num, buf };
+        REQUIRE( gros_bwrite_blocks( disk, &io, 1 ) == 0 );
+        buf[ 100 ] = 'x';
+        REQUIRE( gros_write_block( disk, block_num, buf ) == 0 );
+        io.buf = out;
+        REQUIRE( gros_bread_blocks( disk, &io, 1 ) == 0 );
+        REQUIRE( out[ 100 ] == 'x' );
+        REQUIRE( gros_bread( disk, block_num, out ) == 0 );
+        REQUIRE( disk->csum->failures == 0 );
+        REQUIRE( disk->csum->unverified == 2 );
+    }
+
+    SECTION( "Uncached writers keep each other's checksums" ) {
+        CsumWriter writers[ 4 ];
+        pthread_t  threads[ 4 ];
+        int        i;
+        int        j;
+
+        for( i = 0; i < 4; i++ ) {
+            writers[ i ].disk  = disk;
+            writers[ i ].first = block_num + 1 + i * 32;
+            writers[ i ].fill  = ( char ) ( 'a' + i );
+            REQUIRE( pthread_create( &threads[ i ], NULL, gros_test_csum_writer,
+                                     &writers[ i ] ) == 0 );
+        }
+        for( i = 0; i < 4; i++ )
+            pthread_join( threads[ i ], NULL );
+        for( i = 0; i < 4; i++ ) {
+            REQUIRE( writers[ i ].status == 0 );
+            for( j = 0; j < 32; j++ ) {
+                REQUIRE( gros_bread( disk, writers[ i ].first + j, out ) == 0 );
+                REQUIRE( out[ 0 ] == ( char ) ( 'a' + i ) );
+            }
+        }
+        REQUIRE( disk->csum->failures == 0 );
+    }
+
+    gros_close_disk( disk );
+}
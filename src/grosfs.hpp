@@ -21,7 +21,7 @@
 #define TRIPLE_INDRCT 14        // index for triple indirect data block
 
 // the space at the end of the superblock data up until the end of the block
-#define SB_ILIST_SIZE ( BLOCK_SIZE - 9 * sizeof( int ) )
+#define SB_ILIST_SIZE ( BLOCK_SIZE - sizeof( int64_t ) - 15 * sizeof( int ) )
 
 #define DEBUG
 #ifdef DEBUG
@@ -32,11 +32,14 @@
 
 #include "bitmap.hpp"
 #include "disk.hpp"
+#include "cache.hpp"
+#include "journal.hpp"
+#include "csum.hpp"
 //#include "files.hpp"
 #include "../include/catch.hpp"
 
 typedef struct _superblock {
-    int fs_disk_size;        /* total size of disk, in bytes */
+    int64_t fs_disk_size;    /* total size of disk, in bytes */
     int fs_block_size;       /* size of disk blocks, in bytes */
     int fs_inode_size;       /* size of inode structure, in bytes */
     int fs_num_blocks;       /* total number of data blocks */
@@ -45,6 +48,13 @@ typedef struct _superblock {
     int fs_num_used_blocks;  /* number of used blocks */
     int fs_num_block_groups; /* number of block groups */
     int first_data_block;    /* pointer to first data block */
+    int fs_journal_start;    /* first block of the metadata journal */
+    int fs_journal_blocks;   /* size of the journal, 0 for none */
+    int fs_csum_start;       /* first block of the block checksums */
+    int fs_csum_blocks;      /* size of the checksum area, 0 for none */
+    int fs_dedup_start;      /* first block of the data block reference counts */
+    int fs_dedup_refs;       /* size of the reference counts, 0 for none */
+    int fs_dedup_index;      /* size of the fingerprint index after them */
     int free_inodes[ SB_ILIST_SIZE ]; /* bitmap of free inodes */
 } Superblock;
 
@@ -64,6 +74,7 @@ typedef struct _inode { // 106 bytes
      *    bits 2,3,4:  owner permissions (r/w/x)
      *    bits 5,6,7:  group permissions (r/w/x)
      *    bits 8,9,10: universal permissions (r/w/x)
+     *    bit 12:      data compressed in clusters, see compress.hpp
      */
     short   f_acl;
     time_t  f_ctime;    /* time inode last modified */
@@ -89,6 +100,45 @@ typedef struct _inode { // 106 bytes
 void gros_make_fs( Disk * disk ); // initialize the file system
 
 
+/**
+ * Gets a file system ready for use: anything gros_make_fs left in the
+ *  cache is written home, then the journal is opened, which replays the
+ *  transactions a crash left in it, block checksums are turned on,
+ *  shared data blocks are honored, the free blocks are summarized,
+ *  growing files get blocks reserved for them and inodes and names are
+ *  cached. Transactions only end between whole operations, so the replay
+ *  brings the metadata back to a consistent state; nothing else is
+ *  checked. Without a cache nothing would go through the journal, so it
+ *  is only replayed and then closed.
+ *  Returns the number of transactions replayed or -errno.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+int gros_mount( Disk * disk );
+
+
+/**
+ * Returns the superblock of the file system on the disk. There is one
+ *  copy per disk, read from block 0 the first time it is asked for and
+ *  shared from then on; changes to it only reach block 0 on gros_bsync,
+ *  each round of the flusher and gros_close_disk, once they are marked
+ *  with gros_superblock_dirty. The used block and inode counts are updated
+ *  with atomic adds, the free inode list under the disk's super_lock.
+ *  Returns NULL if block 0 cannot be read.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+Superblock * gros_superblock( Disk * disk );
+
+
+/**
+ * Notes that the superblock was changed and must be written back.
+ *
+ * @param Disk * disk    The disk containing the file system
+ */
+void gros_superblock_dirty( Disk * disk );
+
+
 /**
  * Initializes inodes on disk
  *
@@ -184,7 +234,29 @@ int gros_save_inode( Disk * disk, Inode * inode );
 
 
 /**
-* Scan inode blocks for more free inode numbers for free ilist
+ * Writes an Inode into its block, leaving the inode cache alone. Returns
+ *  the inode number or -errno.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The inode to write
+ */
+int gros_write_inode( Disk * disk, Inode * inode );
+
+
+/**
+ * Reads inode `inode_num` from its block into `inode`. Returns 0, -EINVAL
+ *  for an inode number outside the file system or -EIO.
+ *
+ * @param Disk  * disk       The disk containing the file system
+ * @param int     inode_num  The inode index to read
+ * @param Inode * inode      Where to put it
+ */
+int gros_read_inode( Disk * disk, int inode_num, Inode * inode );
+
+
+/**
+* Scan inode blocks for more free inode numbers for free ilist. Called with
+*  the disk's super_lock held once the file system is in use.
 *
 * @param Disk * disk         The disk that contains the file system
 * @param int    inode_index  The
@@ -201,7 +273,20 @@ Inode * gros_new_inode( Disk * disk );
 
 
 /**
- * Return inode from disk
+ * Returns a new allocated inode like gros_new_inode, with its first data
+ *  block as close after block `goal` as there is room, or in the inode's
+ *  home group for a goal of -1. Returns NULL if no inode is free.
+ *
+ * @param  Disk * disk    The disk that contains the file system
+ * @param  int    goal    The block to place the inode's data near, or -1
+ */
+Inode * gros_new_inode_near( Disk * disk, int goal );
+
+
+/**
+ * Return inode from disk, or NULL if there is no such inode. With an inode
+ *  cache every caller shares one copy; either way it is given back with
+ *  gros_put_inode.
  *
  * @param  Disk * disk      The disk that contains the file system
  * @param  int    inode_num The inode number to retrieve from disk
@@ -209,6 +294,28 @@ Inode * gros_new_inode( Disk * disk );
 Inode * gros_get_inode( Disk * disk, int inode_num );
 
 
+/**
+ * Gives back an Inode returned by gros_get_inode or gros_new_inode. Does
+ *  nothing for NULL.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The inode to give back
+ */
+void gros_put_inode( Disk * disk, Inode * inode );
+
+
+/**
+ * Notes that an Inode was changed without being saved. With an inode cache
+ *  it is saved once it is given back for the last time, or on
+ *  gros_i_fsync; without one, or with a journal, whose transaction the
+ *  change has to join, it is saved right away.
+ *
+ * @param Disk  * disk    The disk containing the file system
+ * @param Inode * inode   The changed inode
+ */
+void gros_inode_dirty( Disk * disk, Inode * inode );
+
+
 /**
  * Deallocates an inode and frees up all the resources owned by it
  *
@@ -246,6 +353,76 @@ void gros_free_data_block( Disk * disk, int block_index );
 int gros_allocate_data_block( Disk * disk );
 
 
+/**
+ * Allocates a run of physically contiguous data blocks, at most `n` of
+ *  them, with a single update of the superblock and of one bitmap. The
+ *  search starts at block `goal`, then goes on through the rest of its
+ *  group and the groups after it; without a goal (-1) it starts at the
+ *  first group with room. The first free run of `n` blocks in a group is
+ *  taken, or else the longest run there. Returns the first block number of
+ *  the run and sets `count` to its length, or returns -1 if there are no
+ *  blocks available.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    goal    The block the run should preferably start at, or -1
+ * @param int    n       The number of blocks wanted
+ * @param int  * count   Set to the number of blocks allocated
+ */
+int gros_allocate_data_blocks( Disk * disk, int goal, int n, int * count );
+
+
+/**
+ * Finds a run of free blocks like gros_allocate_data_blocks, but marks only
+ *  its first `take` blocks used. The rest of the run stays free on disk for
+ *  the caller to reserve in memory, see gros_prealloc_mask. Returns the
+ *  first block number of the run and sets `count` to its length, or
+ *  returns -1 if there are no blocks available.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    goal    The block the run should preferably start at, or -1
+ * @param int    n       The number of blocks wanted
+ * @param int    take    How many blocks at the start of the run to mark used
+ * @param int  * count   Set to the length of the run
+ */
+int gros_reserve_data_blocks( Disk * disk, int goal, int n, int take, int * count );
+
+
+/**
+ * Marks the free blocks from `first` on used, up to `n` of them and no
+ *  further than the first block already in use or the end of its block
+ *  group, with one update of their bitmap and of the superblock. Meant for
+ *  blocks the caller reserved with gros_reserve_data_blocks. Returns how
+ *  many blocks were marked, 0 if block `first` is in use.
+ *
+ * @param Disk * disk    The disk containing the file system
+ * @param int    first   The first block to mark used
+ * @param int    n       The number of blocks wanted
+ */
+int gros_claim_data_blocks( Disk * disk, int first, int n );
+
+
+/**
+ * Returns a block to aim the allocation of a new inode's data at: the first
+ *  block of its home group, which inode numbers are spread over evenly.
+ *
+ * @param Disk * disk        The disk containing the file system
+ * @param int    inode_num   The inode number
+ */
+int gros_inode_goal( Disk * disk, int inode_num );
+
+
+/**
+ * Returns a block to aim a new directory at, Orlov style: directories made
+ *  at the top of the tree go to the group with the most free blocks, so
+ *  unrelated trees spread out; others stay near `parent`, their parent
+ *  directory. Returns -1 for no preference.
+ *
+ * @param Disk  * disk     The disk containing the file system
+ * @param Inode * parent   The directory the new one is made in
+ */
+int gros_dir_goal( Disk * disk, Inode * parent );
+
+
 /**
  *  Given an array of `n` block numbers, deallocate each one.
  *
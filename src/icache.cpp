@@ -0,0 +1,516 @@
+/**
+ * icache.cpp
+ */
+
+#include "icache.hpp"
+#include "journal.hpp"
+#include "files.hpp"
+#include <cstring>
+#include <errno.h>
+
+
+/**
+ * Returns the hash bucket of inode `inode_num` (Fibonacci hashing, like the
+ *  block cache).
+ */
+static unsigned gros_icache_bucket( ICache * ic, int inode_num ) {
+    return ( ( uint32_t ) inode_num * 2654435769u ) >> ic->shift;
+}
+
+
+/**
+ * Returns the cached copy of inode `inode_num`, or NULL if it is not cached.
+ */
+static ICacheEntry * gros_icache_find( ICache * ic, int inode_num ) {
+    ICacheEntry * e = ic->table[ gros_icache_bucket( ic, inode_num ) ];
+
+    while( e != NULL && e->inode.f_inode_num != inode_num )
+        e = e->hnext;
+    return e;
+}
+
+
+/**
+ * Returns the entry `inode` is the handle of, or NULL if it did not come
+ *  from the cache.
+ */
+static ICacheEntry * gros_icache_handle( ICache * ic, Inode * inode ) {
+    ICacheEntry * e = gros_icache_find( ic, inode->f_inode_num );
+
+    return e != NULL && &e->inode == inode ? e : NULL;
+}
+
+
+/**
+ * Takes an unreferenced inode out of the LRU list.
+ */
+static void gros_icache_unlink_lru( ICache * ic, ICacheEntry * e ) {
+    if( e->newer != NULL ) e->newer->older = e->older;
+    else                   ic->newest      = e->older;
+    if( e->older != NULL ) e->older->newer = e->newer;
+    else                   ic->oldest      = e->newer;
+    e->newer = e->older = NULL;
+    ic->nunused--;
+}
+
+
+/**
+ * Puts an inode whose last reference was given back at the newest end of
+ *  the LRU list.
+ */
+static void gros_icache_link_newest( ICache * ic, ICacheEntry * e ) {
+    e->older = ic->newest;
+    e->newer = NULL;
+    if( ic->newest != NULL ) ic->newest->newer = e;
+    else                     ic->oldest        = e;
+    ic->newest = e;
+    ic->nunused++;
+}
+
+
+/**
+ * Removes an unreferenced inode from the cache and frees it, dirty or not.
+ */
+static void gros_icache_drop( ICache * ic, ICacheEntry * e ) {
+    ICacheEntry ** link = &ic->table[ gros_icache_bucket( ic, e->inode.f_inode_num ) ];
+
+    while( * link != e )
+        link = &( * link )->hnext;
+    * link = e->hnext;
+    if( e->refs == 0 )
+        gros_icache_unlink_lru( ic, e );
+    ic->ninodes--;
+    pthread_mutex_destroy( &e->lock );
+    delete e;
+}
+
+
+/**
+ * Saves a dirty inode. Called with the lock held.
+ */
+static int gros_icache_writeback( Disk * disk, ICache * ic, ICacheEntry * e ) {
+    int status;
+
+    if( ! e->dirty )
+        return 0;
+    if( ( status = gros_write_inode( disk, &e->inode ) ) < 0 )
+        return status;
+    e->dirty = false;
+    ic->writebacks++;
+    return 0;
+}
+
+
+/**
+ * Keeps the inodes of the file system in memory, so every caller asking
+ *  for the same inode number shares one copy instead of reading its block
+ *  and getting a private one. Inodes are handed out with a reference
+ *  (gros_icache_get) that is given back with gros_icache_put; up to
+ *  `max_unused` inodes nobody holds stay cached, least recently used
+ *  first out. Returns 0, -EEXIST if the disk already has an inode cache
+ *  or -EINVAL.
+ *
+ * @param Disk * disk         The disk holding the file system
+ * @param int    max_unused   Unreferenced inodes to keep
+ */
+int gros_open_icache( Disk * disk, int max_unused ) {
+    ICache * ic;
+    int      bits = 6;
+
+    if( disk->icache != NULL )
+        return -EEXIST;
+    if( max_unused < 1 )
+        return -EINVAL;
+
+    ic = new ICache();
+    // about one inode per bucket when full
+    while( ( 1 << bits ) < max_unused && bits < 24 )
+        bits++;
+    ic->shift      = 32 - bits;
+    ic->table      = new ICacheEntry * [ 1 << bits ]();
+    ic->newest     = NULL;
+    ic->oldest     = NULL;
+    ic->ninodes    = 0;
+    ic->nunused    = 0;
+    ic->max_unused = max_unused;
+    ic->hits       = 0;
+    ic->misses     = 0;
+    ic->writebacks = 0;
+    pthread_mutex_init( &ic->lock, NULL );
+    disk->icache = ic;
+    return 0;
+}
+
+
+/**
+ * Saves the dirty inodes and drops the inode cache. Handles still given
+ *  out are no longer valid afterwards. Returns 0 or the -errno of a failed
+ *  save.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+int gros_close_icache( Disk * disk ) {
+    ICache * ic = disk->icache;
+    int      status;
+    int      i;
+
+    if( ic == NULL )
+        return 0;
+    status = gros_icache_flush( disk, NULL );
+    for( i = 0; i < ( 1 << ( 32 - ic->shift ) ); i++ )
+        while( ic->table[ i ] != NULL )
+            gros_icache_drop( ic, ic->table[ i ] );
+    pthread_mutex_destroy( &ic->lock );
+    delete [] ic->table;
+    delete ic;
+    disk->icache = NULL;
+    return status;
+}
+
+
+/**
+ * Returns the shared copy of inode `inode_num`, reading it from its block
+ *  if it is not cached, with one more reference on it. Returns NULL for
+ *  an inode number outside the file system.
+ *
+ * @param Disk * disk        The disk holding the file system
+ * @param int    inode_num   The inode to return
+ */
+Inode * gros_icache_get( Disk * disk, int inode_num ) {
+    ICache            * ic = disk->icache;
+    ICacheEntry       * e;
+    pthread_mutexattr_t attr;
+    unsigned            b;
+
+    pthread_mutex_lock( &ic->lock );
+    if( ( e = gros_icache_find( ic, inode_num ) ) != NULL ) {
+        ic->hits++;
+        if( e->refs++ == 0 )
+            gros_icache_unlink_lru( ic, e );
+        pthread_mutex_unlock( &ic->lock );
+        return &e->inode;
+    }
+
+    // read with the lock held, so an inode is never loaded twice
+    ic->misses++;
+    e = new ICacheEntry();
+    if( gros_read_inode( disk, inode_num, &e->inode ) < 0 ) {
+        pthread_mutex_unlock( &ic->lock );
+        delete e;
+        return NULL;
+    }
+    e->refs  = 1;
+    e->dirty = false;
+    // an operation on an inode may call another one on it
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &e->lock, &attr );
+    pthread_mutexattr_destroy( &attr );
+    e->newer = e->older = NULL;
+    b = gros_icache_bucket( ic, inode_num );
+    e->hnext = ic->table[ b ];
+    ic->table[ b ] = e;
+    ic->ninodes++;
+    pthread_mutex_unlock( &ic->lock );
+    return &e->inode;
+}
+
+
+/**
+ * Gives back a reference taken by gros_icache_get. When the last one goes
+ *  a dirty inode is saved, and the inode waits in memory to be asked for
+ *  again. An inode that did not come from the cache is deleted.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to give back
+ */
+void gros_icache_put( Disk * disk, Inode * inode ) {
+    ICache      * ic = disk->icache;
+    ICacheEntry * e;
+
+    pthread_mutex_lock( &ic->lock );
+    if( ( e = gros_icache_handle( ic, inode ) ) == NULL ) {
+        pthread_mutex_unlock( &ic->lock );
+        delete inode;
+        return;
+    }
+    if( e->refs == 0 || --e->refs > 0 ) {
+        pthread_mutex_unlock( &ic->lock );
+        return;
+    }
+    gros_icache_writeback( disk, ic, e );
+    gros_icache_link_newest( ic, e );
+
+    // an inode that could not be saved stays until it can be
+    while( ic->nunused > ic->max_unused
+           && gros_icache_writeback( disk, ic, ic->oldest ) == 0 )
+        gros_icache_drop( ic, ic->oldest );
+    pthread_mutex_unlock( &ic->lock );
+}
+
+
+/**
+ * Notes that a cached inode was changed, so it is saved no later than
+ *  when its last reference is given back.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The changed inode, as returned by gros_icache_get
+ */
+void gros_icache_dirty( Disk * disk, Inode * inode ) {
+    ICache      * ic = disk->icache;
+    ICacheEntry * e;
+
+    pthread_mutex_lock( &ic->lock );
+    if( ( e = gros_icache_handle( ic, inode ) ) != NULL )
+        e->dirty = true;
+    pthread_mutex_unlock( &ic->lock );
+    // nothing else would ever save a private copy
+    if( e == NULL )
+        gros_icache_save( disk, inode );
+}
+
+/**
+ * Takes the lock of a cached inode, which the operations that change it
+ *  (gros_i_write, gros_i_truncate and the like) hold, so they do not
+ *  interleave. A thread may take it again while it holds it. Taken inside
+ *  a journal operation, never the other way round. Does nothing for an
+ *  inode that did not come from the cache.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to lock, as returned by gros_icache_get
+ */
+void gros_icache_lock( Disk * disk, Inode * inode ) {
+    ICache      * ic = disk->icache;
+    ICacheEntry * e;
+
+    if( ic == NULL )
+        return;
+    // the caller's reference keeps the entry from being dropped
+    pthread_mutex_lock( &ic->lock );
+    e = gros_icache_handle( ic, inode );
+    pthread_mutex_unlock( &ic->lock );
+    if( e != NULL )
+        pthread_mutex_lock( &e->lock );
+}
+
+
+/**
+ * Gives back the lock taken by gros_icache_lock.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to unlock
+ */
+void gros_icache_unlock( Disk * disk, Inode * inode ) {
+    ICache      * ic = disk->icache;
+    ICacheEntry * e;
+
+    if( ic == NULL )
+        return;
+    pthread_mutex_lock( &ic->lock );
+    e = gros_icache_handle( ic, inode );
+    pthread_mutex_unlock( &ic->lock );
+    if( e != NULL )
+        pthread_mutex_unlock( &e->lock );
+}
+
+
+
+/**
+ * Saves `inode` to its block. If it is not the cached copy of its inode
+ *  number, the cached copy is brought up to date with it first. Returns
+ *  the inode number or -errno.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to save
+ */
+int gros_icache_save( Disk * disk, Inode * inode ) {
+    ICache      * ic = disk->icache;
+    ICacheEntry * e;
+    int           status;
+
+    pthread_mutex_lock( &ic->lock );
+    e = gros_icache_find( ic, inode->f_inode_num );
+    if( e != NULL && &e->inode != inode )
+        std::memcpy( &e->inode, inode, sizeof( Inode ) );
+    if( ( status = gros_write_inode( disk, inode ) ) >= 0 && e != NULL )
+        e->dirty = false;
+    pthread_mutex_unlock( &ic->lock );
+    return status;
+}
+
+
+/**
+ * Saves `inode` if it is dirty, or every dirty cached inode if `inode` is
+ *  NULL. Returns 0 or the -errno of a failed save.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to save, or NULL for all of them
+ */
+int gros_icache_flush( Disk * disk, Inode * inode ) {
+    ICache      * ic     = disk->icache;
+    ICacheEntry * e;
+    int           status = 0;
+    int           ret;
+    int           i;
+
+    pthread_mutex_lock( &ic->lock );
+    if( inode != NULL ) {
+        if( ( e = gros_icache_handle( ic, inode ) ) != NULL )
+            status = gros_icache_writeback( disk, ic, e );
+    } else {
+        for( i = 0; i < ( 1 << ( 32 - ic->shift ) ); i++ )
+            for( e = ic->table[ i ]; e != NULL; e = e->hnext )
+                if( ( ret = gros_icache_writeback( disk, ic, e ) ) < 0 )
+                    status = ret;
+    }
+    pthread_mutex_unlock( &ic->lock );
+    return status;
+}
+
+
+TEST_CASE( "Inodes are shared through the inode cache", "[icache][FileSystem]" ) {
+    Disk   * disk = gros_open_ram( EMULATOR_SIZE );
+    ICache * ic;
+    Inode  * inode;
+    Inode  * again;
+    Inode    copy;
+    int      num;
+    int      i;
+
+    // the journal is only kept with a cache
+    REQUIRE( gros_attach_cache( disk, 64 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( ( ic = disk->icache ) != NULL );
+    REQUIRE( gros_open_icache( disk, 8 ) == -EEXIST );
+
+    SECTION( "Every caller gets the same copy" ) {
+        inode = gros_get_inode( disk, 0 );
+        again = gros_get_inode( disk, 0 );
+        REQUIRE( inode != NULL );
+        REQUIRE( inode == again );
+        REQUIRE( ic->hits >= 1 );
+        inode->f_uid = 42;
+        REQUIRE( again->f_uid == 42 );
+        gros_put_inode( disk, again );
+        gros_put_inode( disk, inode );
+        REQUIRE( ic->nunused == ic->ninodes );
+        REQUIRE( gros_get_inode( disk, -1 ) == NULL );
+    }
+
+    SECTION( "With a journal a dirty inode joins the transaction at once" ) {
+        inode = gros_new_inode( disk );
+        num   = inode->f_inode_num;
+        inode->f_size = 77;
+        gros_inode_dirty( disk, inode );
+        REQUIRE( gros_read_inode( disk, num, &copy ) == 0 );
+        REQUIRE( copy.f_size == 77 );
+        gros_put_inode( disk, inode );
+    }
+
+    SECTION( "A dirty inode is saved when its last reference goes" ) {
+        // only without a journal
+        REQUIRE( gros_close_journal( disk ) == 0 );
+        inode = gros_new_inode( disk );
+        num   = inode->f_inode_num;
+        REQUIRE( gros_save_inode( disk, inode ) == num );
+        again = gros_get_inode( disk, num );
+        inode->f_size = 77;
+        gros_inode_dirty( disk, inode );
+
+        gros_put_inode( disk, inode );
+        REQUIRE( gros_read_inode( disk, num, &copy ) == 0 );
+        REQUIRE( copy.f_size == 0 );
+        gros_put_inode( disk, again );
+        REQUIRE( gros_read_inode( disk, num, &copy ) == 0 );
+        REQUIRE( copy.f_size == 77 );
+        REQUIRE( ic->writebacks == 1 );
+    }
+
+    SECTION( "Saving a private copy updates the shared one" ) {
+        inode = gros_get_inode( disk, 0 );
+        REQUIRE( gros_read_inode( disk, 0, &copy ) == 0 );
+        copy.f_gid = 9;
+        REQUIRE( gros_save_inode( disk, &copy ) == 0 );
+        REQUIRE( inode->f_gid == 9 );
+        gros_put_inode( disk, inode );
+    }
+
+    SECTION( "Only unreferenced inodes are evicted" ) {
+        REQUIRE( gros_close_icache( disk ) == 0 );
+        REQUIRE( gros_open_icache( disk, 4 ) == 0 );
+        ic    = disk->icache;
+        inode = gros_get_inode( disk, 0 );
+        for( i = 1; i <= 10; i++ )
+            gros_put_inode( disk, gros_get_inode( disk, i ) );
+        REQUIRE( ic->nunused == 4 );
+        REQUIRE( ic->ninodes == 5 );
+        REQUIRE( gros_get_inode( disk, 0 ) == inode );
+        gros_put_inode( disk, inode );
+        gros_put_inode( disk, inode );
+        REQUIRE( ic->nunused == 4 );
+    }
+
+    gros_close_disk( disk );
+}
+
+
+typedef struct _icachewriter {
+    Disk * disk;
+    int    inode_num;   /* the file all threads write to */
+    int    first;       /* this thread writes blocks first, first + 4, ... */
+} ICacheWriter;
+
+
+/**
+ * Writes every fourth block of a shared file, for the inode lock test.
+ */
+static void * gros_test_icache_writer( void * arg ) {
+    ICacheWriter * w = ( ICacheWriter * ) arg;
+    char           data[ BLOCK_SIZE ];
+    Inode        * inode;
+    int            i;
+
+    memset( data, 'a' + w->first, sizeof( data ) );
+    for( i = w->first; i < 256; i += 4 ) {
+        inode = gros_get_inode( w->disk, w->inode_num );
+        gros_i_write( w->disk, inode, data, BLOCK_SIZE, i * BLOCK_SIZE );
+        gros_put_inode( w->disk, inode );
+    }
+    return NULL;
+}
+
+
+TEST_CASE( "Writers to one cached inode do not undo each other", "[icache][files]" ) {
+    Disk         * disk = gros_open_ram( EMULATOR_SIZE );
+    ICacheWriter   w[ 4 ];
+    pthread_t      threads[ 4 ];
+    char           data[ BLOCK_SIZE ];
+    Inode        * inode;
+    int            i;
+    int            j;
+
+    REQUIRE( gros_attach_cache( disk, 1024 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    inode = gros_new_inode( disk );
+    for( i = 0; i < 4; i++ ) {
+        w[ i ].disk      = disk;
+        w[ i ].inode_num = inode->f_inode_num;
+        w[ i ].first     = i;
+        REQUIRE( pthread_create( &threads[ i ], NULL, gros_test_icache_writer, &w[ i ] ) == 0 );
+    }
+    for( i = 0; i < 4; i++ )
+        REQUIRE( pthread_join( threads[ i ], NULL ) == 0 );
+
+    REQUIRE( inode->f_size == 256 * BLOCK_SIZE );
+    for( i = 0; i < 256; i++ ) {
+        REQUIRE( gros_i_read( disk, inode, data, BLOCK_SIZE, i * BLOCK_SIZE ) == BLOCK_SIZE );
+        for( j = 0; j < BLOCK_SIZE; j++ )
+            if( data[ j ] != 'a' + i % 4 )
+                break;
+        REQUIRE( j == BLOCK_SIZE );
+    }
+    gros_put_inode( disk, inode );
+    gros_close_disk( disk );
+}
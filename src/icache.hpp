@@ -0,0 +1,131 @@
+/**
+ * icache.hpp
+ */
+
+#ifndef __ICACHE_HPP_INCLUDED__   // if icache.hpp hasn't been included yet...
+#define __ICACHE_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <pthread.h>
+#include <stdint.h>
+
+#define GROS_ICACHE_DEFAULT 1024    // unreferenced inodes kept in memory
+
+typedef struct _icacheentry {
+    Inode                 inode;    /* what handles point at */
+    int                   refs;     /* handles given out and not put back */
+    bool                  dirty;    /* changed since it was last saved */
+    pthread_mutex_t       lock;     /* held while the inode is changed, see
+                                       gros_icache_lock */
+    struct _icacheentry * hnext;    /* next inode in the same hash bucket */
+    struct _icacheentry * newer;    /* LRU neighbours, while unreferenced */
+    struct _icacheentry * older;
+} ICacheEntry;
+
+typedef struct _icache {
+    ICacheEntry    ** table;        /* hash buckets, indexed by inode number */
+    int               shift;        /* 32 - log2( number of buckets ) */
+    ICacheEntry     * newest;       /* unreferenced inode put back last */
+    ICacheEntry     * oldest;       /* eviction candidate */
+    int               ninodes;      /* inodes held */
+    int               nunused;      /* of which unreferenced */
+    int               max_unused;   /* unreferenced inodes kept */
+    int64_t           hits;
+    int64_t           misses;
+    int64_t           writebacks;   /* dirty inodes saved when put back */
+    pthread_mutex_t   lock;
+} ICache;
+
+/**
+ * Keeps the inodes of the file system in memory, so every caller asking
+ *  for the same inode number shares one copy instead of reading its block
+ *  and getting a private one. Inodes are handed out with a reference
+ *  (gros_icache_get) that is given back with gros_icache_put; up to
+ *  `max_unused` inodes nobody holds stay cached, least recently used
+ *  first out. Returns 0, -EEXIST if the disk already has an inode cache
+ *  or -EINVAL.
+ *
+ * @param Disk * disk         The disk holding the file system
+ * @param int    max_unused   Unreferenced inodes to keep
+ */
+int gros_open_icache( Disk * disk, int max_unused );
+
+/**
+ * Saves the dirty inodes and drops the inode cache. Handles still given
+ *  out are no longer valid afterwards. Returns 0 or the -errno of a failed
+ *  save.
+ *
+ * @param Disk * disk   The disk to drop it from
+ */
+int gros_close_icache( Disk * disk );
+
+/**
+ * Returns the shared copy of inode `inode_num`, reading it from its block
+ *  if it is not cached, with one more reference on it. Returns NULL for
+ *  an inode number outside the file system.
+ *
+ * @param Disk * disk        The disk holding the file system
+ * @param int    inode_num   The inode to return
+ */
+Inode * gros_icache_get( Disk * disk, int inode_num );
+
+/**
+ * Gives back a reference taken by gros_icache_get. When the last one goes
+ *  a dirty inode is saved, and the inode waits in memory to be asked for
+ *  again. An inode that did not come from the cache is deleted.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to give back
+ */
+void gros_icache_put( Disk * disk, Inode * inode );
+
+/**
+ * Notes that a cached inode was changed, so it is saved no later than
+ *  when its last reference is given back.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The changed inode, as returned by gros_icache_get
+ */
+void gros_icache_dirty( Disk * disk, Inode * inode );
+
+/**
+ * Takes the lock of a cached inode, which the operations that change it
+ *  (gros_i_write, gros_i_truncate and the like) hold, so they do not
+ *  interleave. A thread may take it again while it holds it. Taken inside
+ *  a journal operation, never the other way round. Does nothing for an
+ *  inode that did not come from the cache.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to lock, as returned by gros_icache_get
+ */
+void gros_icache_lock( Disk * disk, Inode * inode );
+
+/**
+ * Gives back the lock taken by gros_icache_lock.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to unlock
+ */
+void gros_icache_unlock( Disk * disk, Inode * inode );
+
+/**
+ * Saves `inode` to its block. If it is not the cached copy of its inode
+ *  number, the cached copy is brought up to date with it first. Returns
+ *  the inode number or -errno.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to save
+ */
+int gros_icache_save( Disk * disk, Inode * inode );
+
+/**
+ * Saves `inode` if it is dirty, or every dirty cached inode if `inode` is
+ *  NULL. Returns 0 or the -errno of a failed save.
+ *
+ * @param Disk  * disk    The disk holding the file system
+ * @param Inode * inode   The inode to save, or NULL for all of them
+ */
+int gros_icache_flush( Disk * disk, Inode * inode );
+
+#endif
@@ -0,0 +1,834 @@
+/**
+ * journal.cpp
+ */
+
+#include "journal.hpp"
+#include "cache.hpp"
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+
+
+/**
+ * FNV-1a over `len` bytes, continuing from `hash`.
+ */
+static uint32_t gros_journal_hash( uint32_t hash, const char * buf, size_t len ) {
+    size_t i;
+
+    for( i = 0; i < len; i++ ) {
+        hash ^= ( unsigned char ) buf[ i ];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ * Writes a journal head that makes replay start at `sequence`.
+ */
+static int gros_journal_write_head( Disk * disk, int start, uint32_t sequence ) {
+    char          buf[ BLOCK_SIZE ];
+    JournalHead * head = ( JournalHead * ) buf;
+
+    std::memset( buf, 0, BLOCK_SIZE );
+    head->magic    = GROS_JOURNAL_HEAD;
+    head->sequence = sequence;
+    return gros_write_block( disk, start, buf );
+}
+
+
+/**
+ * Returns how many blocks gros_make_fs reserves for the journal of a disk
+ *  with `num_blocks` blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_journal_size( int num_blocks ) {
+    return std::min( std::max( num_blocks / GROS_JOURNAL_SHARE, GROS_JOURNAL_MIN ),
+                     GROS_JOURNAL_MAX );
+}
+
+
+/**
+ * Writes an empty journal into blocks start .. start + nblocks - 1.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk      The disk to hold the journal
+ * @param int    start     First block of the journal
+ * @param int    nblocks   Size of the journal, in blocks
+ */
+int gros_format_journal( Disk * disk, int start, int nblocks ) {
+    int status;
+
+    if( nblocks < 4 )
+        return -EINVAL;
+    // transactions left over from an older image must not look committed;
+    // discarded blocks read as zeros without taking up space in the image
+    if( ( status = gros_discard_blocks( disk, start + 1, nblocks - 1 ) ) < 0 )
+        return status;
+    return gros_journal_write_head( disk, start, 1 );
+}
+
+
+/**
+ * Reads the transaction at `pos` and, if it was fully committed with
+ *  sequence number `sequence`, writes its blocks to their home. Returns the
+ *  number of journal blocks it took, 0 if there is no such transaction, or
+ *  -errno.
+ */
+static int gros_journal_replay_one( Disk * disk, int start, int nblocks,
+                                    int pos, uint32_t sequence ) {
+    char                   desc[ BLOCK_SIZE ];
+    JournalDesc          * d = ( JournalDesc * ) desc;
+    JournalCommit        * c;
+    std::vector< char >    data;
+    std::vector< BlockIO > ios;
+    uint32_t               hash;
+    int                    i;
+    int                    status;
+
+    if( ( status = gros_read_block( disk, start + pos, desc ) ) < 0 )
+        return status;
+    if( d->magic != GROS_JOURNAL_DESC || d->sequence != sequence
+        || d->count < 1 || d->count > ( int ) GROS_JOURNAL_TAGS
+        || pos + d->count + 2 > nblocks )
+        return 0;
+
+    // the logged blocks and the commit block
+    data.resize( ( size_t ) ( d->count + 1 ) * BLOCK_SIZE );
+    ios.resize( d->count + 1 );
+    for( i = 0; i <= d->count; i++ ) {
+        ios[ i ].block_num = start + pos + 1 + i;
+        ios[ i ].buf       = &data[ ( size_t ) i * BLOCK_SIZE ];
+    }
+    if( ( status = gros_read_blocks( disk, &ios[ 0 ], d->count + 1 ) ) < 0 )
+        return status;
+
+    c    = ( JournalCommit * ) ios[ d->count ].buf;
+    hash = gros_journal_hash( 2166136261u, desc, BLOCK_SIZE );
+    hash = gros_journal_hash( hash, &data[ 0 ], ( size_t ) d->count * BLOCK_SIZE );
+    if( c->magic != GROS_JOURNAL_COMMIT || c->sequence != sequence
+        || c->count != d->count || c->checksum != hash )
+        return 0;
+
+    ios.pop_back();
+    for( i = 0; i < d->count; i++ ) {
+        if( d->blocks[ i ] < 0 || ( int64_t ) d->blocks[ i ] * BLOCK_SIZE
+                                  + BLOCK_SIZE > disk->size )
+            return 0;
+        ios[ i ].block_num = d->blocks[ i ];
+    }
+    // drops whatever the cache read before the replay
+    if( ( status = gros_bwrite_blocks( disk, &ios[ 0 ], d->count ) ) < 0 )
+        return status;
+    return d->count + 2;
+}
+
+
+/**
+ * Replays every transaction committed to the journal at `start` into its
+ *  home location and starts logging into it: from then on the cache writes
+ *  dirty blocks back to the journal instead of their home. Returns the
+ *  number of transactions replayed, or -errno.
+ *
+ * @param Disk * disk      The disk holding the journal
+ * @param int    start     First block of the journal
+ * @param int    nblocks   Size of the journal, in blocks
+ */
+int gros_open_journal( Disk * disk, int start, int nblocks ) {
+    char          buf[ BLOCK_SIZE ];
+    JournalHead * head = ( JournalHead * ) buf;
+    Journal     * journal;
+    uint32_t      sequence;
+    int           pos;
+    int           used;
+    int           replayed = 0;
+    int           status;
+
+    if( disk->journal != NULL )
+        return -EEXIST;
+    if( nblocks < 4 || start < 1
+        || ( int64_t ) ( start + nblocks ) * BLOCK_SIZE > disk->size )
+        return -EINVAL;
+    if( ( status = gros_read_block( disk, start, buf ) ) < 0 )
+        return status;
+
+    if( head->magic != GROS_JOURNAL_HEAD ) {
+        if( ( status = gros_format_journal( disk, start, nblocks ) ) < 0 )
+            return status;
+        sequence = 1;
+    } else {
+        sequence = head->sequence;
+        for( pos = 1; pos + 2 <= nblocks; pos += used, sequence++, replayed++ )
+            if( ( used = gros_journal_replay_one( disk, start, nblocks,
+                                                  pos, sequence ) ) <= 0 )
+                break;
+        if( used < 0 )
+            return used;
+        // the replayed blocks must be home before the journal is reused
+        if( replayed > 0 && ( ( status = gros_sync_disk( disk ) ) < 0
+            || ( status = gros_journal_write_head( disk, start, sequence ) ) < 0
+            || ( status = gros_sync_disk( disk ) ) < 0 ) )
+            return status;
+    }
+
+    journal              = new Journal();
+    journal->start       = start;
+    journal->nblocks     = nblocks;
+    journal->next        = 1;
+    journal->sequence    = sequence;
+    journal->commits     = 0;
+    journal->checkpoints = 0;
+    journal->committed   = 0;
+    journal->handles     = 0;
+    journal->locked      = false;
+    journal->writing     = false;
+    pthread_cond_init( &journal->quiet, NULL );
+    disk->journal        = journal;
+    return replayed;
+}
+
+
+/**
+ * Checkpoints the journal and stops logging. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose journal to close
+ */
+int gros_close_journal( Disk * disk ) {
+    Journal *                         journal = disk->journal;
+    std::map< int, char * >::iterator it;
+    int                               status;
+
+    if( journal == NULL )
+        return 0;
+    status = gros_checkpoint( disk );
+    for( it = journal->pending.begin(); it != journal->pending.end(); ++it )
+        delete [] it->second;
+    pthread_cond_destroy( &journal->quiet );
+    delete journal;
+    disk->journal = NULL;
+    return status;
+}
+
+
+/**
+ * Opens an operation: the blocks it dirties between here and the matching
+ *  gros_journal_end go into the same transaction, since the cache only
+ *  commits while no operation is under way. Operations on the same disk
+ *  nest; only the outermost pair a thread opens on it counts. If the
+ *  running transaction has grown too big for the journal or the cache, it
+ *  is committed before the operation starts.
+ *  Does nothing unless the disk has both a journal and a cache.
+ *
+ * @param Disk * disk   The disk the operation changes
+ */
+void gros_journal_begin( Disk * disk ) {
+    Journal * journal = disk->journal;
+    Cache *   cache   = disk->cache;
+    bool      full;
+
+    if( journal == NULL || cache == NULL )
+        return;
+    pthread_mutex_lock( &cache->lock );
+    if( journal->depth[ pthread_self() ]++ > 0 ) {
+        pthread_mutex_unlock( &cache->lock );
+        return;
+    }
+    // leave the operation room in the journal and the cache for its blocks
+    full = cache->ndirty * 2 >= std::min( journal->nblocks - 1, cache->max_blocks );
+    pthread_mutex_unlock( &cache->lock );
+    if( full )
+        gros_bcommit( disk );
+
+    pthread_mutex_lock( &cache->lock );
+    while( journal->locked )
+        pthread_cond_wait( &journal->quiet, &cache->lock );
+    journal->handles++;
+    pthread_mutex_unlock( &cache->lock );
+}
+
+
+/**
+ * Closes the operation opened by gros_journal_begin.
+ *
+ * @param Disk * disk   The disk the operation changed
+ */
+void gros_journal_end( Disk * disk ) {
+    Journal *                            journal = disk->journal;
+    Cache *                              cache   = disk->cache;
+    std::map< pthread_t, int >::iterator it;
+
+    if( journal == NULL || cache == NULL )
+        return;
+    pthread_mutex_lock( &cache->lock );
+    if( ( it = journal->depth.find( pthread_self() ) ) == journal->depth.end()
+        || --it->second > 0 ) {
+        pthread_mutex_unlock( &cache->lock );
+        return;
+    }
+    journal->depth.erase( it );
+    if( --journal->handles == 0 )
+        pthread_cond_broadcast( &journal->quiet );
+    pthread_mutex_unlock( &cache->lock );
+}
+
+
+/**
+ * Writes `n` blocks as a single transaction at the journal's next free
+ *  block, which the caller made sure has room for it. The journal itself
+ *  is left as it was; see gros_journal_publish.
+ */
+static int gros_journal_write( Disk * disk, Journal * journal,
+                               BlockIO * ios, int n ) {
+    char                   desc[ BLOCK_SIZE ];
+    char                   commit[ BLOCK_SIZE ];
+    JournalDesc          * d = ( JournalDesc * ) desc;
+    JournalCommit        * c = ( JournalCommit * ) commit;
+    std::vector< BlockIO > out( n + 2 );
+    uint32_t               hash;
+    int                    at = journal->start + journal->next;
+    int                    i;
+
+    std::memset( desc, 0, BLOCK_SIZE );
+    std::memset( commit, 0, BLOCK_SIZE );
+    d->magic    = GROS_JOURNAL_DESC;
+    d->sequence = journal->sequence;
+    d->count    = n;
+    for( i = 0; i < n; i++ )
+        d->blocks[ i ] = ios[ i ].block_num;
+
+    hash = gros_journal_hash( 2166136261u, desc, BLOCK_SIZE );
+    out[ 0 ].block_num = at;
+    out[ 0 ].buf       = desc;
+    for( i = 0; i < n; i++ ) {
+        hash = gros_journal_hash( hash, ios[ i ].buf, BLOCK_SIZE );
+        out[ i + 1 ].block_num = at + 1 + i;
+        out[ i + 1 ].buf       = ios[ i ].buf;
+    }
+    c->magic    = GROS_JOURNAL_COMMIT;
+    c->sequence = journal->sequence;
+    c->count    = n;
+    c->checksum = hash;
+    out[ n + 1 ].block_num = at + n + 1;
+    out[ n + 1 ].buf       = commit;
+
+    // the transaction is contiguous, so this is one sequential write
+    return gros_write_blocks( disk, &out[ 0 ], n + 2 );
+}
+
+
+/**
+ * Moves the journal's tail past the transaction gros_journal_write just
+ *  wrote, and keeps its blocks until they are checkpointed.
+ */
+static void gros_journal_publish( Journal * journal, BlockIO * ios, int n ) {
+    std::map< int, char * >::iterator it;
+    int                               i;
+
+    for( i = 0; i < n; i++ ) {
+        if( ( it = journal->pending.find( ios[ i ].block_num ) )
+            == journal->pending.end() )
+            it = journal->pending.insert( std::make_pair( ios[ i ].block_num,
+                                          new char[ BLOCK_SIZE ] ) ).first;
+        std::memcpy( it->second, ios[ i ].buf, BLOCK_SIZE );
+    }
+    if( journal->next == 1 )
+        journal->committed = time( NULL );
+    journal->next += n + 2;
+    journal->sequence++;
+    journal->commits++;
+}
+
+
+/**
+ * Writes `n` blocks as a single transaction at the journal's next free
+ *  block, which the caller made sure has room for it.
+ */
+static int gros_journal_append( Disk * disk, Journal * journal,
+                                BlockIO * ios, int n ) {
+    int status;
+
+    if( ( status = gros_journal_write( disk, journal, ios, n ) ) < 0 )
+        return status;
+    gros_journal_publish( journal, ios, n );
+    return 0;
+}
+
+
+/**
+ * Lists every logged block, with its logged contents, for a checkpoint.
+ */
+static void gros_checkpoint_list( Journal * journal, std::vector< BlockIO > & ios ) {
+    std::map< int, char * >::iterator it;
+
+    for( it = journal->pending.begin(); it != journal->pending.end(); ++it ) {
+        BlockIO io = { it->first, it->second };
+        ios.push_back( io );
+    }
+}
+
+
+/**
+ * Writes the listed blocks home for a checkpoint, and a journal head
+ *  past the last transaction. Returns 0 or -errno.
+ */
+static int gros_checkpoint_write( Disk * disk, Journal * journal,
+                                  std::vector< BlockIO > & ios ) {
+    int status;
+
+    // the homes are only overwritten once the journal is safe, and the
+    // journal is only emptied once the homes are
+    if( ( status = gros_sync_disk( disk ) ) < 0 )
+        return status;
+    if( ! ios.empty()
+        && ( status = gros_write_blocks( disk, &ios[ 0 ], ( int ) ios.size() ) ) < 0 )
+        return status;
+    if( ( status = gros_sync_disk( disk ) ) < 0
+        || ( status = gros_journal_write_head( disk, journal->start,
+                                               journal->sequence ) ) < 0
+        || ( status = gros_sync_disk( disk ) ) < 0 )
+        return status;
+    return 0;
+}
+
+
+/**
+ * Empties the journal once a checkpoint has written its blocks home.
+ */
+static void gros_checkpoint_empty( Journal * journal ) {
+    std::map< int, char * >::iterator it;
+
+    for( it = journal->pending.begin(); it != journal->pending.end(); ++it )
+        delete [] it->second;
+    journal->pending.clear();
+    journal->next = 1;
+    journal->checkpoints++;
+}
+
+
+/**
+ * Appends the blocks as one transaction: a single sequential write of a
+ *  descriptor, the blocks and a commit block. The blocks only reach their
+ *  home on the next checkpoint, which happens when the journal runs out of
+ *  room. Nothing is flushed; gros_sync_disk makes the transaction durable.
+ *  A batch bigger than the whole journal is split over several
+ *  transactions, and is then no longer atomic. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The disk with an open journal
+ * @param BlockIO * ios    The blocks to log and their new contents
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_commit( Disk * disk, BlockIO * ios, int n ) {
+    Journal * journal = disk->journal;
+    int       most    = std::min( ( int ) GROS_JOURNAL_TAGS, journal->nblocks - 3 );
+    int       done;
+    int       count;
+    int       status;
+
+    for( done = 0; done < n; done += count ) {
+        count = std::min( n - done, most );
+        if( journal->next + count + 2 > journal->nblocks
+            && ( status = gros_checkpoint( disk ) ) < 0 )
+            return status;
+        if( ( status = gros_journal_append( disk, journal, ios + done, count ) ) < 0 )
+            return status;
+    }
+    return 0;
+}
+
+
+/**
+ * Commits the blocks like gros_journal_commit, for the cache: called with
+ *  the cache lock held and journal->writing set by the caller. The lock is
+ *  let go while the transaction, and any checkpoint making room for it,
+ *  is written; lookups meanwhile see the journal as it was, and its tail
+ *  only advances once the lock is taken again. `ios` must not change
+ *  until it returns. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The cached disk with an open journal
+ * @param BlockIO * ios    The blocks to log and their new contents
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_log( Disk * disk, BlockIO * ios, int n ) {
+    Journal * journal = disk->journal;
+    Cache *   cache   = disk->cache;
+    int       most    = std::min( ( int ) GROS_JOURNAL_TAGS, journal->nblocks - 3 );
+    int       done;
+    int       count;
+    int       i;
+    int       status  = 0;
+
+    for( i = 0; i < n; i++ )
+        journal->logging.insert( ios[ i ].block_num );
+    for( done = 0; done < n && status == 0; done += count ) {
+        count = std::min( n - done, most );
+        if( journal->next + count + 2 > journal->nblocks
+            && ( status = gros_journal_checkpoint( disk ) ) < 0 )
+            break;
+        pthread_mutex_unlock( &cache->lock );
+        status = gros_journal_write( disk, journal, ios + done, count );
+        pthread_mutex_lock( &cache->lock );
+        if( status == 0 )
+            gros_journal_publish( journal, ios + done, count );
+    }
+    journal->logging.clear();
+    return status;
+}
+
+
+/**
+ * Copies the logged contents of block `block_num` into `buf` if it has
+ *  been committed but not yet checkpointed, since its home is stale then.
+ *  Returns 1 if it was, 0 if the block must be read from its home.
+ *
+ * @param Disk * disk       The disk with an open journal
+ * @param int    block_num  The block to look up
+ * @param char * buf        Destination of BLOCK_SIZE bytes
+ */
+int gros_journal_lookup( Disk * disk, int block_num, char * buf ) {
+    std::map< int, char * >::iterator it = disk->journal->pending.find( block_num );
+
+    if( it == disk->journal->pending.end() )
+        return 0;
+    std::memcpy( buf, it->second, BLOCK_SIZE );
+    return 1;
+}
+
+
+/**
+ * Must be called before blocks are written to their home without going
+ *  through the journal. If any of them is still waiting for a checkpoint,
+ *  the journal is checkpointed first so a replay cannot bring the logged
+ *  copy back over the new contents. Called with the cache lock held, if
+ *  there is a cache; if one of them is being logged by gros_journal_log,
+ *  or a checkpoint is under way without the lock, it waits for that to
+ *  end first. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The disk with an open journal
+ * @param BlockIO * ios    The blocks about to be written
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_release( Disk * disk, BlockIO * ios, int n ) {
+    Journal * journal = disk->journal;
+    bool      logged;
+    int       i;
+
+    for( ;; ) {
+        logged = false;
+        for( i = 0; i < n && ! logged; i++ )
+            logged = journal->pending.count( ios[ i ].block_num ) > 0
+                     || journal->logging.count( ios[ i ].block_num ) > 0;
+        if( ! logged )
+            return 0;
+        if( disk->cache == NULL || ! journal->writing )
+            return gros_checkpoint( disk );
+        pthread_cond_wait( &journal->quiet, &disk->cache->lock );
+    }
+}
+
+
+/**
+ * Writes every logged block to its home, flushes the disk and empties the
+ *  journal. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk with an open journal
+ */
+int gros_checkpoint( Disk * disk ) {
+    Journal *              journal = disk->journal;
+    std::vector< BlockIO > ios;
+    int                    status;
+
+    if( journal->next == 1 )
+        return 0;
+    gros_checkpoint_list( journal, ios );
+    if( ( status = gros_checkpoint_write( disk, journal, ios ) ) < 0 )
+        return status;
+    gros_checkpoint_empty( journal );
+    return 0;
+}
+
+
+/**
+ * Checkpoints the journal like gros_checkpoint, for the cache's flusher:
+ *  called with the cache lock held and journal->writing set by the
+ *  caller. The lock is let go while the logged blocks are written home
+ *  and the disk is flushed, and taken again to empty the journal.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The cached disk with an open journal
+ */
+int gros_journal_checkpoint( Disk * disk ) {
+    Journal *              journal = disk->journal;
+    Cache *                cache   = disk->cache;
+    std::vector< BlockIO > ios;
+    int                    status;
+
+    if( journal->next == 1 )
+        return 0;
+    // only the writer changes the logged copies, so they can be read unlocked
+    gros_checkpoint_list( journal, ios );
+    pthread_mutex_unlock( &cache->lock );
+    status = gros_checkpoint_write( disk, journal, ios );
+    pthread_mutex_lock( &cache->lock );
+    if( status < 0 )
+        return status;
+    gros_checkpoint_empty( journal );
+    return 0;
+}
+
+
+/**
+ * Syncs the disk given as `arg` from a thread of its own.
+ */
+static void * gros_test_bsync( void * arg ) {
+    return ( void * ) ( intptr_t ) gros_bsync( ( Disk * ) arg );
+}
+
+
+TEST_CASE( "Metadata is logged to the journal and checkpointed lazily", "[journal]" ) {
+    Disk *  disk = gros_open_disk();
+    char    buf[ BLOCK_SIZE ];
+    char    out[ BLOCK_SIZE ];
+    int     i;
+
+    std::memset( buf, 0, BLOCK_SIZE );
+    for( i = 300; i < 340; i++ )
+        REQUIRE( gros_write_block( disk, i, buf ) == 0 );
+    REQUIRE( gros_format_journal( disk, 200, 16 ) == 0 );
+    REQUIRE( gros_open_journal( disk, 200, 16 ) == 0 );
+    REQUIRE( gros_open_journal( disk, 200, 16 ) == -EEXIST );
+    REQUIRE( gros_attach_cache( disk, 16 * BLOCK_SIZE ) == 0 );
+    Journal * journal = disk->journal;
+
+    for( i = 0; i < 5; i++ ) {
+        std::memset( buf, 'a' + i, BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 300 + i, buf ) == 0 );
+    }
+    REQUIRE( gros_bsync( disk ) == 0 );
+
+    SECTION( "A sync commits the dirty blocks as one transaction" ) {
+        REQUIRE( journal->commits == 1 );
+        REQUIRE( journal->next == 1 + 5 + 2 );
+        REQUIRE( journal->pending.size() == 5 );
+        REQUIRE( gros_read_block( disk, 302, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0 );
+        REQUIRE( gros_bread( disk, 302, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'c' );
+    }
+
+    SECTION( "Logged blocks pushed out of the cache are read from the journal" ) {
+        for( i = 310; i < 340; i++ )
+            REQUIRE( gros_bread( disk, i, out ) == 0 );
+        REQUIRE( gros_bread( disk, 301, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'b' );
+        BlockIO io = { 303, out };
+        REQUIRE( gros_bread_blocks( disk, &io, 1 ) == 0 );
+        REQUIRE( out[ 0 ] == 'd' );
+    }
+
+    SECTION( "A full journal is checkpointed" ) {
+        for( i = 0; i < 3; i++ ) {
+            std::memset( buf, 'x' + i, BLOCK_SIZE );
+            REQUIRE( gros_bwrite( disk, 310 + i, buf ) == 0 );
+            REQUIRE( gros_bwrite( disk, 320 + i, buf ) == 0 );
+            REQUIRE( gros_bsync( disk ) == 0 );
+        }
+        REQUIRE( journal->checkpoints == 1 );
+        REQUIRE( gros_read_block( disk, 300, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'a' );
+    }
+
+    SECTION( "Eviction leaves the running transaction whole" ) {
+        std::memset( buf, 'p', BLOCK_SIZE );
+        for( i = 0; i < 18; i++ )
+            REQUIRE( gros_bwrite( disk, 310 + i, buf ) == 0 );
+        REQUIRE( journal->commits == 1 );
+        REQUIRE( disk->cache->ndirty == 18 );
+        REQUIRE( disk->cache->nblocks > disk->cache->max_blocks );
+        // more than the journal holds at once has to be split
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( journal->commits == 3 );
+        REQUIRE( disk->cache->nblocks <= disk->cache->max_blocks );
+    }
+
+    SECTION( "A commit waits for the operation under way" ) {
+        pthread_t thread;
+        void    * status;
+
+        gros_journal_begin( disk );
+        std::memset( buf, 'q', BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 310, buf ) == 0 );
+        REQUIRE( pthread_create( &thread, NULL, gros_test_bsync, disk ) == 0 );
+        pthread_mutex_lock( &disk->cache->lock );
+        while( ! journal->locked ) {
+            pthread_mutex_unlock( &disk->cache->lock );
+            sched_yield();
+            pthread_mutex_lock( &disk->cache->lock );
+        }
+        pthread_mutex_unlock( &disk->cache->lock );
+        REQUIRE( journal->commits == 1 );
+        REQUIRE( gros_bwrite( disk, 311, buf ) == 0 );
+        gros_journal_end( disk );
+        REQUIRE( pthread_join( thread, &status ) == 0 );
+        REQUIRE( status == NULL );
+        // both halves went out together
+        REQUIRE( journal->commits == 2 );
+        REQUIRE( journal->next == 1 + 5 + 2 + 2 + 2 );
+    }
+
+    SECTION( "A freed block is discarded once the transaction freeing it is durable" ) {
+        std::memset( buf, 's', BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 330, buf ) == 0 );
+        REQUIRE( gros_bsync( disk ) == 0 );
+        gros_journal_begin( disk );
+        REQUIRE( gros_bdiscard( disk, 330 ) == 0 );
+        REQUIRE( gros_bwrite( disk, 331, buf ) == 0 );
+        gros_journal_end( disk );
+        REQUIRE( disk->discards.size() == 1 );
+        // committed, but not yet on stable storage
+        REQUIRE( gros_bcommit( disk ) == 0 );
+        REQUIRE( disk->discards.size() == 1 );
+        REQUIRE( gros_bsync( disk ) == 0 );
+        REQUIRE( disk->discards.empty() );
+        REQUIRE( gros_read_block( disk, 330, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0 );
+    }
+
+    SECTION( "The flusher commits whole transactions and checkpoints a filling journal" ) {
+        bool done = false;
+
+        std::memset( buf, 'r', BLOCK_SIZE );
+        REQUIRE( gros_bwrite( disk, 310, buf ) == 0 );
+        REQUIRE( gros_bwrite( disk, 311, buf ) == 0 );
+        REQUIRE( gros_start_flusher( disk, 3600 ) == 0 );
+        for( i = 0; i < 50 && ! done; i++ ) {
+            pthread_mutex_lock( &disk->cache->lock );
+            done = journal->checkpoints == 1;
+            pthread_mutex_unlock( &disk->cache->lock );
+            if( ! done )
+                usleep( 100000 );
+        }
+        gros_stop_flusher( disk );
+        REQUIRE( journal->commits == 2 );
+        REQUIRE( journal->checkpoints == 1 );
+        REQUIRE( disk->cache->ndirty == 0 );
+        REQUIRE( gros_read_block( disk, 311, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'r' );
+    }
+
+    SECTION( "Committed transactions are replayed after a crash" ) {
+        // a second disk on the same image sees what a crash would leave
+        Disk * after = gros_open_disk();
+        REQUIRE( gros_open_journal( after, 200, 16 ) == 1 );
+        for( i = 0; i < 5; i++ ) {
+            REQUIRE( gros_read_block( after, 300 + i, out ) == 0 );
+            REQUIRE( out[ 0 ] == 'a' + i );
+        }
+        REQUIRE( after->journal->sequence == journal->sequence );
+        gros_close_disk( after );
+    }
+
+    SECTION( "A torn transaction is not replayed" ) {
+        std::memset( out, '?', BLOCK_SIZE );
+        REQUIRE( gros_write_block( disk, 200 + 3, out ) == 0 );
+        Disk * after = gros_open_disk();
+        REQUIRE( gros_open_journal( after, 200, 16 ) == 0 );
+        REQUIRE( gros_read_block( after, 300, out ) == 0 );
+        REQUIRE( out[ 0 ] == 0 );
+        gros_close_disk( after );
+    }
+
+    SECTION( "Writing around the journal checkpoints the blocks it covers" ) {
+        std::memset( buf, 'z', BLOCK_SIZE );
+        BlockIO io = { 304, buf };
+        REQUIRE( gros_bwrite_blocks( disk, &io, 1 ) == 0 );
+        REQUIRE( journal->checkpoints == 1 );
+        REQUIRE( journal->pending.empty() );
+        Disk * after = gros_open_disk();
+        REQUIRE( gros_open_journal( after, 200, 16 ) == 0 );
+        REQUIRE( gros_read_block( after, 304, out ) == 0 );
+        REQUIRE( out[ 0 ] == 'z' );
+        gros_close_disk( after );
+    }
+
+    gros_close_disk( disk );
+    REQUIRE( gros_read_block( ( disk = gros_open_disk() ), 300, out ) == 0 );
+    REQUIRE( out[ 0 ] == 'a' );
+    gros_close_disk( disk );
+}
+
+TEST_CASE( "Operations are counted per disk", "[journal]" ) {
+    Disk * a = gros_open_ram( 256 * BLOCK_SIZE );
+    Disk * b = gros_open_ram( 256 * BLOCK_SIZE );
+
+    REQUIRE( gros_open_journal( a, 100, 16 ) == 0 );
+    REQUIRE( gros_open_journal( b, 100, 16 ) == 0 );
+    REQUIRE( gros_attach_cache( a, 16 * BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_attach_cache( b, 16 * BLOCK_SIZE ) == 0 );
+
+    // one thread working on two disks at once
+    gros_journal_begin( a );
+    gros_journal_begin( b );
+    gros_journal_begin( a );
+    REQUIRE( a->journal->handles == 1 );
+    REQUIRE( b->journal->handles == 1 );
+    gros_journal_end( b );
+    REQUIRE( b->journal->handles == 0 );
+    gros_journal_end( a );
+    REQUIRE( a->journal->handles == 1 );
+    gros_journal_end( a );
+    REQUIRE( a->journal->handles == 0 );
+    REQUIRE( a->journal->depth.empty() );
+
+    gros_close_disk( b );
+    gros_close_disk( a );
+}
+
+TEST_CASE( "Operations go on while a commit is written", "[journal]" ) {
+    Disk *    disk = gros_open_latency( gros_open_ram( 256 * BLOCK_SIZE ), 50000, 0 );
+    char      buf[ BLOCK_SIZE ];
+    char      out[ BLOCK_SIZE ];
+    pthread_t thread;
+    void    * status;
+
+    REQUIRE( gros_format_journal( disk, 100, 16 ) == 0 );
+    REQUIRE( gros_open_journal( disk, 100, 16 ) == 0 );
+    REQUIRE( gros_attach_cache( disk, 16 * BLOCK_SIZE ) == 0 );
+    Journal * journal = disk->journal;
+
+    std::memset( buf, 'q', BLOCK_SIZE );
+    REQUIRE( gros_bwrite( disk, 150, buf ) == 0 );
+    REQUIRE( pthread_create( &thread, NULL, gros_test_bsync, disk ) == 0 );
+    // wait for the transaction to be taken and written without the lock
+    pthread_mutex_lock( &disk->cache->lock );
+    while( ( ! journal->writing || journal->locked ) && journal->commits == 0 ) {
+        pthread_mutex_unlock( &disk->cache->lock );
+        sched_yield();
+        pthread_mutex_lock( &disk->cache->lock );
+    }
+    pthread_mutex_unlock( &disk->cache->lock );
+    REQUIRE( journal->commits == 0 );
+
+    gros_journal_begin( disk );
+    std::memset( buf, 'r', BLOCK_SIZE );
+    REQUIRE( gros_bwrite( disk, 150, buf ) == 0 );
+    REQUIRE( gros_bread( disk, 150, out ) == 0 );
+    REQUIRE( out[ 0 ] == 'r' );
+    gros_journal_end( disk );
+    REQUIRE( pthread_join( thread, &status ) == 0 );
+    REQUIRE( status == NULL );
+
+    // the commit logged the block as it was taken, and left it dirty
+    REQUIRE( journal->commits == 1 );
+    REQUIRE( journal->pending[ 150 ][ 0 ] == 'q' );
+    REQUIRE( disk->cache->ndirty == 1 );
+    REQUIRE( gros_bsync( disk ) == 0 );
+    REQUIRE( journal->commits == 2 );
+    REQUIRE( journal->pending[ 150 ][ 0 ] == 'r' );
+    REQUIRE( disk->cache->ndirty == 0 );
+
+    gros_close_disk( disk );
+}
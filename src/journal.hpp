@@ -0,0 +1,199 @@
+/**
+ * journal.hpp
+ */
+
+#ifndef __JOURNAL_HPP_INCLUDED__   // if journal.hpp hasn't been included yet...
+#define __JOURNAL_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "disk.hpp"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <map>
+#include <set>
+
+#define GROS_JOURNAL_MIN    16      // smallest journal, in blocks
+#define GROS_JOURNAL_MAX    1024    // largest journal, in blocks (4 mb)
+#define GROS_JOURNAL_SHARE  32      // the journal gets 1/32 of the disk
+
+#define GROS_JOURNAL_HEAD   0x4a534f52  // "ROSJ", first block of the journal
+#define GROS_JOURNAL_DESC   0x44534f52  // "ROSD", opens a transaction
+#define GROS_JOURNAL_COMMIT 0x43534f52  // "ROSC", closes a transaction
+
+// home locations a single descriptor block can list
+#define GROS_JOURNAL_TAGS   ( ( BLOCK_SIZE - 3 * sizeof( uint32_t ) ) / sizeof( int32_t ) )
+
+/**
+ * On disk the journal is a head block followed by transactions, each one a
+ *  descriptor, the logged blocks in the order it lists them, and a commit
+ *  block. A transaction whose commit block is missing or does not match
+ *  its contents was torn by a crash and is ignored along with all later ones.
+ */
+typedef struct _journalhead {
+    uint32_t magic;
+    uint32_t sequence;  /* sequence number of the first transaction to replay */
+} JournalHead;
+
+typedef struct _journaldesc {
+    uint32_t magic;
+    uint32_t sequence;
+    int32_t  count;     /* number of logged blocks that follow */
+    int32_t  blocks[ GROS_JOURNAL_TAGS ]; /* home location of each of them */
+} JournalDesc;
+
+typedef struct _journalcommit {
+    uint32_t magic;
+    uint32_t sequence;
+    int32_t  count;
+    uint32_t checksum;  /* over the descriptor and the logged blocks */
+} JournalCommit;
+
+typedef struct _journal {
+    int       start;    /* block number of the journal head */
+    int       nblocks;  /* size of the journal, head included */
+    int       next;     /* where the next transaction goes, relative to start */
+    uint32_t  sequence; /* sequence number of the next transaction */
+    std::map< int, char * > pending; /* logged blocks not yet checkpointed */
+    int64_t   commits;
+    int64_t   checkpoints;
+    time_t    committed; /* when the oldest transaction not checkpointed was */
+    int       handles;  /* operations under way, see gros_journal_begin */
+    std::map< pthread_t, int > depth; /* how deep each thread is in them */
+    bool      locked;   /* a commit is waiting for them to end */
+    bool      writing;  /* a commit or checkpoint is writing with the cache lock let go */
+    std::set< int > logging; /* blocks of the transaction it is writing */
+    pthread_cond_t quiet; /* signalled, with the cache lock, as they do */
+} Journal;
+
+/**
+ * Returns how many blocks gros_make_fs reserves for the journal of a disk
+ *  with `num_blocks` blocks.
+ *
+ * @param int num_blocks   Size of the disk, in blocks
+ */
+int gros_journal_size( int num_blocks );
+
+/**
+ * Writes an empty journal into blocks start .. start + nblocks - 1.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk      The disk to hold the journal
+ * @param int    start     First block of the journal
+ * @param int    nblocks   Size of the journal, in blocks
+ */
+int gros_format_journal( Disk * disk, int start, int nblocks );
+
+/**
+ * Replays every transaction committed to the journal at `start` into its
+ *  home location and starts logging into it: from then on the cache writes
+ *  dirty blocks back to the journal instead of their home. Returns the
+ *  number of transactions replayed, or -errno.
+ *
+ * @param Disk * disk      The disk holding the journal
+ * @param int    start     First block of the journal
+ * @param int    nblocks   Size of the journal, in blocks
+ */
+int gros_open_journal( Disk * disk, int start, int nblocks );
+
+/**
+ * Checkpoints the journal and stops logging. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk whose journal to close
+ */
+int gros_close_journal( Disk * disk );
+
+/**
+ * Opens an operation: the blocks it dirties between here and the matching
+ *  gros_journal_end go into the same transaction, since the cache only
+ *  commits while no operation is under way. Operations on the same disk
+ *  nest; only the outermost pair a thread opens on it counts. If the
+ *  running transaction has grown too big for the journal or the cache, it
+ *  is committed before the operation starts.
+ *  Does nothing unless the disk has both a journal and a cache.
+ *
+ * @param Disk * disk   The disk the operation changes
+ */
+void gros_journal_begin( Disk * disk );
+
+/**
+ * Closes the operation opened by gros_journal_begin.
+ *
+ * @param Disk * disk   The disk the operation changed
+ */
+void gros_journal_end( Disk * disk );
+
+/**
+ * Appends the blocks as one transaction: a single sequential write of a
+ *  descriptor, the blocks and a commit block. The blocks only reach their
+ *  home on the next checkpoint, which happens when the journal runs out of
+ *  room. Nothing is flushed; gros_sync_disk makes the transaction durable.
+ *  A batch bigger than the whole journal is split over several
+ *  transactions, and is then no longer atomic. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The disk with an open journal
+ * @param BlockIO * ios    The blocks to log and their new contents
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_commit( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Commits the blocks like gros_journal_commit, for the cache: called with
+ *  the cache lock held and journal->writing set by the caller. The lock is
+ *  let go while the transaction, and any checkpoint making room for it,
+ *  is written; lookups meanwhile see the journal as it was, and its tail
+ *  only advances once the lock is taken again. `ios` must not change
+ *  until it returns. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The cached disk with an open journal
+ * @param BlockIO * ios    The blocks to log and their new contents
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_log( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Copies the logged contents of block `block_num` into `buf` if it has
+ *  been committed but not yet checkpointed, since its home is stale then.
+ *  Returns 1 if it was, 0 if the block must be read from its home.
+ *
+ * @param Disk * disk       The disk with an open journal
+ * @param int    block_num  The block to look up
+ * @param char * buf        Destination of BLOCK_SIZE bytes
+ */
+int gros_journal_lookup( Disk * disk, int block_num, char * buf );
+
+/**
+ * Must be called before blocks are written to their home without going
+ *  through the journal. If any of them is still waiting for a checkpoint,
+ *  the journal is checkpointed first so a replay cannot bring the logged
+ *  copy back over the new contents. Called with the cache lock held, if
+ *  there is a cache; if one of them is being logged by gros_journal_log,
+ *  or a checkpoint is under way without the lock, it waits for that to
+ *  end first. Returns 0 or -errno.
+ *
+ * @param Disk    * disk   The disk with an open journal
+ * @param BlockIO * ios    The blocks about to be written
+ * @param int       n      Number of entries in `ios`
+ */
+int gros_journal_release( Disk * disk, BlockIO * ios, int n );
+
+/**
+ * Writes every logged block to its home, flushes the disk and empties the
+ *  journal. Returns 0 or -errno.
+ *
+ * @param Disk * disk   The disk with an open journal
+ */
+int gros_checkpoint( Disk * disk );
+
+/**
+ * Checkpoints the journal like gros_checkpoint, for the cache's flusher:
+ *  called with the cache lock held and journal->writing set by the
+ *  caller. The lock is let go while the logged blocks are written home
+ *  and the disk is flushed, and taken again to empty the journal.
+ *  Returns 0 or -errno.
+ *
+ * @param Disk * disk   The cached disk with an open journal
+ */
+int gros_journal_checkpoint( Disk * disk );
+
+#endif
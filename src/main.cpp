@@ -8,8 +8,135 @@
 #include "fuse_calls.hpp"
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <string>
 #include "../include/catch.hpp"
 
+enum {
+    KEY_SIZE,
+    KEY_ENGINE,
+    KEY_IMAGE,
+    KEY_CACHE,
+    KEY_WRITEBACK,
+    KEY_READAHEAD,
+    KEY_NOVERIFY,
+    KEY_COMPRESS,
+    KEY_DEDUP,
+};
+
+static struct fuse_opt grosfs_opts[] = {
+    FUSE_OPT_KEY( "size=", KEY_SIZE ),
+    FUSE_OPT_KEY( "engine=", KEY_ENGINE ),
+    FUSE_OPT_KEY( "image=", KEY_IMAGE ),
+    FUSE_OPT_KEY( "cache=", KEY_CACHE ),
+    FUSE_OPT_KEY( "writeback=", KEY_WRITEBACK ),
+    FUSE_OPT_KEY( "readahead=", KEY_READAHEAD ),
+    FUSE_OPT_KEY( "noverify", KEY_NOVERIFY ),
+    FUSE_OPT_KEY( "compress", KEY_COMPRESS ),
+    FUSE_OPT_KEY( "dedup", KEY_DEDUP ),
+    FUSE_OPT_END
+};
+
+/**
+ * Returns a newly allocated absolute version of `path`. FUSE changes into
+ *  "/" once it daemonizes, so relative image paths have to be resolved
+ *  against the directory grosfs was started from.
+ */
+static char * grosfs_abspath( const char * path ) {
+    char cwd[ 4096 ];
+
+    if( path[ 0 ] == '/' || getcwd( cwd, sizeof( cwd ) ) == NULL )
+        return strdup( path );
+    return strdup( ( std::string( cwd ) + "/" + path ).c_str() );
+}
+
+/**
+ * Handles the file system specific mount options:
+ *  -o image=PATH              image file to mount (default grosfs.filesystem)
+ *  -o size=64M                size of a newly created image
+ *  -o engine=pread|mmap|uring I/O engine used to reach the image
+ *  -o cache=16M               block cache budget, 0 to disable it
+ *  -o writeback=5             age in seconds at which the flusher writes
+ *                             dirty blocks back, 0 for no flusher
+ *  -o readahead=128K          largest read-ahead window per file
+ *  -o noverify                keep block checksums up to date but do not
+ *                             check blocks read against them
+ *  -o compress                compress the data of new files (single
+ *                             files: setfattr -n user.grosfs.compress -v 1)
+ *  -o dedup                   store data blocks already on the disk once
+ *  Returns 0 to consume an option, 1 to pass it on to FUSE, -1 on error.
+ */
+static int grosfs_opt_proc( void * data, const char * arg, int key,
+                            struct fuse_args * outargs ) {
+    struct fusedata * mydata = ( struct fusedata * ) data;
+    char            * end;
+
+    switch( key ) {
+        case KEY_SIZE:
+            mydata->disk_size = gros_parse_size( strchr( arg, '=' ) + 1 );
+            if( mydata->disk_size < BLOCK_SIZE ) {
+                fprintf( stderr, "grosfs: invalid file system size '%s'\n", arg );
+                return -1;
+            }
+            return 0;
+        case KEY_ENGINE:
+            arg = strchr( arg, '=' ) + 1;
+            if( ! strcmp( arg, "pread" ) )
+                mydata->engine = GROS_IO_PREAD;
+            else if( ! strcmp( arg, "mmap" ) )
+                mydata->engine = GROS_IO_MMAP;
+            else if( ! strcmp( arg, "uring" ) )
+                mydata->engine = GROS_IO_URING;
+            else {
+                fprintf( stderr, "grosfs: unknown I/O engine '%s'\n", arg );
+                return -1;
+            }
+            return 0;
+        case KEY_IMAGE:
+            arg = strchr( arg, '=' ) + 1;
+            if( * arg == '\0' ) {
+                fprintf( stderr, "grosfs: missing image path\n" );
+                return -1;
+            }
+            free( mydata->image );
+            mydata->image = grosfs_abspath( arg );
+            return 0;
+        case KEY_CACHE:
+            mydata->cache_size = gros_parse_size( strchr( arg, '=' ) + 1 );
+            if( mydata->cache_size < 0 ) {
+                fprintf( stderr, "grosfs: invalid cache size '%s'\n", arg );
+                return -1;
+            }
+            return 0;
+        case KEY_WRITEBACK:
+            arg = strchr( arg, '=' ) + 1;
+            mydata->writeback = ( int ) strtol( arg, &end, 10 );
+            if( end == arg || * end != '\0' || mydata->writeback < 0 ) {
+                fprintf( stderr, "grosfs: invalid writeback interval '%s'\n", arg );
+                return -1;
+            }
+            return 0;
+        case KEY_READAHEAD:
+            mydata->readahead = gros_parse_size( strchr( arg, '=' ) + 1 );
+            if( mydata->readahead < 0 ) {
+                fprintf( stderr, "grosfs: invalid read-ahead window '%s'\n", arg );
+                return -1;
+            }
+            return 0;
+        case KEY_NOVERIFY:
+            mydata->noverify = true;
+            return 0;
+        case KEY_COMPRESS:
+            mydata->compress = true;
+            return 0;
+        case KEY_DEDUP:
+            mydata->dedup = true;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
 int main( int argc, char * argv[] ) {
     struct fuse_operations ops = initfuseops();
     int result;
@@ -27,7 +154,20 @@ int main( int argc, char * argv[] ) {
         } else {
             perror("getcwd() error");
         }
-        result = fuse_main( argc, argv, &ops, NULL);
+        struct fuse_args  args   = FUSE_ARGS_INIT( argc, argv );
+        struct fusedata * mydata = new struct fusedata();
+        mydata->disk_size  = EMULATOR_SIZE;
+        mydata->engine     = GROS_IO_PREAD;
+        mydata->cache_size = GROS_CACHE_DEFAULT_SIZE;
+        mydata->writeback  = GROS_WRITEBACK_INTERVAL;
+        mydata->readahead  = GROS_READAHEAD_WINDOW;
+        mydata->image      = grosfs_abspath( GROS_DEFAULT_IMAGE );
+        if( fuse_opt_parse( &args, mydata, grosfs_opts, grosfs_opt_proc ) == -1 )
+            return 1;
+        result = fuse_main( args.argc, args.argv, &ops, mydata );
+        fuse_opt_free_args( &args );
+        free( mydata->image );
+        delete mydata;
     }
 
     pdebug << "Exiting with code " << result << std::endl;
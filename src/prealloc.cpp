@@ -0,0 +1,298 @@
+/**
+ * prealloc.cpp
+ */
+
+#include "prealloc.hpp"
+#include "files.hpp"
+#include <algorithm>
+#include <errno.h>
+
+
+/**
+ * Starts keeping reservation windows: blocks set aside on disk for files
+ *  that are being appended to, so each one grows into a run of its own
+ *  even when several grow at once. Reservations are kept in memory only:
+ *  reserved blocks stay free in the bitmaps, and the allocator passes
+ *  over them (see gros_prealloc_mask) until they are used or released,
+ *  so a crash leaks none of them. Returns 0 or -EEXIST.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+int gros_open_prealloc( Disk * disk ) {
+    Prealloc * pa;
+
+    if( disk->prealloc != NULL )
+        return -EEXIST;
+    pa           = new Prealloc();
+    pa->reserved = 0;
+    pa->refills  = 0;
+    pthread_mutex_init( &pa->lock, NULL );
+    disk->prealloc = pa;
+    return 0;
+}
+
+
+/**
+ * Gives up the unused blocks of window `win`; nothing on disk changes.
+ *  Called with the lock held.
+ */
+static void gros_prealloc_drop( Disk * disk, PreWindow * win ) {
+    disk->prealloc->reserved -= win->left;
+    win->left = 0;
+}
+
+
+/**
+ * Releases every window and stops reserving.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+void gros_close_prealloc( Disk * disk ) {
+    Prealloc * pa = disk->prealloc;
+    std::map< int, PreWindow >::iterator it;
+
+    if( pa == NULL )
+        return;
+    for( it = pa->windows.begin(); it != pa->windows.end(); ++it )
+        gros_prealloc_drop( disk, &it->second );
+    pthread_mutex_destroy( &pa->lock );
+    delete pa;
+    disk->prealloc = NULL;
+}
+
+
+/**
+ * Returns a run of new data blocks for a file, starting with block `fblock`
+ *  of it. A file whose window continues at `fblock` is given up to `want`
+ *  blocks of it without searching for them, all marked used with one
+ *  bitmap update. Otherwise the old window is released and a new one
+ *  reserved, as close after block `goal` as there is room, of at least
+ *  `want` blocks; a file that used up its last window sequentially gets
+ *  one twice as large, up to GROS_PREALLOC_MAX blocks. Returns the first
+ *  block number and sets `count` to the length of the run, or returns -1
+ *  if the disk is full.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file
+ * @param int     fblock   Block of the file to allocate, relative to the file
+ * @param int     goal     Block the window should preferably start at, or -1
+ * @param int     want     Blocks the caller expects to need
+ * @param int   * count    Set to the number of blocks allocated
+ */
+int gros_prealloc_blocks( Disk * disk, Inode * inode, int fblock, int goal, int want,
+                          int * count ) {
+    Prealloc  * pa   = disk->prealloc;
+    PreWindow * win;
+    int         size = GROS_PREALLOC_FIRST;
+    int         block;
+    int         first;
+    int         run;
+    int         n;
+
+    want = std::max( want, 1 );
+    pthread_mutex_lock( &pa->lock );
+    win = &pa->windows[ inode->f_inode_num ];
+    if( win->size > 0 && win->fblock == fblock && win->left > 0 ) {
+        n             = std::min( want, win->left );
+        block         = win->next;
+        pa->reserved -= n;
+        win->left    -= n;
+        win->fblock  += n;
+        win->next    += n;
+        pthread_mutex_unlock( &pa->lock );
+        // out of the window, the blocks are only claimed in their bitmap
+        if( ( * count = gros_claim_data_blocks( disk, block, n ) ) == n )
+            return block;
+        // some were taken before they were reserved; so is the rest, likely
+        gros_prealloc_release( disk, inode->f_inode_num );
+        if( * count > 0 )
+            return block;
+        pthread_mutex_lock( &pa->lock );
+        win = &pa->windows[ inode->f_inode_num ];
+    } else if( win->size > 0 && win->fblock == fblock ) {
+        // the last window was used up by a sequential writer
+        size = std::min( win->size * 2, GROS_PREALLOC_MAX );
+    }
+    gros_prealloc_drop( disk, win );
+    pthread_mutex_unlock( &pa->lock );
+
+    size = std::max( size, want );
+    if( ( first = gros_reserve_data_blocks( disk, goal, size, want, &run ) ) < 0 ) {
+        gros_prealloc_release( disk, inode->f_inode_num );
+        * count = 0;
+        return -1;
+    }
+    * count = std::min( want, run );
+
+    pthread_mutex_lock( &pa->lock );
+    win = &pa->windows[ inode->f_inode_num ];
+    gros_prealloc_drop( disk, win );
+    win->fblock   = fblock + * count;
+    win->next     = first + * count;
+    win->left     = run - * count;
+    win->size     = size;
+    pa->reserved += run - * count;
+    pa->refills++;
+    pthread_mutex_unlock( &pa->lock );
+    return first;
+}
+
+
+
+/**
+ * Gives the reserved blocks a file has not used back to other files. Does
+ *  nothing if the file has no window.
+ *
+ * @param Disk * disk        Disk containing the file system
+ * @param int    inode_num   Inode number of the file
+ */
+void gros_prealloc_release( Disk * disk, int inode_num ) {
+    Prealloc * pa = disk->prealloc;
+    std::map< int, PreWindow >::iterator it;
+
+    if( pa == NULL )
+        return;
+    pthread_mutex_lock( &pa->lock );
+    if( ( it = pa->windows.find( inode_num ) ) != pa->windows.end() ) {
+        gros_prealloc_drop( disk, &it->second );
+        pa->windows.erase( it );
+    }
+    pthread_mutex_unlock( &pa->lock );
+}
+
+
+/**
+ * Marks the reserved blocks among the `n` blocks from `first` on as used
+ *  in `bm`, a scratch copy of the bitmap covering them, so a search of it
+ *  passes over them. Bit 0 of `bm` is block `first`.
+ *
+ * @param Disk   * disk    Disk containing the file system
+ * @param int      first   Block the bitmap starts at
+ * @param int      n       Number of blocks the bitmap covers
+ * @param Bitmap * bm      The copy to mark them in
+ */
+void gros_prealloc_mask( Disk * disk, int first, int n, Bitmap * bm ) {
+    Prealloc * pa = disk->prealloc;
+    std::map< int, PreWindow >::iterator it;
+    int        from;
+    int        to;
+
+    pthread_mutex_lock( &pa->lock );
+    for( it = pa->windows.begin(); it != pa->windows.end(); ++it ) {
+        from = std::max( it->second.next, first );
+        to   = std::min( it->second.next + it->second.left, first + n );
+        if( from < to )
+            gros_set_bits( bm, from - first, to - from );
+    }
+    pthread_mutex_unlock( &pa->lock );
+}
+
+
+/**
+ * Returns in how many runs of physically contiguous blocks the first `n`
+ *  blocks of a file are stored.
+ */
+static int gros_prealloc_test_runs( Disk * disk, Inode * inode, int n ) {
+    int * map  = new int[ n ];
+    int   runs = 1;
+    int   i;
+
+    gros_bmap_range( disk, inode, 0, n, map );
+    for( i = 1; i < n; i++ )
+        if( map[ i ] != map[ i - 1 ] + 1 )
+            runs++;
+    delete [] map;
+    return runs;
+}
+
+
+TEST_CASE( "Files appended to at the same time are not interleaved", "[prealloc][files]" ) {
+    Disk  * disk = gros_open_ram( 16 * 1024 * 1024 );
+    char    data[ BLOCK_SIZE ];
+    Inode * a;
+    Inode * b;
+    int     i;
+    int     before;
+    int     used;
+
+    gros_make_fs( disk );
+    REQUIRE( gros_mount( disk ) >= 0 );
+    REQUIRE( disk->prealloc != NULL );
+    REQUIRE( gros_open_prealloc( disk ) == -EEXIST );
+    a = gros_new_inode( disk );
+    b = gros_new_inode( disk );
+    used = gros_superblock( disk )->fs_num_used_blocks;
+    std::memset( data, 'p', sizeof( data ) );
+
+    for( i = 0; i < 64; i++ ) {
+        REQUIRE( gros_i_write( disk, a, data, BLOCK_SIZE, i * BLOCK_SIZE ) == BLOCK_SIZE );
+        REQUIRE( gros_i_write( disk, b, data, BLOCK_SIZE, i * BLOCK_SIZE ) == BLOCK_SIZE );
+    }
+
+    SECTION( "Each file is stored in a few runs, one per window" ) {
+        // 8 + 16 + 32 + 64 blocks reserved, besides the one a new inode has
+        REQUIRE( gros_prealloc_test_runs( disk, a, 64 ) <= 5 );
+        REQUIRE( gros_prealloc_test_runs( disk, b, 64 ) <= 5 );
+        REQUIRE( disk->prealloc->refills <= 8 );
+        REQUIRE( disk->prealloc->reserved > 0 );
+    }
+
+    SECTION( "Reserved blocks stay free on disk but go to no other file" ) {
+        PreWindow win = disk->prealloc->windows[ a->f_inode_num ];
+        REQUIRE( win.left > 0 );
+        // the first block of each file came with its inode; one indirect
+        // block each maps the rest
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks == used + 2 * 63 + 2 );
+        before = gros_allocate_data_blocks( disk, win.next, 1, &i );
+        REQUIRE( before > 0 );
+        REQUIRE( ( before < win.next || before >= win.next + win.left ) );
+    }
+
+    SECTION( "A longer append takes its blocks out of the window at once" ) {
+        PreWindow win  = disk->prealloc->windows[ a->f_inode_num ];
+        int       runs = gros_prealloc_test_runs( disk, a, 64 );
+        char    * more;
+        int       n;
+
+        REQUIRE( win.left > 1 );
+        n    = std::min( win.left, 16 );
+        more = new char[ n * BLOCK_SIZE ];
+        std::memset( more, 'q', n * BLOCK_SIZE );
+        before = gros_superblock( disk )->fs_num_used_blocks;
+        REQUIRE( gros_i_write( disk, a, more, n * BLOCK_SIZE, 64 * BLOCK_SIZE ) == n * BLOCK_SIZE );
+        REQUIRE( disk->prealloc->windows[ a->f_inode_num ].fblock == 64 + n );
+        REQUIRE( disk->prealloc->windows[ a->f_inode_num ].next == win.next + n );
+        REQUIRE( gros_superblock( disk )->fs_num_used_blocks == before + n );
+        REQUIRE( gros_prealloc_test_runs( disk, a, 64 + n ) == runs );
+        delete [] more;
+    }
+
+    SECTION( "Releasing a file gives its unused blocks back" ) {
+        int left = disk->prealloc->windows[ a->f_inode_num ].left;
+        int next = disk->prealloc->windows[ a->f_inode_num ].next;
+        before   = ( int ) disk->prealloc->reserved;
+        gros_prealloc_release( disk, a->f_inode_num );
+        REQUIRE( disk->prealloc->reserved == before - left );
+        REQUIRE( disk->prealloc->windows.count( a->f_inode_num ) == 0 );
+        REQUIRE( gros_allocate_data_blocks( disk, next, 1, &i ) == next );
+    }
+
+    SECTION( "Truncating a file releases its window" ) {
+        REQUIRE( gros_i_truncate( disk, b, 10 * BLOCK_SIZE ) == 0 );
+        REQUIRE( disk->prealloc->windows.count( b->f_inode_num ) == 0 );
+    }
+
+    SECTION( "Freeing a file releases its window" ) {
+        gros_free_inode( disk, b );
+        REQUIRE( disk->prealloc->windows.count( b->f_inode_num ) == 0 );
+    }
+
+    SECTION( "A write elsewhere in the file starts a new small window" ) {
+        REQUIRE( gros_i_write( disk, a, data, BLOCK_SIZE, 100 * BLOCK_SIZE ) == BLOCK_SIZE );
+        REQUIRE( disk->prealloc->windows[ a->f_inode_num ].fblock == 101 );
+    }
+
+    gros_put_inode( disk, a );
+    gros_put_inode( disk, b );
+    gros_close_disk( disk );
+}
@@ -0,0 +1,91 @@
+/**
+ * prealloc.hpp
+ */
+
+#ifndef __PREALLOC_HPP_INCLUDED__   // if prealloc.hpp hasn't been included yet...
+#define __PREALLOC_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <pthread.h>
+#include <map>
+
+#define GROS_PREALLOC_FIRST   8     // first window of a file, in blocks
+#define GROS_PREALLOC_MAX     256   // largest window of a file, in blocks
+
+typedef struct _prewindow {
+    int     fblock;     /* file block the next reserved block is for */
+    int     next;       /* next reserved block on disk */
+    int     left;       /* reserved blocks not handed out yet */
+    int     size;       /* blocks reserved the last time */
+} PreWindow;
+
+typedef struct _prealloc {
+    pthread_mutex_t             lock;
+    std::map< int, PreWindow >  windows;    /* by inode number */
+    int64_t                     reserved;   /* blocks held in windows */
+    int64_t                     refills;    /* windows reserved */
+} Prealloc;
+
+/**
+ * Starts keeping reservation windows: blocks set aside on disk for files
+ *  that are being appended to, so each one grows into a run of its own
+ *  even when several grow at once. Reservations are kept in memory only:
+ *  reserved blocks stay free in the bitmaps, and the allocator passes
+ *  over them (see gros_prealloc_mask) until they are used or released,
+ *  so a crash leaks none of them. Returns 0 or -EEXIST.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+int gros_open_prealloc( Disk * disk );
+
+/**
+ * Releases every window and stops reserving.
+ *
+ * @param Disk * disk   The disk holding the file system
+ */
+void gros_close_prealloc( Disk * disk );
+
+/**
+ * Returns a run of new data blocks for a file, starting with block `fblock`
+ *  of it. A file whose window continues at `fblock` is given up to `want`
+ *  blocks of it without searching for them, all marked used with one
+ *  bitmap update. Otherwise the old window is released and a new one
+ *  reserved, as close after block `goal` as there is room, of at least
+ *  `want` blocks; a file that used up its last window sequentially gets
+ *  one twice as large, up to GROS_PREALLOC_MAX blocks. Returns the first
+ *  block number and sets `count` to the length of the run, or returns -1
+ *  if the disk is full.
+ *
+ * @param Disk  * disk     Disk containing the file system
+ * @param Inode * inode    Inode of the file
+ * @param int     fblock   Block of the file to allocate, relative to the file
+ * @param int     goal     Block the window should preferably start at, or -1
+ * @param int     want     Blocks the caller expects to need
+ * @param int   * count    Set to the number of blocks allocated
+ */
+int gros_prealloc_blocks( Disk * disk, Inode * inode, int fblock, int goal, int want,
+                          int * count );
+
+/**
+ * Gives the reserved blocks a file has not used back to other files. Does
+ *  nothing if the file has no window.
+ *
+ * @param Disk * disk        Disk containing the file system
+ * @param int    inode_num   Inode number of the file
+ */
+void gros_prealloc_release( Disk * disk, int inode_num );
+
+/**
+ * Marks the reserved blocks among the `n` blocks from `first` on as used
+ *  in `bm`, a scratch copy of the bitmap covering them, so a search of it
+ *  passes over them. Bit 0 of `bm` is block `first`.
+ *
+ * @param Disk   * disk    Disk containing the file system
+ * @param int      first   Block the bitmap starts at
+ * @param int      n       Number of blocks the bitmap covers
+ * @param Bitmap * bm      The copy to mark them in
+ */
+void gros_prealloc_mask( Disk * disk, int first, int n, Bitmap * bm );
+
+#endif
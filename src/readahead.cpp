@@ -0,0 +1,279 @@
+/**
+ * readahead.cpp
+ */
+
+#include "readahead.hpp"
+#include "files.hpp"
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+
+
+/**
+ * Body of the read-ahead worker: maps each queued window to disk blocks
+ *  and prefetches them into the cache.
+ */
+static void * gros_readahead_worker( void * arg ) {
+    Disk *             disk = ( Disk * ) arg;
+    ReadAhead *        ra   = disk->readahead;
+    RaJob              job;
+    std::vector< int > blocks;
+    std::vector< int > wanted;
+    size_t             i;
+
+    pthread_mutex_lock( &ra->lock );
+    for( ;; ) {
+        while( ! ra->stopping && ra->jobs.empty() )
+            pthread_cond_wait( &ra->wake, &ra->lock );
+        if( ra->stopping )
+            break;
+        job = ra->jobs.front();
+        ra->jobs.pop_front();
+        ra->busy = true;
+        pthread_mutex_unlock( &ra->lock );
+
+        // the indirect blocks come into the cache on the way
+        blocks.resize( job.count );
+        gros_bmap_range( disk, &job.inode, job.first, job.count, &blocks[ 0 ] );
+        wanted.clear();
+        for( i = 0; i < blocks.size(); i++ )
+            if( blocks[ i ] >= 0 )
+                wanted.push_back( blocks[ i ] );
+        if( ! wanted.empty() )
+            gros_bprefetch( disk, &wanted[ 0 ], ( int ) wanted.size() );
+
+        pthread_mutex_lock( &ra->lock );
+        ra->busy = false;
+        if( ra->jobs.empty() )
+            pthread_cond_broadcast( &ra->idle );
+    }
+    pthread_cond_broadcast( &ra->idle );
+    pthread_mutex_unlock( &ra->lock );
+    return NULL;
+}
+
+
+/**
+ * Starts prefetching for sequential readers. A worker thread reads
+ *  upcoming data blocks (and the indirect blocks mapping them) into the
+ *  cache while the reader is still busy with the current ones. Each file's
+ *  window starts at GROS_RA_FIRST blocks and doubles every time the reader
+ *  catches up with it, up to `window` bytes. Returns 0, -EINVAL if the
+ *  disk has no cache to prefetch into or `window` is under a block,
+ *  -EEXIST if read-ahead is already running, or -errno if the worker
+ *  could not be started.
+ *
+ * @param Disk  * disk     The cached disk to read ahead on
+ * @param int64_t window   Largest read-ahead window per file, in bytes
+ */
+int gros_start_readahead( Disk * disk, int64_t window ) {
+    ReadAhead * ra;
+    int         i;
+    int         status;
+
+    if( disk->cache == NULL || window < BLOCK_SIZE )
+        return -EINVAL;
+    if( disk->readahead != NULL )
+        return -EEXIST;
+
+    ra             = new ReadAhead();
+    ra->stopping   = false;
+    ra->busy       = false;
+    ra->max_window = ( int ) std::min< int64_t >( window / BLOCK_SIZE,
+                                                  disk->size / BLOCK_SIZE );
+    ra->clock      = 0;
+    for( i = 0; i < GROS_RA_STREAMS; i++ ) {
+        ra->streams[ i ].inode_num = -1;
+        ra->streams[ i ].used      = 0;
+    }
+    pthread_mutex_init( &ra->lock, NULL );
+    pthread_cond_init( &ra->wake, NULL );
+    pthread_cond_init( &ra->idle, NULL );
+
+    disk->readahead = ra;
+    if( ( status = pthread_create( &ra->worker, NULL, gros_readahead_worker,
+                                   disk ) ) != 0 ) {
+        disk->readahead = NULL;
+        pthread_cond_destroy( &ra->idle );
+        pthread_cond_destroy( &ra->wake );
+        pthread_mutex_destroy( &ra->lock );
+        delete ra;
+        return -status;
+    }
+    return 0;
+}
+
+
+/**
+ * Stops the read-ahead worker, if there is one, dropping the windows it
+ *  has not fetched yet.
+ *
+ * @param Disk * disk   The disk to stop reading ahead on
+ */
+void gros_stop_readahead( Disk * disk ) {
+    ReadAhead * ra = disk->readahead;
+
+    if( ra == NULL )
+        return;
+    pthread_mutex_lock( &ra->lock );
+    ra->stopping = true;
+    pthread_cond_signal( &ra->wake );
+    pthread_mutex_unlock( &ra->lock );
+    pthread_join( ra->worker, NULL );
+
+    disk->readahead = NULL;
+    pthread_cond_destroy( &ra->idle );
+    pthread_cond_destroy( &ra->wake );
+    pthread_mutex_destroy( &ra->lock );
+    delete ra;
+}
+
+
+/**
+ * Waits until the read-ahead worker has fetched every window queued so
+ *  far. Does nothing if read-ahead is not running.
+ *
+ * @param Disk * disk   The disk being read ahead on
+ */
+void gros_readahead_wait( Disk * disk ) {
+    ReadAhead * ra = disk->readahead;
+
+    if( ra == NULL )
+        return;
+    pthread_mutex_lock( &ra->lock );
+    while( ! ra->stopping && ( ra->busy || ! ra->jobs.empty() ) )
+        pthread_cond_wait( &ra->idle, &ra->lock );
+    pthread_mutex_unlock( &ra->lock );
+}
+
+
+/**
+ * Tells read-ahead that blocks first .. first + count - 1 of a file are
+ *  being read. A read that carries on where the last one of the same file
+ *  stopped (or starts at the beginning of the file) continues a stream,
+ *  and the next window is queued once less than half of the current one
+ *  is left ahead of the reader. Any other read ends the stream. Returns
+ *  right away; does nothing if read-ahead is not running.
+ *
+ * @param Disk  * disk    The disk holding the file
+ * @param Inode * inode   The file being read
+ * @param int     first   First block read, relative to the file
+ * @param int     count   Number of blocks read
+ */
+void gros_readahead( Disk * disk, Inode * inode, int first, int count ) {
+    ReadAhead * ra = disk->readahead;
+    RaStream *  s  = NULL;
+    RaJob       job;
+    int         end  = first + count;
+    int         eof  = ( inode->f_size + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+    int         i;
+
+    if( ra == NULL || count <= 0 )
+        return;
+
+    pthread_mutex_lock( &ra->lock );
+    for( i = 0; i < GROS_RA_STREAMS && s == NULL; i++ )
+        if( ra->streams[ i ].inode_num == inode->f_inode_num )
+            s = &ra->streams[ i ];
+    if( s == NULL ) {
+        // take over the slot of the file read least recently
+        s = &ra->streams[ 0 ];
+        for( i = 1; i < GROS_RA_STREAMS; i++ )
+            if( ra->streams[ i ].used < s->used )
+                s = &ra->streams[ i ];
+        s->inode_num = inode->f_inode_num;
+        s->next      = 0;
+        s->ahead     = 0;
+        s->window    = 0;
+    }
+    s->used = ++ra->clock;
+
+    if( first == s->next ) {
+        s->ahead = std::max( s->ahead, end );
+        if( s->ahead - end <= s->window / 2 && s->ahead < eof ) {
+            s->window = std::min( s->window == 0 ? GROS_RA_FIRST : s->window * 2,
+                                  ra->max_window );
+            job.inode = * inode;
+            job.first = s->ahead;
+            job.count = std::min( end + s->window, eof ) - s->ahead;
+            if( job.count > 0 ) {
+                // a reader far behind its windows does not need old ones
+                if( ra->jobs.size() >= GROS_RA_JOBS )
+                    ra->jobs.pop_front();
+                ra->jobs.push_back( job );
+                s->ahead += job.count;
+                pthread_cond_signal( &ra->wake );
+            }
+        }
+    } else {
+        s->window = 0;
+        s->ahead  = 0;
+    }
+    s->next = end;
+    pthread_mutex_unlock( &ra->lock );
+}
+
+
+TEST_CASE( "Sequential reads are prefetched", "[readahead]" ) {
+    Disk  * disk = gros_open_disk();
+    REQUIRE( gros_attach_cache( disk, 256 * BLOCK_SIZE ) == 0 );
+    gros_make_fs( disk );
+    REQUIRE( gros_start_readahead( disk, 16 * BLOCK_SIZE ) == 0 );
+    REQUIRE( gros_start_readahead( disk, 16 * BLOCK_SIZE ) == -EEXIST );
+
+    Inode * inode = gros_new_inode( disk );
+    int     size  = 64 * BLOCK_SIZE;
+    char  * in    = new char[ size ];
+    char  * out   = new char[ size ];
+    Cache * cache = disk->cache;
+    int     i;
+
+    for( i = 0; i < size; i++ )
+        in[ i ] = ( char ) ( i % 253 );
+    REQUIRE( gros_i_write( disk, inode, in, size, 0 ) == size );
+
+    SECTION( "A stream gets prefetched windows and reads back intact" ) {
+        for( i = 0; i < 64; i++ ) {
+            REQUIRE( gros_i_read( disk, inode, out + i * BLOCK_SIZE,
+                                  BLOCK_SIZE, i * BLOCK_SIZE ) == BLOCK_SIZE );
+            // let the worker get ahead before the next read
+            gros_readahead_wait( disk );
+        }
+        REQUIRE( memcmp( in, out, size ) == 0 );
+        gros_stop_readahead( disk );
+        REQUIRE( cache->prefetched > 0 );
+        REQUIRE( cache->prefetch_hits > 0 );
+        REQUIRE( cache->prefetch_hits <= cache->prefetched );
+    }
+
+    SECTION( "Windows grow up to the limit and reset on a seek" ) {
+        ReadAhead * ra = disk->readahead;
+        gros_readahead( disk, inode, 0, 1 );
+        REQUIRE( ra->streams[ 0 ].window == GROS_RA_FIRST );
+        REQUIRE( ra->streams[ 0 ].ahead == 1 + GROS_RA_FIRST );
+        for( i = 1; i < 40; i++ )
+            gros_readahead( disk, inode, i, 1 );
+        REQUIRE( ra->streams[ 0 ].window == 16 );
+        gros_readahead( disk, inode, 3, 1 );
+        REQUIRE( ra->streams[ 0 ].window == 0 );
+    }
+
+    SECTION( "A prefetched block written meanwhile is not cached stale" ) {
+        int  blocks[ 1 ];
+        char buf[ BLOCK_SIZE ];
+        gros_bmap_range( disk, inode, 5, 1, blocks );
+        REQUIRE( blocks[ 0 ] > 0 );
+        REQUIRE( gros_bprefetch( disk, blocks, 1 ) == 1 );
+        REQUIRE( gros_bprefetch( disk, blocks, 1 ) == 0 );
+        std::memset( buf, 'w', BLOCK_SIZE );
+        BlockIO io = { blocks[ 0 ], buf };
+        REQUIRE( gros_bwrite_blocks( disk, &io, 1 ) == 0 );
+        REQUIRE( gros_i_read( disk, inode, out, BLOCK_SIZE, 5 * BLOCK_SIZE ) == BLOCK_SIZE );
+        REQUIRE( out[ 0 ] == 'w' );
+    }
+
+    delete [] in;
+    delete [] out;
+    delete inode;
+    gros_close_disk( disk );
+}
@@ -0,0 +1,90 @@
+/**
+ * readahead.hpp
+ */
+
+#ifndef __READAHEAD_HPP_INCLUDED__   // if readahead.hpp hasn't been included yet...
+#define __READAHEAD_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include "grosfs.hpp"
+#include <pthread.h>
+#include <deque>
+
+#define GROS_RA_STREAMS   16    // files whose access pattern is tracked at once
+#define GROS_RA_FIRST     4     // first window of a new stream, in blocks
+#define GROS_RA_JOBS      64    // most windows waiting for the worker
+
+typedef struct _rastream {
+    int           inode_num;    /* the file, -1 for a free slot */
+    int           next;         /* block a sequential read would start at */
+    int           ahead;        /* first block not prefetched yet */
+    int           window;       /* blocks prefetched at a time, 0 if random */
+    unsigned long used;         /* last use, for replacing slots */
+} RaStream;
+
+typedef struct _rajob {
+    Inode         inode;        /* copy of the inode, for its block map */
+    int           first;        /* first block to prefetch, relative to the file */
+    int           count;
+} RaJob;
+
+typedef struct _readahead {
+    pthread_t         worker;
+    pthread_mutex_t   lock;
+    pthread_cond_t    wake;
+    pthread_cond_t    idle;         /* signalled when the worker runs out of windows */
+    bool              stopping;
+    bool              busy;         /* the worker is fetching a window */
+    int               max_window;   /* largest window, in blocks */
+    unsigned long     clock;
+    RaStream          streams[ GROS_RA_STREAMS ];
+    std::deque< RaJob > jobs;       /* windows waiting to be prefetched */
+} ReadAhead;
+
+/**
+ * Starts prefetching for sequential readers. A worker thread reads
+ *  upcoming data blocks (and the indirect blocks mapping them) into the
+ *  cache while the reader is still busy with the current ones. Each file's
+ *  window starts at GROS_RA_FIRST blocks and doubles every time the reader
+ *  catches up with it, up to `window` bytes. Returns 0, -EINVAL if the
+ *  disk has no cache to prefetch into or `window` is under a block,
+ *  -EEXIST if read-ahead is already running, or -errno if the worker
+ *  could not be started.
+ *
+ * @param Disk  * disk     The cached disk to read ahead on
+ * @param int64_t window   Largest read-ahead window per file, in bytes
+ */
+int gros_start_readahead( Disk * disk, int64_t window );
+
+/**
+ * Stops the read-ahead worker, if there is one, dropping the windows it
+ *  has not fetched yet.
+ *
+ * @param Disk * disk   The disk to stop reading ahead on
+ */
+void gros_stop_readahead( Disk * disk );
+
+/**
+ * Tells read-ahead that blocks first .. first + count - 1 of a file are
+ *  being read. A read that carries on where the last one of the same file
+ *  stopped (or starts at the beginning of the file) continues a stream,
+ *  and the next window is queued once less than half of the current one
+ *  is left ahead of the reader. Any other read ends the stream. Returns
+ *  right away; does nothing if read-ahead is not running.
+ *
+ * @param Disk  * disk    The disk holding the file
+ * @param Inode * inode   The file being read
+ * @param int     first   First block read, relative to the file
+ * @param int     count   Number of blocks read
+ */
+void gros_readahead( Disk * disk, Inode * inode, int first, int count );
+
+/**
+ * Waits until the read-ahead worker has fetched every window queued so
+ *  far. Does nothing if read-ahead is not running.
+ *
+ * @param Disk * disk   The disk being read ahead on
+ */
+void gros_readahead_wait( Disk * disk );
+
+#endif
@@ -0,0 +1,311 @@
+/**
+ * uring.cpp
+ */
+
+#include "uring.hpp"
+#include <cstring>
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef GROS_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+static int gros_io_uring_setup( unsigned entries, struct io_uring_params * p ) {
+    return ( int ) syscall( __NR_io_uring_setup, entries, p );
+}
+
+
+static int gros_io_uring_enter( int fd, unsigned to_submit,
+                                unsigned min_complete, unsigned flags ) {
+    return ( int ) syscall( __NR_io_uring_enter, fd, to_submit, min_complete,
+                            flags, NULL, 0 );
+}
+
+
+/**
+ * Sets up an io_uring instance whose requests all go to `fd`. Returns NULL
+ *  with errno set if io_uring is not available (old kernel, not Linux, or
+ *  blocked by a sandbox); callers then stay on synchronous I/O.
+ *
+ * @param int      fd        The file descriptor to issue I/O against
+ * @param unsigned entries   Submission queue depth
+ */
+IORing * gros_uring_open( int fd, unsigned entries ) {
+    struct io_uring_params p;
+    IORing *               ring;
+    char *                 sq;
+    char *                 cq;
+    int                    saved;
+
+    std::memset( &p, 0, sizeof( p ) );
+    ring = new IORing();
+    std::memset( ring, 0, sizeof( IORing ) );
+    ring->target = fd;
+
+    if( ( ring->fd = gros_io_uring_setup( entries, &p ) ) < 0 ) {
+        delete ring;
+        return NULL;
+    }
+    ring->entries      = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    ring->cq_ring_size = p.cq_off.cqes
+                         + p.cq_entries * sizeof( struct io_uring_cqe );
+    ring->sqes_size    = p.sq_entries * sizeof( struct io_uring_sqe );
+
+    // newer kernels share one mapping between both rings
+    if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if( ring->cq_ring_size > ring->sq_ring_size )
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING );
+    if( ring->sq_ring == MAP_FAILED )
+        goto fail;
+    if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd,
+                              IORING_OFF_CQ_RING );
+        if( ring->cq_ring == MAP_FAILED ) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+    if( ring->sqes == MAP_FAILED ) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    sq = ( char * ) ring->sq_ring;
+    cq = ( char * ) ring->cq_ring;
+    ring->sq_head  = ( unsigned * ) ( sq + p.sq_off.head );
+    ring->sq_tail  = ( unsigned * ) ( sq + p.sq_off.tail );
+    ring->sq_mask  = ( unsigned * ) ( sq + p.sq_off.ring_mask );
+    ring->sq_array = ( unsigned * ) ( sq + p.sq_off.array );
+    ring->cq_head  = ( unsigned * ) ( cq + p.cq_off.head );
+    ring->cq_tail  = ( unsigned * ) ( cq + p.cq_off.tail );
+    ring->cq_mask  = ( unsigned * ) ( cq + p.cq_off.ring_mask );
+    ring->cqes     = cq + p.cq_off.cqes;
+    return ring;
+
+fail:
+    saved = errno;
+    if( ring->sq_ring != MAP_FAILED && ring->sq_ring != NULL ) {
+        if( ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring )
+            munmap( ring->cq_ring, ring->cq_ring_size );
+        munmap( ring->sq_ring, ring->sq_ring_size );
+    }
+    close( ring->fd );
+    delete ring;
+    errno = saved;
+    return NULL;
+}
+
+
+/**
+ * Tears down a ring. Requests still in flight are waited for first.
+ *
+ * @param IORing * ring   The ring to close
+ */
+void gros_uring_close( IORing * ring ) {
+    void * data;
+    int    res;
+
+    if( ring == NULL )
+        return;
+    while( ring->queued > 0 || ring->inflight > 0 ) {
+        if( gros_uring_submit( ring, 1 ) < 0 )
+            break;
+        while( gros_uring_reap( ring, &data, &res ) == 1 )
+            ;
+    }
+    munmap( ring->sqes, ring->sqes_size );
+    if( ring->cq_ring != ring->sq_ring )
+        munmap( ring->cq_ring, ring->cq_ring_size );
+    munmap( ring->sq_ring, ring->sq_ring_size );
+    close( ring->fd );
+    delete ring;
+}
+
+
+/**
+ * Queues a vectored read or write of `iov` at byte offset `offset`. The
+ *  request is not seen by the kernel until gros_uring_submit is called;
+ *  `iov` and the buffers it points to must stay valid until it completes.
+ *  Returns 0, or -EBUSY if the ring already holds `entries` requests and
+ *  completions must be reaped first.
+ *
+ * @param IORing       * ring     The ring to queue on
+ * @param int            write    Nonzero to write, zero to read
+ * @param struct iovec * iov      The buffers to transfer
+ * @param int            iovcnt   Number of entries in `iov`
+ * @param off_t          offset   Byte offset into the file
+ * @param void         * data     Handed back by gros_uring_reap
+ */
+int gros_uring_queue( IORing * ring, int write, struct iovec * iov, int iovcnt,
+                      off_t offset, void * data ) {
+    struct io_uring_sqe * sqe;
+    unsigned              tail;
+    unsigned              index;
+
+    // the completion queue is twice as deep, so this keeps it from overflowing
+    if( ring->queued + ring->inflight >= ring->entries )
+        return -EBUSY;
+
+    tail  = * ring->sq_tail;
+    index = tail & * ring->sq_mask;
+    sqe   = &( ( struct io_uring_sqe * ) ring->sqes )[ index ];
+    std::memset( sqe, 0, sizeof( * sqe ) );
+    sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = ring->target;
+    sqe->off       = ( __u64 ) offset;
+    sqe->addr      = ( __u64 ) ( uintptr_t ) iov;
+    sqe->len       = ( __u32 ) iovcnt;
+    sqe->user_data = ( __u64 ) ( uintptr_t ) data;
+    ring->sq_array[ index ] = index;
+
+    // the kernel must see the entry before it sees the new tail
+    __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+    ring->queued++;
+    return 0;
+}
+
+
+/**
+ * Submits everything queued and waits until at least `wait` completions
+ *  are ready to be reaped. Returns the number of requests submitted or
+ *  -errno.
+ *
+ * @param IORing * ring   The ring to submit on
+ * @param unsigned wait   Number of completions to wait for
+ */
+int gros_uring_submit( IORing * ring, unsigned wait ) {
+    int      n;
+    unsigned ready;
+
+    ready = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) - * ring->cq_head;
+    if( ring->queued == 0 && ready >= wait )
+        return 0;
+    if( wait > ring->queued + ring->inflight )
+        wait = ring->queued + ring->inflight;
+
+    do {
+        n = gros_io_uring_enter( ring->fd, ring->queued, wait,
+                                 wait > 0 ? IORING_ENTER_GETEVENTS : 0 );
+    } while( n < 0 && errno == EINTR );
+    if( n < 0 )
+        return -errno;
+    ring->queued   -= ( unsigned ) n;
+    ring->inflight += ( unsigned ) n;
+    return n;
+}
+
+
+/**
+ * Pops one completion off the ring without blocking. Returns 1 and fills in
+ *  `data` and `res` (bytes transferred or -errno) if a completion was
+ *  ready, 0 otherwise.
+ *
+ * @param IORing * ring   The ring to reap from
+ * @param void  ** data   Out parameter for the request's `data`
+ * @param int    * res    Out parameter for the request's result
+ */
+int gros_uring_reap( IORing * ring, void ** data, int * res ) {
+    struct io_uring_cqe * cqe;
+    unsigned              head;
+
+    head = * ring->cq_head;
+    if( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+        return 0;
+    cqe    = &( ( struct io_uring_cqe * ) ring->cqes )[ head & * ring->cq_mask ];
+    * data = ( void * ) ( uintptr_t ) cqe->user_data;
+    * res  = cqe->res;
+    __atomic_store_n( ring->cq_head, head + 1, __ATOMIC_RELEASE );
+    ring->inflight--;
+    return 1;
+}
+
+#else   // no io_uring on this platform: every ring fails to open
+
+
+IORing * gros_uring_open( int fd, unsigned entries ) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+
+void gros_uring_close( IORing * ring ) {
+}
+
+
+int gros_uring_queue( IORing * ring, int write, struct iovec * iov, int iovcnt,
+                      off_t offset, void * data ) {
+    return -ENOSYS;
+}
+
+
+int gros_uring_submit( IORing * ring, unsigned wait ) {
+    return -ENOSYS;
+}
+
+
+int gros_uring_reap( IORing * ring, void ** data, int * res ) {
+    return 0;
+}
+
+#endif
+
+
+TEST_CASE( "Requests complete through io_uring", "[uring]" ) {
+    char         path[] = "grosfs.uring.XXXXXX";
+    int          fd     = mkstemp( path );
+    char         out[ 4096 ];
+    char         in[ 4096 ];
+    struct iovec iov;
+    void *       data;
+    int          res;
+    IORing *     ring;
+
+    REQUIRE( fd != -1 );
+    unlink( path );
+    ring = gros_uring_open( fd, 8 );
+    if( ring == NULL ) {
+        // not every kernel (or sandbox) allows io_uring
+        WARN( "io_uring unavailable: " << strerror( errno ) );
+        close( fd );
+        return;
+    }
+
+    std::memset( out, 'u', sizeof( out ) );
+    iov.iov_base = out;
+    iov.iov_len  = sizeof( out );
+    REQUIRE( gros_uring_queue( ring, 1, &iov, 1, 4096, out ) == 0 );
+    REQUIRE( gros_uring_submit( ring, 1 ) == 1 );
+    REQUIRE( gros_uring_reap( ring, &data, &res ) == 1 );
+    REQUIRE( data == ( void * ) out );
+    REQUIRE( res == sizeof( out ) );
+
+    iov.iov_base = in;
+    iov.iov_len  = sizeof( in );
+    REQUIRE( gros_uring_queue( ring, 0, &iov, 1, 4096, in ) == 0 );
+    REQUIRE( gros_uring_submit( ring, 1 ) == 1 );
+    REQUIRE( gros_uring_reap( ring, &data, &res ) == 1 );
+    REQUIRE( data == ( void * ) in );
+    REQUIRE( res == sizeof( in ) );
+    REQUIRE( memcmp( in, out, sizeof( in ) ) == 0 );
+    REQUIRE( gros_uring_reap( ring, &data, &res ) == 0 );
+
+    gros_uring_close( ring );
+    close( fd );
+}
@@ -0,0 +1,97 @@
+/**
+ * uring.hpp
+ */
+
+#ifndef __URING_HPP_INCLUDED__   // if uring.hpp hasn't been included yet...
+#define __URING_HPP_INCLUDED__   //   #define this so the compiler knows it has been included
+
+#include "../include/catch.hpp"
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined( __linux__ ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#define GROS_HAVE_URING 1
+#endif
+#endif
+
+#define GROS_URING_DEPTH 64     // submission queue entries per ring
+
+typedef struct _ioring {
+    int        fd;          /* the io_uring instance */
+    int        target;      /* file descriptor all requests go to */
+    unsigned   entries;     /* size of the submission queue */
+    unsigned   queued;      /* entries filled in but not yet submitted */
+    unsigned   inflight;    /* entries submitted but not yet reaped */
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    void     * sqes;        /* the submission queue entries */
+    void     * cqes;        /* the completion queue entries */
+    void     * sq_ring;     /* mappings shared with the kernel */
+    size_t     sq_ring_size;
+    void     * cq_ring;
+    size_t     cq_ring_size;
+    size_t     sqes_size;
+} IORing;
+
+/**
+ * Sets up an io_uring instance whose requests all go to `fd`. Returns NULL
+ *  with errno set if io_uring is not available (old kernel, not Linux, or
+ *  blocked by a sandbox); callers then stay on synchronous I/O.
+ *
+ * @param int      fd        The file descriptor to issue I/O against
+ * @param unsigned entries   Submission queue depth
+ */
+IORing * gros_uring_open( int fd, unsigned entries );
+
+/**
+ * Tears down a ring. Requests still in flight are waited for first.
+ *
+ * @param IORing * ring   The ring to close
+ */
+void gros_uring_close( IORing * ring );
+
+/**
+ * Queues a vectored read or write of `iov` at byte offset `offset`. The
+ *  request is not seen by the kernel until gros_uring_submit is called;
+ *  `iov` and the buffers it points to must stay valid until it completes.
+ *  Returns 0, or -EBUSY if the ring already holds `entries` requests and
+ *  completions must be reaped first.
+ *
+ * @param IORing       * ring     The ring to queue on
+ * @param int            write    Nonzero to write, zero to read
+ * @param struct iovec * iov      The buffers to transfer
+ * @param int            iovcnt   Number of entries in `iov`
+ * @param off_t          offset   Byte offset into the file
+ * @param void         * data     Handed back by gros_uring_reap
+ */
+int gros_uring_queue( IORing * ring, int write, struct iovec * iov, int iovcnt,
+                      off_t offset, void * data );
+
+/**
+ * Submits everything queued and waits until at least `wait` completions
+ *  are ready to be reaped. Returns the number of requests submitted or
+ *  -errno.
+ *
+ * @param IORing * ring   The ring to submit on
+ * @param unsigned wait   Number of completions to wait for
+ */
+int gros_uring_submit( IORing * ring, unsigned wait );
+
+/**
+ * Pops one completion off the ring without blocking. Returns 1 and fills in
+ *  `data` and `res` (bytes transferred or -errno) if a completion was
+ *  ready, 0 otherwise.
+ *
+ * @param IORing * ring   The ring to reap from
+ * @param void  ** data   Out parameter for the request's `data`
+ * @param int    * res    Out parameter for the request's result
+ */
+int gros_uring_reap( IORing * ring, void ** data, int * res );
+
+#endif